@@ -5,6 +5,7 @@
  * @brief       Program to set MAC, serial number, mfg date and hotspot_ssid.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,9 +14,13 @@
 #include <strings.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <zlib.h>
 
 #ifndef FACTORY_BACKUP_DIR
 #define FACTORY_BACKUP_DIR "/mnt/flash/vienna/factory_backup"
@@ -26,6 +31,10 @@
 #ifndef SRC_ETC
 #define SRC_ETC "/mnt/flash/etc"
 #endif
+/* Fastest level: line time matters more than a little flash */
+#ifndef FACTORY_BACKUP_GZ_MODE
+#define FACTORY_BACKUP_GZ_MODE "wb1"
+#endif
 
 #ifndef SERIAL_FILE
 #define SERIAL_FILE      "/mnt/flash/vienna/m5s_config/serial_number"
@@ -112,29 +121,453 @@ int run_cmd(const char *cmd)
     return 0;
 }
 
+/* ---------------------------------------------------------
+ * Factory backup capture
+ * ---------------------------------------------------------
+ * SRC_ROOT and SRC_ETC are archived in-process into vienna.tar.gz and
+ * etc.tar.gz, next to a manifest that factory_reset uses for change
+ * detection. One line per path, relative to the parent of SRC_ROOT:
+ *
+ *   <type> <size> <mtime> <hash|-> <path>
+ *
+ * type is f (file), d (directory), l (symlink), h (hard link) or x (an
+ * excluded subtree the reset must leave alone). hash is the 64-bit FNV-1a
+ * of a file's contents, or of a symlink's target. factory_reset.c reads
+ * the same format; keep the two in step.
+ *
+ * A capture is skipped when every path still matches the manifest by
+ * type, size and mtime, so re-running device_setup on a unit that was
+ * already provisioned only costs a directory walk.
+ */
+#define FNV64_OFFSET 0xcbf29ce484222325ULL
+#define FNV64_PRIME  0x100000001b3ULL
+#define TAR_BLOCK    512
+#define COPY_BUF     (64 * 1024)
+
+static const char *const backup_excludes[] = {
+    "lib", "firmware", "scripts", "bin", "factory_backup"
+};
+
+typedef struct {
+    char *path;         /* archive/manifest path, e.g. vienna/m5s_config/x */
+    char *src;          /* where it lives now */
+    char *link;         /* symlink target, or first path of a hard link */
+    char type;
+    int archive;        /* 0 = vienna, 1 = etc */
+    struct stat st;
+    uint64_t hash;
+} backup_entry_t;
+
+typedef struct {
+    backup_entry_t *v;
+    size_t count;
+    size_t cap;
+} backup_list_t;
+
+static unsigned char backup_buf[COPY_BUF];
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    while (len--) {
+        h ^= *p++;
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
+
+static void backup_list_free(backup_list_t *l)
+{
+    for (size_t i = 0; i < l->count; i++) {
+        free(l->v[i].path);
+        free(l->v[i].src);
+        free(l->v[i].link);
+    }
+    free(l->v);
+    memset(l, 0, sizeof(*l));
+}
+
+static backup_entry_t *backup_add(backup_list_t *l, char type, const char *path,
+                                  const char *src, const struct stat *st, int archive)
+{
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        backup_entry_t *grown = realloc(l->v, cap * sizeof(*grown));
+        if (!grown)
+            return NULL;
+        l->v = grown;
+        l->cap = cap;
+    }
+    backup_entry_t *e = &l->v[l->count];
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    e->archive = archive;
+    e->st = *st;
+    e->path = strdup(path);
+    e->src = strdup(src);
+    if (!e->path || !e->src) {
+        free(e->path);
+        free(e->src);
+        return NULL;
+    }
+    l->count++;
+    return e;
+}
+
+/* Collects src (archived as path) and everything below it */
+static int backup_walk(backup_list_t *l, const char *src, const char *path, int archive, int top)
+{
+    struct stat st;
+    if (lstat(src, &st) != 0)
+        return -1;
+
+    if (S_ISDIR(st.st_mode)) {
+        if (!backup_add(l, 'd', path, src, &st, archive))
+            return -1;
+        DIR *dp = opendir(src);
+        if (!dp)
+            return -1;
+
+        int ret = 0;
+        struct dirent *de;
+        char csrc[PATH_MAX], cpath[PATH_MAX];
+        while (ret == 0 && (de = readdir(dp)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            if (snprintf(csrc, sizeof(csrc), "%s/%s", src, de->d_name) >= (int)sizeof(csrc) ||
+                snprintf(cpath, sizeof(cpath), "%s/%s", path, de->d_name) >= (int)sizeof(cpath)) {
+                ret = -1;
+                break;
+            }
+
+            int excluded = 0;
+            for (size_t i = 0; top && archive == 0 && i < sizeof(backup_excludes) / sizeof(backup_excludes[0]); i++)
+                excluded |= (strcmp(de->d_name, backup_excludes[i]) == 0);
+            if (excluded) {
+                struct stat xst;
+                memset(&xst, 0, sizeof(xst));
+                if (!backup_add(l, 'x', cpath, csrc, &xst, archive))
+                    ret = -1;
+                continue;
+            }
+            ret = backup_walk(l, csrc, cpath, archive, 0);
+        }
+        closedir(dp);
+        return ret;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(src, target, sizeof(target) - 1);
+        if (n < 0)
+            return -1;
+        target[n] = '\0';
+        backup_entry_t *e = backup_add(l, 'l', path, src, &st, archive);
+        if (!e || !(e->link = strdup(target)))
+            return -1;
+        e->hash = fnv1a(FNV64_OFFSET, target, n);
+        return 0;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        /* Second and later names of a hard-linked file become links in the archive */
+        if (st.st_nlink > 1) {
+            for (size_t i = 0; i < l->count; i++) {
+                backup_entry_t *o = &l->v[i];
+                if (o->type == 'f' && o->archive == archive &&
+                    o->st.st_ino == st.st_ino && o->st.st_dev == st.st_dev) {
+                    backup_entry_t *e = backup_add(l, 'h', path, src, &st, archive);
+                    if (!e || !(e->link = strdup(l->v[i].path)))
+                        return -1;
+                    return 0;
+                }
+            }
+        }
+        return backup_add(l, 'f', path, src, &st, archive) ? 0 : -1;
+    }
+
+    printf("Skipping special file %s\n", src);
+    return 0;
+}
+
+static int manifest_path_cmp(const void *a, const void *b)
+{
+    return strcmp(((const backup_entry_t *)a)->path, ((const backup_entry_t *)b)->path);
+}
+
+/* Loads an existing manifest into old, sorted by path for bsearch() */
+static int backup_manifest_load(backup_list_t *old)
+{
+    FILE *f = fopen(FACTORY_BACKUP_DIR "/manifest.txt", "r");
+    if (!f)
+        return -1;
+
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), f)) {
+        char type, hash[32];
+        unsigned long long size;
+        long long mtime;
+        int off = 0;
+        struct stat st;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%c %llu %lld %31s %n", &type, &size, &mtime, hash, &off) != 4 || off == 0)
+            continue;
+        memset(&st, 0, sizeof(st));
+        st.st_size = (off_t)size;
+        st.st_mtime = (time_t)mtime;
+        backup_entry_t *e = backup_add(old, type, line + off, "", &st, 0);
+        if (!e) {
+            fclose(f);
+            return -1;
+        }
+        e->hash = strcmp(hash, "-") ? strtoull(hash, NULL, 16) : 0;
+    }
+    fclose(f);
+    qsort(old->v, old->count, sizeof(*old->v), manifest_path_cmp);
+    return 0;
+}
+
+/* 1 when the walk found nothing the manifest does not already describe */
+static int backup_unchanged(const backup_list_t *cur)
+{
+    char archive[PATH_MAX];
+    for (int i = 0; i < 2; i++) {
+        snprintf(archive, sizeof(archive), "%s/%s.tar.gz", FACTORY_BACKUP_DIR, i ? "etc" : "vienna");
+        if (access(archive, F_OK) != 0)
+            return 0;
+    }
+
+    backup_list_t old;
+    memset(&old, 0, sizeof(old));
+    int same = (backup_manifest_load(&old) == 0 && old.count == cur->count);
+    for (size_t i = 0; same && i < cur->count; i++) {
+        const backup_entry_t *e = &cur->v[i];
+        const backup_entry_t *o = bsearch(e, old.v, old.count, sizeof(*old.v), manifest_path_cmp);
+        if (!o || o->type != e->type)
+            same = 0;
+        else if (e->type == 'f')
+            same = (o->st.st_size == e->st.st_size && o->st.st_mtime == e->st.st_mtime);
+        else if (e->type == 'l')
+            same = (o->hash == e->hash);
+    }
+    backup_list_free(&old);
+    return same;
+}
+
+static int tar_write_header(gzFile gz, const char *name, char type, const struct stat *st,
+                            uint64_t size, const char *link)
+{
+    unsigned char h[TAR_BLOCK];
+    size_t name_len = strlen(name);
+    size_t link_len = link ? strlen(link) : 0;
+
+    /* GNU long name/link records for anything past 100 bytes */
+    if (name_len > 100 || link_len > 100) {
+        struct stat none;
+        memset(&none, 0, sizeof(none));
+        const char *lng[2] = { name_len > 100 ? name : NULL, link_len > 100 ? link : NULL };
+        const char types[2] = { 'L', 'K' };
+        for (int i = 0; i < 2; i++) {
+            if (!lng[i])
+                continue;
+            size_t len = strlen(lng[i]) + 1;
+            if (tar_write_header(gz, "././@LongLink", types[i], &none, len, NULL) != 0 ||
+                gzwrite(gz, lng[i], (unsigned)len) != (int)len)
+                return -1;
+            memset(h, 0, sizeof(h));
+            size_t pad = (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK;
+            if (pad && gzwrite(gz, h, (unsigned)pad) != (int)pad)
+                return -1;
+        }
+    }
+
+    memset(h, 0, sizeof(h));
+    memcpy(h, name, name_len > 100 ? 100 : name_len);
+    snprintf((char *)h + 100, 8, "%07o", (unsigned)(st->st_mode & 07777));
+    snprintf((char *)h + 108, 8, "%07o", (unsigned)st->st_uid & 07777777);
+    snprintf((char *)h + 116, 8, "%07o", (unsigned)st->st_gid & 07777777);
+    snprintf((char *)h + 124, 12, "%011llo", (unsigned long long)size);
+    snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)st->st_mtime);
+    h[156] = (unsigned char)type;
+    if (link)
+        memcpy(h + 157, link, link_len > 100 ? 100 : link_len);
+    memcpy(h + 257, "ustar  ", 8);
+
+    unsigned sum = 0;
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += h[i];
+    snprintf((char *)h + 148, 7, "%06o", sum);
+
+    return gzwrite(gz, h, TAR_BLOCK) == TAR_BLOCK ? 0 : -1;
+}
+
+/* Archives one file and hashes it on the way through */
+static int tar_write_file(gzFile gz, backup_entry_t *e)
+{
+    int fd = open(e->src, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (tar_write_header(gz, e->path, '0', &e->st, e->st.st_size, NULL) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint64_t h = FNV64_OFFSET, left = e->st.st_size;
+    while (left > 0) {
+        size_t want = left < COPY_BUF ? (size_t)left : COPY_BUF;
+        ssize_t n = read(fd, backup_buf, want);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || gzwrite(gz, backup_buf, (unsigned)n) != (int)n) {
+            /* Shrunk or unreadable while we were archiving it */
+            close(fd);
+            return -1;
+        }
+        h = fnv1a(h, backup_buf, n);
+        left -= n;
+    }
+    close(fd);
+    e->hash = h;
+
+    size_t pad = (TAR_BLOCK - e->st.st_size % TAR_BLOCK) % TAR_BLOCK;
+    memset(backup_buf, 0, pad);
+    return (pad == 0 || gzwrite(gz, backup_buf, (unsigned)pad) == (int)pad) ? 0 : -1;
+}
+
+static int backup_write_archive(backup_list_t *l, int archive, const char *dst)
+{
+    char tmp[PATH_MAX + 8], name[PATH_MAX + 1];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+    gzFile gz = gzopen(tmp, FACTORY_BACKUP_GZ_MODE);
+    if (!gz)
+        return -1;
+    gzbuffer(gz, COPY_BUF);
+
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < l->count; i++) {
+        backup_entry_t *e = &l->v[i];
+        if (e->archive != archive)
+            continue;
+        switch (e->type) {
+        case 'd':
+            snprintf(name, sizeof(name), "%s/", e->path);
+            ret = tar_write_header(gz, name, '5', &e->st, 0, NULL);
+            break;
+        case 'l':
+            ret = tar_write_header(gz, e->path, '2', &e->st, 0, e->link);
+            break;
+        case 'h':
+            ret = tar_write_header(gz, e->path, '1', &e->st, 0, e->link);
+            break;
+        case 'f':
+            ret = tar_write_file(gz, e);
+            if (ret != 0)
+                fprintf(stderr, "Failed to archive %s\n", e->src);
+            break;
+        default:
+            break;
+        }
+    }
+
+    memset(backup_buf, 0, 2 * TAR_BLOCK);
+    if (ret == 0 && gzwrite(gz, backup_buf, 2 * TAR_BLOCK) != 2 * TAR_BLOCK)
+        ret = -1;
+    if (gzclose(gz) != Z_OK)
+        ret = -1;
+    if (ret != 0 || rename(tmp, dst) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int backup_write_manifest(const backup_list_t *l)
+{
+    const char *dst = FACTORY_BACKUP_DIR "/manifest.txt";
+    const char *tmp = FACTORY_BACKUP_DIR "/manifest.txt.tmp";
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return -1;
+
+    fprintf(f, "# factory manifest: <type> <size> <mtime> <hash|-> <path>\n");
+    for (size_t i = 0; i < l->count; i++) {
+        const backup_entry_t *e = &l->v[i];
+        switch (e->type) {
+        case 'f':
+            fprintf(f, "f %llu %lld %016llx %s\n", (unsigned long long)e->st.st_size,
+                    (long long)e->st.st_mtime, (unsigned long long)e->hash, e->path);
+            break;
+        case 'l':
+            fprintf(f, "l 0 %lld %016llx %s\n", (long long)e->st.st_mtime,
+                    (unsigned long long)e->hash, e->path);
+            break;
+        default:
+            fprintf(f, "%c 0 0 - %s\n", e->type, e->path);
+            break;
+        }
+    }
+    if (fclose(f) != 0 || rename(tmp, dst) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Archive member names are relative to the directory holding SRC_ROOT */
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
 void capture_factory_backup()
 {
     printf("Capturing full factory backup...\n");
 
     mkdir(FACTORY_BACKUP_DIR, 0755);
 
-    run_cmd(
-        "tar -cpf /mnt/flash/vienna/factory_backup/vienna.tar "
-        "--exclude=vienna/lib "
-        "--exclude=vienna/firmware "
-        "--exclude=vienna/scripts "
-        "--exclude=vienna/bin "
-        "--exclude=vienna/factory_backup "
-        "-C /mnt/flash vienna"
-    );
-
-     run_cmd(
-        "tar -cpf /mnt/flash/vienna/factory_backup/etc.tar "
-        "-C /mnt/flash etc"
-    );
+    backup_list_t list;
+    memset(&list, 0, sizeof(list));
+    if (backup_walk(&list, SRC_ROOT, base_name(SRC_ROOT), 0, 1) != 0 ||
+        backup_walk(&list, SRC_ETC, base_name(SRC_ETC), 1, 1) != 0) {
+        fprintf(stderr, "Factory backup failed: cannot read %s or %s\n", SRC_ROOT, SRC_ETC);
+        backup_list_free(&list);
+        return;
+    }
 
-    system("sync");
-    printf("Factory backup complete.\n");
+    if (backup_unchanged(&list)) {
+        printf("Factory backup unchanged (%zu paths), skipping capture.\n", list.count);
+        backup_list_free(&list);
+        return;
+    }
+
+    /* Archives first, manifest last: a manifest only ever describes complete archives */
+    char vienna_tar[PATH_MAX], etc_tar[PATH_MAX];
+    snprintf(vienna_tar, sizeof(vienna_tar), "%s/vienna.tar.gz", FACTORY_BACKUP_DIR);
+    snprintf(etc_tar, sizeof(etc_tar), "%s/etc.tar.gz", FACTORY_BACKUP_DIR);
+    unlink(FACTORY_BACKUP_DIR "/manifest.txt");
+    if (backup_write_archive(&list, 0, vienna_tar) != 0 ||
+        backup_write_archive(&list, 1, etc_tar) != 0 ||
+        backup_write_manifest(&list) != 0) {
+        fprintf(stderr, "Factory backup failed.\n");
+        backup_list_free(&list);
+        return;
+    }
+
+    /* Superseded uncompressed backups from older device_setup builds */
+    unlink(FACTORY_BACKUP_DIR "/vienna.tar");
+    unlink(FACTORY_BACKUP_DIR "/etc.tar");
+
+    int fd = open(FACTORY_BACKUP_DIR, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || syncfs(fd) != 0)
+        sync();
+    if (fd >= 0)
+        close(fd);
+
+    printf("Factory backup complete (%zu paths).\n", list.count);
+    backup_list_free(&list);
 }
 
 /* Validate MAC address format */
@@ -1,10 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include <errno.h>
+#include <zlib.h>
 
 #ifndef CONFIG_DIR
 #define CONFIG_DIR "/mnt/flash/vienna/m5s_config"
@@ -12,12 +18,25 @@
 #ifndef SNAPSHOT_FILE
 #define SNAPSHOT_FILE "/mnt/flash/vienna/default_snapshot.txt"
 #endif
+// tmpfs copies of lazy and volatile keys (fw/fw_config.h). Until it is
+// flushed a copy is read instead of the key file, and the flush writes it
+// back over the file, so a reset drops them.
+#ifndef CONFIG_VOLATILE_DIR
+#define CONFIG_VOLATILE_DIR "/tmp/m5s_config"
+#endif
 
 #ifndef FACTORY_BACKUP_DIR
 #define FACTORY_BACKUP_DIR "/mnt/flash/vienna/factory_backup"
 #endif
 #define FACTORY_VIENNA_BACKUP FACTORY_BACKUP_DIR "/vienna"
 #define FACTORY_ETC_BACKUP FACTORY_BACKUP_DIR "/etc"
+#ifndef FACTORY_MANIFEST
+#define FACTORY_MANIFEST FACTORY_BACKUP_DIR "/manifest.txt"
+#endif
+// Archives hold paths relative to this directory (vienna/..., etc/...)
+#ifndef FACTORY_RESTORE_ROOT
+#define FACTORY_RESTORE_ROOT "/mnt/flash"
+#endif
 
 #ifndef FACTORY_RESET_STATUS_FILE
 #define FACTORY_RESET_STATUS_FILE \
@@ -47,6 +66,19 @@ int write_value(const char *filename, const char *value)
     return 0;
 }
 
+// fsync() one file, or syncfs() the filesystem holding it, without a shell
+static void sync_path(const char *path, int whole_fs)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        sync();
+        return;
+    }
+    if ((whole_fs ? syncfs(fd) : fsync(fd)) != 0)
+        sync();
+    close(fd);
+}
+
 static void update_factory_reset_status(const char *status)
 {
     if (write_value(FACTORY_RESET_STATUS_FILE, status) != 0) {
@@ -56,19 +88,135 @@ static void update_factory_reset_status(const char *status)
     } else {
         printf("Factory reset status -> %s\n", status);
     }
-    system("sync");
+    sync_path(FACTORY_RESET_STATUS_FILE, 0);
+}
+
+#define FNV64_OFFSET 0xcbf29ce484222325ULL
+#define FNV64_PRIME  0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    while (len--) {
+        h ^= *p++;
+        h *= FNV64_PRIME;
+    }
+    return h;
 }
 
 // ---------------------------------------------------------
 // Load snapshot
 // ---------------------------------------------------------
+// Entries keep file order; snapshot_slots indexes them by key
+// (open addressing, entry index + 1, 0 = empty).
 typedef struct {
-    char key[128];
-    char value[512];
+    char *key;
+    char *value;
 } kv_t;
 
-kv_t entries[256];
+kv_t *entries = NULL;
 int entry_count = 0;
+static int entry_cap;
+static int *snapshot_slots;
+static size_t snapshot_nslots;
+
+static size_t snapshot_slot(const char *key)
+{
+    return (size_t)fnv1a(FNV64_OFFSET, key, strlen(key)) & (snapshot_nslots - 1);
+}
+
+static int snapshot_find(const char *key)
+{
+    if (snapshot_nslots == 0)
+        return -1;
+    for (size_t i = snapshot_slot(key);; i = (i + 1) & (snapshot_nslots - 1)) {
+        int idx = snapshot_slots[i];
+        if (idx == 0)
+            return -1;
+        if (strcmp(entries[idx - 1].key, key) == 0)
+            return idx - 1;
+    }
+}
+
+const char *snapshot_lookup(const char *key)
+{
+    int i = snapshot_find(key);
+    return i < 0 ? NULL : entries[i].value;
+}
+
+static void snapshot_free(void)
+{
+    for (int i = 0; i < entry_count; i++) {
+        free(entries[i].key);
+        free(entries[i].value);
+    }
+    free(entries);
+    free(snapshot_slots);
+    entries = NULL;
+    entry_count = entry_cap = 0;
+    snapshot_slots = NULL;
+    snapshot_nslots = 0;
+}
+
+// Keeps the index at <= 50% load
+static int snapshot_rehash(size_t nslots)
+{
+    int *slots = calloc(nslots, sizeof(*slots));
+    if (!slots)
+        return -1;
+    free(snapshot_slots);
+    snapshot_slots = slots;
+    snapshot_nslots = nslots;
+    for (int e = 0; e < entry_count; e++) {
+        size_t i = snapshot_slot(entries[e].key);
+        while (snapshot_slots[i])
+            i = (i + 1) & (nslots - 1);
+        snapshot_slots[i] = e + 1;
+    }
+    return 0;
+}
+
+// A repeated key replaces the earlier value
+static int snapshot_put(const char *key, const char *val)
+{
+    int i = snapshot_find(key);
+    if (i >= 0) {
+        char *v = strdup(val);
+        if (!v)
+            return -1;
+        free(entries[i].value);
+        entries[i].value = v;
+        return 0;
+    }
+
+    if ((size_t)(entry_count + 1) * 2 > snapshot_nslots &&
+        snapshot_rehash(snapshot_nslots ? snapshot_nslots * 2 : 64) != 0)
+        return -1;
+    if (entry_count == entry_cap) {
+        int cap = entry_cap ? entry_cap * 2 : 64;
+        kv_t *grown = realloc(entries, (size_t)cap * sizeof(*grown));
+        if (!grown)
+            return -1;
+        entries = grown;
+        entry_cap = cap;
+    }
+
+    kv_t *e = &entries[entry_count];
+    e->key = strdup(key);
+    e->value = strdup(val);
+    if (!e->key || !e->value) {
+        free(e->key);
+        free(e->value);
+        return -1;
+    }
+    entry_count++;
+
+    size_t slot = snapshot_slot(key);
+    while (snapshot_slots[slot])
+        slot = (slot + 1) & (snapshot_nslots - 1);
+    snapshot_slots[slot] = entry_count;
+    return 0;
+}
 
 void load_snapshot()
 {
@@ -78,43 +226,814 @@ void load_snapshot()
         exit(1);
     }
 
-    char line[700];
-    while (fgets(line, sizeof(line), f))
+    snapshot_free();
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) != -1)
     {
         char *eq = strchr(line, '=');
         if (!eq) continue;
         *eq = 0;
 
         const char *key = line;
-        const char *val = eq + 1;
-	char *newline = strchr(val, '\n');
-	if (newline)
-		*newline = '\0';
+        char *val = eq + 1;
+        val[strcspn(val, "\n")] = '\0';
 
-        strncpy(entries[entry_count].key, key, sizeof(entries[entry_count].key));
-        strncpy(entries[entry_count].value, val, sizeof(entries[entry_count].value));
-        entry_count++;
+        if (snapshot_put(key, val) != 0) {
+            fprintf(stderr, "Out of memory loading snapshot at %s\n", key);
+            break;
+        }
     }
 
+    free(line);
     fclose(f);
 }
 
 // ---------------------------------------------------------
 // FACTORY RESET
 // ---------------------------------------------------------
+// 1 when the file already holds exactly what write_value() would write
+static int value_matches(const char *path, const char *value)
+{
+    size_t len = strlen(value);
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    int same = 0;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size == len + 1 &&
+        (buf = malloc(len + 1)) != NULL) {
+        size_t done = 0;
+        ssize_t n;
+        while (done < len + 1 && (n = read(fd, buf + done, len + 1 - done)) > 0)
+            done += n;
+        same = (done == len + 1 && memcmp(buf, value, len) == 0 && buf[len] == '\n');
+    }
+    free(buf);
+    close(fd);
+    return same;
+}
+
+// Writes value through a temporary file and rename(), keeping the old
+// file's mode and owner. The caller fsyncs the directory.
+static int replace_value(const char *path, const char *value)
+{
+    char tmp[PATH_MAX];
+    struct stat st;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return -1;
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if (stat(path, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+        if (fchown(fd, st.st_uid, st.st_gid) != 0 && errno != EPERM)
+            perror("fchown");
+    }
+
+    size_t len = strlen(value);
+    int ok = write(fd, value, len) == (ssize_t)len && write(fd, "\n", 1) == 1 && fsync(fd) == 0;
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static void drop_volatile_copy(const char *key)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", CONFIG_VOLATILE_DIR, key) < (int)sizeof(path) &&
+        unlink(path) != 0 && errno != ENOENT)
+        fprintf(stderr, "Failed to drop %s: %s\n", path, strerror(errno));
+}
+
+static void drop_volatile_copies(void)
+{
+    DIR *dir = opendir(CONFIG_VOLATILE_DIR);
+    struct dirent *ent;
+    if (!dir)
+        return;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] != '.')
+            drop_volatile_copy(ent->d_name);
+    }
+    closedir(dir);
+}
+
+// Rewrites only the keys that differ from the snapshot, then commits the
+// renames with one fsync of CONFIG_DIR. A key whose file already matches
+// may still have a newer tmpfs copy, so every key's copy is dropped.
 void camera_configuration_reset()
 {
     load_snapshot();
+    int changed = 0;
     for (int i = 0; i < entry_count; i++)
     {
-        char dst[256];
-        snprintf(dst, sizeof(dst), "%s/%s", CONFIG_DIR, entries[i].key);
-        write_value(dst, entries[i].value);
+        char dst[PATH_MAX];
+        drop_volatile_copy(entries[i].key);
+        if (snprintf(dst, sizeof(dst), "%s/%s", CONFIG_DIR, entries[i].key) >= (int)sizeof(dst) ||
+            value_matches(dst, entries[i].value))
+            continue;
+        if (replace_value(dst, entries[i].value) != 0) {
+            fprintf(stderr, "Failed to restore %s: %s\n", entries[i].key, strerror(errno));
+            continue;
+        }
         printf("Restored %s\n", entries[i].key);
+        changed++;
+    }
+
+    if (changed > 0) {
+        int dir = open(CONFIG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir < 0 || fsync(dir) != 0)
+            sync();
+        if (dir >= 0)
+            close(dir);
+    }
+    printf("Factory reset complete (%d of %d keys changed).\n", changed, entry_count);
+}
+
+// ---------------------------------------------------------
+// Factory manifest
+// ---------------------------------------------------------
+// Optional list of everything the factory image owns, one line per path
+// relative to FACTORY_RESTORE_ROOT:
+//
+//   <type> <size> <mtime> <hash|-> <path>
+//
+// type is f (file), d (directory), l (symlink), h (hard link) or x (subtree
+// left alone, e.g. vienna/firmware). hash is the 64-bit FNV-1a of a file's
+// contents in hex. After the archives are restored, anything inside a 'd'
+// directory that the manifest does not list is removed.
+typedef struct {
+    char *path;
+    char type;
+    int has_hash;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+} manifest_entry_t;
+
+static struct {
+    manifest_entry_t *entries;
+    size_t count;
+    size_t cap;
+    size_t *slots;      // open addressing, entry index + 1, 0 = empty
+    size_t nslots;
+} manifest;
+
+// Strips "/" and "./" prefixes and trailing slashes.
+// Returns 1 for the root itself and -1 for paths with ".." components.
+static int normalize_path(char *path)
+{
+    char *p = path;
+    while (*p == '/' || (p[0] == '.' && p[1] == '/'))
+        p += (*p == '/') ? 1 : 2;
+    memmove(path, p, strlen(p) + 1);
+
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+        path[--len] = '\0';
+    if (len == 0 || strcmp(path, ".") == 0)
+        return 1;
+
+    for (const char *c = path; c; ) {
+        if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || c[2] == '\0'))
+            return -1;
+        c = strchr(c, '/');
+        if (c)
+            c++;
+    }
+    return 0;
+}
+
+static size_t manifest_slot(const char *path)
+{
+    return (size_t)fnv1a(FNV64_OFFSET, path, strlen(path)) & (manifest.nslots - 1);
+}
+
+static const manifest_entry_t *manifest_find(const char *path)
+{
+    if (manifest.nslots == 0)
+        return NULL;
+    for (size_t i = manifest_slot(path);; i = (i + 1) & (manifest.nslots - 1)) {
+        size_t idx = manifest.slots[i];
+        if (idx == 0)
+            return NULL;
+        if (strcmp(manifest.entries[idx - 1].path, path) == 0)
+            return &manifest.entries[idx - 1];
+    }
+}
+
+static void manifest_free(void)
+{
+    for (size_t i = 0; i < manifest.count; i++)
+        free(manifest.entries[i].path);
+    free(manifest.entries);
+    free(manifest.slots);
+    memset(&manifest, 0, sizeof(manifest));
+}
+
+// Returns 0 when loaded, 1 when there is no manifest, -1 on error
+static int manifest_load(void)
+{
+    manifest_free();
+    FILE *f = fopen(FACTORY_MANIFEST, "r");
+    if (!f)
+        return errno == ENOENT ? 1 : -1;
+
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), f)) {
+        char type, hash[32];
+        unsigned long long size;
+        long long mtime;
+        int off = 0;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        if (sscanf(line, "%c %llu %lld %31s %n", &type, &size, &mtime, hash, &off) != 4 ||
+            off == 0 || !strchr("fdlhx", type) || normalize_path(line + off) != 0)
+            continue;
+
+        if (manifest.count == manifest.cap) {
+            size_t cap = manifest.cap ? manifest.cap * 2 : 256;
+            manifest_entry_t *grown = realloc(manifest.entries, cap * sizeof(*grown));
+            if (!grown)
+                goto fail;
+            manifest.entries = grown;
+            manifest.cap = cap;
+        }
+        manifest_entry_t *e = &manifest.entries[manifest.count];
+        e->path = strdup(line + off);
+        if (!e->path)
+            goto fail;
+        e->type = type;
+        e->size = size;
+        e->mtime = mtime;
+        e->has_hash = strcmp(hash, "-") != 0;
+        e->hash = e->has_hash ? strtoull(hash, NULL, 16) : 0;
+        manifest.count++;
+    }
+    fclose(f);
+
+    // Index at <= 50% load so lookups stay short
+    manifest.nslots = 16;
+    while (manifest.nslots < manifest.count * 2)
+        manifest.nslots <<= 1;
+    manifest.slots = calloc(manifest.nslots, sizeof(*manifest.slots));
+    if (!manifest.slots) {
+        manifest_free();
+        return -1;
+    }
+    for (size_t e = 0; e < manifest.count; e++) {
+        size_t i = manifest_slot(manifest.entries[e].path);
+        while (manifest.slots[i])
+            i = (i + 1) & (manifest.nslots - 1);
+        manifest.slots[i] = e + 1;
+    }
+    return 0;
+
+fail:
+    fclose(f);
+    manifest_free();
+    return -1;
+}
+
+// ---------------------------------------------------------
+// In-process archive restore
+// ---------------------------------------------------------
+// Reads the factory tar files directly and only writes what differs from
+// the installed tree: a file whose size and mtime match is trusted, one
+// whose size matches is compared by content hash, anything else is
+// rewritten through a temporary file and rename(). Owner, mode and mtime
+// are fixed up in place when only they differ.
+#define TAR_BLOCK 512
+#define COPY_BUF  (64 * 1024)
+
+enum { RESTORE_OK = 0, RESTORE_FAIL = -1, RESTORE_UNSUPPORTED = 1 };
+
+typedef struct {
+    char name[PATH_MAX];
+    char link[PATH_MAX];
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    int64_t mtime;
+    off_t data;         // offset of the contents in the archive
+} tar_entry_t;
+
+static struct {
+    unsigned entries;
+    unsigned unchanged;
+    unsigned rewritten;
+    unsigned metadata;
+    unsigned removed;
+} restore_stats;
+
+static unsigned char copy_buf[COPY_BUF];
+
+// Returns 0 on success, 1 at end of file, -1 on error
+static int pread_full(int fd, void *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return done == 0 ? 1 : -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (const char *)buf + n;
+        len -= n;
     }
+    return 0;
+}
 
-    system("sync");
-    printf("Factory reset complete.\n");
+// pread_full() for the archive stream; gzread() passes plain tar files
+// through, and seeks in them are real lseek()s
+static int arc_read(gzFile gz, void *buf, size_t len, off_t off)
+{
+    if (gztell(gz) != off && gzseek(gz, off, SEEK_SET) != off)
+        return -1;
+    size_t done = 0;
+    while (done < len) {
+        int n = gzread(gz, (char *)buf + done, (unsigned)(len - done));
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return done == 0 ? 1 : -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Octal header field, or GNU base-256 for values that do not fit
+static int64_t tar_number(const unsigned char *p, size_t len)
+{
+    int64_t v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x3f;
+        for (size_t i = 1; i < len; i++)
+            v = (v << 8) | p[i];
+        return v;
+    }
+    for (size_t i = 0; i < len && p[i]; i++) {
+        if (p[i] == ' ')
+            continue;
+        if (p[i] < '0' || p[i] > '7')
+            break;
+        v = v * 8 + (p[i] - '0');
+    }
+    return v;
+}
+
+static int tar_checksum_ok(const unsigned char *h)
+{
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    return (unsigned)tar_number(h + 148, 8) == sum;
+}
+
+// pax extended header: only path and linkpath matter here
+static int tar_pax(gzFile gz, uint64_t size, off_t data, char *name, char *link)
+{
+    if (size > 65536)
+        return -1;
+    char *buf = malloc(size + 1);
+    if (!buf || arc_read(gz, buf, size, data) != 0) {
+        free(buf);
+        return -1;
+    }
+    buf[size] = '\0';
+
+    char *p = buf;
+    while (p < buf + size) {
+        char *kv;
+        long len = strtol(p, &kv, 10);
+        if (len <= 0 || *kv != ' ' || p + len > buf + size)
+            break;
+        p[len - 1] = '\0';
+        kv++;
+        if (strncmp(kv, "path=", 5) == 0)
+            snprintf(name, PATH_MAX, "%s", kv + 5);
+        else if (strncmp(kv, "linkpath=", 9) == 0)
+            snprintf(link, PATH_MAX, "%s", kv + 9);
+        p += len;
+    }
+    free(buf);
+    return 0;
+}
+
+// Reads the member at *off and advances past it, folding GNU long name and
+// pax headers into the entry. Returns 1 at the end of the archive.
+static int tar_next(gzFile gz, off_t *off, tar_entry_t *e)
+{
+    static const unsigned char zero[TAR_BLOCK];
+    unsigned char h[TAR_BLOCK];
+    char long_name[PATH_MAX] = "";
+    char long_link[PATH_MAX] = "";
+
+    for (;;) {
+        int r = arc_read(gz, h, TAR_BLOCK, *off);
+        if (r != 0)
+            return r;
+        if (memcmp(h, zero, TAR_BLOCK) == 0)
+            return 1;
+        if (!tar_checksum_ok(h))
+            return -1;
+
+        uint64_t size = tar_number(h + 124, 12);
+        off_t data = *off + TAR_BLOCK;
+        *off = data + (off_t)((size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK);
+
+        char type = h[156];
+        if (type == 'L' || type == 'K') {
+            char *dst = (type == 'L') ? long_name : long_link;
+            if (size >= PATH_MAX || arc_read(gz, dst, size, data) != 0)
+                return -1;
+            dst[size] = '\0';
+            continue;
+        }
+        if (type == 'x') {
+            if (tar_pax(gz, size, data, long_name, long_link) != 0)
+                return -1;
+            continue;
+        }
+        if (type == 'g')
+            continue;
+
+        if (long_name[0])
+            snprintf(e->name, sizeof(e->name), "%s", long_name);
+        else if (memcmp(h + 257, "ustar", 5) == 0 && h[345])
+            snprintf(e->name, sizeof(e->name), "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+        else
+            snprintf(e->name, sizeof(e->name), "%.100s", (const char *)h);
+        if (long_link[0])
+            snprintf(e->link, sizeof(e->link), "%s", long_link);
+        else
+            snprintf(e->link, sizeof(e->link), "%.100s", (const char *)h + 157);
+
+        e->type = (type == '\0' || type == '7') ? '0' : type;
+        e->mode = (mode_t)(tar_number(h + 100, 8) & 07777);
+        e->uid = (uid_t)tar_number(h + 108, 8);
+        e->gid = (gid_t)tar_number(h + 116, 8);
+        e->size = size;
+        e->mtime = tar_number(h + 136, 12);
+        e->data = data;
+        return 0;
+    }
+}
+
+// FNV-1a of len bytes of fd starting at off
+static int hash_range(int fd, off_t off, uint64_t len, uint64_t *out)
+{
+    uint64_t h = FNV64_OFFSET;
+    while (len > 0) {
+        size_t n = len < COPY_BUF ? (size_t)len : COPY_BUF;
+        if (pread_full(fd, copy_buf, n, off) != 0)
+            return -1;
+        h = fnv1a(h, copy_buf, n);
+        off += n;
+        len -= n;
+    }
+    *out = h;
+    return 0;
+}
+
+// Same-size file with a different mtime: 1 if the contents still match.
+// The manifest hash is preferred; a compressed archive without one cannot
+// be re-read cheaply, so the file is treated as changed.
+static int content_matches(gzFile gz, const tar_entry_t *e, const char *dst)
+{
+    const manifest_entry_t *m = manifest_find(e->name);
+    uint64_t want = FNV64_OFFSET, have;
+
+    if (m && m->type == 'f' && m->has_hash && m->size == e->size) {
+        want = m->hash;
+    } else if (gzdirect(gz)) {
+        off_t off = e->data;
+        for (uint64_t left = e->size; left > 0; ) {
+            size_t n = left < COPY_BUF ? (size_t)left : COPY_BUF;
+            if (arc_read(gz, copy_buf, n, off) != 0)
+                return -1;
+            want = fnv1a(want, copy_buf, n);
+            off += n;
+            left -= n;
+        }
+    } else {
+        return 0;
+    }
+
+    int in = open(dst, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return 0;
+    int r = hash_range(in, 0, e->size, &have);
+    close(in);
+    return r == 0 && have == want;
+}
+
+static int remove_tree(const char *path)
+{
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path);
+
+    DIR *d = opendir(path);
+    if (!d)
+        return -1;
+    int ret = 0;
+    struct dirent *de;
+    char child[PATH_MAX];
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, de->d_name) >= (int)sizeof(child) ||
+            remove_tree(child) != 0)
+            ret = -1;
+    }
+    closedir(d);
+    return (rmdir(path) == 0) ? ret : -1;
+}
+
+// mkdir -p for the directories above path, for archives without dir entries
+static void make_parents(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + strlen(FACTORY_RESTORE_ROOT) + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+}
+
+// Brings owner, mode and mtime in line with the archive; 1 if anything changed.
+// Directory mtimes are left alone since restoring their contents moves them.
+static int fix_metadata(const char *dst, const tar_entry_t *e, const struct stat *st)
+{
+    int changed = 0;
+    if ((st->st_uid != e->uid || st->st_gid != e->gid) && lchown(dst, e->uid, e->gid) == 0)
+        changed = 1;
+    if (e->type != '2' && (st->st_mode & 07777) != e->mode && chmod(dst, e->mode) == 0)
+        changed = 1;
+    if (e->type != '5' && st->st_mtime != e->mtime) {
+        struct timespec ts[2] = { { 0, UTIME_OMIT }, { (time_t)e->mtime, 0 } };
+        if (utimensat(AT_FDCWD, dst, ts, AT_SYMLINK_NOFOLLOW) == 0)
+            changed = 1;
+    }
+    return changed;
+}
+
+static int write_file(gzFile gz, const tar_entry_t *e, const char *dst, const char *tmp)
+{
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out < 0)
+        return -1;
+
+    uint64_t left = e->size;
+    off_t off = e->data;
+    while (left > 0) {
+        size_t n = left < COPY_BUF ? (size_t)left : COPY_BUF;
+        if (arc_read(gz, copy_buf, n, off) != 0 || write_full(out, copy_buf, n) != 0) {
+            close(out);
+            unlink(tmp);
+            return -1;
+        }
+        off += n;
+        left -= n;
+    }
+
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { (time_t)e->mtime, 0 } };
+    if (fchown(out, e->uid, e->gid) != 0 && errno != EPERM)
+        perror("fchown");
+    fchmod(out, e->mode);
+    futimens(out, ts);
+    if (close(out) != 0 || rename(tmp, dst) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 0 when restored, RESTORE_UNSUPPORTED for device/fifo entries, -1 on error
+static int restore_entry(gzFile gz, tar_entry_t *e)
+{
+    char dst[PATH_MAX], tmp[PATH_MAX + 8], target[PATH_MAX], cur[PATH_MAX];
+    struct stat st, tst;
+
+    int n = normalize_path(e->name);
+    if (n > 0)
+        return 0;
+    if (n < 0) {
+        fprintf(stderr, "Skipping unsafe archive path %s\n", e->name);
+        return 0;
+    }
+    if (snprintf(dst, sizeof(dst), "%s/%s", FACTORY_RESTORE_ROOT, e->name) >= (int)sizeof(dst)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.frtmp", dst);
+
+    int exists = (lstat(dst, &st) == 0);
+    if (exists && S_ISDIR(st.st_mode) && e->type != '5') {
+        if (remove_tree(dst) != 0)
+            return -1;
+        exists = 0;
+    }
+    if (!exists)
+        make_parents(dst);
+    restore_stats.entries++;
+
+    switch (e->type) {
+    case '5':
+        if (exists && !S_ISDIR(st.st_mode)) {
+            if (unlink(dst) != 0)
+                return -1;
+            exists = 0;
+        }
+        if (!exists) {
+            if (mkdir(dst, 0700) != 0 && errno != EEXIST)
+                return -1;
+            if (lchown(dst, e->uid, e->gid) != 0 && errno != EPERM)
+                perror("lchown");
+            chmod(dst, e->mode);
+            restore_stats.rewritten++;
+            return 0;
+        }
+        break;
+
+    case '0':
+        if (exists && S_ISREG(st.st_mode) && (uint64_t)st.st_size == e->size) {
+            if (st.st_mtime == e->mtime)
+                break;
+            int same = content_matches(gz, e, dst);
+            if (same < 0)
+                return -1;
+            if (same)
+                break;
+        }
+        if (write_file(gz, e, dst, tmp) != 0)
+            return -1;
+        restore_stats.rewritten++;
+        return 0;
+
+    case '2':
+        if (exists && S_ISLNK(st.st_mode)) {
+            ssize_t len = readlink(dst, cur, sizeof(cur) - 1);
+            if (len >= 0) {
+                cur[len] = '\0';
+                if (strcmp(cur, e->link) == 0)
+                    break;
+            }
+        }
+        unlink(tmp);
+        if (symlink(e->link, tmp) != 0)
+            return -1;
+        if (lchown(tmp, e->uid, e->gid) != 0 && errno != EPERM)
+            perror("lchown");
+        if (rename(tmp, dst) != 0) {
+            unlink(tmp);
+            return -1;
+        }
+        restore_stats.rewritten++;
+        return 0;
+
+    case '1':
+        if (normalize_path(e->link) != 0 ||
+            snprintf(target, sizeof(target), "%s/%s", FACTORY_RESTORE_ROOT, e->link) >= (int)sizeof(target) ||
+            lstat(target, &tst) != 0)
+            return -1;
+        if (exists && st.st_dev == tst.st_dev && st.st_ino == tst.st_ino) {
+            restore_stats.unchanged++;
+            return 0;
+        }
+        unlink(tmp);
+        if (link(target, tmp) != 0)
+            return -1;
+        if (rename(tmp, dst) != 0) {
+            unlink(tmp);
+            return -1;
+        }
+        restore_stats.rewritten++;
+        return 0;
+
+    default:
+        restore_stats.entries--;
+        return RESTORE_UNSUPPORTED;
+    }
+
+    if (fix_metadata(dst, e, &st))
+        restore_stats.metadata++;
+    else
+        restore_stats.unchanged++;
+    return 0;
+}
+
+// Plain and gzip-compressed tar files are read here. Missing archives and
+// ones this reader does not handle (other compression, device nodes) come
+// back as RESTORE_UNSUPPORTED so the caller can hand them to tar.
+static int restore_archive(const char *archive)
+{
+    gzFile gz = gzopen(archive, "rb");
+    if (!gz)
+        return RESTORE_UNSUPPORTED;
+    gzbuffer(gz, COPY_BUF);
+
+    tar_entry_t *e = malloc(sizeof(*e));
+    if (!e) {
+        gzclose(gz);
+        return RESTORE_FAIL;
+    }
+
+    int ret = RESTORE_OK;
+    off_t off = 0;
+    for (int first = 1;; first = 0) {
+        int r = tar_next(gz, &off, e);
+        if (r == 1)
+            break;
+        if (r < 0) {
+            fprintf(stderr, "Unreadable archive header in %s\n", archive);
+            ret = first ? RESTORE_UNSUPPORTED : RESTORE_FAIL;
+            break;
+        }
+        r = restore_entry(gz, e);
+        if (r == RESTORE_UNSUPPORTED) {
+            fprintf(stderr, "%s: entry type '%c' needs tar\n", e->name, e->type);
+            ret = r;
+            break;
+        }
+        if (r != 0) {
+            fprintf(stderr, "Failed to restore %s: %s\n", e->name, strerror(errno));
+            ret = RESTORE_FAIL;
+            break;
+        }
+    }
+
+    free(e);
+    gzclose(gz);
+    return ret;
+}
+
+// Removes what the manifest does not list from the directories it owns
+static int prune_extras(void)
+{
+    char dir[PATH_MAX], rel[PATH_MAX], child[PATH_MAX];
+    int ret = 0;
+
+    for (size_t i = 0; i < manifest.count; i++) {
+        const manifest_entry_t *m = &manifest.entries[i];
+        if (m->type != 'd')
+            continue;
+        snprintf(dir, sizeof(dir), "%s/%s", FACTORY_RESTORE_ROOT, m->path);
+        DIR *d = opendir(dir);
+        if (!d)
+            continue;
+
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            if (snprintf(rel, sizeof(rel), "%s/%s", m->path, de->d_name) >= (int)sizeof(rel) ||
+                snprintf(child, sizeof(child), "%s/%s", dir, de->d_name) >= (int)sizeof(child) ||
+                manifest_find(rel))
+                continue;
+            if (strcmp(child, FACTORY_BACKUP_DIR) == 0 ||
+                strcmp(child, FACTORY_RESET_STATUS_FILE) == 0)
+                continue;
+            if (remove_tree(child) != 0) {
+                fprintf(stderr, "Failed to remove %s: %s\n", child, strerror(errno));
+                ret = -1;
+                continue;
+            }
+            printf("Removed %s\n", rel);
+            restore_stats.removed++;
+        }
+        closedir(d);
+    }
+    return ret;
 }
 
 // ---------------------------------------------------------
@@ -138,30 +1057,52 @@ void camera_factory_reset()
     // 2. Mark in-progress
     update_factory_reset_status(STATUS_IN_PROGRESS);
 
-    // 3. Restore vienna
-    printf("Restoring /mnt/flash/vienna from TAR...\n");
-    if (run_cmd(
-            "tar -xpf /mnt/flash/vienna/factory_backup/vienna.tar "
-            "-C /mnt/flash") != 0)
-    {
-        update_factory_reset_status(STATUS_FAIL);
-        return;
+    // 3. Restore vienna and etc, rewriting only what differs.
+    //    device_setup writes .tar.gz; units provisioned earlier have .tar.
+    static const char *const archives[] = { "vienna", "etc" };
+    int have_manifest = (manifest_load() == 0);
+    memset(&restore_stats, 0, sizeof(restore_stats));
+
+    for (size_t i = 0; i < sizeof(archives) / sizeof(archives[0]); i++) {
+        char archive[PATH_MAX], cmd[2 * PATH_MAX];
+        int gz = 1;
+        snprintf(archive, sizeof(archive), "%s/%s.tar.gz", FACTORY_BACKUP_DIR, archives[i]);
+        if (access(archive, F_OK) != 0) {
+            snprintf(archive, sizeof(archive), "%s/%s.tar", FACTORY_BACKUP_DIR, archives[i]);
+            gz = 0;
+        }
+        printf("Restoring %s from %s...\n", FACTORY_RESTORE_ROOT, archive);
+
+        int ret = restore_archive(archive);
+        if (ret == RESTORE_UNSUPPORTED) {
+            snprintf(cmd, sizeof(cmd), "tar -x%spf %s -C %s", gz ? "z" : "", archive, FACTORY_RESTORE_ROOT);
+            ret = run_cmd(cmd);
+        }
+        if (ret != 0) {
+            manifest_free();
+            update_factory_reset_status(STATUS_FAIL);
+            return;
+        }
     }
 
-    // 4. Restore etc
-    printf("Restoring /mnt/flash/etc from TAR...\n");
-    if (run_cmd(
-            "tar -xpf /mnt/flash/vienna/factory_backup/etc.tar "
-            "-C /mnt/flash") != 0)
-    {
+    // 4. Remove files the factory image does not have
+    int pruned = have_manifest ? prune_extras() : 0;
+    manifest_free();
+    printf("Restore: %u entries, %u unchanged, %u rewritten, %u metadata only, %u removed\n",
+           restore_stats.entries, restore_stats.unchanged, restore_stats.rewritten,
+           restore_stats.metadata, restore_stats.removed);
+    if (pruned != 0) {
         update_factory_reset_status(STATUS_FAIL);
         return;
     }
 
-    // 5. Sync filesystem
-    system("sync");
+    // 5. Sync the flash filesystem
+    sync_path(FACTORY_RESTORE_ROOT, 1);
+
+    // 6. Drop the tmpfs config copies, which predate the restored files
+    drop_volatile_copies();
 
-    // 6. Back to idle (success)
+    // 7. Back to idle (success)
     update_factory_reset_status(STATUS_IDLE);
     printf("Camera factory reset complete.\n");
 }
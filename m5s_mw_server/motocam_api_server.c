@@ -7,6 +7,7 @@
 #include "gpio.h"
 #include "timer.h"
 #include "log.h"
+#include "fw/fw_config.h"
 
 #ifndef CONFIG_PATH
 #define CONFIG_PATH "/mnt/flash/vienna/config"
@@ -72,15 +73,34 @@ int update_calibration_value()
     return 0;
 }
 
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_handler(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
 int main() {
+    struct sigaction sa;
 
     gpio_init();
 
     update_calibration_value();
 
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &stop_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
     timer_init();
 
-    while (1) {
+    while (!stop_requested) {
         pause(); // Wait for signals
     }
+
+    /* Persist lazily written config (e.g. IR brightness) before exiting */
+    timer_deinit();
+    config_flush_lazy();
+    return 0;
 }
@@ -6,7 +6,10 @@
 #include <pthread.h>
 #include <unistd.h>
 #include "fw.h"
+#include "fw/fw_clock.h"
 #include "fw/fw_image.h"
+#include "fw/fw_msg.h"
+#include "fw/fw_config.h"
 #include "fw/fw_sensor.h"
 #include "gpio.h"
 #include "log.h"
@@ -52,6 +55,8 @@ static int minute_counter_ir = 0;
 
 static volatile sig_atomic_t timer_tick = 0;
 static pthread_t tid;
+static int timer_started;
+static int timer_stop;
 
 static int read_float_from_file(const char *path, float *val)
 {
@@ -153,10 +158,18 @@ void get_gain(float *gain_value)
 {
     float gain = 0;
     
+    char reply[64];
     int status;
-    status = system("asc_msg_sender -e 12 -g");
+
+    // The ASC daemon answers with the gain; the CLI leaves it in GAIN_FILE
+    status = fw_msg_request(&fw_msg_asc, "-e 12 -g", reply, sizeof(reply));
     if (status != 0)
         LOG_ERROR("Command execution failed with status %d\n", status);
+    if (reply[0]) {
+        if (sscanf(reply, "%f", &gain) == 1)
+            *gain_value = gain;
+        return;
+    }
 
     FILE *fp = fopen(GAIN_FILE, "r");
     if (!fp)
@@ -235,8 +248,14 @@ void process_auto_day_night(void)
 static void *timer_worker(void *arg)
 {
     (void)arg;
+    uint64_t next_tick = fw_clock_now_ms() + TEMP_TIMER_IN_SEC * 1000u;
 
-    while (1) {
+    while (!__atomic_load_n(&timer_stop, __ATOMIC_SEQ_CST)) {
+        uint64_t now = fw_clock_now_ms();
+        if (now >= next_tick) {
+            next_tick = now + TEMP_TIMER_IN_SEC * 1000u;
+            timer_tick = 1;
+        }
         if (timer_tick) {
             timer_tick = 0;
 
@@ -245,16 +264,14 @@ static void *timer_worker(void *arg)
                 control_ir();
             }
             process_auto_day_night();
+            config_flush_due();
         }
-        struct timespec ts;
-        ts.tv_sec  = 0;
-        ts.tv_nsec = 10 * 1000 * 1000; // 10 ms
-
-        (void)nanosleep(&ts, NULL);
+        fw_clock_sleep_ms(10);
     }
     return NULL;
 }
 
+/* SIGALRM: run the periodic work now instead of at the next interval */
 void timer_handler(int sig)
 {
     (void)sig;
@@ -264,7 +281,6 @@ void timer_handler(int sig)
 void timer_init()
 {
     struct sigaction sa;
-    struct itimerval timer;
 
     load_mode_thresholds_from_config();
     // checking for ir and sensor support is there or not
@@ -275,12 +291,17 @@ void timer_init()
     sa.sa_handler = &timer_handler;
     sigaction(SIGALRM, &sa, NULL);
 
-    // Configure timer to go off every 3 seconds
-    timer.it_value.tv_sec = TEMP_TIMER_IN_SEC;
-    timer.it_value.tv_usec = 0;
-    timer.it_interval.tv_sec = TEMP_TIMER_IN_SEC;
-    timer.it_interval.tv_usec = 0;
-    
-    setitimer(ITIMER_REAL, &timer, NULL);
-    pthread_create(&tid, NULL, timer_worker, NULL);
+    // The worker runs the work every TEMP_TIMER_IN_SEC on the fw clock
+    __atomic_store_n(&timer_stop, 0, __ATOMIC_SEQ_CST);
+    if (pthread_create(&tid, NULL, timer_worker, NULL) == 0)
+        timer_started = 1;
+}
+
+void timer_deinit()
+{
+    if (!timer_started)
+        return;
+    __atomic_store_n(&timer_stop, 1, __ATOMIC_SEQ_CST);
+    pthread_join(tid, NULL);
+    timer_started = 0;
 }
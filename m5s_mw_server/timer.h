@@ -4,6 +4,8 @@
 #include <sys/time.h>
 
 void timer_init();
+/* Stop the worker started by timer_init() and wait for it */
+void timer_deinit();
 
 #endif
 
@@ -0,0 +1,18 @@
+#include <stdint.h>
+
+/*
+ * Latest-wins coalescing of state-setting SET commands (zoom, IR
+ * brightness, ...), one slot per (command, sub_command). While one request
+ * of a slot is executing, later ones replace the slot's pending value
+ * instead of queueing behind it. When the running request finishes, the
+ * latest pending value is executed, and every request it replaced returns
+ * that execution's result. Other commands run as before.
+ */
+
+#define COALESCE_DATA_MAX 255
+
+int8_t is_state_setting_command(const uint8_t command, const uint8_t sub_command);
+int8_t set_command_coalesced(const uint8_t command, const uint8_t sub_command,
+                             const uint8_t data_length, const uint8_t *data);
+/* Requests executed through a slot, and requests replaced before running */
+void get_coalesce_stats(unsigned long *executed, unsigned long *coalesced);
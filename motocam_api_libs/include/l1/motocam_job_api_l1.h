@@ -0,0 +1,48 @@
+#include <stdint.h>
+
+/*
+ * Bounded executor for SET_ASYNC requests. A request is queued as a job and
+ * acknowledged with its id straight away; JOB_WORKERS threads run the jobs
+ * through set_command_coalesced(). Submitting a request identical to one
+ * that is still queued or running returns that job's id instead of adding
+ * another. When a job finishes, a job_event_t is sent to
+ * JOB_EVENT_SOCK_PATH, and its result can be polled with GET SYSTEM
+ * JOB_STATUS until JOB_HISTORY newer jobs have been submitted.
+ */
+
+#ifndef JOB_WORKERS
+#define JOB_WORKERS 2
+#endif
+#ifndef JOB_QUEUE_MAX
+#define JOB_QUEUE_MAX 8 /* jobs waiting for a worker */
+#endif
+#define JOB_HISTORY (JOB_QUEUE_MAX + JOB_WORKERS + 16)
+
+#ifndef JOB_EVENT_SOCK_PATH
+#define JOB_EVENT_SOCK_PATH "/tmp/job_event.sock"
+#endif
+
+#define JOB_DATA_MAX 255
+#define JOB_ERR_BUSY (-8) /* queue full, try again later */
+
+enum JobState { JOB_UNKNOWN = 0, JOB_QUEUED, JOB_RUNNING, JOB_DONE };
+
+/* Sent to JOB_EVENT_SOCK_PATH when a job finishes */
+typedef struct {
+  uint16_t job_id;
+  uint8_t command;
+  uint8_t sub_command;
+  int8_t result; /* set_command() return value */
+  uint8_t reserved[3];
+} job_event_t;
+
+/* Queue a SET request. Returns a job id (> 0) or JOB_ERR_BUSY. */
+int32_t submit_job(const uint8_t command, const uint8_t sub_command,
+                   const uint8_t data_length, const uint8_t *data);
+/* JOB_UNKNOWN for ids that never existed or have been forgotten */
+uint8_t get_job_state(const uint16_t job_id, int8_t *result);
+/* GET SYSTEM JOB_STATUS: data is the job id (big endian), response is
+ * [state, result] */
+int8_t get_job_status_l1(const uint8_t data_length, const uint8_t *data,
+                         uint8_t **res_data_bytes,
+                         uint8_t *res_data_bytes_size);
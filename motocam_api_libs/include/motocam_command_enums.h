@@ -1,6 +1,7 @@
 #ifndef CMD_ENUMS_H
 #define CMD_ENUMS_H
-enum Header { SET = 1, GET, ACK, RESPONSE };
+/* SET_ASYNC: as SET, but acknowledged with a job id before it runs */
+enum Header { SET = 1, GET, ACK, RESPONSE, SET_ASYNC };
 enum Commands { STREAMING = 1, NETWORK, CONFIG, IMAGE, AUDIO, SYSTEM };
 enum StreamingGetSubCommands { STREAM_STATE = 1, WEBRTC_STREAMING_STATUS };
 enum StreamingSetSubCommands {
@@ -58,7 +59,8 @@ enum SystemGetSubCommands {
   OTA_UPDATE_STATUS,
   HEALTH_CHECK,
   GET_USER_DOB,
-  FACTORY_RESET_STATUS
+  FACTORY_RESET_STATUS,
+  JOB_STATUS
 };
 enum SystemSetSubCommands {
   SETCAMERANAME = 1,
@@ -0,0 +1,111 @@
+#include "motocam_coalesce_api_l1.h"
+#include "motocam_command_enums.h"
+#include "motocam_helper_api_l1.h"
+#include <pthread.h>
+#include <string.h>
+
+typedef struct {
+  uint8_t command;
+  uint8_t sub_command;
+  pthread_cond_t done;
+  int running;
+  int has_pending;
+  uint8_t pending[COALESCE_DATA_MAX];
+  uint8_t pending_length;
+  unsigned long next_seq;  /* sequence number of the latest request */
+  unsigned long done_seq;  /* latest request covered by an execution */
+  int8_t done_ret;
+} coalesce_slot_t;
+
+#define SLOT(cmd, sub) {cmd, sub, PTHREAD_COND_INITIALIZER, 0, 0, {0}, 0, 0, 0, 0}
+
+/* Commands whose only effect is the value they leave behind */
+static coalesce_slot_t slots[] = {
+    SLOT(IMAGE, ZOOM),         SLOT(IMAGE, ROTATION),
+    SLOT(IMAGE, IRCUTFILTER),  SLOT(IMAGE, IRBRIGHTNESS),
+    SLOT(IMAGE, DAYMODE),      SLOT(IMAGE, RESOLUTION),
+    SLOT(IMAGE, MIRROR),       SLOT(IMAGE, FLIP),
+    SLOT(IMAGE, TILT),         SLOT(IMAGE, WDR),
+    SLOT(IMAGE, EIS),          SLOT(IMAGE, GYROREADER),
+    SLOT(IMAGE, MISC),         SLOT(IMAGE, MID_IRBRIGHTNESS),
+    SLOT(IMAGE, SIDE_IRBRIGHTNESS), SLOT(IMAGE, VIDEO_FREQUENCY),
+    SLOT(AUDIO, MIC),
+};
+
+static pthread_mutex_t coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long coalesce_executed;
+static unsigned long coalesce_replaced;
+
+static coalesce_slot_t *find_slot(const uint8_t command,
+                                  const uint8_t sub_command) {
+  for (size_t i = 0; i < sizeof(slots) / sizeof(slots[0]); i++) {
+    if (slots[i].command == command && slots[i].sub_command == sub_command)
+      return &slots[i];
+  }
+  return NULL;
+}
+
+int8_t is_state_setting_command(const uint8_t command,
+                                const uint8_t sub_command) {
+  return find_slot(command, sub_command) != NULL;
+}
+
+int8_t set_command_coalesced(const uint8_t command, const uint8_t sub_command,
+                             const uint8_t data_length, const uint8_t *data) {
+  coalesce_slot_t *slot = find_slot(command, sub_command);
+  uint8_t value[COALESCE_DATA_MAX];
+  uint8_t value_length;
+  unsigned long seq, taken;
+  int8_t ret;
+
+  if (!slot)
+    return set_command(command, sub_command, data_length, data);
+
+  pthread_mutex_lock(&coalesce_lock);
+  seq = ++slot->next_seq;
+  if (slot->has_pending)
+    coalesce_replaced++;
+  memcpy(slot->pending, data, data ? data_length : 0);
+  slot->pending_length = data ? data_length : 0;
+  slot->has_pending = 1;
+
+  if (slot->running) {
+    /* The running request executes the latest value once it is done */
+    while (slot->done_seq < seq)
+      pthread_cond_wait(&slot->done, &coalesce_lock);
+    ret = slot->done_ret;
+    pthread_mutex_unlock(&coalesce_lock);
+    return ret;
+  }
+
+  slot->running = 1;
+  while (slot->has_pending) {
+    value_length = slot->pending_length;
+    memcpy(value, slot->pending, value_length);
+    taken = slot->next_seq;
+    slot->has_pending = 0;
+    coalesce_executed++;
+    pthread_mutex_unlock(&coalesce_lock);
+
+    ret = set_command(command, sub_command, value_length,
+                      value_length ? value : NULL);
+
+    pthread_mutex_lock(&coalesce_lock);
+    slot->done_seq = taken;
+    slot->done_ret = ret;
+    pthread_cond_broadcast(&slot->done);
+  }
+  slot->running = 0;
+  ret = slot->done_ret;
+  pthread_mutex_unlock(&coalesce_lock);
+  return ret;
+}
+
+void get_coalesce_stats(unsigned long *executed, unsigned long *coalesced) {
+  pthread_mutex_lock(&coalesce_lock);
+  if (executed)
+    *executed = coalesce_executed;
+  if (coalesced)
+    *coalesced = coalesce_replaced;
+  pthread_mutex_unlock(&coalesce_lock);
+}
@@ -0,0 +1,223 @@
+#include "motocam_job_api_l1.h"
+#include "motocam_coalesce_api_l1.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct {
+  uint16_t id;
+  uint8_t state;
+  int8_t result;
+  unsigned long seq; /* submission order, to recycle the oldest finished job */
+  uint8_t command;
+  uint8_t sub_command;
+  uint8_t data_length;
+  uint8_t data[JOB_DATA_MAX];
+} job_t;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_once_t job_once = PTHREAD_ONCE_INIT;
+static job_t jobs[JOB_HISTORY];
+static int queue[JOB_QUEUE_MAX]; /* indices into jobs[], FIFO */
+static int queue_head, queue_count;
+static int workers;
+static uint16_t next_id;
+static unsigned long next_seq;
+static int event_sock = -1;
+
+static void send_job_event(const job_t *job) {
+  struct sockaddr_un addr;
+  job_event_t evt;
+
+  if (event_sock < 0)
+    event_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (event_sock < 0)
+    return;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", JOB_EVENT_SOCK_PATH);
+
+  memset(&evt, 0, sizeof(evt));
+  evt.job_id = job->id;
+  evt.command = job->command;
+  evt.sub_command = job->sub_command;
+  evt.result = job->result;
+  if (sendto(event_sock, &evt, sizeof(evt), MSG_DONTWAIT,
+             (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+      errno != ENOENT && errno != ECONNREFUSED)
+    printf("job event send failed errno=%d\n", errno);
+}
+
+static void run_job(job_t *job) {
+  uint8_t data[JOB_DATA_MAX];
+  uint8_t data_length;
+  int8_t ret;
+
+  /* The slot is not recycled while running, but copy out of the lock anyway */
+  pthread_mutex_lock(&job_lock);
+  job->state = JOB_RUNNING;
+  data_length = job->data_length;
+  memcpy(data, job->data, data_length);
+  pthread_mutex_unlock(&job_lock);
+
+  ret = set_command_coalesced(job->command, job->sub_command, data_length,
+                              data_length ? data : NULL);
+  printf("job %u (%d/%d) finished: %d\n", job->id, job->command,
+         job->sub_command, ret);
+
+  pthread_mutex_lock(&job_lock);
+  job->result = ret;
+  job->state = JOB_DONE;
+  send_job_event(job);
+  pthread_mutex_unlock(&job_lock);
+}
+
+static void *job_worker(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&job_lock);
+    while (queue_count == 0)
+      pthread_cond_wait(&job_ready, &job_lock);
+    job_t *job = &jobs[queue[queue_head]];
+    queue_head = (queue_head + 1) % JOB_QUEUE_MAX;
+    queue_count--;
+    pthread_mutex_unlock(&job_lock);
+
+    run_job(job);
+  }
+  return NULL;
+}
+
+static void job_init(void) {
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (int i = 0; i < JOB_WORKERS; i++) {
+    if (pthread_create(&tid, &attr, job_worker, NULL) == 0)
+      workers++;
+  }
+  pthread_attr_destroy(&attr);
+  if (workers == 0)
+    printf("job executor: no worker threads, jobs will run inline\n");
+}
+
+static job_t *find_job(const uint16_t job_id) {
+  for (int i = 0; i < JOB_HISTORY; i++) {
+    if (jobs[i].state != JOB_UNKNOWN && jobs[i].id == job_id)
+      return &jobs[i];
+  }
+  return NULL;
+}
+
+static job_t *find_duplicate(const uint8_t command, const uint8_t sub_command,
+                             const uint8_t data_length, const uint8_t *data) {
+  for (int i = 0; i < JOB_HISTORY; i++) {
+    job_t *job = &jobs[i];
+    if ((job->state == JOB_QUEUED || job->state == JOB_RUNNING) &&
+        job->command == command && job->sub_command == sub_command &&
+        job->data_length == data_length &&
+        (data_length == 0 || memcmp(job->data, data, data_length) == 0))
+      return job;
+  }
+  return NULL;
+}
+
+/* A free slot, else the oldest finished job; queued and running jobs never
+ * fill the table, so there always is one */
+static job_t *alloc_job(void) {
+  job_t *oldest = NULL;
+
+  for (int i = 0; i < JOB_HISTORY; i++) {
+    if (jobs[i].state == JOB_UNKNOWN)
+      return &jobs[i];
+    if (jobs[i].state == JOB_DONE && (!oldest || jobs[i].seq < oldest->seq))
+      oldest = &jobs[i];
+  }
+  return oldest;
+}
+
+int32_t submit_job(const uint8_t command, const uint8_t sub_command,
+                   const uint8_t data_length, const uint8_t *data) {
+  job_t *job;
+  int32_t id;
+
+  pthread_once(&job_once, job_init);
+  pthread_mutex_lock(&job_lock);
+  job = find_duplicate(command, sub_command, data ? data_length : 0, data);
+  if (job) {
+    id = job->id;
+    pthread_mutex_unlock(&job_lock);
+    printf("job %d: duplicate submission collapsed\n", id);
+    return id;
+  }
+  if (queue_count == JOB_QUEUE_MAX) {
+    pthread_mutex_unlock(&job_lock);
+    printf("job queue full\n");
+    return JOB_ERR_BUSY;
+  }
+
+  job = alloc_job();
+  if (++next_id == 0)
+    next_id = 1;
+  job->id = next_id;
+  job->seq = ++next_seq;
+  job->state = JOB_QUEUED;
+  job->result = 0;
+  job->command = command;
+  job->sub_command = sub_command;
+  job->data_length = data ? data_length : 0;
+  if (job->data_length)
+    memcpy(job->data, data, job->data_length);
+  id = job->id;
+
+  if (workers > 0) {
+    queue[(queue_head + queue_count) % JOB_QUEUE_MAX] = (int)(job - jobs);
+    queue_count++;
+    pthread_cond_signal(&job_ready);
+    pthread_mutex_unlock(&job_lock);
+  } else {
+    pthread_mutex_unlock(&job_lock);
+    run_job(job);
+  }
+  return id;
+}
+
+uint8_t get_job_state(const uint16_t job_id, int8_t *result) {
+  uint8_t state = JOB_UNKNOWN;
+
+  pthread_mutex_lock(&job_lock);
+  job_t *job = job_id ? find_job(job_id) : NULL;
+  if (job) {
+    state = job->state;
+    if (result)
+      *result = job->result;
+  }
+  pthread_mutex_unlock(&job_lock);
+  return state;
+}
+
+int8_t get_job_status_l1(const uint8_t data_length, const uint8_t *data,
+                         uint8_t **res_data_bytes,
+                         uint8_t *res_data_bytes_size) {
+  int8_t result = 0;
+
+  if (data_length != 2 || data == NULL) {
+    printf("invalid data/data length\n");
+    return -5;
+  }
+  uint8_t state = get_job_state((uint16_t)(data[0] << 8 | data[1]), &result);
+
+  *res_data_bytes_size = 2;
+  *res_data_bytes = (uint8_t *)malloc(*res_data_bytes_size);
+  (*res_data_bytes)[0] = state;
+  (*res_data_bytes)[1] = (uint8_t)result;
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include "motocam_system_api_l1.h"
 #include "motocam_command_enums.h"
+#include "motocam_job_api_l1.h"
 #include "motocam_system_api_l2.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -232,6 +233,9 @@ int8_t get_system_command(const uint8_t sub_command, const uint8_t data_length,
   case GET_USER_DOB:
     return get_system_user_dob_l1(data_length, data, res_data_bytes,
                                   res_data_bytes_size);
+  case JOB_STATUS:
+    return get_job_status_l1(data_length, data, res_data_bytes,
+                             res_data_bytes_size);
   default:
     printf("invalid system sub command\n");
     return -4;
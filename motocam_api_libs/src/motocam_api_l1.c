@@ -7,8 +7,10 @@
 #include <string.h>
 
 #include "motocam_api_l1.h"
+#include "motocam_coalesce_api_l1.h"
 #include "motocam_command_enums.h"
 #include "motocam_helper_api_l1.h"
+#include "motocam_job_api_l1.h"
 
 int8_t do_processing(const uint8_t *req_bytes, const uint8_t req_bytes_size,
                      uint8_t **res_bytes, uint8_t *res_bytes_size) {
@@ -46,7 +48,8 @@ int8_t do_processing(const uint8_t *req_bytes, const uint8_t req_bytes_size,
     (*res_bytes)[*res_bytes_size - 1] =
         calc_crc(*res_bytes, *res_bytes_size); // last byte CRC
   } else if (header == SET) {
-    int8_t ret = set_command(command, sub_command, data_length, data);
+    /* A burst of e.g. zoom requests collapses to its latest value */
+    int8_t ret = set_command_coalesced(command, sub_command, data_length, data);
     uint8_t res_data_bytes_size = 1;
     *res_bytes_size = packet_length_except_data + data_success_flag_size +
                       res_data_bytes_size;
@@ -65,6 +68,31 @@ int8_t do_processing(const uint8_t *req_bytes, const uint8_t req_bytes_size,
     (*res_bytes)[5] = (uint8_t)ret; // success / err value
     (*res_bytes)[*res_bytes_size - 1] =
         calc_crc(*res_bytes, *res_bytes_size); // last byte CRC
+  } else if (header == SET_ASYNC) {
+    /* Long commands (misc, Wi-Fi, OTA, ...) run on the job executor; the
+     * result is polled with JOB_STATUS or pushed as a job event */
+    int32_t ret = submit_job(command, sub_command, data_length, data);
+    uint8_t res_data_bytes_size = ret > 0 ? 3 : 1;
+    *res_bytes_size = packet_length_except_data + data_success_flag_size +
+                      res_data_bytes_size;
+    *res_bytes = (uint8_t *)malloc(*res_bytes_size);
+    (*res_bytes)[0] = ACK;
+    (*res_bytes)[1] = command;
+    (*res_bytes)[2] = sub_command;
+    (*res_bytes)[3] =
+        data_success_flag_size + res_data_bytes_size; // DataLength
+    printf("do_processing: submit_job returned %d\n", ret);
+    if (ret > 0) {
+      (*res_bytes)[4] = 0;                    // success
+      (*res_bytes)[5] = 0;                    // queued
+      (*res_bytes)[6] = (uint8_t)(ret >> 8);  // job id, big endian
+      (*res_bytes)[7] = (uint8_t)ret;
+    } else {
+      (*res_bytes)[4] = 1;            // failed
+      (*res_bytes)[5] = (uint8_t)ret; // err queue full
+    }
+    (*res_bytes)[*res_bytes_size - 1] =
+        calc_crc(*res_bytes, *res_bytes_size); // last byte CRC
   } else if (header == GET) {
     uint8_t res_data_bytes_size = 0;
     uint8_t *res_data_bytes = NULL;
@@ -102,7 +102,7 @@ do {                                       \
 } while (0)
 
 static const char WIFI_RUNTIME_RESULT[] =
-    "/mnt/flash/vienna/m5s_config/wifi_runtime_result";
+    M5S_CONFIG_DIR "/wifi_runtime_result";
 
 typedef enum encoder_type
 {
@@ -154,7 +154,28 @@ typedef enum image_rotation
     R270
 } ImageRotation;
 
-extern pthread_mutex_t lock;
+/*
+ * One reader-writer lock per subsystem, taken by the fw_<subsystem>.c
+ * entry points: getters share it, setters hold it exclusively. A slow
+ * Wi-Fi switch (network) no longer stalls image or system getters.
+ * fw_helper.c's temperature reads and fw_system.c's stream getters use
+ * system_lock.
+ *
+ * set_image_misc() holds image_lock and then streaming_lock, since a
+ * misc change stops WebRTC and restarts the streamer. Any other operation
+ * that needs more than one, e.g. a factory reset that also rewrites
+ * network and image state, must take them in this order and release in
+ * reverse:
+ *
+ *   system_lock -> network_lock -> image_lock -> streaming_lock
+ *
+ * None of them is recursive: an entry point must not call another entry
+ * point of its own subsystem while holding the lock.
+ */
+extern pthread_rwlock_t system_lock;
+extern pthread_rwlock_t network_lock;
+extern pthread_rwlock_t image_lock;
+extern pthread_rwlock_t streaming_lock;
 
 int update_calibration_value();
 
@@ -185,6 +206,9 @@ int8_t is_sensor_temp();
 
 int exec_cmd(const char *cmd, char *out, size_t out_size);
 int8_t outdu_update_brightness(uint8_t val);
+/* "period,off" duty for a brightness level, NULL for unknown levels */
+const char *get_pwm5_val(uint8_t val);
+const char *get_pwm4_val(uint8_t val);
 void safe_remove(const char *path);
 void safe_symlink(const char *target, const char *linkpath);
 
@@ -0,0 +1,46 @@
+#ifndef FW_CLOCK_H
+#define FW_CLOCK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Monotonic time and sleep source of the fw timers, the reactor, the IR
+ * actuators and the LED watcher. It is CLOCK_MONOTONIC and nanosleep()
+ * unless replaced, e.g. by the virtual clock below in tests.
+ */
+
+typedef uint64_t (*fw_clock_now_fn)(void);
+typedef void (*fw_clock_sleep_fn)(uint32_t ms);
+
+/** Replace the time source; NULL restores the real clock (and sleep). */
+void fw_clock_set(fw_clock_now_fn now_ms, fw_clock_sleep_fn sleep_ms);
+/** 1 while a replaced time source is installed. */
+int fw_clock_is_virtual(void);
+
+/** Milliseconds; with the real clock, CLOCK_MONOTONIC time. */
+uint64_t fw_clock_now_ms(void);
+void fw_clock_sleep_ms(uint32_t ms);
+
+/** pthread_cond_timedwait() until fw_clock_now_ms() reaches deadline_ms.
+ *  cond must use CLOCK_MONOTONIC. With a replaced clock, mu is released
+ *  and the caller sleeps up to the deadline instead. Returns 0 or
+ *  ETIMEDOUT. */
+int fw_clock_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mu,
+                       uint64_t deadline_ms);
+
+/** Install a virtual clock reading start_ms, on which sleeping only
+ *  advances the time. */
+void fw_clock_use_virtual(uint64_t start_ms);
+/** Move the virtual clock forward. */
+void fw_clock_advance_ms(uint32_t ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FW_CLOCK_H */
@@ -0,0 +1,239 @@
+#ifndef FW_CONFIG_H
+#define FW_CONFIG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ------------------------------------------------------------------ */
+/*  Binary config image                                               */
+/* ------------------------------------------------------------------ */
+/*
+ * Alternative backend for the one-file-per-key store in M5S_CONFIG_DIR.
+ * All keys live in one fixed-layout image, kept twice in a single file:
+ * region A and region B. A commit writes the whole image, with the next
+ * generation number and a CRC, into the region not in use and then
+ * fdatasync()s once. After a crash, whichever region has a valid CRC and
+ * the higher generation wins, so a commit is all or nothing.
+ *
+ * Reads go through a read-only mmap of the file. The per-key files in
+ * M5S_CONFIG_DIR are kept as a mirror, without fsync, so that scripts,
+ * the streamer and the factory tools can keep reading them. A commit
+ * only marks its slots pending; config_store_mirror() writes their files
+ * before fw hands over to another process (a command, a script or a
+ * daemon), and config_store_flush() also records each file's mtime and
+ * inode in the image, once per CONFIG_LAZY_FLUSH_SEC and at exit. After
+ * a crash the files are rebuilt from the image when the store is opened.
+ * A file whose mtime, size or inode no longer matches its slot was
+ * written by someone else. Reads then fall back to the file, and the
+ * next open imports it. Keys or values that do not fit in a slot are
+ * never put in the image and are always read from their file.
+ *
+ * Build with FW_CONFIG_BACKEND_IMAGE to make set_uboot_env() and the
+ * "cat M5S_CONFIG_DIR/<key>" reads in exec_cmd() use the image.
+ */
+
+#ifndef M5S_CONFIG_IMAGE
+#define M5S_CONFIG_IMAGE "/mnt/flash/vienna/m5s_config.img"
+#endif
+
+#define CONFIG_IMAGE_MAGIC   0x4b43354du /* "M5CK" */
+#define CONFIG_IMAGE_VERSION 1
+#define CONFIG_KEY_MAX       32          /* including the NUL */
+#define CONFIG_VALUE_MAX     80          /* including the NUL */
+#define CONFIG_IMAGE_SLOTS   127         /* header + slots = 16 KiB */
+#define CONFIG_REGION_SIZE   16384
+
+typedef struct {
+  char key[CONFIG_KEY_MAX];
+  char value[CONFIG_VALUE_MAX];
+  int64_t mirror_mtime_ns; /* mtime and inode of the per-key file we */
+  uint64_t mirror_ino;     /* last wrote or imported; inode 0: the
+                              file is still to be written            */
+} config_slot_t;
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t generation;
+  uint32_t crc;        /* CRC-32 of the region with this field zeroed */
+  int64_t committed_ns;
+  uint8_t reserved[104];
+  config_slot_t slot[CONFIG_IMAGE_SLOTS];
+} config_image_t;
+
+/** Open (or create from dir) the image at path and make it the backend.
+ *  Returns 0 on success, -1 on failure (the file backend stays in use). */
+int config_store_open(const char *path, const char *dir);
+void config_store_close(void);
+
+/** 1 when set_uboot_env() and config reads go through the image. With
+ *  FW_CONFIG_BACKEND_IMAGE the first call opens M5S_CONFIG_IMAGE. */
+int config_store_active(void);
+
+/** Copy the value of key into out. -1 if it is absent, or if its per-key
+ *  file was changed behind the store's back (read the file instead). */
+int config_store_get(const char *key, char *out, size_t out_size);
+
+/** Commit one key: one A/B region write + fdatasync. Its mirror file is
+ *  written later, see config_store_mirror(). */
+int config_store_set(const char *key, const char *value);
+
+/** Write the mirror files of keys set since the last call; a no-op when
+ *  there are none. Call before anything outside this process may read
+ *  M5S_CONFIG_DIR. */
+int config_store_mirror(void);
+/** config_store_mirror(), then commit the files' stamps into the image.
+ *  Run by config_flush_due() and at exit. */
+int config_store_flush(void);
+
+/** Serve "cat M5S_CONFIG_DIR/<key>" from the image. 0 when handled. */
+int config_store_cat(const char *cmd, char *out, size_t out_size);
+
+/** Per-key directory <-> image, for scripts and factory tools. import
+ *  replaces the image contents with dir and mirrors them into the store
+ *  directory; export writes every key whose file differs, then syncs the
+ *  filesystem of dir once. */
+int config_store_import_dir(const char *dir);
+int config_store_export_dir(const char *dir);
+
+uint32_t config_store_generation(void);
+
+/* ------------------------------------------------------------------ */
+/*  Transactions                                                      */
+/* ------------------------------------------------------------------ */
+/*
+ * Stage several keys and make them durable together:
+ *
+ *   config_txn_t txn;
+ *   config_txn_begin(&txn);
+ *   config_txn_set_int(&txn, "eis", 1);
+ *   config_txn_set_int(&txn, "wdr", 0);
+ *   config_txn_commit(&txn);
+ *
+ * With the image backend a transaction is one generation, so one
+ * fdatasync. With the per-key files the values go to a journal in
+ * M5S_CONFIG_DIR first. The journal's fsync is the commit point. The files
+ * are then replaced without fsync, and one syncfs() retires the journal.
+ * A journal left by a crash is replayed before the next commit. Commits
+ * hold an exclusive flock() on M5S_CONFIG_DIR. Config reads through
+ * exec_cmd() hold a shared one, so they see all of a transaction or none
+ * of it.
+ */
+
+#define CONFIG_TXN_MAX_KEYS  16
+#define CONFIG_TXN_VALUE_MAX 128
+#define CONFIG_TXN_JOURNAL   ".txn"
+
+typedef struct {
+  int count;
+  int failed; /* a set was rejected; commit will refuse */
+  char key[CONFIG_TXN_MAX_KEYS][CONFIG_KEY_MAX];
+  char value[CONFIG_TXN_MAX_KEYS][CONFIG_TXN_VALUE_MAX];
+} config_txn_t;
+
+void config_txn_begin(config_txn_t *txn);
+int config_txn_set(config_txn_t *txn, const char *key, const char *value);
+int config_txn_set_int(config_txn_t *txn, const char *key, int value);
+/** 0 once every staged key is durable, -1 if nothing was committed or
+ *  the apply step failed (then the journal finishes it later). */
+int config_txn_commit(config_txn_t *txn);
+/** Replay or discard a journal left in dir. */
+int config_txn_recover(const char *dir);
+
+/* ------------------------------------------------------------------ */
+/*  Durability classes                                                */
+/* ------------------------------------------------------------------ */
+/*
+ * Every key has a class, declared in the key table in fw_config.c:
+ *
+ *   SYNC      durable before set_uboot_env() returns (the default)
+ *   LAZY      kept in CONFIG_VOLATILE_DIR (tmpfs) and persisted as one
+ *             transaction CONFIG_LAZY_FLUSH_SEC after the first change,
+ *             or at exit / config_flush_lazy()
+ *   VOLATILE  kept in CONFIG_VOLATILE_DIR only; after a reboot the
+ *             persisted value, if any, is current again
+ *
+ * "cat M5S_CONFIG_DIR/<key>" in exec_cmd() reads the tmpfs copy of
+ * LAZY and VOLATILE keys. Counters per class record how many sets were
+ * made and how many flash sync barriers they cost. A tool that rewrites
+ * key files itself (factory_reset) must drop their tmpfs copies, or they
+ * keep shadowing the files and are flushed back over them.
+ */
+
+#ifndef CONFIG_VOLATILE_DIR
+#define CONFIG_VOLATILE_DIR "/tmp/m5s_config"
+#endif
+#ifndef CONFIG_LAZY_FLUSH_SEC
+#define CONFIG_LAZY_FLUSH_SEC 60
+#endif
+
+typedef enum {
+  CONFIG_CLASS_SYNC = 0,
+  CONFIG_CLASS_LAZY,
+  CONFIG_CLASS_VOLATILE,
+  CONFIG_CLASS_COUNT
+} config_class_t;
+
+typedef struct {
+  unsigned long sets;
+  unsigned long flash_syncs;
+} config_class_stats_t;
+
+config_class_t config_key_class(const char *key);
+/** Write a LAZY or VOLATILE key. Returns 1 for SYNC keys, which the
+ *  caller writes itself. */
+int config_set_deferred(const char *key, const char *value);
+int config_flush_lazy(void);
+/** Flush lazy keys and config_store_flush() if the interval is up; call
+ *  from a periodic timer. */
+void config_flush_due(void);
+/** Serve a "cat" of a LAZY or VOLATILE key from tmpfs. 0 when handled. */
+int config_class_cat(const char *cmd, char *out, size_t out_size);
+
+void config_class_account(config_class_t cls, unsigned int sets, unsigned int flash_syncs);
+void config_class_stats(config_class_t cls, config_class_stats_t *out);
+
+/* ------------------------------------------------------------------ */
+/*  No-op detection                                                   */
+/* ------------------------------------------------------------------ */
+/*
+ * Setters call config_unchanged() before touching flash, PWM, GPIO or a
+ * process, and return at once when the key already holds the requested
+ * value. The current value is read the way exec_cmd() would see it: the
+ * tmpfs copy of a LAZY or VOLATILE key, the image, or the per-key file.
+ * File contents are cached per path and revalidated with stat(), so a
+ * write by another process is noticed, and a file changed within the
+ * last second is always read again. Every skip is counted under a name:
+ * the key, or the setter for checks over several keys.
+ */
+
+#define CONFIG_SKIP_NAMES 64
+
+/** 1 when key holds value. Does not count anything. */
+int config_value_equals(const char *key, const char *value);
+int config_value_equals_int(const char *key, int value);
+/** Same for a file outside the key store; one trailing '\n' is ignored. */
+int config_file_equals(const char *path, const char *value);
+
+/** config_value_equals(), counting a skip under key when it is 1. */
+int config_unchanged(const char *key, const char *value);
+int config_unchanged_int(const char *key, int value);
+
+void config_skip_account(const char *name);
+/** Skipped writes counted under name, or all of them for NULL. */
+unsigned long config_skipped(const char *name);
+
+/** Shared lock for a "cat M5S_CONFIG_DIR/<key>" command, -1 for others. */
+int config_read_lock(const char *cmd);
+void config_read_unlock(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
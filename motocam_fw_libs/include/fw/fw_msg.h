@@ -0,0 +1,61 @@
+#ifndef FW_MSG_H
+#define FW_MSG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * In-process clients of the control daemons' message interfaces, in place
+ * of a shell and a *_msg_sender process per request. Each client keeps one
+ * SOCK_SEQPACKET connection to its daemon, opened on first use and
+ * reopened after the daemon restarts. A request carries the same arguments
+ * as the sender CLI ("-C 2 --mirror 1"); the reply is "<status>[ <data>]".
+ * When the daemon cannot be reached, the request goes through the CLI.
+ * A request the daemon took but did not answer is not sent again.
+ */
+
+#ifndef STREAMER_MSG_SOCK
+#define STREAMER_MSG_SOCK "/tmp/streamer_msg.sock"
+#endif
+#ifndef ASC_MSG_SOCK
+#define ASC_MSG_SOCK "/tmp/asc_msg.sock"
+#endif
+#ifndef FW_MSG_TIMEOUT_MS
+#define FW_MSG_TIMEOUT_MS 500 /* reply wait before the connection is dropped */
+#endif
+
+typedef struct {
+  const char *path; /* daemon socket            */
+  const char *cli;  /* fallback sender command  */
+  pthread_mutex_t lock;
+  int fd;           /* -1 while disconnected    */
+  uint32_t sent;    /* requests the daemon answered */
+  uint32_t via_cli; /* requests that fell back  */
+} fw_msg_client_t;
+
+#define FW_MSG_CLIENT_INIT(path, cli)                                          \
+  { (path), (cli), PTHREAD_MUTEX_INITIALIZER, -1, 0, 0 }
+
+extern fw_msg_client_t fw_msg_streamer; /* streamer_msg_sender */
+extern fw_msg_client_t fw_msg_asc;      /* asc_msg_sender      */
+
+/** Send args to the daemon and wait for its reply. Returns its status
+ *  with its data in reply, or the CLI's exit status with reply empty when
+ *  the daemon is unreachable. -1 when the daemon took the request but
+ *  did not reply within FW_MSG_TIMEOUT_MS. reply may be NULL. */
+int fw_msg_request(fw_msg_client_t *c, const char *args, char *reply,
+                   size_t reply_size);
+
+/** Drop the connection; the next request reconnects. */
+void fw_msg_close(fw_msg_client_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FW_MSG_H */
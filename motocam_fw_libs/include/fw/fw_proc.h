@@ -0,0 +1,46 @@
+#ifndef FW_PROC_H
+#define FW_PROC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Supervisor of the camera daemons (streamer, signalserver, ...). Daemons
+ * started here are spawned directly and tracked by pid and pidfd, so their
+ * exit is seen by polling the pidfd rather than by scanning /proc. Stopping
+ * signals the processes themselves and waits for them to exit, escalating
+ * to SIGKILL after the timeout. Daemons started elsewhere (boot scripts)
+ * are still found by a single pass over /proc.
+ *
+ * Without pidfds (kernels before 5.3) exits are seen through waitpid() for
+ * our own children and kill(pid, 0) for the others.
+ */
+
+#ifndef FW_PROC_MAX
+#define FW_PROC_MAX 8 /* daemons tracked at once */
+#endif
+
+#ifndef FW_PROC_STOP_MS
+#define FW_PROC_STOP_MS 3000 /* SIGTERM grace before SIGKILL */
+#endif
+
+/** 1 if a process named name runs (argv[0] contains it), else 0. */
+int fw_proc_running(const char *name);
+
+/** Spawn name (looked up in PATH) with stdio on /dev/null and track it.
+ *  1 if it was already running, 0 when spawned, -1 on failure. */
+int fw_proc_start(const char *name);
+
+/** SIGTERM every process called names[i] (its comm, as killall matches)
+ *  and wait for all of them together, at most timeout_ms before SIGKILL.
+ *  0 once they are gone, -1 if one survived SIGKILL. */
+int fw_proc_stop_all(const char *const *names, int count, int timeout_ms);
+/** fw_proc_stop_all() for one name. */
+int fw_proc_stop(const char *name, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FW_PROC_H */
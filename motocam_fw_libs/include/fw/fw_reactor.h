@@ -0,0 +1,70 @@
+#ifndef FW_REACTOR_H
+#define FW_REACTOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "fw/fw_state_machine.h"
+#include <stdint.h>
+
+/*
+ * One epoll loop that steps any number of state machine instances. An
+ * instance is stepped when the deadline of its timer passes (timerfd), when
+ * its fd becomes readable, or every FW_SM_POLL_MS while it polls something
+ * that has neither. The loop runs on the reactor thread; without one, the
+ * callers waiting in fw_reactor_wait() take turns running it. Deadlines
+ * are fw_clock_now_ms() times; on a virtual clock (fw/fw_clock.h) the loop
+ * sleeps on that clock instead of arming the timerfd.
+ *
+ * Instances are owned by the caller and must stay valid until they are
+ * finished (fw_reactor_wait() returned a DONE status) or cancelled.
+ */
+
+#ifndef FW_SM_POLL_MS
+#define FW_SM_POLL_MS 10
+#endif
+
+typedef fw_sm_status_t (*fw_sm_step_fn)(void *ctx);
+
+typedef struct fw_sm_instance {
+  fw_sm_step_fn step;
+  void *ctx;
+  const fw_sm_timer_t *timer; /* the machine's timer, or NULL */
+  int fd;                     /* step when readable, -1 for none */
+
+  /* Owned by the reactor */
+  fw_sm_status_t status;
+  uint64_t due_ms;
+  int ready;
+  unsigned pass;
+  struct fw_sm_instance *next;
+} fw_sm_instance_t;
+
+void fw_sm_instance_init(fw_sm_instance_t *m, fw_sm_step_fn step, void *ctx,
+                         const fw_sm_timer_t *timer, int fd);
+
+/** Start stepping m. 0 on success, -1 if its fd cannot be watched. */
+int fw_reactor_add(fw_sm_instance_t *m);
+/** Wait until m is finished, at most timeout_ms (-1: no limit). Returns its
+ *  final status, or FW_SM_RUNNING on timeout. */
+fw_sm_status_t fw_reactor_wait(fw_sm_instance_t *m, int timeout_ms);
+/** Stop stepping m; not from inside a step. */
+void fw_reactor_cancel(fw_sm_instance_t *m);
+/** Blocking adapter: run one machine to completion. */
+fw_sm_status_t fw_reactor_run(fw_sm_step_fn step, void *ctx,
+                              const fw_sm_timer_t *timer);
+
+/** Run the loop once: wait up to timeout_ms (-1: no limit) unless an
+ *  instance is due, then step every due instance once. Returns the number
+ *  of steps taken. */
+int fw_reactor_run_once(int timeout_ms);
+/** Earliest deadline (fw_clock_now_ms() time) of a waiting instance, or
+ *  UINT64_MAX when none is waiting on a deadline. */
+uint64_t fw_reactor_next_due(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FW_REACTOR_H */
@@ -19,7 +19,7 @@ typedef enum {
 } fw_sm_status_t;
 
 /* ------------------------------------------------------------------ */
-/*  Monotonic timer – wraps clock_gettime(CLOCK_MONOTONIC)            */
+/*  Monotonic timer – on fw_clock_now_ms() (fw/fw_clock.h)            */
 /* ------------------------------------------------------------------ */
 typedef struct {
   struct timespec start;
@@ -32,17 +32,25 @@ void fw_sm_timer_start(fw_sm_timer_t *t, uint32_t delay_ms);
 /** Return 1 when the target delay has elapsed, 0 otherwise. */
 int fw_sm_timer_expired(const fw_sm_timer_t *t);
 
+/** fw_clock_now_ms() time at which the timer expires. */
+uint64_t fw_sm_timer_deadline_ms(const fw_sm_timer_t *t);
+
 /* ------------------------------------------------------------------ */
-/*  Non-blocking yield – 10 ms usleep to avoid busy-spin              */
+/*  Non-blocking yield – 10 ms fw_clock sleep to avoid busy-spin      */
 /* ------------------------------------------------------------------ */
 void fw_sm_yield(void);
 
+/*
+ * Each machine below also has a _run() adapter that steps it to completion
+ * on the reactor (fw/fw_reactor.h) and returns FW_SM_DONE_OK or
+ * FW_SM_DONE_FAIL. Other machines keep running meanwhile.
+ */
+
 /* ------------------------------------------------------------------ */
 /*  ONVIF interface switch state machine                              */
 /* ------------------------------------------------------------------ */
 typedef enum {
   ONVIF_SM_IDLE,
-  ONVIF_SM_WAIT_STOP,  /* waiting after killall               */
   ONVIF_SM_START_CMD,  /* launch the update script            */
   ONVIF_SM_POLL_START, /* polling is_running() with retries   */
   ONVIF_SM_DONE_OK,
@@ -59,6 +67,7 @@ typedef struct {
 
 void onvif_sm_init(onvif_sm_ctx_t *ctx, uint8_t interface);
 fw_sm_status_t onvif_sm_step(onvif_sm_ctx_t *ctx);
+fw_sm_status_t onvif_sm_run(onvif_sm_ctx_t *ctx);
 
 /* ------------------------------------------------------------------ */
 /*  WiFi status polling state machine                                 */
@@ -79,6 +88,7 @@ typedef struct {
 
 void wifi_sm_init(wifi_sm_ctx_t *ctx, int max_retries);
 fw_sm_status_t wifi_sm_step(wifi_sm_ctx_t *ctx);
+fw_sm_status_t wifi_sm_run(wifi_sm_ctx_t *ctx);
 
 /* ------------------------------------------------------------------ */
 /*  Generic process-start polling state machine                       */
@@ -101,6 +111,7 @@ typedef struct {
 void proc_sm_init(proc_sm_ctx_t *ctx, const char *process_name,
                   int max_retries);
 fw_sm_status_t proc_sm_step(proc_sm_ctx_t *ctx);
+fw_sm_status_t proc_sm_run(proc_sm_ctx_t *ctx);
 
 /* ------------------------------------------------------------------ */
 /*  Shutdown / OTA delay state machine                                */
@@ -119,24 +130,69 @@ typedef struct {
 
 void delay_sm_init(delay_sm_ctx_t *ctx, uint32_t delay_ms);
 fw_sm_status_t delay_sm_step(delay_sm_ctx_t *ctx);
+fw_sm_status_t delay_sm_run(delay_sm_ctx_t *ctx);
 
 /* ------------------------------------------------------------------ */
 /*  Streamer restart (set_misc) state machine                         */
 /* ------------------------------------------------------------------ */
+/*
+ * Waits until the restarted streamer is ready to serve: it sent
+ * "READY=1" to STREAMER_NOTIFY_SOCK, or accepts connections on
+ * 127.0.0.1:STREAMER_READY_PORT when one is set. Init before stopping the
+ * old streamer so an early notification is not missed.
+ *
+ * The streamer does not send READY=1 yet, so once STREAMER_READY_GRACE_MS
+ * pass without a signal, a running streamer process is taken as ready.
+ * Until then a process that is up but not serving is not. Without a
+ * running process the wait goes on to the timeout.
+ */
+#ifndef STREAMER_NOTIFY_SOCK
+#define STREAMER_NOTIFY_SOCK "/tmp/streamer_ready.sock"
+#endif
+#ifndef STREAMER_READY_PORT
+#define STREAMER_READY_PORT 0 /* 0: no port to probe */
+#endif
+#ifndef STREAMER_READY_TIMEOUT_MS
+#define STREAMER_READY_TIMEOUT_MS 15000
+#endif
+#ifndef STREAMER_READY_GRACE_MS
+#define STREAMER_READY_GRACE_MS 2000
+#endif
+#define STREAMER_READY_PROBE_MS 100
+
 typedef enum {
   MISC_SM_IDLE,
-  MISC_SM_WAIT_STOP,    /* 1 s delay after stop_process()      */
-  MISC_SM_POLL_RESTART, /* poll is_running()                    */
+  MISC_SM_WAIT_READY, /* notification, port or timeout          */
   MISC_SM_DONE
 } misc_sm_state_t;
 
+typedef enum {
+  MISC_READY_NONE,
+  MISC_READY_NOTIFY,
+  MISC_READY_PORT,
+  MISC_READY_PROCESS /* no signal, but the process runs */
+} misc_ready_t;
+
 typedef struct {
   misc_sm_state_t state;
-  fw_sm_timer_t timer;
+  fw_sm_timer_t timer;   /* next probe                   */
+  int notify_fd;         /* -1 if the socket is missing  */
+  uint16_t ready_port;
+  uint32_t grace_ms;     /* before the process will do   */
+  uint32_t timeout_ms;
+  uint64_t start_ms;
+  uint32_t elapsed_ms;   /* until ready or timed out     */
+  misc_ready_t ready_by;
 } misc_sm_ctx_t;
 
 void misc_sm_init(misc_sm_ctx_t *ctx);
 fw_sm_status_t misc_sm_step(misc_sm_ctx_t *ctx);
+/** Also closes the notification socket. */
+fw_sm_status_t misc_sm_run(misc_sm_ctx_t *ctx);
+
+/** Stop the streamer and wait for the one restarted in its place to be
+ *  ready. Returns the milliseconds that took, or -1 if it was not. */
+int misc_sm_restart_streamer(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,65 @@
+#ifndef HW_HANDLE_H
+#define HW_HANDLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * GPIO lines and PWM devices are opened once and then stay open.
+ *
+ * When the kernel has the GPIO character device (GPIO_CHIP_DEV), each
+ * hw_gpio_claim() becomes one line request. A hw_gpio_set() of lines from
+ * one request is a single ioctl, so the lines change together. Without it,
+ * each line is exported through sysfs once and its value file is kept
+ * open for pwrite()/pread().
+ *
+ * The PWM devices, and LOCK_FILE that serialises them with other
+ * processes, are kept open too. A write is pwrite() between
+ * hw_pwm_lock() and hw_pwm_unlock().
+ */
+
+#define HW_GPIO_MAX_LINES  16
+#define HW_GPIO_MAX_GROUPS 4
+#define HW_PWM_MAX         4
+
+#ifndef GPIO_CHIP_DEV
+#define GPIO_CHIP_DEV "/dev/gpiochip0"
+#endif
+#ifndef GPIO_CHIP_BASE
+#define GPIO_CHIP_BASE 0 /* sysfs number of line 0 of GPIO_CHIP_DEV */
+#endif
+
+/* Syscalls issued by this layer, for measuring it */
+typedef struct {
+  unsigned long opens;
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long ioctls;
+  unsigned long locks;
+} hw_stats_t;
+
+/** Claim pins as outputs driven to values, as one group. 0 on success. */
+int hw_gpio_claim(const int *pins, const int *values, int count);
+/** Drive pins. Pins claimed together on the chardev take one ioctl. */
+int hw_gpio_set(const int *pins, const int *values, int count);
+/** 0 or 1, -1 on error. Unclaimed pins are read through sysfs. */
+int hw_gpio_get(int pin);
+/** 1 when GPIO goes through the character device. */
+int hw_gpio_chardev(void);
+
+/** Take the cross-process PWM lock (non-blocking). 0 on success. */
+int hw_pwm_lock(void);
+void hw_pwm_unlock(void);
+/** Write "value\n" to a PWM device; call with the PWM lock held. */
+int hw_pwm_write(const char *path, const char *value);
+
+/** Close every handle; the next call opens them again. */
+void hw_close_all(void);
+void hw_stats(hw_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HW_HANDLE_H
@@ -0,0 +1,50 @@
+#ifndef IR_CUT_H
+#define IR_CUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * IR cut filter actuator. The filter is latching: it is moved by driving
+ * GPIO 59 (coil) with GPIO 60 giving the direction for IR_CUT_PULSE_MS,
+ * then releasing the coil. ir_cut_request() starts the pulse and returns;
+ * a timerfd ends it, from the actuator thread or from whichever caller
+ * looks at the state next.
+ *
+ * While the filter is moving a request for the same position is merged
+ * into it, and a request for the other position is queued and started
+ * when the current pulse ends (the latest queued request wins). The coil
+ * is never reversed mid-pulse.
+ */
+
+#ifndef IR_CUT_PULSE_MS
+#define IR_CUT_PULSE_MS 2000
+#endif
+
+typedef enum {
+  IR_CUT_UNKNOWN = 0,
+  IR_CUT_MOVING,
+  IR_CUT_DAY,   /* update_ir_cut_filter_off() position */
+  IR_CUT_NIGHT  /* update_ir_cut_filter_on() position */
+} ir_cut_state_t;
+
+#define IR_CUT_STARTED 0
+#define IR_CUT_MERGED  1
+#define IR_CUT_QUEUED  2
+
+/** Claim the lines and move the filter to the day position. */
+void ir_cut_init(void);
+/** Move to night (1) or day (0). Returns IR_CUT_STARTED, _MERGED or
+ *  _QUEUED without waiting for the pulse. */
+int ir_cut_request(int night);
+ir_cut_state_t ir_cut_state(void);
+/** Wait until the filter has settled, at most timeout_ms (-1: no limit).
+ *  0 when settled, -1 on timeout. */
+int ir_cut_wait(int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IR_CUT_H
@@ -0,0 +1,53 @@
+#ifndef IR_LED_H
+#define IR_LED_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * IR LED brightness actuator. ir_led_request() records the target level
+ * (IR_OFF .. ULTRA) and returns; the PWM writes are made on a timerfd
+ * schedule, from the actuator thread or from whichever caller uses the
+ * actuator next.
+ *
+ * Without a ramp pwm5 is written first and pwm4 IR_LED_STAGGER_MS later,
+ * as outdu_update_brightness() always did. With a ramp both duty cycles
+ * move together every IR_LED_STEP_MS. A new request during a ramp starts
+ * from the duty cycles reached so far; the latest request wins.
+ *
+ * The level is persisted with set_uboot_env() once it has been applied
+ * and left alone for IR_LED_PERSIST_MS, so a slider drag costs one write.
+ */
+
+#ifndef IR_LED_STEP_MS
+#define IR_LED_STEP_MS 20
+#endif
+#ifndef IR_LED_STAGGER_MS
+#define IR_LED_STAGGER_MS 100
+#endif
+#ifndef IR_LED_PERSIST_MS
+#define IR_LED_PERSIST_MS 1000
+#endif
+#ifndef IR_LED_RAMP_MS
+#define IR_LED_RAMP_MS 300 /* used by set_ir_led_brightness() */
+#endif
+
+/** Accept a new target level. 0 on success, -1 for an unknown level. */
+int ir_led_request(uint8_t level, int ramp_ms);
+/** Last accepted level, or -1 before the first request or after a
+ *  failed change (the persisted value is current then). */
+int ir_led_target(void);
+/** Wait until the target is applied, at most timeout_ms (-1: no limit).
+ *  0 when applied, 1 if a PWM write failed, -1 on timeout. */
+int ir_led_wait(int timeout_ms);
+/** Persist the applied level now instead of after IR_LED_PERSIST_MS. */
+void ir_led_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IR_LED_H
@@ -2,10 +2,16 @@
 // Created by sr on 05/06/22.
 //
 #include "fw.h"
-#include <dirent.h>
+#include "fw/fw_config.h"
+#include "fw/fw_proc.h"
+#include "hw_handle.h"
+#include "ir_led.h"
 #include <time.h>
 
-pthread_mutex_t lock;
+pthread_rwlock_t system_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t network_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t image_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t streaming_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 #define EXEC_TMP_BUF 128
 
@@ -18,11 +24,24 @@ int exec_cmd(const char *cmd, char *out, size_t out_size)
     if (!cmd || !out || out_size == 0)
         return -1;
 
+    /* "cat M5S_CONFIG_DIR/<key>" is answered from tmpfs (lazy and
+       volatile keys) or the config image when it is in use */
+    if (config_class_cat(cmd, out, out_size) == 0 ||
+        config_store_cat(cmd, out, out_size) == 0)
+        return 0;
+
     LOG_DEBUG("%s\n", cmd);
 
+    /* The command may read per-key files the image is ahead of */
+    config_store_mirror();
+    /* Config reads wait out a transaction commit (see config_txn_commit) */
+    int cfg_lock = config_read_lock(cmd);
     pipe = popen(cmd, "r");
     if (!pipe)
+    {
+        config_read_unlock(cfg_lock);
         return -1;
+    }
 
     out[0] = '\0';
 
@@ -36,6 +55,7 @@ int exec_cmd(const char *cmd, char *out, size_t out_size)
     }
 
     int status = pclose(pipe);
+    config_read_unlock(cfg_lock);
     if (WIFEXITED(status))
         return WEXITSTATUS(status);
     return status;
@@ -53,6 +73,7 @@ int exec_return(const char *cmd)
 
     LOG_DEBUG("%s\n", cmd);
 
+    config_store_mirror();
     pipe = popen(cmd, "r");
     if (!pipe)
         return -1;
@@ -71,51 +92,7 @@ int exec_return(const char *cmd)
 
 int is_running(const char *process_name)
 {
-    DIR *proc;
-    struct dirent *ent;
-    char path[512];
-    char cmdline[512];
-
-    if (!process_name || *process_name == '\0')
-        return 0;
-
-#ifndef PROC_PATH
-#define PROC_PATH "/proc"
-#endif
-
-    proc = opendir(PROC_PATH);
-    if (!proc)
-        return 0;
-
-    while ((ent = readdir(proc)) != NULL)
-    {
-        if (!isdigit((unsigned char)ent->d_name[0]))
-            continue;
-
-        snprintf(path, sizeof(path), PROC_PATH "/%s/cmdline", ent->d_name);
-
-        FILE *fp = fopen(path, "r");
-        if (!fp)
-            continue;
-
-        size_t n = fread(cmdline, 1, sizeof(cmdline) - 1, fp);
-        fclose(fp);
-
-        if (n == 0)
-            continue;
-
-        cmdline[n] = '\0';
-
-        /* cmdline is NUL-separated; first string is argv[0] */
-        if (strstr(cmdline, process_name))
-        {
-            closedir(proc);
-            return 1;
-        }
-    }
-
-    closedir(proc);
-    return 0;
+    return fw_proc_running(process_name);
 }
 
 int8_t get_mode(void)
@@ -165,35 +142,28 @@ int8_t get_ir_tmp_ctl(void)
 // One-file-per-key configuration system functions
 
 int8_t set_uboot_env(const char *key, uint8_t value)
+{
+  char buf[8];
+  snprintf(buf, sizeof(buf), "%d", value);
+  return set_uboot_env_chars(key, buf);
+}
+
+int8_t set_uboot_env_chars(const char *key, const char *value)
 {
   char tmp_path[512];
   char file_path[512];
-  snprintf(file_path, sizeof(file_path), "%s/%s", M5S_CONFIG_DIR, key);
-  snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", M5S_CONFIG_DIR, key);
 
-  FILE *f = fopen(tmp_path, "w");
-  if (!f)
-    return -1;
+  /* Lazy and volatile keys (see fw/fw_config.h) skip the fsync below */
+  int deferred = config_set_deferred(key, value);
+  if (deferred <= 0)
+    return deferred;
 
-  fprintf(f, "%d\n", value);
-  fflush(f);
-  fsync(fileno(f));   // ensures data is written to flash
-  fclose(f);
-
-  if (rename(tmp_path, file_path) != 0)
+  if (config_store_active() && config_store_set(key, value) == 0)
   {
-    perror("rename failed");
-    unlink(tmp_path);
-    return -1;
+    config_class_account(CONFIG_CLASS_SYNC, 1, 1);
+    return 0;
   }
 
-  return 0;
-}
-
-int8_t set_uboot_env_chars(const char *key, const char *value)
-{
-  char tmp_path[512];
-  char file_path[512];
   snprintf(file_path, sizeof(file_path), "%s/%s", M5S_CONFIG_DIR, key);
   snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", M5S_CONFIG_DIR, key);
 
@@ -203,8 +173,9 @@ int8_t set_uboot_env_chars(const char *key, const char *value)
 
   fprintf(f, "%s\n", value);
   fflush(f);
-  fsync(fileno(f));
+  fsync(fileno(f));   // ensures data is written to flash
   fclose(f);
+  config_class_account(CONFIG_CLASS_SYNC, 1, 1);
 
   if (rename(tmp_path, file_path) != 0)
   {
@@ -228,16 +199,10 @@ void stop_process(const char *process_name)
     return;
   }
 
-  char cmd[256];
-
-  snprintf(cmd, sizeof(cmd), "killall %s", process_name);
-
-  int ret = system(cmd);
-
-  if (ret == -1)
+  if (fw_proc_stop(process_name, FW_PROC_STOP_MS) != 0)
   {
 
-    LOG_ERROR("Failed to execute killall");
+    LOG_ERROR("Failed to stop %s", process_name);
   }
 }
 
@@ -290,41 +255,19 @@ int8_t set_haptic_motor(int duty_cycle, int duration)
 
   snprintf(pwm7_val, sizeof(pwm7_val), "%u,%u", duty_cycle, duration);
 
-  // Open lock file
-  int lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666);
-  if (lock_fd < 0)
-  {
-    perror("Failed to open lock file");
-    return -1;
-  }
-
-  // Try to acquire file lock (non-blocking)
-  struct flock fl;
-  memset(&fl, 0, sizeof(fl));
-  fl.l_type = F_WRLCK;
-  fl.l_whence = SEEK_SET;
-  if (fcntl(lock_fd, F_SETLK, &fl) == -1)
-  {
-    perror("Could not acquire lock, exiting");
-    close(lock_fd);
+  // Try to acquire the PWM lock (non-blocking)
+  if (hw_pwm_lock() != 0)
     return -1;
-  }
 
   // Write to /dev/pwmdev-7
-  FILE *pwm7_fp = fopen(PWM7_FILE, "w");
-  if (!pwm7_fp)
+  if (hw_pwm_write(PWM7_FILE, pwm7_val) != 0)
   {
     perror("Failed to write to pwmdev-7");
-    close(lock_fd);
+    hw_pwm_unlock();
     return -1;
   }
-  fprintf(pwm7_fp, "%s\n", pwm7_val);
-  fclose(pwm7_fp);
 
-  // Release lock
-  fl.l_type = F_UNLCK;
-  fcntl(lock_fd, F_SETLK, &fl);
-  close(lock_fd);
+  hw_pwm_unlock();
 
   return 0;
 }
@@ -336,41 +279,19 @@ int8_t debug_pwm4_set(uint8_t val)
 
   snprintf(pwm4_val, sizeof(pwm4_val), "1000000,%u", second);
 
-  // Open lock file
-  int lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666);
-  if (lock_fd < 0)
-  {
-    perror("Failed to open lock file");
+  // Try to acquire the PWM lock (non-blocking)
+  if (hw_pwm_lock() != 0)
     return 1;
-  }
-
-  // Try to acquire file lock (non-blocking)
-  struct flock fl;
-  memset(&fl, 0, sizeof(fl));
-  fl.l_type = F_WRLCK;
-  fl.l_whence = SEEK_SET;
-  if (fcntl(lock_fd, F_SETLK, &fl) == -1)
-  {
-    perror("Could not acquire lock, exiting");
-    close(lock_fd);
-    return 1;
-  }
 
   // Write to /dev/pwmdev-4
-  FILE *pwm4_fp = fopen(PWM4_FILE, "w");
-  if (!pwm4_fp)
+  if (hw_pwm_write(PWM4_FILE, pwm4_val) != 0)
   {
     perror("Failed to write to pwmdev-4");
-    close(lock_fd);
+    hw_pwm_unlock();
     return 1;
   }
-  fprintf(pwm4_fp, "%s\n", pwm4_val);
-  fclose(pwm4_fp);
 
-  // Release lock
-  fl.l_type = F_UNLCK;
-  fcntl(lock_fd, F_SETLK, &fl);
-  close(lock_fd);
+  hw_pwm_unlock();
 
   return 0;
 }
@@ -382,109 +303,36 @@ int8_t debug_pwm5_set(uint8_t val)
 
   snprintf(pwm5_val, sizeof(pwm5_val), "1000000,%u", second);
 
-  // Open lock file
-  int lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666);
-  if (lock_fd < 0)
-  {
-    perror("Failed to open lock file");
+  // Try to acquire the PWM lock (non-blocking)
+  if (hw_pwm_lock() != 0)
     return 1;
-  }
-
-  // Try to acquire file lock (non-blocking)
-  struct flock fl;
-  memset(&fl, 0, sizeof(fl));
-  fl.l_type = F_WRLCK;
-  fl.l_whence = SEEK_SET;
-  if (fcntl(lock_fd, F_SETLK, &fl) == -1)
-  {
-    perror("Could not acquire lock, exiting");
-    close(lock_fd);
-    return 1;
-  }
 
   // Write to /dev/pwmdev-5
-  FILE *pwm5_fp = fopen(PWM5_FILE, "w");
-  if (!pwm5_fp)
+  if (hw_pwm_write(PWM5_FILE, pwm5_val) != 0)
   {
     perror("Failed to write to pwmdev-5");
-    close(lock_fd);
+    hw_pwm_unlock();
     return 1;
   }
-  fprintf(pwm5_fp, "%s\n", pwm5_val);
-  fclose(pwm5_fp);
 
-  // Release lock
-  fl.l_type = F_UNLCK;
-  fcntl(lock_fd, F_SETLK, &fl);
-  close(lock_fd);
+  hw_pwm_unlock();
 
   return 0;
 }
 
+/* Blocking form of ir_led_request(), persisted at once: for boot-time callers */
 int8_t outdu_update_brightness(uint8_t val)
 {
-  const char *pwm5_val = get_pwm5_val(val);
-  const char *pwm4_val = get_pwm4_val(val);
-
-  if (!pwm5_val || !pwm4_val)
+  if (ir_led_request(val, 0) != 0)
   {
     fprintf(stderr, "Invalid PWM values computed.\n");
     return 1;
   }
 
-  // Open lock file
-  int lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666);
-  if (lock_fd < 0)
-  {
-    perror("Failed to open lock file");
-    return 1;
-  }
-
-  // Try to acquire file lock (non-blocking)
-  struct flock fl;
-  memset(&fl, 0, sizeof(fl));
-  fl.l_type = F_WRLCK;
-  fl.l_whence = SEEK_SET;
-  if (fcntl(lock_fd, F_SETLK, &fl) == -1)
-  {
-    perror("Could not acquire lock, exiting");
-    close(lock_fd);
-    return 1;
-  }
-
-  // Write to /dev/pwmdev-5
-  FILE *pwm5_fp = fopen(PWM5_FILE, "w");
-  if (!pwm5_fp)
-  {
-    perror("Failed to write to pwmdev-5");
-    close(lock_fd);
+  if (ir_led_wait(-1) != 0)
     return 1;
-  }
-  fprintf(pwm5_fp, "%s\n", pwm5_val);
-  fclose(pwm5_fp);
 
-  struct timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = 100 * 1000 * 1000; // 100 ms
-  (void)nanosleep(&ts, NULL);
-
-  // Write to /dev/pwmdev-4
-  FILE *pwm4_fp = fopen(PWM4_FILE, "w");
-  if (!pwm4_fp)
-  {
-    perror("Failed to write to pwmdev-4");
-    close(lock_fd);
-    return 1;
-  }
-  fprintf(pwm4_fp, "%s\n", pwm4_val);
-  fclose(pwm4_fp);
-
-  // Release lock
-  fl.l_type = F_UNLCK;
-  fcntl(lock_fd, F_SETLK, &fl);
-  close(lock_fd);
-
-  set_uboot_env(IR, val);
+  ir_led_flush();
 
   return 0;
 }
@@ -619,20 +467,14 @@ void stream_server_config_2k_on(){
   }
 
 void kill_all_processes(){
-
-
-  if(is_running(STREAM_RESTART_SERVICE_PROCESS_NAME))
-    stop_process(STREAM_RESTART_SERVICE_PROCESS_NAME);
-  if(is_running(PORTABLE_RTC_PROCESS_NAME))
-    stop_process(PORTABLE_RTC_PROCESS_NAME);
-  if(is_running(SIGNALING_SERVER_PROCESS_NAME))
-    stop_process(SIGNALING_SERVER_PROCESS_NAME);
-  if(is_running(STREAMER_PROCESS_NAME))
-    stop_process(STREAMER_PROCESS_NAME);
-  if(is_running(RTSP_SERVER_PROCESS_NAME))
-    stop_process(RTSP_SERVER_PROCESS_NAME);
-  if(is_running(ONVIF_SERVER_PROCESS_NAME))
-    stop_process(ONVIF_SERVER_PROCESS_NAME);
-  if(is_running(CAMERA_MONITOR_PROCESS_NAME))
-    stop_process(CAMERA_MONITOR_PROCESS_NAME);
+  static const char *const names[] = {
+      STREAM_RESTART_SERVICE_PROCESS_NAME, PORTABLE_RTC_PROCESS_NAME,
+      SIGNALING_SERVER_PROCESS_NAME,       STREAMER_PROCESS_NAME,
+      RTSP_SERVER_PROCESS_NAME,            ONVIF_SERVER_PROCESS_NAME,
+      CAMERA_MONITOR_PROCESS_NAME};
+
+  // All at once: one pass over /proc, and the exits are awaited together
+  if (fw_proc_stop_all(names, sizeof(names) / sizeof(names[0]),
+                       FW_PROC_STOP_MS) != 0)
+    LOG_ERROR("Failed to stop all processes");
 }
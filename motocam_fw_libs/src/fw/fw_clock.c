@@ -0,0 +1,88 @@
+#include "fw/fw_clock.h"
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+static fw_clock_now_fn clock_now;
+static fw_clock_sleep_fn clock_sleep;
+static uint64_t virtual_ms;
+
+static uint64_t real_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000u + (uint64_t)(now.tv_nsec / 1000000L);
+}
+
+static void real_sleep_ms(uint32_t ms) {
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+}
+
+void fw_clock_set(fw_clock_now_fn now_ms, fw_clock_sleep_fn sleep_ms) {
+  __atomic_store_n(&clock_sleep, now_ms ? sleep_ms : NULL, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&clock_now, now_ms, __ATOMIC_SEQ_CST);
+}
+
+int fw_clock_is_virtual(void) {
+  return __atomic_load_n(&clock_now, __ATOMIC_SEQ_CST) != NULL;
+}
+
+uint64_t fw_clock_now_ms(void) {
+  fw_clock_now_fn now_ms = __atomic_load_n(&clock_now, __ATOMIC_SEQ_CST);
+  return now_ms ? now_ms() : real_now_ms();
+}
+
+void fw_clock_sleep_ms(uint32_t ms) {
+  fw_clock_sleep_fn sleep_ms = __atomic_load_n(&clock_sleep, __ATOMIC_SEQ_CST);
+  if (sleep_ms)
+    sleep_ms(ms);
+  else
+    real_sleep_ms(ms);
+}
+
+int fw_clock_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mu,
+                       uint64_t deadline_ms) {
+  if (!fw_clock_is_virtual()) {
+    struct timespec until;
+
+    // The real clock is CLOCK_MONOTONIC, so the deadline maps directly
+    until.tv_sec = (time_t)(deadline_ms / 1000u);
+    until.tv_nsec = (long)(deadline_ms % 1000u) * 1000000L;
+    return pthread_cond_timedwait(cond, mu, &until);
+  }
+
+  uint64_t now = fw_clock_now_ms();
+  pthread_mutex_unlock(mu);
+  if (deadline_ms > now)
+    fw_clock_sleep_ms(deadline_ms - now > UINT32_MAX
+                          ? UINT32_MAX
+                          : (uint32_t)(deadline_ms - now));
+  pthread_mutex_lock(mu);
+  return ETIMEDOUT;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Virtual clock                                                     */
+/* ------------------------------------------------------------------ */
+
+static uint64_t virtual_now_ms(void) {
+  return __atomic_load_n(&virtual_ms, __ATOMIC_SEQ_CST);
+}
+
+static void virtual_sleep_ms(uint32_t ms) {
+  __atomic_add_fetch(&virtual_ms, ms, __ATOMIC_SEQ_CST);
+  sched_yield(); // let whoever waits for the sleeper run
+}
+
+void fw_clock_use_virtual(uint64_t start_ms) {
+  __atomic_store_n(&virtual_ms, start_ms, __ATOMIC_SEQ_CST);
+  fw_clock_set(virtual_now_ms, virtual_sleep_ms);
+}
+
+void fw_clock_advance_ms(uint32_t ms) {
+  __atomic_add_fetch(&virtual_ms, ms, __ATOMIC_SEQ_CST);
+}
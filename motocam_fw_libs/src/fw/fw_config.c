@@ -0,0 +1,1473 @@
+#define _GNU_SOURCE
+#include "fw.h"
+#include "fw/fw_config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+// Binary config image with A/B commit, see fw/fw_config.h for the layout
+
+#define CONFIG_IMAGE_SIZE (2 * CONFIG_REGION_SIZE)
+#define CONFIG_HDR_SIZE   offsetof(config_image_t, slot)
+
+_Static_assert(sizeof(config_image_t) == CONFIG_REGION_SIZE, "config region must be 16 KiB");
+
+static struct {
+  pthread_mutex_t mu;
+  int fd;
+  const unsigned char *map;
+  char dir[256];
+  int tried;
+  uint32_t checked_gen[2]; // last generation whose CRC passed, per region
+  int checked[2];
+  config_image_t scratch;  // next image being built, under mu
+  int unwritten;           // sets whose per-key file is not written yet
+  int unstamped;           // mirror slots the next flush has to stamp
+  time_t unstamped_since;
+} store = { .mu = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static uint32_t crc_table[256];
+
+static void crc_init(void)
+{
+  if (crc_table[1])
+    return;
+  for (uint32_t i = 0; i < 256; i++)
+  {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc_update(uint32_t crc, const void *buf, size_t len)
+{
+  const unsigned char *p = buf;
+  while (len--)
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+// CRC-32 of a region, taken with its crc field as zero
+static uint32_t region_crc(const config_image_t *img)
+{
+  static const unsigned char zero[sizeof(img->crc)];
+  const unsigned char *p = (const unsigned char *)img;
+  size_t at = offsetof(config_image_t, crc);
+
+  uint32_t crc = crc_update(0xffffffffu, p, at);
+  crc = crc_update(crc, zero, sizeof(zero));
+  crc = crc_update(crc, p + at + sizeof(zero), sizeof(*img) - at - sizeof(zero));
+  return crc ^ 0xffffffffu;
+}
+
+static const config_image_t *region(int i)
+{
+  return (const config_image_t *)(store.map + (size_t)i * CONFIG_REGION_SIZE);
+}
+
+static int header_ok(const config_image_t *img)
+{
+  return img->magic == CONFIG_IMAGE_MAGIC && img->version == CONFIG_IMAGE_VERSION &&
+         img->count <= CONFIG_IMAGE_SLOTS;
+}
+
+// The CRC is checked once per generation seen in a region, not on every read
+static int region_valid(int i)
+{
+  const config_image_t *img = region(i);
+  if (!header_ok(img))
+    return 0;
+
+  uint32_t gen = img->generation;
+  if (store.checked[i] && store.checked_gen[i] == gen)
+    return 1;
+
+  store.checked[i] = 0;
+  if (region_crc(img) != img->crc || img->generation != gen)
+    return 0;
+  store.checked[i] = 1;
+  store.checked_gen[i] = gen;
+  return 1;
+}
+
+// Index of the valid region with the newest generation, -1 if neither is
+static int active_region(void)
+{
+  int a = region_valid(0);
+  int b = region_valid(1);
+  if (a && b)
+    return (int32_t)(region(1)->generation - region(0)->generation) > 0 ? 1 : 0;
+  return a ? 0 : b ? 1 : -1;
+}
+
+static int key_ok(const char *key)
+{
+  size_t len = strlen(key);
+  if (len == 0 || len >= CONFIG_KEY_MAX || key[0] == '.')
+    return 0;
+  if (len > 4 && strcmp(key + len - 4, ".tmp") == 0)
+    return 0;
+  for (const char *p = key; *p; p++)
+  {
+    if (!isalnum((unsigned char)*p) && *p != '_' && *p != '-' && *p != '.')
+      return 0;
+  }
+  return 1;
+}
+
+static int value_ok(const char *value)
+{
+  return strlen(value) < CONFIG_VALUE_MAX && !strchr(value, '\n');
+}
+
+static int64_t stat_mtime_ns(const struct stat *st)
+{
+  return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static time_t monotonic_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// A slot whose per-key file is behind its value has inode 0 and keeps the
+// mtime of the file it supersedes, 0 if there was none
+static int mirror_pending(const config_slot_t *slot)
+{
+  return slot->mirror_ino == 0;
+}
+
+static int mirror_matches(const config_slot_t *slot, const struct stat *st)
+{
+  if (mirror_pending(slot))
+    return stat_mtime_ns(st) == slot->mirror_mtime_ns;
+  return stat_mtime_ns(st) == slot->mirror_mtime_ns && (uint64_t)st->st_ino == slot->mirror_ino &&
+         (size_t)st->st_size == strlen(slot->value) + 1;
+}
+
+static config_slot_t *slot_find(config_image_t *img, const char *key)
+{
+  for (int n = 0; n < img->count; n++)
+  {
+    if (strncmp(img->slot[n].key, key, CONFIG_KEY_MAX) == 0)
+      return &img->slot[n];
+  }
+  return NULL;
+}
+
+static void slot_stamp(config_slot_t *slot, const struct stat *st)
+{
+  slot->mirror_mtime_ns = stat_mtime_ns(st);
+  slot->mirror_ino = st->st_ino;
+}
+
+// 1 while the per-key file of slot is as the store left it (or, for a new
+// key, still absent); st is filled when the file exists
+static int mirror_untouched(const config_slot_t *slot, const char *path, struct stat *st)
+{
+  if (stat(path, st) != 0)
+    return errno == ENOENT && mirror_pending(slot) && slot->mirror_mtime_ns == 0;
+  return mirror_matches(slot, st);
+}
+
+// st NULL: the value goes into the image alone and supersedes whatever
+// file is there now; the file is written later
+static config_slot_t *slot_put(config_image_t *img, const char *key, const char *value,
+                               const struct stat *st)
+{
+  config_slot_t *slot = slot_find(img, key);
+  if (!slot)
+  {
+    if (img->count >= CONFIG_IMAGE_SLOTS)
+    {
+      LOG_ERROR("config image full, %s stays file-only", key);
+      return NULL;
+    }
+    slot = &img->slot[img->count++];
+    memset(slot, 0, sizeof(*slot));
+    snprintf(slot->key, sizeof(slot->key), "%s", key);
+  }
+  memset(slot->value, 0, sizeof(slot->value));
+  snprintf(slot->value, sizeof(slot->value), "%s", value);
+  if (st)
+  {
+    slot_stamp(slot, st);
+  }
+  else
+  {
+    char path[512];
+    struct stat cur;
+    snprintf(path, sizeof(path), "%s/%s", store.dir, key);
+    slot->mirror_mtime_ns = stat(path, &cur) == 0 ? stat_mtime_ns(&cur) : 0;
+    slot->mirror_ino = 0;
+  }
+  return slot;
+}
+
+static void slot_drop(config_image_t *img, config_slot_t *slot)
+{
+  config_slot_t *last = &img->slot[img->count - 1];
+  if (slot != last)
+    *slot = *last;
+  memset(last, 0, sizeof(*last));
+  img->count--;
+}
+
+// A per-key file fits in a slot if it is exactly one line ending in '\n'
+static int read_value(const char *path, char *value, struct stat *st)
+{
+  char buf[CONFIG_VALUE_MAX + 1];
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  int ok = fstat(fileno(f), st) == 0 && S_ISREG(st->st_mode);
+  fclose(f);
+
+  if (!ok || n == 0 || n > CONFIG_VALUE_MAX || buf[n - 1] != '\n' || memchr(buf, '\n', n - 1))
+    return -1;
+  memcpy(value, buf, n - 1);
+  value[n - 1] = '\0';
+  return 0;
+}
+
+// Mirror write: tmp + rename, no fsync. The image commit is the barrier.
+static int write_value(const char *dir, const char *key, const char *value, struct stat *st)
+{
+  char tmp_path[512];
+  char file_path[512];
+  snprintf(file_path, sizeof(file_path), "%s/%s", dir, key);
+  snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", dir, key);
+
+  FILE *f = fopen(tmp_path, "w");
+  if (!f)
+    return -1;
+  fprintf(f, "%s\n", value);
+  if (fclose(f) != 0 || rename(tmp_path, file_path) != 0 || stat(file_path, st) != 0)
+  {
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+static void sync_dir(const char *dir)
+{
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || syncfs(fd) != 0)
+    sync();
+  if (fd >= 0)
+    close(fd);
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+  const unsigned char *p = buf;
+  while (len > 0)
+  {
+    ssize_t n = pwrite(fd, p, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Starts the next image from the active one; returns the active index or -1
+static int scratch_load(void)
+{
+  int i = active_region();
+  if (i >= 0)
+  {
+    memcpy(&store.scratch, region(i), sizeof(store.scratch));
+  }
+  else
+  {
+    memset(&store.scratch, 0, sizeof(store.scratch));
+  }
+  return i;
+}
+
+/*
+ * Writes the scratch image into the region that is not active. The target
+ * header is cleared first so a reader of that region retries instead of
+ * mixing two generations; a torn write fails the CRC and the other region,
+ * which this commit never touches, stays the active one.
+ */
+static int scratch_commit(int active)
+{
+  config_image_t *img = &store.scratch;
+  int target = active == 0 ? 1 : 0;
+  off_t off = (off_t)target * CONFIG_REGION_SIZE;
+  struct timespec ts;
+  static const uint32_t cleared;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  img->magic = CONFIG_IMAGE_MAGIC;
+  img->version = CONFIG_IMAGE_VERSION;
+  img->generation = active >= 0 ? region(active)->generation + 1 : 1;
+  img->committed_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  img->crc = 0;
+  img->crc = region_crc(img);
+
+  if (pwrite_all(store.fd, &cleared, sizeof(cleared), off) != 0 ||
+      pwrite_all(store.fd, (const unsigned char *)img + CONFIG_HDR_SIZE,
+                 sizeof(*img) - CONFIG_HDR_SIZE, off + CONFIG_HDR_SIZE) != 0 ||
+      pwrite_all(store.fd, img, CONFIG_HDR_SIZE, off) != 0 || fdatasync(store.fd) != 0)
+  {
+    LOG_ERROR("config image commit failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Adds every per-key file of dir that fits in a slot and is not in img yet
+static int scan_dir(config_image_t *img, const char *dir)
+{
+  DIR *d = opendir(dir);
+  if (!d)
+    return -1;
+
+  struct dirent *ent;
+  int added = 0;
+  while ((ent = readdir(d)) != NULL)
+  {
+    char path[512];
+    char value[CONFIG_VALUE_MAX];
+    struct stat st;
+
+    if (!key_ok(ent->d_name) || slot_find(img, ent->d_name))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+    if (read_value(path, value, &st) == 0 && slot_put(img, ent->d_name, value, &st))
+      added++;
+  }
+  closedir(d);
+  return added;
+}
+
+// Replaces the image with dir; keys from elsewhere are mirrored into store.dir
+static int import_locked(const char *dir)
+{
+  int active = active_region();
+  config_image_t *img = &store.scratch;
+
+  memset(img, 0, sizeof(*img));
+  if (scan_dir(img, dir) < 0)
+    return -1;
+  if (strcmp(dir, store.dir) != 0)
+  {
+    for (int n = 0; n < img->count; n++)
+    {
+      struct stat st;
+      if (write_value(store.dir, img->slot[n].key, img->slot[n].value, &st) != 0)
+        return -1;
+      slot_stamp(&img->slot[n], &st);
+    }
+  }
+  return scratch_commit(active);
+}
+
+/*
+ * Writes the per-key files of the pending slots in img. With stamp, their
+ * mtime and inode go into img as well and the caller commits it; a file
+ * someone else replaced since the set is then taken into the image.
+ * Returns how many slots were stamped, or -1.
+ */
+static int mirror_write_locked(config_image_t *img, int stamp)
+{
+  int stamped = 0;
+
+  for (int n = 0; n < img->count; n++)
+  {
+    config_slot_t *slot = &img->slot[n];
+    char path[512];
+    char value[CONFIG_VALUE_MAX];
+    struct stat st;
+
+    if (!mirror_pending(slot))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", store.dir, slot->key);
+    if (mirror_untouched(slot, path, &st) || (stamp && read_value(path, value, &st) != 0))
+    {
+      if (write_value(store.dir, slot->key, slot->value, &st) != 0)
+        return -1;
+    }
+    else if (stamp)
+    {
+      // Written by an earlier mirror pass, or by someone else, who then wins
+      slot_put(img, slot->key, value, &st);
+    }
+    if (stamp)
+    {
+      slot_stamp(slot, &st);
+      stamped++;
+    }
+  }
+  return stamped;
+}
+
+/*
+ * Brings the image and the per-key files back in step after a restart:
+ * pending and missing files are written from the image, files someone
+ * else changed are taken into it, and new files are added.
+ */
+static int reconcile_locked(void)
+{
+  int active = scratch_load();
+  config_image_t *img = &store.scratch;
+  int dirty = mirror_write_locked(img, 1);
+
+  if (dirty < 0)
+    return -1;
+
+  for (int n = img->count - 1; n >= 0; n--)
+  {
+    config_slot_t *slot = &img->slot[n];
+    char path[512];
+    char value[CONFIG_VALUE_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", store.dir, slot->key);
+    if (stat(path, &st) != 0)
+    {
+      if (errno != ENOENT)
+        continue;
+      if (write_value(store.dir, slot->key, slot->value, &st) != 0)
+        return -1;
+      slot_stamp(slot, &st);
+      dirty = 1;
+    }
+    else if (!mirror_matches(slot, &st))
+    {
+      if (read_value(path, value, &st) == 0)
+        slot_put(img, slot->key, value, &st);
+      else
+        slot_drop(img, slot);
+      dirty = 1;
+    }
+  }
+
+  int added = scan_dir(img, store.dir);
+  if (added < 0)
+    return -1;
+  if (!dirty && added == 0)
+    return 0;
+  return scratch_commit(active);
+}
+
+// flock() on the config directory orders transactions against readers
+static int dir_lock(const char *dir, int op)
+{
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  while (flock(fd, op) != 0 && errno == EINTR)
+    ;
+  return fd;
+}
+
+static void dir_unlock(int fd)
+{
+  if (fd >= 0)
+    close(fd);
+}
+
+static void store_unmap(void)
+{
+  if (store.map)
+    munmap((void *)store.map, CONFIG_IMAGE_SIZE);
+  if (store.fd >= 0)
+    close(store.fd);
+  store.map = NULL;
+  store.fd = -1;
+  store.checked[0] = store.checked[1] = 0;
+}
+
+int config_store_open(const char *path, const char *dir)
+{
+  struct stat st;
+  int ret = -1;
+
+  pthread_mutex_lock(&store.mu);
+  if (store.fd >= 0)
+  {
+    pthread_mutex_unlock(&store.mu);
+    return 0;
+  }
+  crc_init();
+
+  store.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (store.fd < 0)
+  {
+    LOG_ERROR("open %s: %s", path, strerror(errno));
+    pthread_mutex_unlock(&store.mu);
+    return -1;
+  }
+  flock(store.fd, LOCK_EX);
+
+  if (fstat(store.fd, &st) != 0 ||
+      (st.st_size < CONFIG_IMAGE_SIZE && ftruncate(store.fd, CONFIG_IMAGE_SIZE) != 0))
+    goto out;
+  void *map = mmap(NULL, CONFIG_IMAGE_SIZE, PROT_READ, MAP_SHARED, store.fd, 0);
+  if (map == MAP_FAILED)
+    goto out;
+  store.map = map;
+  snprintf(store.dir, sizeof(store.dir), "%s", dir);
+
+  if (active_region() < 0)
+  {
+    LOG_INFO("no valid config image in %s, importing %s", path, dir);
+    ret = import_locked(dir);
+  }
+  else
+  {
+    ret = reconcile_locked();
+  }
+
+out:
+  flock(store.fd, LOCK_UN);
+  if (ret != 0)
+    store_unmap();
+  pthread_mutex_unlock(&store.mu);
+  return ret;
+}
+
+void config_store_close(void)
+{
+  pthread_mutex_lock(&store.mu);
+  store_unmap();
+  pthread_mutex_unlock(&store.mu);
+}
+
+int config_store_active(void)
+{
+#ifdef FW_CONFIG_BACKEND_IMAGE
+  if (!store.tried)
+  {
+    store.tried = 1;
+    config_store_open(M5S_CONFIG_IMAGE, M5S_CONFIG_DIR);
+  }
+#endif
+  return store.fd >= 0;
+}
+
+// 1 with *slot filled, 0 if key is absent, -1 if its file was written behind our back
+static int store_lookup(const char *key, config_slot_t *slot)
+{
+  int found = -1;
+
+  pthread_mutex_lock(&store.mu);
+  // Another process may commit into the region we read; retry if it did
+  for (int tries = 0; tries < 3 && found < 0 && store.map; tries++)
+  {
+    int i = active_region();
+    if (i < 0)
+      break;
+    const config_image_t *img = region(i);
+    uint32_t gen = img->generation;
+    __sync_synchronize();
+
+    const config_slot_t *hit = slot_find((config_image_t *)img, key);
+    if (hit)
+      *slot = *hit;
+    __sync_synchronize();
+    if (img->magic == CONFIG_IMAGE_MAGIC && img->generation == gen)
+      found = hit != NULL;
+  }
+  pthread_mutex_unlock(&store.mu);
+  if (found != 1)
+    return found < 0 ? 0 : found;
+
+  char path[512];
+  struct stat st;
+  slot->value[CONFIG_VALUE_MAX - 1] = '\0';
+  snprintf(path, sizeof(path), "%s/%s", store.dir, key);
+  if (mirror_untouched(slot, path, &st))
+    return 1;
+  // A pending file written by config_store_mirror() still holds the value
+  char value[CONFIG_VALUE_MAX];
+  if (!mirror_pending(slot) || read_value(path, value, &st) != 0 || strcmp(value, slot->value) != 0)
+    return -1;
+  return 1;
+}
+
+int config_store_get(const char *key, char *out, size_t out_size)
+{
+  config_slot_t slot;
+
+  if (!key || !out || out_size == 0 || !config_store_active() || !key_ok(key))
+    return -1;
+
+  int found = store_lookup(key, &slot);
+  if (found < 0)
+  {
+    // A transaction may be between its mirror writes and its commit
+    int lock_fd = dir_lock(store.dir, LOCK_SH);
+    found = store_lookup(key, &slot);
+    dir_unlock(lock_fd);
+  }
+  if (found != 1)
+    return -1;
+
+  snprintf(out, out_size, "%s", slot.value);
+  return 0;
+}
+
+static void flush_at_exit(void);
+static pthread_once_t flush_at_exit_once = PTHREAD_ONCE_INIT;
+
+static void flush_at_exit_register(void)
+{
+  atexit(flush_at_exit);
+}
+
+// Counts sets whose per-key files config_store_mirror() and
+// config_store_flush() still have to write; under store.mu
+static void mirror_defer(int sets)
+{
+  __atomic_add_fetch(&store.unwritten, sets, __ATOMIC_RELAXED);
+  if (store.unstamped == 0)
+    store.unstamped_since = monotonic_sec();
+  store.unstamped += sets;
+  pthread_once(&flush_at_exit_once, flush_at_exit_register);
+}
+
+int config_store_set(const char *key, const char *value)
+{
+  int ret = -1;
+
+  if (!key || !value || !config_store_active() || !key_ok(key) || !value_ok(value))
+    return -1;
+
+  pthread_mutex_lock(&store.mu);
+  if (store.fd < 0)
+    goto out;
+  flock(store.fd, LOCK_EX);
+
+  int active = scratch_load();
+  if (slot_put(&store.scratch, key, value, NULL))
+    ret = scratch_commit(active);
+  if (ret == 0)
+    mirror_defer(1);
+
+  flock(store.fd, LOCK_UN);
+out:
+  pthread_mutex_unlock(&store.mu);
+  return ret;
+}
+
+int config_store_mirror(void)
+{
+  int ret = 0;
+
+  if (!__atomic_load_n(&store.unwritten, __ATOMIC_RELAXED))
+    return 0;
+
+  pthread_mutex_lock(&store.mu);
+  if (store.fd >= 0 && store.unwritten)
+  {
+    flock(store.fd, LOCK_EX);
+    scratch_load();
+    ret = mirror_write_locked(&store.scratch, 0) < 0 ? -1 : 0;
+    flock(store.fd, LOCK_UN);
+    if (ret == 0)
+      store.unwritten = 0;
+  }
+  pthread_mutex_unlock(&store.mu);
+  return ret;
+}
+
+int config_store_flush(void)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&store.mu);
+  if (store.fd >= 0 && store.unstamped)
+  {
+    flock(store.fd, LOCK_EX);
+    int active = scratch_load();
+    int stamped = mirror_write_locked(&store.scratch, 1);
+    ret = stamped < 0 ? -1 : stamped > 0 ? scratch_commit(active) : 0;
+    flock(store.fd, LOCK_UN);
+    if (ret == 0)
+      store.unwritten = store.unstamped = 0;
+  }
+  pthread_mutex_unlock(&store.mu);
+  return ret;
+}
+
+// Key of a plain "cat <dir>/<key>" command, NULL for anything else
+static const char *cat_key(const char *cmd, const char *dir)
+{
+  size_t len = strlen(dir);
+  if (strncmp(cmd, "cat ", 4) != 0 || strncmp(cmd + 4, dir, len) != 0 || cmd[4 + len] != '/')
+    return NULL;
+  return key_ok(cmd + 5 + len) ? cmd + 5 + len : NULL;
+}
+
+int config_store_cat(const char *cmd, char *out, size_t out_size)
+{
+  char value[CONFIG_VALUE_MAX];
+
+  if (!config_store_active())
+    return -1;
+  const char *key = cat_key(cmd, store.dir);
+  if (!key || config_store_get(key, value, sizeof(value)) != 0)
+    return -1;
+
+  snprintf(out, out_size, "%s\n", value);
+  return 0;
+}
+
+int config_store_import_dir(const char *dir)
+{
+  int ret = -1;
+
+  if (!dir || !config_store_active())
+    return -1;
+
+  pthread_mutex_lock(&store.mu);
+  if (store.fd >= 0)
+  {
+    flock(store.fd, LOCK_EX);
+    ret = import_locked(dir);
+    flock(store.fd, LOCK_UN);
+  }
+  pthread_mutex_unlock(&store.mu);
+  return ret;
+}
+
+int config_store_export_dir(const char *dir)
+{
+  int ret = -1;
+  int written = 0;
+  int dirty = 0;
+
+  if (!dir || !config_store_active())
+    return -1;
+
+  pthread_mutex_lock(&store.mu);
+  if (store.fd < 0)
+    goto out;
+  flock(store.fd, LOCK_EX);
+
+  int active = scratch_load();
+  int own_dir = strcmp(dir, store.dir) == 0;
+  config_image_t *img = &store.scratch;
+  ret = 0;
+  for (int n = 0; n < img->count && ret == 0; n++)
+  {
+    config_slot_t *slot = &img->slot[n];
+    char path[512];
+    char value[CONFIG_VALUE_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, slot->key);
+    if (read_value(path, value, &st) != 0 || strcmp(value, slot->value) != 0)
+    {
+      if (write_value(dir, slot->key, slot->value, &st) != 0)
+      {
+        ret = -1;
+        break;
+      }
+      written++;
+    }
+    if (own_dir && (mirror_pending(slot) || !mirror_matches(slot, &st)))
+    {
+      slot_stamp(slot, &st);
+      dirty = 1;
+    }
+  }
+
+  // One filesystem sync for every file written above
+  if (ret == 0 && written > 0)
+    sync_dir(dir);
+  if (ret == 0 && dirty)
+    ret = scratch_commit(active);
+  if (ret == 0 && own_dir)
+    store.unwritten = store.unstamped = 0;
+
+  flock(store.fd, LOCK_UN);
+out:
+  pthread_mutex_unlock(&store.mu);
+  return ret;
+}
+
+uint32_t config_store_generation(void)
+{
+  uint32_t gen = 0;
+
+  if (!config_store_active())
+    return 0;
+
+  pthread_mutex_lock(&store.mu);
+  int i = store.map ? active_region() : -1;
+  if (i >= 0)
+    gen = region(i)->generation;
+  pthread_mutex_unlock(&store.mu);
+  return gen;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Transactions                                                      */
+/* ------------------------------------------------------------------ */
+
+static pthread_once_t txn_recover_once = PTHREAD_ONCE_INIT;
+
+void config_txn_begin(config_txn_t *txn)
+{
+  memset(txn, 0, sizeof(*txn));
+}
+
+int config_txn_set(config_txn_t *txn, const char *key, const char *value)
+{
+  if (!key || !value || !key_ok(key) || strlen(value) >= CONFIG_TXN_VALUE_MAX || strchr(value, '\n'))
+  {
+    LOG_ERROR("cannot stage %s", key ? key : "(null)");
+    txn->failed = 1;
+    return -1;
+  }
+
+  int n;
+  for (n = 0; n < txn->count; n++)
+  {
+    if (strcmp(txn->key[n], key) == 0)
+      break;
+  }
+  if (n == txn->count)
+  {
+    if (txn->count >= CONFIG_TXN_MAX_KEYS)
+    {
+      LOG_ERROR("transaction full, cannot stage %s", key);
+      txn->failed = 1;
+      return -1;
+    }
+    snprintf(txn->key[txn->count++], CONFIG_KEY_MAX, "%s", key);
+  }
+  snprintf(txn->value[n], CONFIG_TXN_VALUE_MAX, "%s", value);
+  return 0;
+}
+
+int config_txn_set_int(config_txn_t *txn, const char *key, int value)
+{
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%d", value);
+  return config_txn_set(txn, key, buf);
+}
+
+// Image backend: the whole transaction becomes one generation
+static int txn_commit_image(const config_txn_t *txn)
+{
+  int ret = 0;
+
+  for (int n = 0; n < txn->count; n++)
+  {
+    if (!value_ok(txn->value[n]))
+      return -1;
+  }
+
+  pthread_mutex_lock(&store.mu);
+  if (store.fd < 0)
+  {
+    pthread_mutex_unlock(&store.mu);
+    return -1;
+  }
+  flock(store.fd, LOCK_EX);
+
+  int active = scratch_load();
+  for (int n = 0; n < txn->count && ret == 0; n++)
+  {
+    if (!slot_put(&store.scratch, txn->key[n], txn->value[n], NULL))
+      ret = -1;
+  }
+  if (ret == 0)
+    ret = scratch_commit(active);
+  if (ret == 0)
+    mirror_defer(txn->count);
+
+  flock(store.fd, LOCK_UN);
+  pthread_mutex_unlock(&store.mu);
+  return ret;
+}
+
+/*
+ * Journal: "<key> <value>" lines, then "end <count> <crc32>". The journal
+ * fsync is the commit point; the key files are then replaced without
+ * fsync, the journal is removed and one syncfs() retires the lot. A
+ * journal left behind by a crash is replayed by config_txn_recover().
+ */
+static int journal_build(const config_txn_t *txn, char *buf, size_t size)
+{
+  size_t len = 0;
+
+  crc_init();
+  for (int n = 0; n < txn->count; n++)
+  {
+    int w = snprintf(buf + len, size - len, "%s %s\n", txn->key[n], txn->value[n]);
+    if (w < 0 || (size_t)w >= size - len)
+      return -1;
+    len += w;
+  }
+  uint32_t crc = crc_update(0xffffffffu, buf, len) ^ 0xffffffffu;
+  int w = snprintf(buf + len, size - len, "end %d %08x\n", txn->count, crc);
+  if (w < 0 || (size_t)w >= size - len)
+    return -1;
+  return (int)(len + w);
+}
+
+static int journal_parse(char *buf, size_t len, config_txn_t *txn)
+{
+  // The trailer is the last line; a torn journal has none or a bad CRC
+  buf[len] = '\0';
+  if (len == 0 || buf[len - 1] != '\n')
+    return -1;
+  buf[len - 1] = '\0';
+  char *end = strrchr(buf, '\n');
+  end = end ? end + 1 : buf;
+
+  int count;
+  unsigned int crc;
+  crc_init();
+  if (sscanf(end, "end %d %8x", &count, &crc) != 2 ||
+      (crc_update(0xffffffffu, buf, end - buf) ^ 0xffffffffu) != crc)
+    return -1;
+
+  config_txn_begin(txn);
+  *end = '\0';
+  for (char *line = buf; *line;)
+  {
+    char *nl = strchr(line, '\n');
+    char *sp = strchr(line, ' ');
+    if (!nl || !sp || sp > nl)
+      return -1;
+    *nl = '\0';
+    *sp = '\0';
+    if (config_txn_set(txn, line, sp + 1) != 0)
+      return -1;
+    line = nl + 1;
+  }
+  return txn->count == count ? 0 : -1;
+}
+
+static int txn_apply_files(const config_txn_t *txn, const char *dir)
+{
+  struct stat st;
+  for (int n = 0; n < txn->count; n++)
+  {
+    if (write_value(dir, txn->key[n], txn->value[n], &st) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int txn_commit_journal(const config_txn_t *txn, const char *dir)
+{
+  char buf[CONFIG_TXN_MAX_KEYS * (CONFIG_KEY_MAX + CONFIG_TXN_VALUE_MAX + 2) + 32];
+  char path[512];
+
+  int len = journal_build(txn, buf, sizeof(buf));
+  if (len < 0)
+    return -1;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, CONFIG_TXN_JOURNAL);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -1;
+  int ok = pwrite_all(fd, buf, len, 0) == 0 && fsync(fd) == 0;
+  close(fd);
+  if (!ok)
+  {
+    unlink(path);
+    return -1;
+  }
+
+  // Committed. A failure from here on is finished by config_txn_recover().
+  if (txn_apply_files(txn, dir) != 0)
+    return -1;
+  // The key files must be durable before the journal that replays them goes
+  sync_dir(dir);
+  unlink(path);
+  sync_dir(dir);
+  return 0;
+}
+
+static int recover_dir(const char *dir)
+{
+  char buf[CONFIG_TXN_MAX_KEYS * (CONFIG_KEY_MAX + CONFIG_TXN_VALUE_MAX + 2) + 32];
+  char path[512];
+  config_txn_t txn;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, CONFIG_TXN_JOURNAL);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+
+  int ret = 0;
+  if (len > 0 && journal_parse(buf, len, &txn) == 0)
+  {
+    LOG_INFO("replaying interrupted config transaction (%d keys)", txn.count);
+    ret = txn_apply_files(&txn, dir);
+  }
+  if (ret == 0)
+  {
+    sync_dir(dir);
+    unlink(path);
+    sync_dir(dir);
+  }
+  return ret;
+}
+
+int config_txn_recover(const char *dir)
+{
+  int lock_fd = dir_lock(dir, LOCK_EX);
+  int ret = recover_dir(dir);
+  dir_unlock(lock_fd);
+  return ret;
+}
+
+static void txn_recover_default(void)
+{
+  config_txn_recover(M5S_CONFIG_DIR);
+}
+
+static pthread_mutex_t stats_mu = PTHREAD_MUTEX_INITIALIZER;
+static config_class_stats_t class_stats[CONFIG_CLASS_COUNT];
+
+void config_class_account(config_class_t cls, unsigned int sets, unsigned int flash_syncs)
+{
+  if (cls < 0 || cls >= CONFIG_CLASS_COUNT)
+    return;
+  pthread_mutex_lock(&stats_mu);
+  class_stats[cls].sets += sets;
+  class_stats[cls].flash_syncs += flash_syncs;
+  pthread_mutex_unlock(&stats_mu);
+}
+
+void config_class_stats(config_class_t cls, config_class_stats_t *out)
+{
+  memset(out, 0, sizeof(*out));
+  if (cls < 0 || cls >= CONFIG_CLASS_COUNT)
+    return;
+  pthread_mutex_lock(&stats_mu);
+  *out = class_stats[cls];
+  pthread_mutex_unlock(&stats_mu);
+}
+
+static int txn_commit_as(config_txn_t *txn, config_class_t cls)
+{
+  if (txn->failed)
+    return -1;
+  if (txn->count == 0)
+    return 0;
+
+  pthread_once(&txn_recover_once, txn_recover_default);
+
+  // Readers going through exec_cmd() wait on this lock, so they see all or none
+  int lock_fd = dir_lock(M5S_CONFIG_DIR, LOCK_EX);
+  int ret;
+  if (config_store_active() && txn_commit_image(txn) == 0)
+  {
+    ret = 0;
+    config_class_account(cls, txn->count, 1);
+  }
+  else
+  {
+    ret = txn_commit_journal(txn, M5S_CONFIG_DIR);
+    config_class_account(cls, txn->count, 3);
+  }
+  dir_unlock(lock_fd);
+
+  config_txn_begin(txn);
+  return ret;
+}
+
+int config_txn_commit(config_txn_t *txn)
+{
+  return txn_commit_as(txn, CONFIG_CLASS_SYNC);
+}
+
+int config_read_lock(const char *cmd)
+{
+  if (!cmd || !cat_key(cmd, M5S_CONFIG_DIR))
+    return -1;
+  return dir_lock(M5S_CONFIG_DIR, LOCK_SH);
+}
+
+void config_read_unlock(int fd)
+{
+  dir_unlock(fd);
+}
+
+/* ------------------------------------------------------------------ */
+/*  Durability classes                                                */
+/* ------------------------------------------------------------------ */
+
+// Every key not listed here is CONFIG_CLASS_SYNC
+static const struct {
+  const char *key;
+  config_class_t cls;
+} config_key_table[] = {
+  /* Thermal loop state in m5s_mw_server, recomputed after every boot */
+  { "isp_temp_state", CONFIG_CLASS_VOLATILE },
+  { "ir_temp_state", CONFIG_CLASS_VOLATILE },
+  /* Lowered and restored by the thermal loop as well as set by the user */
+  { "ir_led_brightness", CONFIG_CLASS_LAZY },
+};
+
+static struct {
+  pthread_mutex_t mu;
+  char key[CONFIG_TXN_MAX_KEYS][CONFIG_KEY_MAX];
+  int count;
+  time_t dirty_since;
+} lazy = { .mu = PTHREAD_MUTEX_INITIALIZER };
+
+config_class_t config_key_class(const char *key)
+{
+  for (size_t n = 0; key && n < sizeof(config_key_table) / sizeof(config_key_table[0]); n++)
+  {
+    if (strcmp(config_key_table[n].key, key) == 0)
+      return config_key_table[n].cls;
+  }
+  return CONFIG_CLASS_SYNC;
+}
+
+static void flush_at_exit(void)
+{
+  config_flush_lazy();
+  config_store_flush();
+}
+
+int config_set_deferred(const char *key, const char *value)
+{
+  struct stat st;
+  config_class_t cls = config_key_class(key);
+
+  if (cls == CONFIG_CLASS_SYNC)
+    return 1;
+  if (!value || strlen(value) >= CONFIG_TXN_VALUE_MAX || strchr(value, '\n'))
+    return -1;
+
+  if (write_value(CONFIG_VOLATILE_DIR, key, value, &st) != 0)
+  {
+    if (mkdir(CONFIG_VOLATILE_DIR, 0755) != 0 && errno != EEXIST)
+      return -1;
+    if (write_value(CONFIG_VOLATILE_DIR, key, value, &st) != 0)
+      return -1;
+  }
+  config_class_account(cls, 1, 0);
+  if (cls == CONFIG_CLASS_VOLATILE)
+    return 0;
+
+  int full = 0;
+  pthread_mutex_lock(&lazy.mu);
+  int n;
+  for (n = 0; n < lazy.count; n++)
+  {
+    if (strcmp(lazy.key[n], key) == 0)
+      break;
+  }
+  if (n == lazy.count)
+  {
+    if (lazy.count == 0)
+      lazy.dirty_since = monotonic_sec();
+    snprintf(lazy.key[lazy.count++], CONFIG_KEY_MAX, "%s", key);
+    full = lazy.count == CONFIG_TXN_MAX_KEYS;
+  }
+  pthread_mutex_unlock(&lazy.mu);
+  pthread_once(&flush_at_exit_once, flush_at_exit_register);
+
+  if (full)
+    return config_flush_lazy();
+  // Processes without a timer of their own flush here once the interval is up
+  config_flush_due();
+  return 0;
+}
+
+// Marks the keys of a failed flush dirty again, so the next flush retries
+static void lazy_requeue(const config_txn_t *txn)
+{
+  pthread_mutex_lock(&lazy.mu);
+  for (int k = 0; k < txn->count && lazy.count < CONFIG_TXN_MAX_KEYS; k++)
+  {
+    int n;
+    for (n = 0; n < lazy.count; n++)
+    {
+      if (strcmp(lazy.key[n], txn->key[k]) == 0)
+        break;
+    }
+    if (n < lazy.count)
+      continue;
+    if (lazy.count == 0)
+      lazy.dirty_since = monotonic_sec();
+    snprintf(lazy.key[lazy.count++], CONFIG_KEY_MAX, "%s", txn->key[k]);
+  }
+  pthread_mutex_unlock(&lazy.mu);
+}
+
+/*
+ * Persists the dirty lazy keys as one transaction. The value comes from
+ * the tmpfs copy, not from this process, so whichever process flushes
+ * last writes the newest value.
+ */
+int config_flush_lazy(void)
+{
+  config_txn_t txn;
+
+  config_txn_begin(&txn);
+  pthread_mutex_lock(&lazy.mu);
+  for (int n = 0; n < lazy.count; n++)
+  {
+    char path[512];
+    char value[CONFIG_TXN_VALUE_MAX];
+    snprintf(path, sizeof(path), "%s/%s", CONFIG_VOLATILE_DIR, lazy.key[n]);
+    FILE *f = fopen(path, "r");
+    if (!f)
+      continue;
+    if (fgets(value, sizeof(value), f))
+    {
+      value[strcspn(value, "\n")] = '\0';
+      config_txn_set(&txn, lazy.key[n], value);
+    }
+    fclose(f);
+  }
+  lazy.count = 0;
+  pthread_mutex_unlock(&lazy.mu);
+
+  if (txn.count == 0)
+    return 0;
+  // The commit resets txn; keep its keys to queue them again on failure
+  config_txn_t flushed = txn;
+  int ret = txn_commit_as(&txn, CONFIG_CLASS_LAZY);
+  if (ret != 0)
+  {
+    LOG_ERROR("lazy config flush failed");
+    lazy_requeue(&flushed);
+  }
+  return ret;
+}
+
+void config_flush_due(void)
+{
+  pthread_mutex_lock(&lazy.mu);
+  int due = lazy.count > 0 && monotonic_sec() - lazy.dirty_since >= CONFIG_LAZY_FLUSH_SEC;
+  pthread_mutex_unlock(&lazy.mu);
+  if (due)
+    config_flush_lazy();
+
+  pthread_mutex_lock(&store.mu);
+  due = store.unstamped > 0 && monotonic_sec() - store.unstamped_since >= CONFIG_LAZY_FLUSH_SEC;
+  pthread_mutex_unlock(&store.mu);
+  if (due)
+    config_store_flush();
+}
+
+int config_class_cat(const char *cmd, char *out, size_t out_size)
+{
+  char path[512];
+
+  const char *key = cat_key(cmd, M5S_CONFIG_DIR);
+  if (!key || config_key_class(key) == CONFIG_CLASS_SYNC)
+    return -1;
+
+  // Until the first write after boot the persisted value is the current one
+  snprintf(path, sizeof(path), "%s/%s", CONFIG_VOLATILE_DIR, key);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  size_t n = fread(out, 1, out_size - 1, f);
+  out[n] = '\0';
+  fclose(f);
+  return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  No-op detection                                                   */
+/* ------------------------------------------------------------------ */
+
+#define VALUE_CACHE_SIZE 64
+#define VALUE_RACY_NS    1000000000LL // mtime may not have ticked yet
+
+static struct {
+  pthread_mutex_t mu;
+  struct {
+    char path[256];
+    char value[CONFIG_TXN_VALUE_MAX];
+    int64_t mtime_ns;
+    uint64_t ino;
+    off_t size;
+  } entry[VALUE_CACHE_SIZE];
+  int next;
+  struct {
+    char name[CONFIG_KEY_MAX];
+    unsigned long count;
+  } skip[CONFIG_SKIP_NAMES];
+  unsigned long skipped;
+} noop = { .mu = PTHREAD_MUTEX_INITIALIZER };
+
+static int64_t realtime_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Contents of path without one trailing '\n', re-read only when it changed
+static int cached_read(const char *path, char *out, size_t out_size)
+{
+  struct stat st;
+  if (strlen(path) >= sizeof(noop.entry[0].path) || stat(path, &st) != 0 ||
+      !S_ISREG(st.st_mode) || st.st_size >= CONFIG_TXN_VALUE_MAX)
+    return -1;
+
+  pthread_mutex_lock(&noop.mu);
+  int n;
+  for (n = 0; n < VALUE_CACHE_SIZE; n++)
+  {
+    if (strcmp(noop.entry[n].path, path) == 0)
+      break;
+  }
+  if (n < VALUE_CACHE_SIZE && noop.entry[n].mtime_ns == stat_mtime_ns(&st) &&
+      noop.entry[n].ino == (uint64_t)st.st_ino && noop.entry[n].size == st.st_size &&
+      realtime_ns() - stat_mtime_ns(&st) >= VALUE_RACY_NS)
+  {
+    snprintf(out, out_size, "%s", noop.entry[n].value);
+    pthread_mutex_unlock(&noop.mu);
+    return 0;
+  }
+  if (n == VALUE_CACHE_SIZE)
+  {
+    n = noop.next;
+    noop.next = (noop.next + 1) % VALUE_CACHE_SIZE;
+  }
+
+  char buf[CONFIG_TXN_VALUE_MAX];
+  size_t len = 0;
+  FILE *f = fopen(path, "r");
+  if (f)
+  {
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+  }
+  buf[len] = '\0';
+  if (len > 0 && buf[len - 1] == '\n')
+    buf[len - 1] = '\0';
+
+  // A replacement between stat() and fopen() just costs a re-read next time
+  snprintf(noop.entry[n].path, sizeof(noop.entry[n].path), "%s", f ? path : "");
+  snprintf(noop.entry[n].value, sizeof(noop.entry[n].value), "%s", buf);
+  noop.entry[n].mtime_ns = stat_mtime_ns(&st);
+  noop.entry[n].ino = st.st_ino;
+  noop.entry[n].size = st.st_size;
+  pthread_mutex_unlock(&noop.mu);
+
+  if (!f)
+    return -1;
+  snprintf(out, out_size, "%s", buf);
+  return 0;
+}
+
+int config_file_equals(const char *path, const char *value)
+{
+  char current[CONFIG_TXN_VALUE_MAX];
+
+  if (!path || !value || cached_read(path, current, sizeof(current)) != 0)
+    return 0;
+  return strcmp(current, value) == 0;
+}
+
+int config_value_equals(const char *key, const char *value)
+{
+  char current[CONFIG_TXN_VALUE_MAX];
+  char path[512];
+
+  if (!key || !value || !key_ok(key))
+    return 0;
+
+  // Same sources, in the same order, as a "cat" through exec_cmd()
+  if (config_key_class(key) != CONFIG_CLASS_SYNC)
+  {
+    snprintf(path, sizeof(path), "%s/%s", CONFIG_VOLATILE_DIR, key);
+    if (cached_read(path, current, sizeof(current)) == 0)
+      return strcmp(current, value) == 0;
+  }
+  if (config_store_active() && config_store_get(key, current, sizeof(current)) == 0)
+    return strcmp(current, value) == 0;
+
+  snprintf(path, sizeof(path), "%s/%s", M5S_CONFIG_DIR, key);
+  return config_file_equals(path, value);
+}
+
+int config_value_equals_int(const char *key, int value)
+{
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%d", value);
+  return config_value_equals(key, buf);
+}
+
+int config_unchanged(const char *key, const char *value)
+{
+  if (!config_value_equals(key, value))
+    return 0;
+  config_skip_account(key);
+  return 1;
+}
+
+int config_unchanged_int(const char *key, int value)
+{
+  if (!config_value_equals_int(key, value))
+    return 0;
+  config_skip_account(key);
+  return 1;
+}
+
+void config_skip_account(const char *name)
+{
+  LOG_DEBUG("%s unchanged, skipping write", name);
+
+  pthread_mutex_lock(&noop.mu);
+  noop.skipped++;
+  for (int n = 0; n < CONFIG_SKIP_NAMES; n++)
+  {
+    if (noop.skip[n].name[0] == '\0')
+      snprintf(noop.skip[n].name, sizeof(noop.skip[n].name), "%s", name);
+    if (strncmp(noop.skip[n].name, name, sizeof(noop.skip[n].name) - 1) == 0)
+    {
+      noop.skip[n].count++;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&noop.mu);
+}
+
+unsigned long config_skipped(const char *name)
+{
+  unsigned long count = 0;
+
+  pthread_mutex_lock(&noop.mu);
+  if (!name)
+    count = noop.skipped;
+  for (int n = 0; name && n < CONFIG_SKIP_NAMES && noop.skip[n].name[0]; n++)
+  {
+    if (strncmp(noop.skip[n].name, name, sizeof(noop.skip[n].name) - 1) == 0)
+    {
+      count = noop.skip[n].count;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&noop.mu);
+  return count;
+}
@@ -72,14 +72,14 @@ int8_t get_ir_temp(uint8_t *temp)
 {
   uint16_t val;
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   /* Get IR Temp details */
   val = get_sysfs_read_val(IR_FILE);
 
   *temp = find_temperature(val);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
 
   return 0;
 }
@@ -88,7 +88,7 @@ int8_t get_sensor_temp(uint8_t *temp)
 {
   uint16_t val;
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   /* Get sensor Temp details */
   val = get_sysfs_read_val(SENSOR_FILE);
@@ -96,19 +96,19 @@ int8_t get_sensor_temp(uint8_t *temp)
   *temp = find_temperature(val);
 
   printf("Sensor Temp: %d, Sensor Value: %d\n", *temp, val);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
 
   return 0;
 }
 
 int8_t get_isp_temp(uint8_t *temp)
 {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   /* Get ISP Temp details */
   *temp = (uint8_t)get_sysfs_read_val(ISP_FILE);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
 
   return 0;
 }
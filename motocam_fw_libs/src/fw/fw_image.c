@@ -1,4 +1,9 @@
 #include "fw/fw_image.h"
+#include "fw/fw_config.h"
+#include "ir_cut.h"
+#include "ir_led.h"
+#include "fw/fw_msg.h"
+#include "fw/fw_proc.h"
 #include "fw/fw_state_machine.h"
 #include "fw/fw_system.h"
 #include <errno.h>
@@ -147,157 +152,126 @@ void start_wdr_eis_mode(uint8_t day_mode) {
   handle_linear_mode(day_mode, eis, stream1_resolution);
 }
 
-void do_action_for_1() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-  set_uboot_env(IR_FILTER, 0);
+/* One transaction per misc change: the misc value and every key it implies */
+static void commit_misc_env(uint8_t misc, uint8_t eis, uint8_t wdr,
+                            uint8_t stream1_resolution, uint8_t ir_filter) {
+  config_txn_t txn;
+
+  config_txn_begin(&txn);
+  config_txn_set_int(&txn, SET_MISC, misc);
+  config_txn_set_int(&txn, EIS, eis);
+  config_txn_set_int(&txn, WDR, wdr);
+  config_txn_set_int(&txn, STREAM1_RESOLUTION, stream1_resolution);
+  config_txn_set_int(&txn, IR_FILTER, ir_filter);
+  /* 4K modes cannot run WebRTC */
+  if (misc == DAY_EIS_ON_WDR_ON || misc == NIGHT_EIS_ON_WDR_ON)
+    config_txn_set_int(&txn, WEBRTC_ENABLED, 0);
+  if (config_txn_commit(&txn) != 0)
+    LOG_ERROR("misc %u: config commit failed\n", misc);
+}
 
-  outdu_update_brightness(0);
-  update_ir_cut_filter_off();
+void do_action_for_1() {
+  commit_misc_env(DAY_EIS_OFF_WDR_OFF, 0, 0, 2, 0);
+  ir_led_request(IR_OFF, 0);
+  ir_cut_request(0);
   stream_server_config_2k_on();
   start_wdr_eis_mode(DAY_M);
 }
 
 void do_action_for_2() {
-  set_uboot_env(EIS, 1);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 0);
-  outdu_update_brightness(0);
-  update_ir_cut_filter_off();
+  commit_misc_env(DAY_EIS_ON_WDR_OFF, 1, 0, 2, 0);
+  ir_led_request(IR_OFF, 0);
+  ir_cut_request(0);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(DAY_M);
 }
 
 void do_action_for_3() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 1);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 0);
-  outdu_update_brightness(0);
-  update_ir_cut_filter_off();
+  commit_misc_env(DAY_EIS_OFF_WDR_ON, 0, 1, 2, 0);
+  ir_led_request(IR_OFF, 0);
+  ir_cut_request(0);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(DAY_M);
 }
 
 void do_action_for_4() {
-
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 3);
-
-  set_uboot_env(IR_FILTER, 0);
-  outdu_update_brightness(0);
-  update_ir_cut_filter_off();
+  commit_misc_env(DAY_EIS_ON_WDR_ON, 0, 0, 3, 0);
+  ir_led_request(IR_OFF, 0);
+  ir_cut_request(0);
   stream_server_config_4k_on();
 
   start_wdr_eis_mode(DAY_M);
 }
 
 void do_action_for_5() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 1);
-  outdu_update_brightness(0);
-  update_ir_cut_filter_on();
+  commit_misc_env(LOWLIGHT_EIS_OFF_WDR_OFF, 0, 0, 2, 1);
+  ir_led_request(IR_OFF, 0);
+  ir_cut_request(1);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(LOW_LIGHT_M);
 }
 
 void do_action_for_6() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 1);
-  outdu_update_brightness(0);
-  update_ir_cut_filter_on();
+  commit_misc_env(LOWLIGHT_EIS_ON_WDR_OFF, 0, 0, 2, 1);
+  ir_led_request(IR_OFF, 0);
+  ir_cut_request(1);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(LOW_LIGHT_M);
 }
 
 void do_action_for_7() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 1);
-  outdu_update_brightness(0);
-  update_ir_cut_filter_on();
+  commit_misc_env(LOWLIGHT_EIS_OFF_WDR_ON, 0, 0, 2, 1);
+  ir_led_request(IR_OFF, 0);
+  ir_cut_request(1);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(LOW_LIGHT_M);
 }
 
 void do_action_for_8() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 1);
-  outdu_update_brightness(0);
-  update_ir_cut_filter_on();
+  commit_misc_env(LOWLIGHT_EIS_ON_WDR_ON, 0, 0, 2, 1);
+  ir_led_request(IR_OFF, 0);
+  ir_cut_request(1);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(LOW_LIGHT_M);
 }
 
 void do_action_for_9() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 1);
-  outdu_update_brightness(MAX);
-  update_ir_cut_filter_on();
+  commit_misc_env(NIGHT_EIS_OFF_WDR_OFF, 0, 0, 2, 1);
+  ir_led_request(MAX, 0);
+  ir_cut_request(1);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(NIGHT_M);
 }
 
 void do_action_for_10() {
-  set_uboot_env(EIS, 1);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 1);
-  outdu_update_brightness(MAX);
-  update_ir_cut_filter_on();
+  commit_misc_env(NIGHT_EIS_ON_WDR_OFF, 1, 0, 2, 1);
+  ir_led_request(MAX, 0);
+  ir_cut_request(1);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(NIGHT_M);
 }
 
 void do_action_for_11() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 1);
-  set_uboot_env(STREAM1_RESOLUTION, 2);
-
-  set_uboot_env(IR_FILTER, 1);
-  outdu_update_brightness(MAX);
-  update_ir_cut_filter_on();
+  commit_misc_env(NIGHT_EIS_OFF_WDR_ON, 0, 1, 2, 1);
+  ir_led_request(MAX, 0);
+  ir_cut_request(1);
   stream_server_config_2k_on();
 
   start_wdr_eis_mode(NIGHT_M);
 }
 
 void do_action_for_12() {
-  set_uboot_env(EIS, 0);
-  set_uboot_env(WDR, 0);
-  set_uboot_env(STREAM1_RESOLUTION, 3);
-
-  set_uboot_env(IR_FILTER, 1);
-  outdu_update_brightness(MAX);
-  update_ir_cut_filter_on();
+  commit_misc_env(NIGHT_EIS_ON_WDR_ON, 0, 0, 3, 1);
+  ir_led_request(MAX, 0);
+  ir_cut_request(1);
   stream_server_config_4k_on();
 
   start_wdr_eis_mode(NIGHT_M);
@@ -350,27 +324,14 @@ void set_misc(uint8_t misc) {
   }
 
   if (misc == DAY_EIS_ON_WDR_ON || misc == NIGHT_EIS_ON_WDR_ON) {
-    if (is_running(SIGNALING_SERVER_PROCESS_NAME))
-      stop_process(SIGNALING_SERVER_PROCESS_NAME);
-    if (is_running(PORTABLE_RTC_PROCESS_NAME))
-      stop_process(PORTABLE_RTC_PROCESS_NAME);
-    set_uboot_env(WEBRTC_ENABLED, 0);
+    static const char *const webrtc[] = {SIGNALING_SERVER_PROCESS_NAME,
+                                         PORTABLE_RTC_PROCESS_NAME};
+    fw_proc_stop_all(webrtc, 2, FW_PROC_STOP_MS);
   }
 
-  if (is_running(STREAMER_PROCESS_NAME)) {
-    stop_process(STREAMER_PROCESS_NAME);
-
-    /* Non-blocking wait for streamer restart */
-    misc_sm_ctx_t sm;
-    misc_sm_init(&sm);
-
-    fw_sm_status_t sm_status;
-    do {
-      sm_status = misc_sm_step(&sm);
-      if (sm_status == FW_SM_RUNNING)
-        fw_sm_yield();
-    } while (sm_status == FW_SM_RUNNING);
-  }
+  /* Restarted by start.sh; wait until the new one serves */
+  if (is_running(STREAMER_PROCESS_NAME))
+    misc_sm_restart_streamer();
 }
 
 int8_t set_image_zoom(uint8_t image_zoom) {
@@ -379,7 +340,7 @@ int8_t set_image_zoom(uint8_t image_zoom) {
   int status;
 
   LOG_DEBUG("fw set_image_zoom %d\n", image_zoom);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
   switch (image_zoom) {
   case 1:
@@ -396,89 +357,113 @@ int8_t set_image_zoom(uint8_t image_zoom) {
     break;
   default:
     LOG_ERROR("Invalid option\n");
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&image_lock);
     return -1;
   }
 
+  if (config_unchanged_int(ZOOM, image_zoom)) {
+    pthread_rwlock_unlock(&image_lock);
+    return 0;
+  }
+
   set_uboot_env(ZOOM, image_zoom);
 
-  snprintf(command, sizeof(command), "streamer_msg_sender -C 0 -s 0 -z %s",
-           value);
-  status = system(command);
+  snprintf(command, sizeof(command), "-C 0 -s 0 -z %s", value);
+  status = fw_msg_request(&fw_msg_streamer, command, NULL, 0);
   if (status != 0) {
     LOG_ERROR("Command execution failed with status %d\n", status);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t set_image_rotation(uint8_t image_rotation) {
   LOG_DEBUG("fw set_image_rotation %d\n", image_rotation);
   (void)image_rotation;
-  pthread_mutex_lock(&lock);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t set_ir_cutfilter(OnOff on_off) {
   LOG_DEBUG("fw set_ir_cutfilter %d\n", on_off);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
-  if (on_off == ON) {
-    update_ir_cut_filter_on();
-  } else {
-    update_ir_cut_filter_off();
+  /* The filter is latching: ircut_filter is the last position driven */
+  if (config_unchanged_int(IR_FILTER, on_off == ON)) {
+    pthread_rwlock_unlock(&image_lock);
+    return 0;
   }
 
-  pthread_mutex_unlock(&lock);
+  /* Returns at once; the actuator ends the pulse (see ir_cut.h) */
+  ir_cut_request(on_off == ON);
+  set_uboot_env(IR_FILTER, on_off == ON);
+
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t set_ir_led_brightness(uint8_t brightness) {
   LOG_INFO("fw set_ir_led_brightness %d\n", brightness);
   uint8_t last_ir = 0;
+  int target = ir_led_target();
+
+  /* Until the debounced write, the actuator has the current level */
+  if (target == brightness) {
+    config_skip_account(IR);
+    return 0;
+  }
+  if (target < 0 && config_unchanged_int(IR, brightness))
+    return 0;
   get_ir_led_brightness(&last_ir);
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
-  outdu_update_brightness(brightness);
+  /* Returns once accepted; the ramp and the persist run on (see ir_led.h) */
+  if (ir_led_request(brightness, IR_LED_RAMP_MS) != 0) {
+    pthread_rwlock_unlock(&image_lock);
+    return -1;
+  }
 
   /* Notify after change */
   LOG_INFO("ir brightness changed: %u -> %u\n", last_ir, brightness);
   send_ir_event(last_ir, brightness);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t set_ir_temp_state(uint8_t state) {
   LOG_DEBUG("fw set_ir_temp_state %d\n", state);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
-  set_uboot_env(IR_TEMP_STATE, state);
+  if (!config_unchanged_int(IR_TEMP_STATE, state))
+    set_uboot_env(IR_TEMP_STATE, state);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t set_isp_temp_state(uint8_t state) {
   LOG_DEBUG("fw set_isp_temp_state %d\n", state);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
-  set_uboot_env(ISP_TEMP_STATE, state);
+  if (!config_unchanged_int(ISP_TEMP_STATE, state))
+    set_uboot_env(ISP_TEMP_STATE, state);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t set_day_mode(enum ON_OFF on_off) {
   LOG_DEBUG("fw set_day_night %d\n", on_off);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
-  set_uboot_env(DAY_MODE, on_off);
+  if (!config_unchanged_int(DAY_MODE, on_off))
+    set_uboot_env(DAY_MODE, on_off);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
@@ -488,25 +473,27 @@ int8_t set_gyro_reader(enum ON_OFF on_off)
 
   LOG_DEBUG("fw set_gyro_reader %d\n", on_off);
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
-  set_uboot_env(GYRO_READER, on_off);
+  if (!config_unchanged_int(GYRO_READER, on_off))
+    set_uboot_env(GYRO_READER, on_off);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
 
   return 0;
 }
 int8_t set_image_resolution(uint8_t resolution) {
   LOG_DEBUG("fw set_image_resolution %d\n", resolution);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
   if (resolution == 0 || resolution == 1) {
-    set_uboot_env(RESOLUTION, resolution);
+    if (!config_unchanged_int(RESOLUTION, resolution))
+      set_uboot_env(RESOLUTION, resolution);
   } else {
     LOG_ERROR("Invalid resolution value is selected Valid range: 0 to 1\n");
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 int8_t set_image_mirror(uint8_t mirror) {
@@ -514,13 +501,19 @@ int8_t set_image_mirror(uint8_t mirror) {
   char cmd[64];
 
   LOG_DEBUG("fw set_image_mirror %d\n", mirror);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
+
+  /* Unchanged: no write and no streamer round trip */
+  if ((mirror == 0 || mirror == 1) && config_unchanged_int(MIRROR, mirror)) {
+    pthread_rwlock_unlock(&image_lock);
+    return 0;
+  }
 
   if (mirror == 0 || mirror == 1) {
     set_uboot_env(MIRROR, mirror);
 
-    snprintf(cmd, sizeof(cmd), "streamer_msg_sender -C 2 --mirror %d", mirror);
-    result = system(cmd);
+    snprintf(cmd, sizeof(cmd), "-C 2 --mirror %d", mirror);
+    result = fw_msg_request(&fw_msg_streamer, cmd, NULL, 0);
     if (result != 0) {
       LOG_ERROR("Command failed with exit code %d\n", result);
     }
@@ -528,7 +521,7 @@ int8_t set_image_mirror(uint8_t mirror) {
     LOG_ERROR("Invalid mirror value is selected Valid range: 0 to 1\n");
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 int8_t set_image_flip(uint8_t flip) {
@@ -536,14 +529,20 @@ int8_t set_image_flip(uint8_t flip) {
   char cmd[64];
 
   LOG_DEBUG("fw set_image_flip %d\n", flip);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
+
+  /* Unchanged: no write and no streamer round trip */
+  if ((flip == 0 || flip == 1) && config_unchanged_int(FLIP, flip)) {
+    pthread_rwlock_unlock(&image_lock);
+    return 0;
+  }
 
   if (flip == 0 || flip == 1) {
 
     set_uboot_env(FLIP, flip);
 
-    snprintf(cmd, sizeof(cmd), "streamer_msg_sender -C 2 --flip %d", flip);
-    result = system(cmd);
+    snprintf(cmd, sizeof(cmd), "-C 2 --flip %d", flip);
+    result = fw_msg_request(&fw_msg_streamer, cmd, NULL, 0);
     if (result != 0) {
       LOG_ERROR("Command failed with exit code %d\n", result);
     }
@@ -551,42 +550,45 @@ int8_t set_image_flip(uint8_t flip) {
     LOG_ERROR("Invalid flip value is selected Valid range: 0 to 1\n");
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 int8_t set_image_tilt(uint8_t tilt) {
   LOG_DEBUG("fw set_image_tilt %d\n", tilt);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
   if (tilt <= 5) {
-    set_uboot_env(TILT, tilt);
+    if (!config_unchanged_int(TILT, tilt))
+      set_uboot_env(TILT, tilt);
   } else {
     LOG_ERROR("Invalid tilt value is selected Valid range: 0 to 5\n");
   }
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t set_image_wdr(uint8_t wdr) {
   LOG_DEBUG("fw set_image_wdr %d\n", wdr);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
   if (wdr == 1 || wdr == 0) {
-    set_uboot_env(WDR, wdr);
+    if (!config_unchanged_int(WDR, wdr))
+      set_uboot_env(WDR, wdr);
   } else {
     LOG_ERROR("Invalid wdr value\n");
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 int8_t set_image_eis(uint8_t eis) {
   LOG_DEBUG("fw set_image_eis %d\n", eis);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
 
-  set_uboot_env(EIS, eis);
+  if (!config_unchanged_int(EIS, eis))
+    set_uboot_env(EIS, eis);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
@@ -642,11 +644,14 @@ int8_t set_image_misc(uint8_t misc) {
   /* No-op if misc is unchanged */
   if (first_set_done && misc == last_misc) {
     LOG_DEBUG("set_image_misc: misc %u unchanged, skipping\n", misc);
+    config_skip_account(SET_MISC);
     return 0;
   }
 
   LOG_DEBUG("fw set_image_misc %d\n", misc);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&image_lock);
+  /* set_misc() stops WebRTC and restarts the streamer (see fw.h) */
+  pthread_rwlock_wrlock(&streaming_lock);
 
   char webrtc_enabled[64];
   uint8_t webrtc_en = 0;
@@ -658,7 +663,8 @@ int8_t set_image_misc(uint8_t misc) {
   if (webrtc_en == 1 &&
       (misc == DAY_EIS_ON_WDR_ON || misc == NIGHT_EIS_ON_WDR_ON)) {
     printf("[INFO] WebRTC is enabled. Cannot set misc to %d\n", misc);
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&streaming_lock);
+    pthread_rwlock_unlock(&image_lock);
     return -1;
   }
 
@@ -666,9 +672,9 @@ int8_t set_image_misc(uint8_t misc) {
   LOG_INFO("misc changed: %u -> %u\n", last_misc, misc);
   send_misc_event(last_misc, misc);
 
-  set_uboot_env(SET_MISC, misc);
   set_misc(misc);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&streaming_lock);
+  pthread_rwlock_unlock(&image_lock);
 
   /* Notify AFTER successful change */
   LOG_INFO("misc changed: %u -> %u\n", last_misc, misc);
@@ -679,92 +685,98 @@ int8_t set_image_misc(uint8_t misc) {
 }
 
 int8_t get_ir_led_brightness(uint8_t *brightness) {
-  pthread_mutex_lock(&lock);
+  int target = ir_led_target();
+
+  if (target >= 0) {
+    *brightness = (uint8_t)target;
+    return 0;
+  }
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_IR, brightness);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_ir_temp_state(uint8_t *ir_temp_state) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_IR_TEMP_STATE, ir_temp_state);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_isp_temp_state(uint8_t *isp_temp_state) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_ISP_TEMP_STATE, isp_temp_state);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_image_resolution(uint8_t *resolution) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_RESOLUTION, resolution);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_wdr(uint8_t *wdr) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_WDR, wdr);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_eis(uint8_t *eis) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_EIS, eis);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_flip(uint8_t *flip) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_FLIP, flip);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_mirror(uint8_t *mirror) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_MIRROR, mirror);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_image_zoom(uint8_t *zoom) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_ZOOM, zoom);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_day_mode(uint8_t *day_mode) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_DAY_MODE, day_mode);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_gyro_reader(uint8_t *gyro_reader) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_GYRO_READER, gyro_reader);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_image_misc(uint8_t *misc) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
   EXEC_GET_UINT8(GET_MISC, misc);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
 
 int8_t get_ir_cutfilter(OnOff *on_off) {
   uint8_t value;
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&image_lock);
 
   value = get_ir_cut_filter();
 
@@ -774,6 +786,6 @@ int8_t get_ir_cutfilter(OnOff *on_off) {
     *on_off = ON;
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&image_lock);
   return 0;
 }
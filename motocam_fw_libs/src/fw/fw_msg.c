@@ -0,0 +1,114 @@
+#include "fw/fw_msg.h"
+#include "log.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MSG_MAX 256
+
+fw_msg_client_t fw_msg_streamer =
+    FW_MSG_CLIENT_INIT(STREAMER_MSG_SOCK, "streamer_msg_sender");
+fw_msg_client_t fw_msg_asc = FW_MSG_CLIENT_INIT(ASC_MSG_SOCK, "asc_msg_sender");
+
+static void close_locked(fw_msg_client_t *c) {
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+}
+
+static int connect_locked(fw_msg_client_t *c) {
+  struct sockaddr_un addr;
+
+  if (c->fd >= 0)
+    return 0;
+
+  c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (c->fd < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", c->path);
+  if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close_locked(c);
+    return -1;
+  }
+  return 0;
+}
+
+// One round trip on the open connection: -1 if the request was not
+// delivered, -2 if it was but no reply came back
+static int exchange_locked(fw_msg_client_t *c, const char *args, char *msg) {
+  struct pollfd p = {.fd = c->fd, .events = POLLIN};
+  ssize_t n;
+
+  if (send(c->fd, args, strlen(args), MSG_NOSIGNAL) < 0)
+    return -1;
+  if (poll(&p, 1, FW_MSG_TIMEOUT_MS) <= 0) {
+    LOG_ERROR("no reply from %s to %s", c->path, args);
+    return -2;
+  }
+  n = recv(c->fd, msg, MSG_MAX - 1, 0);
+  if (n <= 0) { // the daemon went away, maybe after acting on it
+    LOG_ERROR("%s closed before replying to %s", c->path, args);
+    return -2;
+  }
+  msg[n] = '\0';
+  return 0;
+}
+
+int fw_msg_request(fw_msg_client_t *c, const char *args, char *reply,
+                   size_t reply_size) {
+  char msg[MSG_MAX], cmd[MSG_MAX + 64];
+  int status;
+
+  if (reply && reply_size)
+    reply[0] = '\0';
+
+  pthread_mutex_lock(&c->lock);
+  // A connection left over from before a daemon restart fails once
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (connect_locked(c) != 0)
+      break;
+    int ret = exchange_locked(c, args, msg);
+    if (ret == -2) {
+      // Sent once is enough: a resend or the CLI could run it again
+      close_locked(c);
+      pthread_mutex_unlock(&c->lock);
+      return -1;
+    }
+    if (ret == 0) {
+      char *data = NULL;
+
+      status = (int)strtol(msg, &data, 10);
+      while (*data == ' ')
+        data++;
+      if (reply && reply_size)
+        snprintf(reply, reply_size, "%s", data);
+      c->sent++;
+      pthread_mutex_unlock(&c->lock);
+      return status;
+    }
+    close_locked(c);
+  }
+  c->via_cli++;
+  pthread_mutex_unlock(&c->lock);
+
+  snprintf(cmd, sizeof(cmd), "%s %s", c->cli, args);
+  status = system(cmd);
+  if (status != 0)
+    LOG_ERROR("%s failed with status %d", cmd, status);
+  return status;
+}
+
+void fw_msg_close(fw_msg_client_t *c) {
+  pthread_mutex_lock(&c->lock);
+  close_locked(c);
+  pthread_mutex_unlock(&c->lock);
+}
@@ -1,4 +1,5 @@
 #include "fw/fw_network.h"
+#include "fw/fw_config.h"
 #include "fw/fw_state_machine.h"
 #define SET_WIFI "/mnt/flash/vienna/scripts/network/start_wifi.sh"
 #define SET_ETHERNET_IPADDRESS                                                 \
@@ -36,6 +37,20 @@
 
 static int check_wifi_status_with_retry(void);
 
+/* 1 when wifi is already up in mode (1 hotspot, 2 client) with these keys */
+static int wifi_unchanged(const char *name, int mode, const char *const *keys,
+                          const char *const *values, int count) {
+  if (!config_value_equals_int("wifi_state", mode) ||
+      !config_value_equals_int("wifi_runtime_result", 0))
+    return 0;
+  for (int i = 0; i < count; i++) {
+    if (!config_value_equals(keys[i], values[i]))
+      return 0;
+  }
+  config_skip_account(name);
+  return 1;
+}
+
 int8_t get_wifi_hotspot_config(char *ssid, uint8_t *encryption_type,
                                char *encryption_key, char *ip_address,
                                char *subnetmask) {
@@ -45,7 +60,7 @@ int8_t get_wifi_hotspot_config(char *ssid, uint8_t *encryption_type,
   char output_ip_address[64];
   char output_subnetmask[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&network_lock);
 
   if (exec_cmd(GET_WIFI_HOTSPOT_SSID, output_ssid, sizeof(output_ssid)) == 0) {
     snprintf(ssid, 32, "%s", output_ssid);
@@ -71,7 +86,7 @@ int8_t get_wifi_hotspot_config(char *ssid, uint8_t *encryption_type,
     snprintf(subnetmask, 16, "%s", output_subnetmask);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
@@ -83,7 +98,17 @@ int8_t set_wifi_client_config(const char *ssid, const uint8_t encryption_type,
          "ipaddress=%s, subnetmask=%s \n",
          ssid, encryption_type, encryption_key, ip_address, subnetmask);
 
-  pthread_mutex_lock(&lock);
+  const char *const keys[] = {"client_dhcp", "client_ssid",
+                              "client_encryption_key", "client_ipaddress",
+                              "client_subnetmask"};
+  const char *const values[] = {"0", ssid, encryption_key, ip_address,
+                                subnetmask};
+
+  pthread_rwlock_wrlock(&network_lock);
+  if (wifi_unchanged("wifi_client", 2, keys, values, 5)) {
+    pthread_rwlock_unlock(&network_lock);
+    return 0;
+  }
   set_uboot_env("wifi_runtime_result", 3); // 3 means in progress
 
   char cmd[500];
@@ -93,20 +118,25 @@ int8_t set_wifi_client_config(const char *ssid, const uint8_t encryption_type,
   char background_cmd[600];
   snprintf(background_cmd, sizeof(background_cmd),
            "%s < /dev/null > /dev/null 2>&1 &", cmd);
+  config_store_mirror(); // the script reads the settings from their files
   system(background_cmd);
   if (check_wifi_status_with_retry() != 1) {
     printf("WiFi Client mode setup failed\n");
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&network_lock);
 
     return -1;
   }
 
-  set_uboot_env_chars("client_ssid", ssid);
-  set_uboot_env_chars("client_encryption_key", encryption_key);
-  set_uboot_env_chars("client_ipaddress", ip_address);
-  set_uboot_env_chars("client_subnetmask", subnetmask);
+  config_txn_t txn;
+  config_txn_begin(&txn);
+  config_txn_set(&txn, "client_dhcp", "0");
+  config_txn_set(&txn, "client_ssid", ssid);
+  config_txn_set(&txn, "client_encryption_key", encryption_key);
+  config_txn_set(&txn, "client_ipaddress", ip_address);
+  config_txn_set(&txn, "client_subnetmask", subnetmask);
+  config_txn_commit(&txn);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 int8_t set_wifi_dhcp_client_config(const char *ssid,
@@ -115,7 +145,16 @@ int8_t set_wifi_dhcp_client_config(const char *ssid,
 
   printf("set_WifiClient_l2 ssid=%s, encryption_type=%d, encryption_key=%s \n",
          ssid, encryption_type, encryption_key);
-  pthread_mutex_lock(&lock);
+
+  const char *const keys[] = {"client_dhcp", "client_ssid",
+                              "client_encryption_key"};
+  const char *const values[] = {"1", ssid, encryption_key};
+
+  pthread_rwlock_wrlock(&network_lock);
+  if (wifi_unchanged("wifi_dhcp_client", 2, keys, values, 3)) {
+    pthread_rwlock_unlock(&network_lock);
+    return 0;
+  }
   set_uboot_env("wifi_runtime_result", 3); // 3 means in progress
 
   char cmd[500];
@@ -127,16 +166,21 @@ int8_t set_wifi_dhcp_client_config(const char *ssid,
   snprintf(background_cmd, sizeof(background_cmd),
            "%s < /dev/null > /dev/null 2>&1 &", cmd);
   printf("dhcp  command:%s\n", cmd);
+  config_store_mirror(); // the script reads the settings from their files
   system(background_cmd);
   if (check_wifi_status_with_retry() != 1) {
     printf("WiFi AP mode setup failed\n");
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&network_lock);
 
     return -1;
   }
-  set_uboot_env_chars("client_ssid", ssid);
-  set_uboot_env_chars("client_encryption_key", encryption_key);
-  pthread_mutex_unlock(&lock);
+  config_txn_t txn;
+  config_txn_begin(&txn);
+  config_txn_set(&txn, "client_dhcp", "1");
+  config_txn_set(&txn, "client_ssid", ssid);
+  config_txn_set(&txn, "client_encryption_key", encryption_key);
+  config_txn_commit(&txn);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
@@ -149,7 +193,7 @@ int8_t get_wifi_client_config(char *ssid, uint8_t *encryption_type,
   char output_ip_address[64];
   char output_subnetmask[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&network_lock);
 
   if (exec_cmd(GET_WIFI_CLIENT_SSID, output_ssid, sizeof(output_ssid)) == 0) {
     snprintf(ssid, 32, "%s", output_ssid);
@@ -175,21 +219,21 @@ int8_t get_wifi_client_config(char *ssid, uint8_t *encryption_type,
     snprintf(subnetmask, 16, "%s", output_subnetmask);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
 int8_t get_wifi_state(uint8_t *state) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&network_lock);
 
   if (exec_cmd(GET_WIFI_STATE, output, sizeof(output)) == 0) {
     printf("get_wifi_state %s\n", output);
     *state = (uint8_t)atoi(output);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
 
   printf("get_wifi_state %d\n", state[0]);
   return 0;
@@ -199,12 +243,12 @@ int8_t get_onvif_interface_state(uint8_t *interface) {
   char cmd[500];
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&network_lock);
 
   snprintf(cmd, sizeof(cmd), "cat %s", ONVIF_INTERFACE_STATE_FILE);
 
   if (exec_cmd(cmd, output, sizeof(output)) != 0) {
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&network_lock);
     return -1;
   }
 
@@ -225,18 +269,18 @@ int8_t get_onvif_interface_state(uint8_t *interface) {
     *interface = 1;
   } else {
     LOG_DEBUG("invalid onvif interface option %d", *interface);
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&network_lock);
     return -1;
   }
   printf("get_onvif_interface_state %d\n", interface[0]);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
 int8_t get_wifi_hotspot_ipaddress(char *ip_address) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&network_lock);
 
   if (exec_cmd(GET_WIFI_HOTSPOT_IPADDRESS, output, sizeof(output)) == 0) {
     /* trim trailing newline */
@@ -247,14 +291,14 @@ int8_t get_wifi_hotspot_ipaddress(char *ip_address) {
     snprintf(ip_address, 16, "%s", output);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
 int8_t get_wifi_client_ipaddress(char *ip_address) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&network_lock);
 
   if (exec_cmd(GET_WIFI_CLIENT_IPADDRESS, output, sizeof(output)) == 0) {
     /* trim trailing newline */
@@ -265,14 +309,14 @@ int8_t get_wifi_client_ipaddress(char *ip_address) {
     snprintf(ip_address, 16, "%s", output);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
 int8_t get_eth_ipaddress(char *ip_address) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&network_lock);
 
   if (exec_cmd(GET_ETHERNET_IPADDRESS, output, sizeof(output)) == 0) {
     /* trim trailing newline */
@@ -283,7 +327,7 @@ int8_t get_eth_ipaddress(char *ip_address) {
     snprintf(ip_address, 16, "%s", output);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
@@ -293,28 +337,34 @@ int8_t set_ethernet_ip_address(const char *ip_address, const char *subnetmask) {
 
   printf("fw set_ethernet_ip_address %s\n", ip_address);
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&network_lock);
+
+  if (config_unchanged("current_eth_ip", ip_address)) {
+    pthread_rwlock_unlock(&network_lock);
+    return 0;
+  }
 
   snprintf(cmd, sizeof(cmd), "%s %s ", SET_ETHERNET_IPADDRESS, ip_address);
 
   (void)subnetmask; /* unused, kept for API compatibility */
   exec_cmd(cmd, dummy, sizeof(dummy));
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
 int8_t set_ethernet_dhcp_config() {
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&network_lock);
   char cmd[500];
   sprintf(cmd, "%s", SET_ETHERNET_IPADDRESS);
   char background_cmd[600];
   snprintf(background_cmd, sizeof(background_cmd),
            "%s < /dev/null > /dev/null 2>&1 &", cmd);
+  config_store_mirror(); // the script reads the settings from their files
   system(background_cmd);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
@@ -326,19 +376,22 @@ int8_t set_onvif_interface(const uint8_t interface) {
     return -4;
   }
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&network_lock);
+
+  /* Skip the 3 s server restart when it already serves this interface */
+  if (config_value_equals("onvif_itrf", interface == 0 ? "eth" : "wifi") &&
+      is_running(ONVIF_SERVER_PROCESS_NAME)) {
+    config_skip_account("onvif_itrf");
+    pthread_rwlock_unlock(&network_lock);
+    return 0;
+  }
 
   onvif_sm_ctx_t sm;
   onvif_sm_init(&sm, interface);
 
-  fw_sm_status_t status;
-  do {
-    status = onvif_sm_step(&sm);
-    if (status == FW_SM_RUNNING)
-      fw_sm_yield();
-  } while (status == FW_SM_RUNNING);
+  fw_sm_status_t status = onvif_sm_run(&sm);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
 
   if (status == FW_SM_DONE_FAIL)
     return -3;
@@ -351,7 +404,16 @@ int8_t set_wifi_hotspot_config(const char *ssid, const uint8_t encryption_type,
                                const char *ip_address, const char *subnetmask) {
 
   printf("fw set_wifi_hotspot %s %s\n", ssid, ip_address);
-  pthread_mutex_lock(&lock);
+
+  const char *const keys[] = {"hotspot_ssid", "hotspot_encryption_key",
+                              "hotspot_ipaddress", "hotspot_subnetmask"};
+  const char *const values[] = {ssid, encryption_key, ip_address, subnetmask};
+
+  pthread_rwlock_wrlock(&network_lock);
+  if (wifi_unchanged("wifi_hotspot", 1, keys, values, 4)) {
+    pthread_rwlock_unlock(&network_lock);
+    return 0;
+  }
 
   set_uboot_env("wifi_runtime_result", 3); // 3 means in progress
 
@@ -364,22 +426,26 @@ int8_t set_wifi_hotspot_config(const char *ssid, const uint8_t encryption_type,
 
   printf("---------cmd: %s\n", cmd);
 
-  set_uboot_env_chars("hotspot_ssid", ssid);
-  set_uboot_env_chars("hotspot_encryption_key", encryption_key);
-  set_uboot_env_chars("hotspot_ipaddress", ip_address);
-  set_uboot_env_chars("hotspot_subnetmask", subnetmask);
+  config_txn_t txn;
+  config_txn_begin(&txn);
+  config_txn_set(&txn, "hotspot_ssid", ssid);
+  config_txn_set(&txn, "hotspot_encryption_key", encryption_key);
+  config_txn_set(&txn, "hotspot_ipaddress", ip_address);
+  config_txn_set(&txn, "hotspot_subnetmask", subnetmask);
+  config_txn_commit(&txn);
 
   char background_cmd[600];
   snprintf(background_cmd, sizeof(background_cmd),
            "%s < /dev/null > /dev/null 2>&1 &", cmd);
+  config_store_mirror(); // the script reads the settings from their files
   system(background_cmd);
   if (check_wifi_status_with_retry() != 1) {
     printf("WiFi AP mode setup failed\n");
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&network_lock);
 
     return -1;
   }
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&network_lock);
   return 0;
 }
 
@@ -419,12 +485,7 @@ static int check_wifi_status_with_retry(void) {
   wifi_sm_ctx_t sm;
   wifi_sm_init(&sm, 20);
 
-  fw_sm_status_t status;
-  do {
-    status = wifi_sm_step(&sm);
-    if (status == FW_SM_RUNNING)
-      fw_sm_yield();
-  } while (status == FW_SM_RUNNING);
+  fw_sm_status_t status = wifi_sm_run(&sm);
 
   return (status == FW_SM_DONE_OK) ? 1 : 0;
 }
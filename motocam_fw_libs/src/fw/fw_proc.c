@@ -0,0 +1,385 @@
+#include "fw/fw_proc.h"
+#include "fw/fw_clock.h"
+#include "log.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef PROC_PATH
+#define PROC_PATH "/proc"
+#endif
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+#define PROC_TARGETS 32  // processes stopped at once
+#define PROC_POLL_MS 10  // exit polling without pidfds
+#define PROC_KILL_MS 500 // wait for SIGKILL to land
+#define COMM_LEN 15      // the kernel keeps this much of a process name
+
+extern char **environ;
+
+typedef struct {
+  pid_t pid;
+  int pidfd; // -1 without pidfds
+  int child; // spawned here: reap with waitpid()
+  int gone;
+} target_t;
+
+typedef struct {
+  char name[32];
+  target_t t; // t.pid 0: free slot
+} managed_t;
+
+static pthread_mutex_t proc_lock = PTHREAD_MUTEX_INITIALIZER;
+static managed_t managed[FW_PROC_MAX];
+
+static int pidfd_open_pid(pid_t pid) {
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void signal_target(const target_t *t, int sig) {
+  if (t->pidfd >= 0 &&
+      (syscall(SYS_pidfd_send_signal, t->pidfd, sig, NULL, 0) == 0 ||
+       errno != ENOSYS))
+    return;
+  kill(t->pid, sig);
+}
+
+// 1 once the target has exited; our own children are reaped here
+static int target_gone(target_t *t) {
+  if (t->gone)
+    return 1;
+
+  if (t->pidfd >= 0) {
+    struct pollfd p = {.fd = t->pidfd, .events = POLLIN};
+    t->gone = poll(&p, 1, 0) > 0;
+    if (t->gone && t->child)
+      waitpid(t->pid, NULL, WNOHANG);
+  } else if (t->child) {
+    // -1 (ECHILD) when someone else reaped it
+    t->gone = waitpid(t->pid, NULL, WNOHANG) != 0;
+  } else {
+    t->gone = kill(t->pid, 0) != 0 && errno == ESRCH;
+  }
+  return t->gone;
+}
+
+// Wait until every target has exited or the deadline passes; returns how
+// many are left
+static int wait_exits(target_t *t, int n, uint64_t deadline) {
+  struct pollfd pfds[PROC_TARGETS];
+
+  for (;;) {
+    int left = 0, np = 0, blind = 0;
+    uint64_t now;
+
+    for (int i = 0; i < n; i++) {
+      if (target_gone(&t[i]))
+        continue;
+      left++;
+      if (t[i].pidfd >= 0) {
+        pfds[np].fd = t[i].pidfd;
+        pfds[np].events = POLLIN;
+        np++;
+      } else {
+        blind = 1;
+      }
+    }
+
+    now = fw_clock_now_ms();
+    if (!left || now >= deadline)
+      return left;
+
+    if (blind || fw_clock_is_virtual()) {
+      fw_clock_sleep_ms(deadline - now < PROC_POLL_MS
+                            ? (uint32_t)(deadline - now)
+                            : PROC_POLL_MS);
+    } else if (poll(pfds, np, (int)(deadline - now)) < 0 && errno != EINTR) {
+      LOG_ERROR("proc: poll failed: %s", strerror(errno));
+      return left;
+    }
+  }
+}
+
+static int read_comm(const char *pid, char *comm, size_t size) {
+  char path[64];
+  FILE *fp;
+
+  snprintf(path, sizeof(path), PROC_PATH "/%s/comm", pid);
+  fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  if (!fgets(comm, (int)size, fp)) {
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  comm[strcspn(comm, "\n")] = '\0';
+  return 0;
+}
+
+// The kernel truncates comm, so long names match on their first COMM_LEN
+static int comm_is(const char *comm, const char *name) {
+  size_t len = strlen(name);
+
+  if (len > COMM_LEN)
+    len = COMM_LEN;
+  return strncmp(comm, name, len) == 0 && comm[len] == '\0';
+}
+
+static int comm_is_any(const char *comm, const char *const *names,
+                       int count) {
+  for (int i = 0; i < count; i++) {
+    if (names[i] && *names[i] && comm_is(comm, names[i]))
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * One pass over PROC_PATH for processes called names[i]: with exact, whose
+ * comm is the name (as killall matches), else whose argv[0] contains it.
+ * Collects up to max pids and returns how many matched; with max 0 it stops
+ * at the first match.
+ */
+static int scan(const char *const *names, int count, int exact, pid_t *pids,
+                int max) {
+  DIR *proc;
+  struct dirent *ent;
+  char path[512];
+  char cmdline[512];
+  int matched = 0;
+
+  proc = opendir(PROC_PATH);
+  if (!proc)
+    return 0;
+
+  while ((ent = readdir(proc)) != NULL) {
+    int hit = 0;
+
+    if (!isdigit((unsigned char)ent->d_name[0]))
+      continue;
+
+    if (exact) {
+      hit = read_comm(ent->d_name, cmdline, sizeof(cmdline)) == 0 &&
+            comm_is_any(cmdline, names, count);
+    } else {
+      snprintf(path, sizeof(path), PROC_PATH "/%s/cmdline", ent->d_name);
+
+      FILE *fp = fopen(path, "r");
+      if (!fp)
+        continue;
+
+      size_t n = fread(cmdline, 1, sizeof(cmdline) - 1, fp);
+      fclose(fp);
+
+      if (n == 0)
+        continue;
+
+      cmdline[n] = '\0';
+
+      /* cmdline is NUL-separated; first string is argv[0] */
+      for (int i = 0; i < count && !hit; i++)
+        hit = names[i] && *names[i] && strstr(cmdline, names[i]) != NULL;
+    }
+
+    if (!hit)
+      continue;
+    pid_t pid = (pid_t)atoi(ent->d_name);
+    if (pid == getpid())
+      continue;
+    if (matched < max)
+      pids[matched] = pid;
+    matched++;
+    if (max == 0)
+      break;
+  }
+
+  closedir(proc);
+  return matched;
+}
+
+// Forget managed daemons that exited, reaping them
+static void reap_locked(void) {
+  for (int i = 0; i < FW_PROC_MAX; i++) {
+    target_t *t = &managed[i].t;
+    if (t->pid > 0 && target_gone(t)) {
+      if (t->pidfd >= 0)
+        close(t->pidfd);
+      memset(&managed[i], 0, sizeof(managed[i]));
+    }
+  }
+}
+
+static int find_locked(const char *name) {
+  for (int i = 0; i < FW_PROC_MAX; i++) {
+    if (managed[i].t.pid > 0 && strcmp(managed[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+int fw_proc_running(const char *name) {
+  int managed_hit;
+
+  if (!name || *name == '\0')
+    return 0;
+
+  pthread_mutex_lock(&proc_lock);
+  reap_locked();
+  managed_hit = find_locked(name) >= 0;
+  pthread_mutex_unlock(&proc_lock);
+
+  return managed_hit || scan(&name, 1, 0, NULL, 0) > 0;
+}
+
+int fw_proc_start(const char *name) {
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  sigset_t none, all;
+  char *argv[2];
+  pid_t pid;
+  int err, slot = -1;
+
+  if (!name || *name == '\0' || strlen(name) >= sizeof(managed[0].name))
+    return -1;
+
+  pthread_mutex_lock(&proc_lock);
+  reap_locked();
+  if (find_locked(name) >= 0 || scan(&name, 1, 0, NULL, 0) > 0) {
+    pthread_mutex_unlock(&proc_lock);
+    return 1;
+  }
+  for (int i = 0; i < FW_PROC_MAX && slot < 0; i++) {
+    if (managed[i].t.pid == 0)
+      slot = i;
+  }
+  if (slot < 0) {
+    pthread_mutex_unlock(&proc_lock);
+    LOG_ERROR("proc: no slot left for %s", name);
+    return -1;
+  }
+
+  // Detached like "name < /dev/null > /dev/null 2>&1 &" used to be
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&fa, 1, 2);
+  posix_spawnattr_init(&attr);
+  sigemptyset(&none);
+  sigfillset(&all);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &all);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                      POSIX_SPAWN_SETSIGDEF |
+                                      POSIX_SPAWN_SETPGROUP);
+
+  argv[0] = (char *)name;
+  argv[1] = NULL;
+  err = posix_spawnp(&pid, name, &fa, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+
+  if (err != 0) {
+    pthread_mutex_unlock(&proc_lock);
+    LOG_ERROR("proc: cannot spawn %s: %s", name, strerror(err));
+    return -1;
+  }
+
+  strcpy(managed[slot].name, name);
+  managed[slot].t.pid = pid;
+  managed[slot].t.pidfd = pidfd_open_pid(pid);
+  managed[slot].t.child = 1;
+  managed[slot].t.gone = 0;
+  pthread_mutex_unlock(&proc_lock);
+  return 0;
+}
+
+int fw_proc_stop_all(const char *const *names, int count, int timeout_ms) {
+  target_t t[PROC_TARGETS];
+  pid_t pids[PROC_TARGETS];
+  char comm[64], pid_str[16];
+  int n = 0, found, left;
+
+  if (!names || count <= 0)
+    return 0;
+
+  // Our own daemons change hands: from here on they are only targets
+  pthread_mutex_lock(&proc_lock);
+  reap_locked();
+  for (int i = 0; i < FW_PROC_MAX && n < PROC_TARGETS; i++) {
+    for (int j = 0; j < count; j++) {
+      if (managed[i].t.pid > 0 && names[j] &&
+          strcmp(managed[i].name, names[j]) == 0) {
+        t[n++] = managed[i].t;
+        memset(&managed[i], 0, sizeof(managed[i]));
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&proc_lock);
+
+  found = scan(names, count, 1, pids, PROC_TARGETS);
+  for (int k = 0; k < found && k < PROC_TARGETS && n < PROC_TARGETS; k++) {
+    int known = 0;
+    for (int i = 0; i < n; i++)
+      known |= t[i].pid == pids[k];
+    if (known)
+      continue;
+
+    // Pin the pid, then make sure it is still the process we matched
+    target_t x = {.pid = pids[k], .pidfd = pidfd_open_pid(pids[k])};
+    snprintf(pid_str, sizeof(pid_str), "%d", (int)pids[k]);
+    if ((x.pidfd < 0 && errno != ENOSYS) ||
+        read_comm(pid_str, comm, sizeof(comm)) != 0 ||
+        !comm_is_any(comm, names, count)) {
+      if (x.pidfd >= 0)
+        close(x.pidfd);
+      continue;
+    }
+    t[n++] = x;
+  }
+
+  for (int i = 0; i < n; i++)
+    signal_target(&t[i], SIGTERM);
+  left = wait_exits(t, n, fw_clock_now_ms() + (uint64_t)timeout_ms);
+
+  if (left) {
+    for (int i = 0; i < n; i++) {
+      if (!t[i].gone) {
+        LOG_ERROR("proc: %d ignored SIGTERM, killing it", (int)t[i].pid);
+        signal_target(&t[i], SIGKILL);
+      }
+    }
+    left = wait_exits(t, n, fw_clock_now_ms() + PROC_KILL_MS);
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (t[i].pidfd >= 0)
+      close(t[i].pidfd);
+  }
+  return left ? -1 : 0;
+}
+
+int fw_proc_stop(const char *name, int timeout_ms) {
+  return fw_proc_stop_all(&name, 1, timeout_ms);
+}
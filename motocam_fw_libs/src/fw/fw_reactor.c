@@ -0,0 +1,330 @@
+#include "fw/fw_reactor.h"
+#include "fw/fw_clock.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RX_EVENTS 8
+
+static struct {
+  pthread_mutex_t mu;    // instance list and statuses
+  pthread_mutex_t drive; // held by whoever runs the loop
+  pthread_cond_t changed; // an instance stepped or the loop was released
+  int epfd, tfd, wakefd;
+  unsigned pass;
+  fw_sm_instance_t *head;
+  fw_sm_instance_t *stepping; // instance whose step is running
+} rx = {.mu = PTHREAD_MUTEX_INITIALIZER,
+        .drive = PTHREAD_MUTEX_INITIALIZER,
+        .epfd = -1, .tfd = -1, .wakefd = -1};
+
+static pthread_once_t rx_once = PTHREAD_ONCE_INIT;
+
+static void watch(int fd, void *ptr) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = ptr;
+  if (epoll_ctl(rx.epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    LOG_ERROR("reactor: cannot watch fd %d: %s", fd, strerror(errno));
+}
+
+static void wake(void) {
+  uint64_t one = 1;
+
+  if (rx.wakefd >= 0 && write(rx.wakefd, &one, sizeof(one)) < 0 &&
+      errno != EAGAIN)
+    LOG_ERROR("reactor: wake failed: %s", strerror(errno));
+}
+
+static void *reactor_thread(void *arg) {
+  (void)arg;
+  for (;;)
+    fw_reactor_run_once(-1);
+  return NULL;
+}
+
+static void rx_init(void) {
+  pthread_condattr_t cattr;
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&rx.changed, &cattr);
+  pthread_condattr_destroy(&cattr);
+
+  rx.epfd = epoll_create1(EPOLL_CLOEXEC);
+  rx.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  rx.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (rx.epfd < 0 || rx.tfd < 0 || rx.wakefd < 0) {
+    LOG_ERROR("reactor: no epoll/timerfd (%s), falling back to polling",
+              strerror(errno));
+    return;
+  }
+  watch(rx.tfd, &rx.tfd);
+  watch(rx.wakefd, &rx.wakefd);
+
+  // Without the thread, fw_reactor_wait() callers run the loop themselves
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, reactor_thread, NULL) != 0)
+    LOG_ERROR("reactor: no thread");
+  pthread_attr_destroy(&attr);
+}
+
+static void unlink_locked(fw_sm_instance_t *m) {
+  for (fw_sm_instance_t **p = &rx.head; *p; p = &(*p)->next) {
+    if (*p == m) {
+      *p = m->next;
+      break;
+    }
+  }
+  if (m->fd >= 0 && rx.epfd >= 0)
+    epoll_ctl(rx.epfd, EPOLL_CTL_DEL, m->fd, NULL);
+}
+
+// When a machine that just stepped wants to be stepped again
+static uint64_t next_due(const fw_sm_instance_t *m, uint64_t now) {
+  if (m->timer) {
+    uint64_t deadline = fw_sm_timer_deadline_ms(m->timer);
+    if (deadline > now)
+      return deadline;
+  }
+  return m->fd >= 0 ? UINT64_MAX : now + FW_SM_POLL_MS;
+}
+
+static uint64_t next_due_locked(void) {
+  uint64_t due = UINT64_MAX;
+
+  for (fw_sm_instance_t *m = rx.head; m; m = m->next) {
+    if (m->ready)
+      return 0;
+    if (m->due_ms < due)
+      due = m->due_ms;
+  }
+  return due;
+}
+
+// Step each due instance once
+static int step_due(void) {
+  fw_sm_instance_t *m;
+  fw_sm_status_t status;
+  int steps = 0;
+
+  pthread_mutex_lock(&rx.mu);
+  unsigned pass = ++rx.pass;
+  for (;;) {
+    uint64_t now = fw_clock_now_ms();
+    for (m = rx.head; m; m = m->next) {
+      if (m->pass != pass && (m->ready || m->due_ms <= now))
+        break;
+    }
+    if (!m)
+      break;
+    m->pass = pass;
+    m->ready = 0;
+    rx.stepping = m;
+    pthread_mutex_unlock(&rx.mu);
+
+    status = m->step(m->ctx);
+    steps++;
+
+    pthread_mutex_lock(&rx.mu);
+    rx.stepping = NULL;
+    if (status == FW_SM_RUNNING) {
+      m->due_ms = next_due(m, fw_clock_now_ms());
+    } else {
+      unlink_locked(m);
+      m->status = status;
+    }
+    pthread_cond_broadcast(&rx.changed);
+  }
+  pthread_mutex_unlock(&rx.mu);
+  return steps;
+}
+
+// Wait for the timer, an fd or a wake-up; called with drive held
+static void wait_events(uint64_t due, int timeout_ms) {
+  struct epoll_event evs[RX_EVENTS];
+  struct itimerspec its;
+  uint64_t now = fw_clock_now_ms(), count;
+  int n;
+
+  if (rx.epfd < 0) {
+    if (timeout_ms != 0)
+      fw_clock_sleep_ms(FW_SM_POLL_MS);
+    return;
+  }
+
+  if (fw_clock_is_virtual() && due != UINT64_MAX && timeout_ms != 0) {
+    // The deadline is on a replaced clock: sleep on it, then only poll fds
+    uint64_t ms = due > now ? due - now : 0;
+    if (timeout_ms > 0 && ms > (uint64_t)timeout_ms)
+      ms = (uint64_t)timeout_ms;
+    fw_clock_sleep_ms((uint32_t)ms);
+    timeout_ms = 0;
+  }
+
+  memset(&its, 0, sizeof(its));
+  if (due != UINT64_MAX && timeout_ms != 0) {
+    uint64_t ms = due > now ? due - now : 0;
+    its.it_value.tv_sec = (time_t)(ms / 1000u);
+    its.it_value.tv_nsec = (long)(ms % 1000u) * 1000000L + 1;
+  }
+  timerfd_settime(rx.tfd, 0, &its, NULL);
+
+  n = epoll_wait(rx.epfd, evs, RX_EVENTS, timeout_ms);
+  if (n < 0 && errno != EINTR)
+    LOG_ERROR("reactor: epoll_wait failed: %s", strerror(errno));
+
+  pthread_mutex_lock(&rx.mu);
+  for (int i = 0; i < n; i++) {
+    if (evs[i].data.ptr == &rx.tfd) {
+      if (read(rx.tfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG_ERROR("reactor: timerfd read failed");
+    } else if (evs[i].data.ptr == &rx.wakefd) {
+      if (read(rx.wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        LOG_ERROR("reactor: eventfd read failed");
+    } else {
+      // Skip instances cancelled since epoll_wait() returned
+      for (fw_sm_instance_t *m = rx.head; m; m = m->next) {
+        if (m == evs[i].data.ptr)
+          m->ready = 1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&rx.mu);
+}
+
+// One round of the loop; called with drive held
+static int drive_locked(int timeout_ms) {
+  pthread_mutex_lock(&rx.mu);
+  uint64_t due = next_due_locked();
+  pthread_mutex_unlock(&rx.mu);
+
+  wait_events(due, due <= fw_clock_now_ms() ? 0 : timeout_ms);
+  return step_due();
+}
+
+static void release_drive(void) {
+  pthread_mutex_unlock(&rx.drive);
+  pthread_mutex_lock(&rx.mu);
+  pthread_cond_broadcast(&rx.changed);
+  pthread_mutex_unlock(&rx.mu);
+}
+
+void fw_sm_instance_init(fw_sm_instance_t *m, fw_sm_step_fn step, void *ctx,
+                         const fw_sm_timer_t *timer, int fd) {
+  memset(m, 0, sizeof(*m));
+  m->step = step;
+  m->ctx = ctx;
+  m->timer = timer;
+  m->fd = fd;
+  m->status = FW_SM_IDLE;
+}
+
+int fw_reactor_add(fw_sm_instance_t *m) {
+  pthread_once(&rx_once, rx_init);
+
+  if (m->fd >= 0) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = m;
+    if (rx.epfd < 0 || epoll_ctl(rx.epfd, EPOLL_CTL_ADD, m->fd, &ev) != 0)
+      return -1;
+  }
+
+  pthread_mutex_lock(&rx.mu);
+  m->status = FW_SM_RUNNING;
+  m->due_ms = 0; // first step right away
+  m->ready = 0;
+  m->pass = 0;
+  m->next = rx.head;
+  rx.head = m;
+  pthread_mutex_unlock(&rx.mu);
+
+  wake();
+  return 0;
+}
+
+fw_sm_status_t fw_reactor_wait(fw_sm_instance_t *m, int timeout_ms) {
+  fw_sm_status_t status;
+  uint64_t deadline, now, until;
+
+  pthread_once(&rx_once, rx_init);
+  deadline = fw_clock_now_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+
+  pthread_mutex_lock(&rx.mu);
+  while (m->status == FW_SM_RUNNING) {
+    now = fw_clock_now_ms();
+    if (timeout_ms >= 0 && now >= deadline)
+      break;
+
+    if (pthread_mutex_trylock(&rx.drive) == 0) {
+      // Nobody is running the loop: run it here, for everyone
+      pthread_mutex_unlock(&rx.mu);
+      drive_locked(timeout_ms < 0 ? -1 : (int)(deadline - now));
+      release_drive();
+      pthread_mutex_lock(&rx.mu);
+      continue;
+    }
+
+    // Woken when an instance steps or the loop is released
+    until = now + 100;
+    if (timeout_ms >= 0 && deadline < until)
+      until = deadline;
+    fw_clock_cond_wait(&rx.changed, &rx.mu, until);
+  }
+  status = m->status;
+  pthread_mutex_unlock(&rx.mu);
+  return status;
+}
+
+void fw_reactor_cancel(fw_sm_instance_t *m) {
+  pthread_mutex_lock(&rx.mu);
+  while (rx.stepping == m)
+    pthread_cond_wait(&rx.changed, &rx.mu);
+  if (m->status == FW_SM_RUNNING) {
+    unlink_locked(m);
+    m->status = FW_SM_IDLE;
+  }
+  pthread_mutex_unlock(&rx.mu);
+}
+
+fw_sm_status_t fw_reactor_run(fw_sm_step_fn step, void *ctx,
+                              const fw_sm_timer_t *timer) {
+  fw_sm_instance_t m;
+
+  fw_sm_instance_init(&m, step, ctx, timer, -1);
+  if (fw_reactor_add(&m) != 0)
+    return FW_SM_DONE_FAIL;
+  return fw_reactor_wait(&m, -1);
+}
+
+int fw_reactor_run_once(int timeout_ms) {
+  int steps;
+
+  pthread_once(&rx_once, rx_init);
+  pthread_mutex_lock(&rx.drive);
+  steps = drive_locked(timeout_ms);
+  release_drive();
+  return steps;
+}
+
+uint64_t fw_reactor_next_due(void) {
+  pthread_mutex_lock(&rx.mu);
+  uint64_t due = next_due_locked();
+  pthread_mutex_unlock(&rx.mu);
+  return due;
+}
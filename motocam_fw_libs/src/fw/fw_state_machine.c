@@ -1,7 +1,15 @@
 #include "fw/fw_state_machine.h"
 #include "fw.h"
+#include "fw/fw_config.h"
+#include "fw/fw_clock.h"
+#include "fw/fw_reactor.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 /* ================================================================== */
@@ -9,22 +17,23 @@
 /* ================================================================== */
 
 void fw_sm_timer_start(fw_sm_timer_t *t, uint32_t delay_ms) {
-  clock_gettime(CLOCK_MONOTONIC, &t->start);
+  uint64_t now = fw_clock_now_ms();
+  t->start.tv_sec = (time_t)(now / 1000u);
+  t->start.tv_nsec = (long)(now % 1000u) * 1000000L;
   t->target_ms = delay_ms;
 }
 
-int fw_sm_timer_expired(const fw_sm_timer_t *t) {
-  struct timespec now;
-  clock_gettime(CLOCK_MONOTONIC, &now);
-
-  long elapsed_ms = (now.tv_sec - t->start.tv_sec) * 1000L +
-                    (now.tv_nsec - t->start.tv_nsec) / 1000000L;
+uint64_t fw_sm_timer_deadline_ms(const fw_sm_timer_t *t) {
+  return (uint64_t)t->start.tv_sec * 1000u +
+         (uint64_t)(t->start.tv_nsec / 1000000L) + t->target_ms;
+}
 
-  return elapsed_ms >= (long)t->target_ms;
+int fw_sm_timer_expired(const fw_sm_timer_t *t) {
+  return fw_clock_now_ms() >= fw_sm_timer_deadline_ms(t);
 }
 
 void fw_sm_yield(void) {
-  usleep(10000); /* 10 ms – yield CPU without hard-blocking */
+  fw_clock_sleep_ms(10); /* 10 ms – yield CPU without hard-blocking */
 }
 
 /* ================================================================== */
@@ -195,36 +204,29 @@ void onvif_sm_init(onvif_sm_ctx_t *ctx, uint8_t interface) {
 fw_sm_status_t onvif_sm_step(onvif_sm_ctx_t *ctx) {
   switch (ctx->state) {
   case ONVIF_SM_IDLE:
-    /* If ONVIF is running, stop it and wait 3 s */
+    /* If ONVIF is running, stop it; stop_process() waits for the exit */
     if (is_running(ONVIF_SERVER_PROCESS_NAME)) {
       stop_process(ONVIF_SERVER_PROCESS_NAME);
       printf("stopped onvif server process before changing interface\n");
-      fw_sm_timer_start(&ctx->timer, 3000);
-      ctx->state = ONVIF_SM_WAIT_STOP;
-    } else {
-      ctx->state = ONVIF_SM_START_CMD;
     }
-    return FW_SM_RUNNING;
-
-  case ONVIF_SM_WAIT_STOP:
-    if (!fw_sm_timer_expired(&ctx->timer))
-      return FW_SM_RUNNING;
     ctx->state = ONVIF_SM_START_CMD;
     return FW_SM_RUNNING;
 
   case ONVIF_SM_START_CMD: {
-    /* Set env + launch the background script */
+    /* Set env + launch the background script, which reads onvif_itrf */
     if (ctx->interface == 0) {
       set_uboot_env_chars("onvif_itrf", "eth");
       char bg[600];
       snprintf(bg, sizeof(bg), "%s < /dev/null > /dev/null 2>&1 &",
                SM_SET_ONVIF_INTERFACE_ETHERNET);
+      config_store_mirror();
       system(bg);
     } else {
       set_uboot_env_chars("onvif_itrf", "wifi");
       char bg[600];
       snprintf(bg, sizeof(bg), "%s < /dev/null > /dev/null 2>&1 &",
                SM_SET_ONVIF_INTERFACE_WIFI);
+      config_store_mirror();
       system(bg);
     }
     ctx->retry_count = 0;
@@ -269,34 +271,170 @@ fw_sm_status_t onvif_sm_step(onvif_sm_ctx_t *ctx) {
 /*  Streamer restart (set_misc) state machine                         */
 /* ================================================================== */
 
-void misc_sm_init(misc_sm_ctx_t *ctx) { ctx->state = MISC_SM_IDLE; }
+void misc_sm_init(misc_sm_ctx_t *ctx) {
+  struct sockaddr_un addr;
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->state = MISC_SM_IDLE;
+  ctx->ready_port = STREAMER_READY_PORT;
+  ctx->grace_ms = STREAMER_READY_GRACE_MS;
+  ctx->timeout_ms = STREAMER_READY_TIMEOUT_MS;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", STREAMER_NOTIFY_SOCK);
+  ctx->notify_fd =
+      socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(STREAMER_NOTIFY_SOCK);
+  if (ctx->notify_fd >= 0 &&
+      bind(ctx->notify_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    LOG_ERROR("cannot bind %s: %s", STREAMER_NOTIFY_SOCK, strerror(errno));
+    close(ctx->notify_fd);
+    ctx->notify_fd = -1;
+  }
+}
+
+/* Drain the notification socket; 1 if the streamer said READY=1 */
+static int misc_notified(misc_sm_ctx_t *ctx) {
+  char msg[128];
+  ssize_t n;
+  int ready = 0;
+
+  if (ctx->notify_fd < 0)
+    return 0;
+  while ((n = recv(ctx->notify_fd, msg, sizeof(msg) - 1, 0)) >= 0) {
+    msg[n] = '\0';
+    if (strstr(msg, "READY=1"))
+      ready = 1;
+  }
+  return ready;
+}
+
+static int misc_port_accepts(uint16_t port) {
+  struct sockaddr_in addr;
+  int fd, ok;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return 0;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  /* Loopback connects are answered at once */
+  ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  close(fd);
+  return ok;
+}
+
+static fw_sm_status_t misc_done(misc_sm_ctx_t *ctx, misc_ready_t by) {
+  static const char *const how[] = {"not ready", "notified", "port open",
+                                    "running, no ready signal"};
+
+  ctx->ready_by = by;
+  ctx->elapsed_ms = (uint32_t)(fw_clock_now_ms() - ctx->start_ms);
+  ctx->state = MISC_SM_DONE;
+  if (by == MISC_READY_NONE)
+    LOG_ERROR("streamer %s after %u ms", how[by], ctx->elapsed_ms);
+  else
+    LOG_INFO("streamer ready (%s) after %u ms", how[by], ctx->elapsed_ms);
+  return by == MISC_READY_NONE ? FW_SM_DONE_FAIL : FW_SM_DONE_OK;
+}
 
 fw_sm_status_t misc_sm_step(misc_sm_ctx_t *ctx) {
   switch (ctx->state) {
   case MISC_SM_IDLE:
-    fw_sm_timer_start(&ctx->timer, 1000);
-    ctx->state = MISC_SM_WAIT_STOP;
+    /* The old streamer is gone once stop_process() returns */
+    ctx->start_ms = fw_clock_now_ms();
+    fw_sm_timer_start(&ctx->timer, STREAMER_READY_PROBE_MS);
+    ctx->state = MISC_SM_WAIT_READY;
     return FW_SM_RUNNING;
 
-  case MISC_SM_WAIT_STOP:
+  case MISC_SM_WAIT_READY:
+    /* Stepped when a datagram arrives or the probe timer expires */
+    if (misc_notified(ctx))
+      return misc_done(ctx, MISC_READY_NOTIFY);
     if (!fw_sm_timer_expired(&ctx->timer))
       return FW_SM_RUNNING;
 
-    ctx->state = MISC_SM_POLL_RESTART;
-    return FW_SM_RUNNING;
-
-  case MISC_SM_POLL_RESTART:
-    if (is_running(STREAMER_PROCESS_NAME)) {
-      ctx->state = MISC_SM_DONE;
-      return FW_SM_DONE_OK;
+    if (ctx->ready_port && misc_port_accepts(ctx->ready_port))
+      return misc_done(ctx, MISC_READY_PORT);
+    /* With nothing to tell readiness, or no word within the grace
+       period, the process has to do */
+    if ((ctx->notify_fd < 0 && !ctx->ready_port) ||
+        fw_clock_now_ms() - ctx->start_ms >= ctx->grace_ms) {
+      if (is_running(STREAMER_PROCESS_NAME))
+        return misc_done(ctx, MISC_READY_PROCESS);
     }
-    /* Yield and retry on next step */
+
+    if (fw_clock_now_ms() - ctx->start_ms >= ctx->timeout_ms)
+      return misc_done(ctx, is_running(STREAMER_PROCESS_NAME)
+                                ? MISC_READY_PROCESS
+                                : MISC_READY_NONE);
+    fw_sm_timer_start(&ctx->timer, STREAMER_READY_PROBE_MS);
     return FW_SM_RUNNING;
 
   case MISC_SM_DONE:
-    return FW_SM_DONE_OK;
+    return ctx->ready_by == MISC_READY_NONE ? FW_SM_DONE_FAIL
+                                            : FW_SM_DONE_OK;
 
   default:
     return FW_SM_DONE_FAIL;
   }
 }
+
+int misc_sm_restart_streamer(void) {
+  misc_sm_ctx_t sm;
+
+  misc_sm_init(&sm);
+  /* The streamer comes back reading its settings from the key files */
+  config_store_mirror();
+  stop_process(STREAMER_PROCESS_NAME);
+  if (misc_sm_run(&sm) != FW_SM_DONE_OK)
+    return -1;
+  return (int)sm.elapsed_ms;
+}
+
+/* ================================================================== */
+/*  Blocking adapters – step on the reactor until done                */
+/* ================================================================== */
+
+static fw_sm_status_t delay_sm_step_any(void *ctx) { return delay_sm_step(ctx); }
+static fw_sm_status_t proc_sm_step_any(void *ctx) { return proc_sm_step(ctx); }
+static fw_sm_status_t wifi_sm_step_any(void *ctx) { return wifi_sm_step(ctx); }
+static fw_sm_status_t onvif_sm_step_any(void *ctx) { return onvif_sm_step(ctx); }
+static fw_sm_status_t misc_sm_step_any(void *ctx) { return misc_sm_step(ctx); }
+
+fw_sm_status_t delay_sm_run(delay_sm_ctx_t *ctx) {
+  return fw_reactor_run(delay_sm_step_any, ctx, &ctx->timer);
+}
+
+fw_sm_status_t proc_sm_run(proc_sm_ctx_t *ctx) {
+  return fw_reactor_run(proc_sm_step_any, ctx, &ctx->timer);
+}
+
+fw_sm_status_t wifi_sm_run(wifi_sm_ctx_t *ctx) {
+  return fw_reactor_run(wifi_sm_step_any, ctx, &ctx->timer);
+}
+
+fw_sm_status_t onvif_sm_run(onvif_sm_ctx_t *ctx) {
+  return fw_reactor_run(onvif_sm_step_any, ctx, &ctx->timer);
+}
+
+fw_sm_status_t misc_sm_run(misc_sm_ctx_t *ctx) {
+  fw_sm_instance_t m;
+  fw_sm_status_t status;
+
+  /* Stepped as soon as a notification arrives */
+  fw_sm_instance_init(&m, misc_sm_step_any, ctx, &ctx->timer, ctx->notify_fd);
+  status = fw_reactor_add(&m) == 0
+               ? fw_reactor_wait(&m, -1)
+               : fw_reactor_run(misc_sm_step_any, ctx, &ctx->timer);
+
+  if (ctx->notify_fd >= 0) {
+    close(ctx->notify_fd);
+    ctx->notify_fd = -1;
+    unlink(STREAMER_NOTIFY_SOCK);
+  }
+  return status;
+}
@@ -1,37 +1,24 @@
 #include "fw/fw_streaming.h"
+#include "fw/fw_config.h"
+#include "fw/fw_proc.h"
 #include "fw/fw_state_machine.h"
 
 static int start_process_with_name(const char *process_name) {
-  printf("[INFO] starting process :%s with 20 retries...\n", process_name);
-  if (is_running(process_name)) {
+  printf("[INFO] starting process :%s\n", process_name);
+  config_store_mirror(); // daemons read their settings from the key files
+  int ret = fw_proc_start(process_name);
+  if (ret == 1)
     printf("[INFO] process :%s is already running.\n", process_name);
-    return 1;
-  }
-
-  char background_cmd[600];
-  snprintf(background_cmd, sizeof(background_cmd),
-           "%s < /dev/null > /dev/null 2>&1 &", process_name);
-  system(background_cmd);
-
-  proc_sm_ctx_t sm;
-  proc_sm_init(&sm, process_name, 20);
 
-  fw_sm_status_t status;
-  do {
-    status = proc_sm_step(&sm);
-    if (status == FW_SM_RUNNING)
-      fw_sm_yield();
-  } while (status == FW_SM_RUNNING);
-
-  return (status == FW_SM_DONE_OK) ? 0 : -2;
+  return ret < 0 ? -2 : ret;
 }
 
 int8_t get_stream_state() {
   uint8_t state = 0;
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&streaming_lock);
   EXEC_GET_UINT8(GET_STREAMING_STATE, &state);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&streaming_lock);
   return (int8_t)state;
 }
 
@@ -39,9 +26,9 @@ int8_t start_stream() {
 
   LOG_DEBUG("start_stream called");
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&streaming_lock);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&streaming_lock);
 
   return 0;
 }
@@ -50,39 +37,46 @@ int8_t stop_stream() {
 
   LOG_DEBUG("stop_stream called");
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&streaming_lock);
 
-  stop_process(STREAMER_PROCESS_NAME);
-  while (!is_running(STREAMER_PROCESS_NAME))
-    ;
+  /* Restarted by start.sh; wait until the new one serves */
+  int ms = misc_sm_restart_streamer();
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&streaming_lock);
 
-  return 0;
+  return ms < 0 ? -1 : 0;
 }
 
 int8_t get_webrtc_streaming_state(uint8_t *webrtc_state) {
   uint8_t webrtc_enabled = 0;
   printf("fw get_webrtc_streaming_state \n");
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&streaming_lock);
   EXEC_GET_UINT8(GET_WEBRTC_ENABLED, &webrtc_enabled);
   printf("fw get_webrtc_streaming_state webrtc_enabled=%d\n", webrtc_enabled);
   webrtc_state[0] = webrtc_enabled;
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&streaming_lock);
   return 0;
 }
 
 int8_t start_webrtc_stream() {
   uint8_t misc = 0;
   LOG_DEBUG("fw start_webrtc %d\n", misc);
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&streaming_lock);
+
+  if (config_value_equals_int(WEBRTC_ENABLED, 1) &&
+      is_running(SIGNALING_SERVER_PROCESS_NAME) &&
+      is_running(PORTABLE_RTC_PROCESS_NAME)) {
+    config_skip_account(WEBRTC_ENABLED);
+    pthread_rwlock_unlock(&streaming_lock);
+    return 0;
+  }
 
   EXEC_GET_UINT8(GET_MISC, &misc);
   printf("fw get_misc misc=%d\n", misc);
 
   if (misc == DAY_EIS_ON_WDR_ON || misc == NIGHT_EIS_ON_WDR_ON) {
     printf("[INFO] Misc value is 4 or 12 which indicates 4k\n");
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&streaming_lock);
 
     return -1;
   }
@@ -91,33 +85,33 @@ int8_t start_webrtc_stream() {
   if (ret < 0) {
     printf("[ERROR] Unable to start process :%s\n",
            SIGNALING_SERVER_PROCESS_NAME);
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&streaming_lock);
 
     return -1;
   }
   ret = start_process_with_name(PORTABLE_RTC_PROCESS_NAME);
   if (ret < 0) {
     printf("[ERROR] Unable to start process :%s\n", PORTABLE_RTC_PROCESS_NAME);
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&streaming_lock);
 
     return -2;
   }
 
   set_uboot_env(WEBRTC_ENABLED, 1);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&streaming_lock);
   return 0;
 }
 
 int8_t stop_webrtc_stream() {
   LOG_DEBUG("fw stop_webrtc %d\n", misc);
-  pthread_mutex_lock(&lock);
-
-  if (is_running(SIGNALING_SERVER_PROCESS_NAME))
-    stop_process(SIGNALING_SERVER_PROCESS_NAME);
-  if (is_running(PORTABLE_RTC_PROCESS_NAME))
-    stop_process(PORTABLE_RTC_PROCESS_NAME);
-  set_uboot_env(WEBRTC_ENABLED, 0);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_wrlock(&streaming_lock);
+
+  static const char *const webrtc[] = {SIGNALING_SERVER_PROCESS_NAME,
+                                       PORTABLE_RTC_PROCESS_NAME};
+  fw_proc_stop_all(webrtc, 2, FW_PROC_STOP_MS);
+  if (!config_unchanged_int(WEBRTC_ENABLED, 0))
+    set_uboot_env(WEBRTC_ENABLED, 0);
+  pthread_rwlock_unlock(&streaming_lock);
   return 0;
 }
 
@@ -1,4 +1,6 @@
 #include "fw/fw_system.h"
+#include "fw/fw_clock.h"
+#include "fw/fw_config.h"
 #include "fw/fw_state_machine.h"
 
 #define GET_CPU_USAGE                                                          \
@@ -20,7 +22,7 @@
 #define SET_CAMERA_NAME "camera_name"
 #define SET_LOGIN_PIN "login_pin"
 
-#define OTA_UPDATE_COMMAND "/mnt/flash/vienna/firmware/ota/ota_service &"
+#define OTA_UPDATE_COMMAND "/mnt/flash/vienna/firmware/ota/ota_service --throttle &"
 
 #define OTA_STATUS "ota_status"
 #define GET_OTA_STATUS "cat " M5S_CONFIG_DIR "/ota_status"
@@ -67,7 +69,7 @@ int8_t camera_health_check(uint8_t *streamer, uint8_t *rtsp,
                            uint8_t *portable_rtc, uint8_t *cpu_usage,
                            uint8_t *memory_usage, uint8_t *isp_temp,
                            uint8_t *ir_temp, uint8_t *sensor_temp) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   // Check if the streamer is running
   *streamer = is_running("streamer");
@@ -76,17 +78,17 @@ int8_t camera_health_check(uint8_t *streamer, uint8_t *rtsp,
 
   // Get CPU usage
   if (get_cpu_usage(cpu_usage) != 0) {
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&system_lock);
     return -1;
   }
 
   // Get memory usage
   if (get_memory_usage(memory_usage) != 0) {
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&system_lock);
     return -1;
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
 
   get_isp_temp(isp_temp);
   get_ir_temp(ir_temp);
@@ -121,7 +123,7 @@ int8_t provisioning_mode(const char *mac_address, const char *serial_number,
 }
 
 int8_t remove_ota_files() {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
 
   // Remove all files matching ota.tar.gz*
   char cmd[256];
@@ -131,24 +133,19 @@ int8_t remove_ota_files() {
     perror("Failed to remove OTA files");
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
 
   return 0;
 }
 
 int8_t shutdown_device() {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
 
   /* Non-blocking 1 s delay before reboot */
   delay_sm_ctx_t sm;
   delay_sm_init(&sm, 1000);
 
-  fw_sm_status_t status;
-  do {
-    status = delay_sm_step(&sm);
-    if (status == FW_SM_RUNNING)
-      fw_sm_yield();
-  } while (status == FW_SM_RUNNING);
+  delay_sm_run(&sm);
 
   // Flush file system buffers
   sync();
@@ -159,13 +156,13 @@ int8_t shutdown_device() {
     perror("Failed to reboot");
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
 
   return 0;
 }
 
 int8_t ota_update() {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
 
   printf("executing ota update command");
   set_uboot_env_chars(OTA_STATUS, "update_started");
@@ -176,12 +173,7 @@ int8_t ota_update() {
   delay_sm_ctx_t sm;
   delay_sm_init(&sm, 1000);
 
-  fw_sm_status_t status;
-  do {
-    status = delay_sm_step(&sm);
-    if (status == FW_SM_RUNNING)
-      fw_sm_yield();
-  } while (status == FW_SM_RUNNING);
+  delay_sm_run(&sm);
 
   sync();
 
@@ -193,37 +185,39 @@ int8_t ota_update() {
     printf("executing ota update command failed\n");
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
 
   return 0;
 }
 
 int8_t set_camera_name(const char *camera_name) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
 
-  set_uboot_env_chars(SET_CAMERA_NAME, camera_name);
-  pthread_mutex_unlock(&lock);
+  if (!config_unchanged(SET_CAMERA_NAME, camera_name))
+    set_uboot_env_chars(SET_CAMERA_NAME, camera_name);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 int8_t set_login(const char *login_pin, const char *dob) {
   int8_t dob_validation = validate_user_dob(dob);
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
 
   if (dob_validation != 0) {
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&system_lock);
     return dob_validation; // Return -6 or -7
   }
 
-  set_uboot_env_chars(SET_LOGIN_PIN, login_pin);
-  pthread_mutex_unlock(&lock);
+  if (!config_unchanged(SET_LOGIN_PIN, login_pin))
+    set_uboot_env_chars(SET_LOGIN_PIN, login_pin);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t get_camera_name(char *camera_name) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   if (exec_cmd(GET_CAMERA_NAME, output, sizeof(output)) == 0) {
     /* trim trailing newline */
@@ -234,70 +228,70 @@ int8_t get_camera_name(char *camera_name) {
     snprintf(camera_name, 32, "%s", output);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t get_firmware_version(char *firmware_version) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   if (exec_cmd(GET_FIRMWARE_VERSION, output, sizeof(output)) == 0) {
     snprintf(firmware_version, 32, "%s", output);
     printf("firmware-version %s\n", firmware_version);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t get_mac_address(char *mac_address) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   if (exec_cmd(GET_MAC_ADDRESS, output, sizeof(output)) == 0) {
     snprintf(mac_address, 18, "%s", output);
     printf("mac-address %s\n", mac_address);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t get_ota_update_status(char *ota_status) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   if (exec_cmd(GET_OTA_STATUS, output, sizeof(output)) == 0) {
     snprintf(ota_status, 32, "%s", output);
     printf("ota_status %s\n", ota_status);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t get_factory_reset_status(char *factory_reset_status) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   if (exec_cmd(GET_FACTORY_RESET_STATUS, output, sizeof(output)) == 0) {
     snprintf(factory_reset_status, 32, "%s", output);
     printf("factory_reset_status %s\n", factory_reset_status);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t get_login_pin(char *loginPin) {
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   if (exec_cmd(GET_LOGIN_PIN, output, sizeof(output)) == 0) {
     /* trim trailing newline */
@@ -308,7 +302,7 @@ int8_t get_login_pin(char *loginPin) {
     snprintf(loginPin, 32, "%s", output);
   }
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
@@ -346,11 +340,11 @@ int8_t set_factory_reset(const char *dob) {
 
   int8_t dob_validation = validate_user_dob(dob);
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
 
   // Validate DOB
   if (dob_validation != 0) {
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&system_lock);
     return dob_validation; // Return -6 or -7
   }
   kill_all_processes();
@@ -361,18 +355,18 @@ int8_t set_factory_reset(const char *dob) {
   snprintf(background_cmd, sizeof(background_cmd),
            "%s < /dev/null > /dev/null 2>&1 &", cmd);
   system(background_cmd);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t set_config_reset(const char *dob) {
   int8_t dob_validation = validate_user_dob(dob);
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
 
   // Validate DOB
   if (dob_validation != 0) {
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&system_lock);
     return dob_validation; // Return -6 or -7
   }
   kill_all_processes();
@@ -387,7 +381,7 @@ int8_t set_config_reset(const char *dob) {
   printf("set_config_reset command:%s\n", background_cmd);
   system(background_cmd);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
@@ -396,7 +390,7 @@ int8_t get_stream_resolution(enum image_resolution *resolution,
   char cmd[100];
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   snprintf(cmd, sizeof(cmd), "cat " M5S_CONFIG_DIR "/stream%d_resolution",
            stream_number);
@@ -404,7 +398,7 @@ int8_t get_stream_resolution(enum image_resolution *resolution,
   if (exec_cmd(cmd, output, sizeof(output)) == 0)
     *resolution = (enum image_resolution)atoi(output);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
@@ -412,7 +406,7 @@ int8_t get_stream_fps(uint8_t *fps, uint8_t stream_number) {
   char cmd[100];
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   snprintf(cmd, sizeof(cmd), "cat " M5S_CONFIG_DIR "/stream%d_fps",
            stream_number);
@@ -420,7 +414,7 @@ int8_t get_stream_fps(uint8_t *fps, uint8_t stream_number) {
   if (exec_cmd(cmd, output, sizeof(output)) == 0)
     *fps = (uint8_t)atoi(output);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
@@ -428,7 +422,7 @@ int8_t get_stream_bitrate(uint8_t *bitrate, uint8_t stream_number) {
   char cmd[100];
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   snprintf(cmd, sizeof(cmd), "cat " M5S_CONFIG_DIR "/stream%d_bitrate",
            stream_number);
@@ -436,7 +430,7 @@ int8_t get_stream_bitrate(uint8_t *bitrate, uint8_t stream_number) {
   if (exec_cmd(cmd, output, sizeof(output)) == 0)
     *bitrate = (uint8_t)atoi(output);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
@@ -444,7 +438,7 @@ int8_t get_stream_encoder(enum encoder_type *encoder1, uint8_t stream_number) {
   char cmd[100];
   char output[64];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
 
   snprintf(cmd, sizeof(cmd), "cat " M5S_CONFIG_DIR "/stream%d_encoder",
            stream_number);
@@ -452,7 +446,7 @@ int8_t get_stream_encoder(enum encoder_type *encoder1, uint8_t stream_number) {
   if (exec_cmd(cmd, output, sizeof(output)) == 0)
     *encoder1 = (enum encoder_type)atoi(output);
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
@@ -507,7 +501,7 @@ int8_t get_cpu_usage(uint8_t *cpu_usage) {
   }
 
   // Wait for 1 second
-  sleep(1);
+  fw_clock_sleep_ms(1000);
 
   // Read second measurement
   if (read_cpu_stats(&stats2) != 0) {
@@ -545,33 +539,38 @@ int8_t get_cpu_usage(uint8_t *cpu_usage) {
 }
 
 int8_t get_process_status(const char *process_name, uint8_t *status) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
   *status = is_running(process_name) ? 1 : 0;
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t set_user_dob(const char *dob) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
+  if (config_file_equals(USER_DOB_FILE, dob)) {
+    config_skip_account("user_dob");
+    pthread_rwlock_unlock(&system_lock);
+    return 0;
+  }
   FILE *fp = fopen(USER_DOB_FILE, "w");
   if (fp == NULL) {
     LOG_ERROR("set_user_dob: failed to open file\n");
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&system_lock);
     return -1;
   }
 
   fprintf(fp, "%s", dob);
   fclose(fp);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
 
 int8_t get_user_dob(char *dob) {
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_rdlock(&system_lock);
   FILE *fp = fopen(USER_DOB_FILE, "r");
   if (fp == NULL) {
     LOG_ERROR("get_user_dob: file not found\n");
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&system_lock);
     return -1;
   }
 
@@ -582,12 +581,12 @@ int8_t get_user_dob(char *dob) {
       dob[len - 1] = '\0';
 
     fclose(fp);
-    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&system_lock);
     return 0;
   }
 
   fclose(fp);
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return -1;
 }
 
@@ -595,11 +594,11 @@ int8_t set_system_time(const char *epoch_time) {
   char cmd[300];
   char dummy[8];
 
-  pthread_mutex_lock(&lock);
+  pthread_rwlock_wrlock(&system_lock);
 
   snprintf(cmd, sizeof(cmd), "%s %s", SET_TIME_COMMAND, epoch_time);
   exec_cmd(cmd, dummy, sizeof(dummy)); /* output not needed */
 
-  pthread_mutex_unlock(&lock);
+  pthread_rwlock_unlock(&system_lock);
   return 0;
 }
@@ -1,5 +1,7 @@
 #include "gpio.h"
-#include "fw/fw_state_machine.h"
+#include "fw/fw_clock.h"
+#include "hw_handle.h"
+#include "ir_cut.h"
 #include "log.h"
 #include <errno.h>
 #include <fcntl.h>
@@ -12,16 +14,6 @@
 #include <time.h>
 #include <unistd.h>
 
-#ifndef GPIO_EXPORT_PATH
-#define GPIO_EXPORT_PATH "/sys/class/gpio/export"
-#endif
-#ifndef GPIO_DIRECTION_PATH
-#define GPIO_DIRECTION_PATH "/sys/class/gpio/gpio%d/direction"
-#endif
-#ifndef GPIO_VALUE_PATH
-#define GPIO_VALUE_PATH "/sys/class/gpio/gpio%d/value"
-#endif
-
 #ifndef OTA_WATCH_DIR
 #define OTA_WATCH_DIR "/mnt/flash/vienna/firmware/ota/"
 #endif
@@ -115,95 +107,29 @@ static int is_ota_failed_state(const char *status) {
   return 0;
 }
 
-static void export_gpio(int gpio_pin) {
-  FILE *export_file = fopen(GPIO_EXPORT_PATH, "w");
-
-  if (export_file == NULL) {
-    perror("Failed to export GPIO pin");
-    return;
-  }
-  fprintf(export_file, "%d", gpio_pin);
-  fclose(export_file);
-}
-
-static void set_gpio_direction(int gpio_pin, const char *direction) {
-  char direction_path[64];
-  snprintf(direction_path, sizeof(direction_path), GPIO_DIRECTION_PATH,
-           gpio_pin);
-  FILE *direction_file = fopen(direction_path, "w");
-
-  if (direction_file == NULL) {
-    perror("Failed to set GPIO direction");
-    return;
-  }
-  fprintf(direction_file, "%s", direction);
-  fclose(direction_file);
-}
-
-static void set_gpio_value(int gpio_pin, int value) {
-  char value_path[64];
-  snprintf(value_path, sizeof(value_path), GPIO_VALUE_PATH, gpio_pin);
-  FILE *value_file = fopen(value_path, "w");
-
-  if (value_file == NULL) {
-    perror("Failed to set GPIO value");
-    return;
-  }
-  fprintf(value_file, "%d", value);
-  fclose(value_file);
-}
-
+/* Lines are opened once and kept open, see hw_handle.h */
 uint8_t get_gpio_value(int gpio_pin) {
-  char value_path[64];
-  snprintf(value_path, sizeof(value_path), GPIO_VALUE_PATH, gpio_pin);
-
-  FILE *fp = fopen(value_path, "r");
-  if (!fp) {
-    perror("Failed to open GPIO value file");
-    return 2;
-  }
-
-  char value[4];
-  if (fgets(value, sizeof(value), fp) == NULL) {
-    perror("Failed to read GPIO value");
-    fclose(fp);
-    return 2;
-  }
-  fclose(fp);
-
-  size_t len = strcspn(value, "\n");
-  if (len < sizeof(value)) {
-    // Remove newline if present
-    value[len] = '\0';
-  }
-
-  if (strcmp(value, "1") == 0) {
-    return 1;
-  } else {
-    return 0;
-  }
+  int value = hw_gpio_get(gpio_pin);
+  return value < 0 ? 2 : (uint8_t)value;
 }
 
+static const int LED_PINS[] = {GPIO_PIN_R_LED, GPIO_PIN_G_LED, GPIO_PIN_B_LED};
+
 static void apply_rgb(int r, int g, int b) {
-  set_gpio_value(GPIO_PIN_R_LED, r ? SET_GPIO : CLEAR_GPIO);
-  set_gpio_value(GPIO_PIN_G_LED, g ? SET_GPIO : CLEAR_GPIO);
-  set_gpio_value(GPIO_PIN_B_LED, b ? SET_GPIO : CLEAR_GPIO);
+  const int values[] = {r ? SET_GPIO : CLEAR_GPIO, g ? SET_GPIO : CLEAR_GPIO,
+                        b ? SET_GPIO : CLEAR_GPIO};
+  hw_gpio_set(LED_PINS, values, 3);
 }
 
+/* Blocking forms of ir_cut_request(), for boot-time callers */
 void update_ir_cut_filter_on() {
-
-  set_gpio_value(GPIO_PIN_IR_CUT_59, SET_GPIO);
-  set_gpio_value(GPIO_PIN_IR_CUT_60, CLEAR_GPIO);
-  sleep(2);
-  set_gpio_value(GPIO_PIN_IR_CUT_59, CLEAR_GPIO);
+  ir_cut_request(1);
+  ir_cut_wait(-1);
 }
 
 void update_ir_cut_filter_off() {
-
-  set_gpio_value(GPIO_PIN_IR_CUT_59, SET_GPIO);
-  set_gpio_value(GPIO_PIN_IR_CUT_60, SET_GPIO);
-  sleep(2);
-  set_gpio_value(GPIO_PIN_IR_CUT_59, CLEAR_GPIO);
+  ir_cut_request(0);
+  ir_cut_wait(-1);
 }
 
 uint8_t get_ir_cut_filter() { return get_gpio_value(GPIO_PIN_IR_CUT_60); }
@@ -231,10 +157,7 @@ static void run_led_pattern(const led_step_t *pattern, int steps) {
 
     apply_rgb(pattern[i].red, pattern[i].green, pattern[i].blue);
 
-    struct timespec ts;
-    ts.tv_sec = pattern[i].duration_ms / 1000;
-    ts.tv_nsec = (pattern[i].duration_ms % 1000) * 1000 * 1000;
-    (void)nanosleep(&ts, NULL);
+    fw_clock_sleep_ms((uint32_t)pattern[i].duration_ms);
   }
 }
 
@@ -305,11 +228,7 @@ static void decide_and_run_led(const system_state_t *st) {
     apply_rgb(0, 1, 0);
   }
 
-  /* Non-blocking 1 s wait */
-  fw_sm_timer_t led_timer;
-  fw_sm_timer_start(&led_timer, 1000);
-  while (!fw_sm_timer_expired(&led_timer))
-    fw_sm_yield();
+  fw_clock_sleep_ms(1000);
 }
 
 int read_wifi_state(void) {
@@ -409,12 +328,16 @@ static subsys_state_t check_ota(char *status_buf, size_t len) {
   return SUBSYS_OK;
 }
 
+static pthread_t led_watcher_tid;
+static int led_watcher_started;
+static int led_watcher_stop;
+
 static void *system_led_watcher(void *arg) {
   (void)arg;
   system_state_t st;
   char ota_status[64];
 
-  while (1) {
+  while (!__atomic_load_n(&led_watcher_stop, __ATOMIC_SEQ_CST)) {
     memset(&st, 0, sizeof(st));
 
     st.wifi = check_wifi();
@@ -430,49 +353,39 @@ static void *system_led_watcher(void *arg) {
 
     decide_and_run_led(&st);
   }
+  return NULL;
 }
 
 int start_led_watcher() {
-  pthread_t tid;
-
-  if (pthread_create(&tid, NULL, system_led_watcher, NULL) != 0) {
+  __atomic_store_n(&led_watcher_stop, 0, __ATOMIC_SEQ_CST);
+  if (pthread_create(&led_watcher_tid, NULL, system_led_watcher, NULL) != 0) {
     perror("pthread_create");
     return -1;
   }
 
-  pthread_detach(tid);
+  led_watcher_started = 1;
   return 0;
 }
 
+/* Stop the watcher after its current pattern and wait for it */
+void stop_led_watcher() {
+  if (!led_watcher_started)
+    return;
+  __atomic_store_n(&led_watcher_stop, 1, __ATOMIC_SEQ_CST);
+  pthread_join(led_watcher_tid, NULL);
+  led_watcher_started = 0;
+}
+
 int gpio_init() {
 
   LOG_DEBUG("gpio_init Called");
 
-  // Initialize IR CUT FILTER pins
-  export_gpio(GPIO_PIN_IR_CUT_59);
-  set_gpio_direction(GPIO_PIN_IR_CUT_59, GPIO_DIRECTION_OUT);
-  set_gpio_value(GPIO_PIN_IR_CUT_59, SET_GPIO);
-
-  export_gpio(GPIO_PIN_IR_CUT_60);
-  set_gpio_direction(GPIO_PIN_IR_CUT_60, GPIO_DIRECTION_OUT);
-  set_gpio_value(GPIO_PIN_IR_CUT_60, SET_GPIO);
-
-  set_gpio_value(GPIO_PIN_IR_CUT_59, CLEAR_GPIO);
-
-  // Initialize B LED
-  export_gpio(GPIO_PIN_B_LED);
-  set_gpio_direction(GPIO_PIN_B_LED, GPIO_DIRECTION_OUT);
-  set_gpio_value(GPIO_PIN_B_LED, CLEAR_GPIO);
-
-  // Initialize G LED
-  export_gpio(GPIO_PIN_G_LED);
-  set_gpio_direction(GPIO_PIN_G_LED, GPIO_DIRECTION_OUT);
-  set_gpio_value(GPIO_PIN_G_LED, SET_GPIO);
+  // Initialize IR CUT FILTER pins: pulse to the filter-off position
+  ir_cut_init();
 
-  // Initialize R LED
-  export_gpio(GPIO_PIN_R_LED);
-  set_gpio_direction(GPIO_PIN_R_LED, GPIO_DIRECTION_OUT);
-  set_gpio_value(GPIO_PIN_R_LED, CLEAR_GPIO);
+  // Initialize the RGB LED: green
+  const int led_init[] = {CLEAR_GPIO, SET_GPIO, CLEAR_GPIO};
+  hw_gpio_claim(LED_PINS, led_init, 3);
 
   start_led_watcher();
 
@@ -0,0 +1,402 @@
+#include "hw_handle.h"
+#include "fw.h"
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#ifndef GPIO_EXPORT_PATH
+#define GPIO_EXPORT_PATH "/sys/class/gpio/export"
+#endif
+#ifndef GPIO_DIRECTION_PATH
+#define GPIO_DIRECTION_PATH "/sys/class/gpio/gpio%d/direction"
+#endif
+#ifndef GPIO_VALUE_PATH
+#define GPIO_VALUE_PATH "/sys/class/gpio/gpio%d/value"
+#endif
+
+#define COUNT(field) __atomic_fetch_add(&hw.stats.field, 1, __ATOMIC_RELAXED)
+
+static struct {
+  pthread_mutex_t mu;     // GPIO handles
+  pthread_mutex_t pwm_mu; // PWM handles, held from hw_pwm_lock() to unlock
+  int chip_fd;
+  int chip_tried;
+  unsigned int chip_lines;
+  struct {
+    int fd; // line request from GPIO_V2_GET_LINE_IOCTL
+    int count;
+    int pin[HW_GPIO_MAX_LINES];
+  } group[HW_GPIO_MAX_GROUPS];
+  int groups;
+  struct {
+    int pin;
+    int fd; // sysfs value file
+  } line[HW_GPIO_MAX_LINES];
+  int lines;
+  int lock_fd;
+  struct {
+    char path[64];
+    int fd;
+  } pwm[HW_PWM_MAX];
+  int pwms;
+  hw_stats_t stats;
+} hw = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .pwm_mu = PTHREAD_MUTEX_INITIALIZER,
+    .chip_fd = -1,
+    .lock_fd = -1,
+};
+
+static int hw_open(const char *path, int flags) {
+  COUNT(opens);
+  return open(path, flags | O_CLOEXEC, 0666);
+}
+
+// Character devices that are not seekable reject pwrite() with ESPIPE
+static int write_text(int fd, const char *text) {
+  size_t len = strlen(text);
+  COUNT(writes);
+  ssize_t n = pwrite(fd, text, len, 0);
+  if (n < 0 && errno == ESPIPE)
+    n = write(fd, text, len);
+  return n == (ssize_t)len ? 0 : -1;
+}
+
+// export and direction are written once per claim, not kept open
+static int write_path(const char *path, const char *text) {
+  int fd = hw_open(path, O_WRONLY);
+  if (fd < 0)
+    return -1;
+  int ret = write_text(fd, text);
+  close(fd);
+  return ret;
+}
+
+/* ------------------------------------------------------------------ */
+/*  GPIO                                                              */
+/* ------------------------------------------------------------------ */
+
+static int chip_open(void) {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+  if (!hw.chip_tried) {
+    struct gpiochip_info info;
+    hw.chip_tried = 1;
+    int fd = hw_open(GPIO_CHIP_DEV, O_RDWR);
+    if (fd >= 0) {
+      COUNT(ioctls);
+      if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) == 0) {
+        hw.chip_fd = fd;
+        hw.chip_lines = info.lines;
+        LOG_INFO("gpio through %s (%u lines)", GPIO_CHIP_DEV, info.lines);
+      } else {
+        close(fd);
+      }
+    }
+  }
+#endif
+  return hw.chip_fd;
+}
+
+static int group_index(int pin, int *bit) {
+  for (int g = 0; g < hw.groups; g++) {
+    for (int k = 0; k < hw.group[g].count; k++) {
+      if (hw.group[g].pin[k] == pin) {
+        *bit = k;
+        return g;
+      }
+    }
+  }
+  return -1;
+}
+
+static void group_release(int g) {
+  close(hw.group[g].fd);
+  hw.group[g] = hw.group[--hw.groups];
+}
+
+static int chip_claim(const int *pins, const int *values, int count) {
+#ifdef GPIO_V2_GET_LINE_IOCTL
+  struct gpio_v2_line_request req;
+  int bit;
+
+  if (chip_open() < 0)
+    return -1;
+  // Claiming again (gpio_init() twice) replaces the old request
+  for (int i = 0; i < count; i++) {
+    int g = group_index(pins[i], &bit);
+    if (g >= 0)
+      group_release(g);
+  }
+  if (hw.groups == HW_GPIO_MAX_GROUPS)
+    return -1;
+
+  memset(&req, 0, sizeof(req));
+  for (int i = 0; i < count; i++) {
+    int offset = pins[i] - GPIO_CHIP_BASE;
+    if (offset < 0 || (unsigned int)offset >= hw.chip_lines)
+      return -1;
+    req.offsets[i] = offset;
+    if (values[i])
+      req.config.attrs[0].attr.values |= 1ULL << i;
+  }
+  snprintf(req.consumer, sizeof(req.consumer), "motocam");
+  req.num_lines = count;
+  req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  req.config.num_attrs = 1;
+  req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+  req.config.attrs[0].mask = (count == 64) ? ~0ULL : (1ULL << count) - 1;
+
+  COUNT(ioctls);
+  if (ioctl(hw.chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) != 0) {
+    LOG_ERROR("gpio line request failed: %s", strerror(errno));
+    return -1;
+  }
+  hw.group[hw.groups].fd = req.fd;
+  hw.group[hw.groups].count = count;
+  memcpy(hw.group[hw.groups].pin, pins, count * sizeof(int));
+  hw.groups++;
+  return 0;
+#else
+  (void)pins;
+  (void)values;
+  (void)count;
+  return -1;
+#endif
+}
+
+static int line_fd(int pin) {
+  char path[64];
+
+  for (int n = 0; n < hw.lines; n++) {
+    if (hw.line[n].pin == pin)
+      return hw.line[n].fd;
+  }
+  if (hw.lines == HW_GPIO_MAX_LINES) {
+    LOG_ERROR("gpio%d: no free line handle", pin);
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), GPIO_VALUE_PATH, pin);
+  int fd = hw_open(path, O_RDWR);
+  if (fd < 0 && (errno == EACCES || errno == EPERM))
+    fd = hw_open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  hw.line[hw.lines].pin = pin;
+  hw.line[hw.lines].fd = fd;
+  hw.lines++;
+  return fd;
+}
+
+static int sysfs_claim(const int *pins, const int *values, int count) {
+  char buf[64];
+  int ret = 0;
+
+  for (int i = 0; i < count; i++) {
+    snprintf(buf, sizeof(buf), "%d", pins[i]);
+    if (write_path(GPIO_EXPORT_PATH, buf) != 0 && errno != EBUSY)
+      LOG_ERROR("gpio%d: export failed: %s", pins[i], strerror(errno));
+    snprintf(buf, sizeof(buf), GPIO_DIRECTION_PATH, pins[i]);
+    if (write_path(buf, GPIO_DIRECTION_OUT) != 0)
+      LOG_ERROR("gpio%d: direction failed: %s", pins[i], strerror(errno));
+
+    int fd = line_fd(pins[i]);
+    if (fd < 0 || write_text(fd, values[i] ? "1" : "0") != 0)
+      ret = -1;
+  }
+  return ret;
+}
+
+int hw_gpio_claim(const int *pins, const int *values, int count) {
+  if (count <= 0 || count > HW_GPIO_MAX_LINES)
+    return -1;
+
+  pthread_mutex_lock(&hw.mu);
+  int ret = chip_claim(pins, values, count);
+  if (ret != 0)
+    ret = sysfs_claim(pins, values, count);
+  pthread_mutex_unlock(&hw.mu);
+  return ret;
+}
+
+int hw_gpio_set(const int *pins, const int *values, int count) {
+  int done[HW_GPIO_MAX_LINES] = {0};
+  int ret = 0;
+
+  if (count <= 0 || count > HW_GPIO_MAX_LINES)
+    return -1;
+
+  pthread_mutex_lock(&hw.mu);
+#ifdef GPIO_V2_GET_LINE_IOCTL
+  for (int g = 0; g < hw.groups; g++) {
+    struct gpio_v2_line_values lv = {0, 0};
+    int bit;
+    for (int i = 0; i < count; i++) {
+      if (group_index(pins[i], &bit) != g)
+        continue;
+      lv.mask |= 1ULL << bit;
+      if (values[i])
+        lv.bits |= 1ULL << bit;
+      done[i] = 1;
+    }
+    if (lv.mask == 0)
+      continue;
+    COUNT(ioctls);
+    if (ioctl(hw.group[g].fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &lv) != 0)
+      ret = -1;
+  }
+#endif
+  for (int i = 0; i < count; i++) {
+    if (done[i])
+      continue;
+    int fd = line_fd(pins[i]);
+    if (fd < 0 || write_text(fd, values[i] ? "1" : "0") != 0) {
+      LOG_ERROR("gpio%d: set value failed", pins[i]);
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&hw.mu);
+  return ret;
+}
+
+int hw_gpio_get(int pin) {
+  char value[4];
+  int ret = -1;
+
+  pthread_mutex_lock(&hw.mu);
+#ifdef GPIO_V2_GET_LINE_IOCTL
+  int bit;
+  int g = group_index(pin, &bit);
+  if (g >= 0) {
+    struct gpio_v2_line_values lv = {0, 1ULL << bit};
+    COUNT(ioctls);
+    if (ioctl(hw.group[g].fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &lv) == 0)
+      ret = (lv.bits >> bit) & 1;
+    pthread_mutex_unlock(&hw.mu);
+    return ret;
+  }
+#endif
+  int fd = line_fd(pin);
+  if (fd >= 0) {
+    COUNT(reads);
+    ssize_t n = pread(fd, value, sizeof(value) - 1, 0);
+    if (n > 0) {
+      value[n] = '\0';
+      value[strcspn(value, "\n")] = '\0';
+      ret = strcmp(value, "1") == 0;
+    }
+  }
+  pthread_mutex_unlock(&hw.mu);
+  return ret;
+}
+
+int hw_gpio_chardev(void) {
+  pthread_mutex_lock(&hw.mu);
+  int fd = chip_open();
+  pthread_mutex_unlock(&hw.mu);
+  return fd >= 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  PWM                                                               */
+/* ------------------------------------------------------------------ */
+
+int hw_pwm_lock(void) {
+  struct flock fl;
+
+  pthread_mutex_lock(&hw.pwm_mu);
+  if (hw.lock_fd < 0) {
+    hw.lock_fd = hw_open(LOCK_FILE, O_RDWR | O_CREAT);
+    if (hw.lock_fd < 0) {
+      perror("Failed to open lock file");
+      pthread_mutex_unlock(&hw.pwm_mu);
+      return -1;
+    }
+  }
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  COUNT(locks);
+  if (fcntl(hw.lock_fd, F_SETLK, &fl) == -1) {
+    perror("Could not acquire lock");
+    pthread_mutex_unlock(&hw.pwm_mu);
+    return -1;
+  }
+  return 0;
+}
+
+void hw_pwm_unlock(void) {
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_UNLCK;
+  fl.l_whence = SEEK_SET;
+  COUNT(locks);
+  fcntl(hw.lock_fd, F_SETLK, &fl);
+  pthread_mutex_unlock(&hw.pwm_mu);
+}
+
+int hw_pwm_write(const char *path, const char *value) {
+  char buf[64];
+  int n;
+
+  for (n = 0; n < hw.pwms; n++) {
+    if (strcmp(hw.pwm[n].path, path) == 0)
+      break;
+  }
+  if (n == hw.pwms) {
+    // Opened like the fopen(path, "w") it replaces
+    int fd = hw_open(path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0)
+      return -1;
+    if (hw.pwms == HW_PWM_MAX || strlen(path) >= sizeof(hw.pwm[0].path)) {
+      snprintf(buf, sizeof(buf), "%s\n", value);
+      int ret = write_text(fd, buf);
+      close(fd);
+      return ret;
+    }
+    snprintf(hw.pwm[n].path, sizeof(hw.pwm[n].path), "%s", path);
+    hw.pwm[n].fd = fd;
+    hw.pwms++;
+  }
+
+  snprintf(buf, sizeof(buf), "%s\n", value);
+  if (write_text(hw.pwm[n].fd, buf) == 0)
+    return 0;
+
+  // Drop the handle so that a reloaded driver is opened again
+  close(hw.pwm[n].fd);
+  hw.pwm[n] = hw.pwm[--hw.pwms];
+  return -1;
+}
+
+void hw_close_all(void) {
+  pthread_mutex_lock(&hw.pwm_mu);
+  pthread_mutex_lock(&hw.mu);
+  while (hw.groups > 0)
+    group_release(hw.groups - 1);
+  for (int n = 0; n < hw.lines; n++)
+    close(hw.line[n].fd);
+  hw.lines = 0;
+  if (hw.chip_fd >= 0)
+    close(hw.chip_fd);
+  hw.chip_fd = -1;
+  hw.chip_tried = 0;
+  for (int n = 0; n < hw.pwms; n++)
+    close(hw.pwm[n].fd);
+  hw.pwms = 0;
+  if (hw.lock_fd >= 0)
+    close(hw.lock_fd);
+  hw.lock_fd = -1;
+  pthread_mutex_unlock(&hw.mu);
+  pthread_mutex_unlock(&hw.pwm_mu);
+}
+
+void hw_stats(hw_stats_t *out) {
+  out->opens = __atomic_load_n(&hw.stats.opens, __ATOMIC_RELAXED);
+  out->reads = __atomic_load_n(&hw.stats.reads, __ATOMIC_RELAXED);
+  out->writes = __atomic_load_n(&hw.stats.writes, __ATOMIC_RELAXED);
+  out->ioctls = __atomic_load_n(&hw.stats.ioctls, __ATOMIC_RELAXED);
+  out->locks = __atomic_load_n(&hw.stats.locks, __ATOMIC_RELAXED);
+}
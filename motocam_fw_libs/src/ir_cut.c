@@ -0,0 +1,180 @@
+#include "ir_cut.h"
+#include "fw/fw_clock.h"
+#include "gpio.h"
+#include "hw_handle.h"
+#include "log.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static const int IR_CUT_PINS[] = {GPIO_PIN_IR_CUT_59, GPIO_PIN_IR_CUT_60};
+
+static struct {
+  pthread_mutex_t mu;
+  pthread_cond_t settled;
+  int tfd;
+  ir_cut_state_t state;
+  int target;                 // position being moved to while MOVING
+  int pending;                // queued position, -1 for none
+  uint64_t release_ms;        // fw_clock_now_ms() end of the current pulse
+} act = {.mu = PTHREAD_MUTEX_INITIALIZER, .tfd = -1, .pending = -1};
+
+static pthread_once_t act_once = PTHREAD_ONCE_INIT;
+
+static void start_locked(int night);
+
+// Release the coil; a queued request starts right away
+static void finish_locked(void) {
+  const int release = CLEAR_GPIO;
+
+  hw_gpio_set(IR_CUT_PINS, &release, 1);
+  act.state = act.target ? IR_CUT_NIGHT : IR_CUT_DAY;
+  LOG_DEBUG("ir cut settled: %s", act.target ? "night" : "day");
+
+  if (act.pending >= 0) {
+    int next = act.pending;
+    act.pending = -1;
+    start_locked(next);
+    return;
+  }
+  pthread_cond_broadcast(&act.settled);
+}
+
+static void start_locked(int night) {
+  const int drive[] = {SET_GPIO, night ? CLEAR_GPIO : SET_GPIO};
+  struct itimerspec its;
+
+  hw_gpio_set(IR_CUT_PINS, drive, 2);
+  act.state = IR_CUT_MOVING;
+  act.target = night;
+  act.release_ms = fw_clock_now_ms() + IR_CUT_PULSE_MS;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = IR_CUT_PULSE_MS / 1000;
+  its.it_value.tv_nsec = (IR_CUT_PULSE_MS % 1000) * 1000000L;
+  if (act.tfd < 0 || timerfd_settime(act.tfd, 0, &its, NULL) != 0) {
+    // No timer: hold the coil in the caller, as before
+    fw_clock_sleep_ms(IR_CUT_PULSE_MS);
+    finish_locked();
+  }
+}
+
+// The timer only wakes the worker; the deadline ends the pulse
+static void reap_locked(void) {
+  uint64_t expirations;
+
+  if (act.tfd >= 0 && read(act.tfd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    LOG_ERROR("ir cut: timerfd read failed: %s", strerror(errno));
+  if (act.state == IR_CUT_MOVING && fw_clock_now_ms() >= act.release_ms)
+    finish_locked();
+}
+
+static void *ir_cut_worker(void *arg) {
+  struct pollfd pfd = {.fd = act.tfd, .events = POLLIN, .revents = 0};
+  (void)arg;
+
+  for (;;) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      LOG_ERROR("ir cut worker: poll failed: %s", strerror(errno));
+      return NULL;
+    }
+    pthread_mutex_lock(&act.mu);
+    reap_locked();
+    pthread_mutex_unlock(&act.mu);
+  }
+}
+
+static void act_init(void) {
+  pthread_condattr_t cattr;
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&act.settled, &cattr);
+  pthread_condattr_destroy(&cattr);
+
+  act.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (act.tfd < 0) {
+    LOG_ERROR("ir cut: no timerfd (%s), pulses will block", strerror(errno));
+    return;
+  }
+
+  // Without the thread a pulse still ends at the next ir_cut_* call
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, ir_cut_worker, NULL) != 0)
+    LOG_ERROR("ir cut: no worker thread");
+  pthread_attr_destroy(&attr);
+}
+
+void ir_cut_init(void) {
+  const int released[] = {CLEAR_GPIO, SET_GPIO};
+
+  pthread_once(&act_once, act_init);
+  hw_gpio_claim(IR_CUT_PINS, released, 2);
+  ir_cut_request(0);
+}
+
+int ir_cut_request(int night) {
+  int ret = IR_CUT_STARTED;
+
+  night = night ? 1 : 0;
+  pthread_once(&act_once, act_init);
+  pthread_mutex_lock(&act.mu);
+  reap_locked();
+  if (act.state != IR_CUT_MOVING) {
+    start_locked(night);
+  } else if (night == act.target) {
+    act.pending = -1; // latest request wins over a queued one
+    ret = IR_CUT_MERGED;
+  } else {
+    act.pending = night;
+    ret = IR_CUT_QUEUED;
+  }
+  pthread_mutex_unlock(&act.mu);
+
+  LOG_DEBUG("ir cut request %s: %d", night ? "night" : "day", ret);
+  return ret;
+}
+
+ir_cut_state_t ir_cut_state(void) {
+  pthread_once(&act_once, act_init);
+  pthread_mutex_lock(&act.mu);
+  reap_locked();
+  ir_cut_state_t state = act.state;
+  pthread_mutex_unlock(&act.mu);
+  return state;
+}
+
+int ir_cut_wait(int timeout_ms) {
+  uint64_t deadline, until;
+  int ret = 0;
+
+  pthread_once(&act_once, act_init);
+  deadline = fw_clock_now_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+
+  pthread_mutex_lock(&act.mu);
+  for (;;) {
+    reap_locked();
+    if (act.state != IR_CUT_MOVING)
+      break;
+    if (timeout_ms >= 0 && fw_clock_now_ms() >= deadline) {
+      ret = -1;
+      break;
+    }
+    // Wake at the end of the pulse at the latest, in case no worker reaps it
+    until = act.release_ms;
+    if (timeout_ms >= 0 && deadline < until)
+      until = deadline;
+    fw_clock_cond_wait(&act.settled, &act.mu, until);
+  }
+  pthread_mutex_unlock(&act.mu);
+  return ret;
+}
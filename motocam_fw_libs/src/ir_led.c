@@ -0,0 +1,279 @@
+#include "ir_led.h"
+#include "fw.h"
+#include "fw/fw_clock.h"
+#include "hw_handle.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { LED_PWM5 = 0, LED_PWM4, LED_PWMS };
+
+static const char *const LED_PWM_FILE[LED_PWMS] = {PWM5_FILE, PWM4_FILE};
+
+static struct {
+  pthread_mutex_t mu;
+  pthread_cond_t applied;
+  int tfd;
+  int target;          // level being applied or applied, -1 for none
+  int busy;            // steps of the current change left to write
+  int result;          // outcome of the last change, for ir_led_wait()
+  int have_duty;       // duty[] holds what the PWMs were last set to
+  int persist_pending; // target applied but not yet persisted
+  uint32_t period;
+  uint32_t duty[LED_PWMS], from[LED_PWMS], to[LED_PWMS]; // off-times
+  int step, steps;
+  int stagger; // 1: pwm5 still to lead, 2: pwm5 already at its target
+  int armed;            // a timer event is scheduled at next_ms
+  uint64_t next_ms;     // fw_clock_now_ms() time of the next timer event
+} led = {.mu = PTHREAD_MUTEX_INITIALIZER, .tfd = -1, .target = -1};
+
+static pthread_once_t led_once = PTHREAD_ONCE_INIT;
+
+// "period,off" as in the IR_xx table of fw.h
+static int parse_duty(const char *s, uint32_t *period, uint32_t *off) {
+  return s && sscanf(s, "%u,%u", period, off) == 2 ? 0 : -1;
+}
+
+static int write_locked(const uint32_t *off, int first, int last) {
+  char val[32];
+  int ret = 0;
+
+  if (hw_pwm_lock() != 0)
+    return 1;
+  for (int n = first; n <= last && ret == 0; n++) {
+    snprintf(val, sizeof(val), "%u,%u", led.period, off[n]);
+    if (hw_pwm_write(LED_PWM_FILE[n], val) != 0) {
+      LOG_ERROR("ir led: failed to write %s", LED_PWM_FILE[n]);
+      ret = 1;
+    } else {
+      led.duty[n] = off[n];
+    }
+  }
+  hw_pwm_unlock();
+  return ret;
+}
+
+static void advance_locked(void);
+
+// The timer fired: take the next step, or persist the settled level
+static void expire_locked(void) {
+  if (led.busy) {
+    advance_locked();
+  } else if (led.persist_pending) {
+    led.persist_pending = 0;
+    set_uboot_env(IR, (uint8_t)led.target);
+  }
+}
+
+// Schedule the next timer event; without a timer, handle it inline
+static void arm_locked(int ms) {
+  struct itimerspec its;
+
+  led.next_ms = fw_clock_now_ms() + (uint64_t)ms;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (long)(ms % 1000) * 1000000L;
+  if (led.tfd >= 0 && timerfd_settime(led.tfd, 0, &its, NULL) == 0) {
+    led.armed = 1;
+    return;
+  }
+
+  led.armed = 0;
+  if (led.busy)
+    fw_clock_sleep_ms((uint32_t)ms);
+  expire_locked();
+}
+
+static void done_locked(int result) {
+  led.busy = 0;
+  led.result = result;
+  if (result != 0) {
+    // The PWMs are in an unknown state; the persisted level is current
+    led.target = -1;
+    led.have_duty = 0;
+    led.persist_pending = 0;
+  }
+  pthread_cond_broadcast(&led.applied);
+}
+
+static void advance_locked(void) {
+  uint32_t off[LED_PWMS];
+
+  if (led.stagger == 1) {
+    // pwm5 leads pwm4, as in the synchronous outdu_update_brightness()
+    led.stagger = 2;
+    if (write_locked(led.to, LED_PWM5, LED_PWM5) != 0) {
+      done_locked(1);
+      return;
+    }
+    arm_locked(IR_LED_STAGGER_MS);
+    return;
+  }
+
+  led.step++;
+  for (int n = 0; n < LED_PWMS; n++)
+    off[n] = (uint32_t)(led.from[n] + ((int64_t)led.to[n] - led.from[n]) *
+                                          led.step / led.steps);
+  if (write_locked(off, led.stagger == 2 ? LED_PWM4 : LED_PWM5, LED_PWM4) != 0) {
+    done_locked(1);
+    return;
+  }
+  if (led.step < led.steps) {
+    arm_locked(IR_LED_STEP_MS);
+    return;
+  }
+
+  led.have_duty = 1;
+  led.persist_pending = 1;
+  done_locked(0);
+  arm_locked(IR_LED_PERSIST_MS);
+}
+
+// The timer only wakes the worker; the deadline decides what is due
+static void reap_locked(void) {
+  uint64_t expirations;
+
+  if (led.tfd >= 0 && read(led.tfd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    LOG_ERROR("ir led: timerfd read failed: %s", strerror(errno));
+  while (led.armed && fw_clock_now_ms() >= led.next_ms) {
+    led.armed = 0;
+    expire_locked();
+  }
+}
+
+static void *ir_led_worker(void *arg) {
+  struct pollfd pfd = {.fd = led.tfd, .events = POLLIN, .revents = 0};
+  (void)arg;
+
+  for (;;) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      LOG_ERROR("ir led worker: poll failed: %s", strerror(errno));
+      return NULL;
+    }
+    pthread_mutex_lock(&led.mu);
+    reap_locked();
+    pthread_mutex_unlock(&led.mu);
+  }
+}
+
+static void led_init(void) {
+  pthread_condattr_t cattr;
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&led.applied, &cattr);
+  pthread_condattr_destroy(&cattr);
+
+  led.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (led.tfd < 0) {
+    LOG_ERROR("ir led: no timerfd (%s), changes will block", strerror(errno));
+    return;
+  }
+
+  // Without the thread a change still advances at the next ir_led_* call
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, ir_led_worker, NULL) != 0)
+    LOG_ERROR("ir led: no worker thread");
+  pthread_attr_destroy(&attr);
+}
+
+int ir_led_request(uint8_t level, int ramp_ms) {
+  uint32_t period4, period5, to[LED_PWMS];
+
+  if (parse_duty(get_pwm5_val(level), &period5, &to[LED_PWM5]) != 0 ||
+      parse_duty(get_pwm4_val(level), &period4, &to[LED_PWM4]) != 0 ||
+      period4 != period5)
+    return -1;
+
+  pthread_once(&led_once, led_init);
+  pthread_mutex_lock(&led.mu);
+  reap_locked();
+  if (led.busy && led.target == level) {
+    pthread_mutex_unlock(&led.mu);
+    return 0;
+  }
+
+  led.target = level;
+  led.period = period5;
+  led.busy = 1;
+  led.persist_pending = 0;
+  led.step = 0;
+  // Ramp from wherever the PWMs are now, including mid-ramp
+  if (led.have_duty && ramp_ms > 0) {
+    memcpy(led.from, led.duty, sizeof(led.from));
+    led.steps = ramp_ms / IR_LED_STEP_MS > 0 ? ramp_ms / IR_LED_STEP_MS : 1;
+    led.stagger = 0;
+  } else {
+    memcpy(led.from, to, sizeof(led.from));
+    led.steps = 1;
+    led.stagger = 1;
+  }
+  memcpy(led.to, to, sizeof(led.to));
+  advance_locked();
+  pthread_mutex_unlock(&led.mu);
+
+  LOG_DEBUG("ir led request %u, ramp %d ms", level, ramp_ms);
+  return 0;
+}
+
+int ir_led_target(void) {
+  pthread_once(&led_once, led_init);
+  pthread_mutex_lock(&led.mu);
+  reap_locked();
+  int target = led.target;
+  pthread_mutex_unlock(&led.mu);
+  return target;
+}
+
+int ir_led_wait(int timeout_ms) {
+  uint64_t deadline, until;
+  int ret;
+
+  pthread_once(&led_once, led_init);
+  deadline = fw_clock_now_ms() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0);
+
+  pthread_mutex_lock(&led.mu);
+  for (;;) {
+    reap_locked();
+    if (!led.busy) {
+      ret = led.result;
+      break;
+    }
+    if (timeout_ms >= 0 && fw_clock_now_ms() >= deadline) {
+      ret = -1;
+      break;
+    }
+    // Wake at the next step at the latest, in case no worker reaps it
+    until = led.next_ms;
+    if (timeout_ms >= 0 && deadline < until)
+      until = deadline;
+    fw_clock_cond_wait(&led.applied, &led.mu, until);
+  }
+  pthread_mutex_unlock(&led.mu);
+  return ret;
+}
+
+void ir_led_flush(void) {
+  pthread_once(&led_once, led_init);
+  pthread_mutex_lock(&led.mu);
+  reap_locked();
+  if (led.persist_pending) {
+    struct itimerspec off;
+
+    memset(&off, 0, sizeof(off));
+    if (led.tfd >= 0)
+      timerfd_settime(led.tfd, 0, &off, NULL);
+    led.armed = 0;
+    led.persist_pending = 0;
+    set_uboot_env(IR, (uint8_t)led.target);
+  }
+  pthread_mutex_unlock(&led.mu);
+}
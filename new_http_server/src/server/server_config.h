@@ -12,6 +12,8 @@ constexpr auto MAX_FILE_SIZE_BYTES = static_cast<long long>(MAX_FILE_SIZE_MB * 1
 
 constexpr char MISC_SOCK_PATH[] = "/tmp/misc_change.sock";
 constexpr char IR_SOCK_PATH[] = "/tmp/ir_change.sock";
+constexpr char OTA_PROGRESS_SOCK_PATH[] = "/tmp/ota_progress.sock";
+constexpr char JOB_EVENT_SOCK_PATH[] = "/tmp/job_event.sock";
 constexpr char HTTP_PORT[] = "80";
 
 struct Settings {
@@ -9,6 +9,7 @@
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -34,6 +35,46 @@ struct ir_event {
 };
 using ir_event_t = ir_event;
 
+// MUST match ota_progress_event_t in ota/.../camera-side/ota_handler.h
+struct ota_progress_event {
+  uint64_t bytes_done;
+  uint64_t bytes_total;
+  uint32_t files_done;
+  uint32_t files_total;
+  uint32_t eta_sec;
+  uint32_t elapsed_sec;
+  int32_t status;
+  uint8_t version;
+  uint8_t phase;
+  uint8_t percent;
+  uint8_t reserved;
+};
+using ota_progress_event_t = ota_progress_event;
+static_assert(sizeof(ota_progress_event_t) == 40,
+              "ota_progress_event_t layout changed");
+
+// MUST match job_event_t in motocam_api_libs/include/l1/motocam_job_api_l1.h
+struct job_event {
+  uint16_t job_id;
+  uint8_t command;
+  uint8_t sub_command;
+  int8_t result;
+  uint8_t reserved[3];
+};
+using job_event_t = job_event;
+static_assert(sizeof(job_event_t) == 8, "job_event_t layout changed");
+
+constexpr uint8_t OTA_PROGRESS_VERSION = 1;
+constexpr uint32_t OTA_PROGRESS_ETA_UNKNOWN = 0xFFFFFFFFu;
+
+static const char *ota_phase_to_string(uint8_t phase) {
+  static const char *const names[] = {"unknown",  "prepare", "verify",
+                                      "filelist", "backup",  "install",
+                                      "check",    "rollback", "done",
+                                      "failed"};
+  return phase < sizeof(names) / sizeof(names[0]) ? names[phase] : "unknown";
+}
+
 enum class MiscEventType { STARTED_STREAMING, CHANGING_MISC };
 
 static const char *misc_event_type_to_string(MiscEventType type) {
@@ -118,11 +159,85 @@ void WebServer::handle_ir_event() {
   }
 }
 
+void WebServer::handle_ota_progress_event() {
+  if (ota_socket_fd < 0)
+    return;
+
+  // ota_service already rate limits; drain anything queued while we were busy
+  // and relay only the newest event so a slow client never sees stale progress
+  ota_progress_event_t evt, latest;
+  bool have_event = false;
+  ssize_t n;
+  while ((n = recv(ota_socket_fd, &evt, sizeof(evt), MSG_DONTWAIT)) >= 0) {
+    if (n == static_cast<ssize_t>(sizeof(evt)) &&
+        evt.version == OTA_PROGRESS_VERSION) {
+      latest = evt;
+      have_event = true;
+    }
+  }
+  if (!have_event)
+    return;
+
+  LOG_DEBUG("OTA progress event received: phase=%u percent=%u",
+            latest.phase, latest.percent);
+
+  std::string json_msg =
+      R"({"event_type":"ota progress","phase":")" +
+      std::string(ota_phase_to_string(latest.phase)) +
+      R"(","status":)" + std::to_string(latest.status) +
+      R"(,"percent":)" + std::to_string(latest.percent) +
+      R"(,"bytes_done":)" + std::to_string(latest.bytes_done) +
+      R"(,"bytes_total":)" + std::to_string(latest.bytes_total) +
+      R"(,"files_done":)" + std::to_string(latest.files_done) +
+      R"(,"files_total":)" + std::to_string(latest.files_total) +
+      R"(,"eta_sec":)" +
+      (latest.eta_sec == OTA_PROGRESS_ETA_UNKNOWN
+           ? std::string("null")
+           : std::to_string(latest.eta_sec)) +
+      R"(,"elapsed_sec":)" + std::to_string(latest.elapsed_sec) + "}";
+
+  broadcast_message(json_msg.c_str());
+}
+
+void WebServer::handle_job_event() {
+  if (job_socket_fd < 0)
+    return;
+
+  job_event_t evt;
+  ssize_t n = recv(job_socket_fd, &evt, sizeof(evt), MSG_DONTWAIT);
+
+  if (n == static_cast<ssize_t>(sizeof(evt))) {
+    LOG_DEBUG("Job event received: job_id=%u, result=%d", evt.job_id,
+              evt.result);
+
+    std::string json_msg =
+        R"({"event_type":"job done","job_id":)" + std::to_string(evt.job_id) +
+        R"(,"command":)" + std::to_string(evt.command) +
+        R"(,"sub_command":)" + std::to_string(evt.sub_command) +
+        R"(,"result":)" + std::to_string(evt.result) + "}";
+
+    broadcast_message(json_msg.c_str());
+  }
+}
+
 void WebServer::broadcast_loop() {
+  // Sleep in poll() so events are relayed as they arrive instead of on a tick
   while (!stop_broadcast) {
-    handle_misc_event();
-    handle_ir_event();
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    struct pollfd fds[] = {{misc_socket_fd, POLLIN, 0},
+                           {ir_socket_fd, POLLIN, 0},
+                           {ota_socket_fd, POLLIN, 0},
+                           {job_socket_fd, POLLIN, 0}};
+    if (poll(fds, 4, 500) <= 0)
+      continue;
+
+    if (fds[0].revents & POLLIN)
+      handle_misc_event();
+    if (fds[1].revents & POLLIN)
+      handle_ir_event();
+    if (fds[2].revents & POLLIN)
+      handle_ota_progress_event();
+    if (fds[3].revents & POLLIN)
+      handle_job_event();
   }
 }
 
@@ -280,6 +395,24 @@ void WebServer::ws_close_handler(const struct mg_connection *conn,
   printf("Client closed connection\n");
 }
 
+// Binds a datagram socket that local daemons send event structs to
+static int bind_event_socket(const char *path) {
+  int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return -1;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
 bool WebServer::init() {
   mg_init_library(0);
 
@@ -319,38 +452,13 @@ bool WebServer::init() {
                void *))ws_data_handler,
       (void (*)(const struct mg_connection *, void *))ws_close_handler, this);
 
-  // Init sockets (Misc & IR) - similar to original code
-  // ... (Code omitted for brevity, assuming similar to original but using
-  // ServerConfig::MISC_SOCK_PATH) Actually I should copy the socket init code
-  // from original net.cpp
-
-  misc_socket_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
-  if (misc_socket_fd >= 0) {
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, ServerConfig::MISC_SOCK_PATH,
-            sizeof(addr.sun_path) - 1);
-    unlink(ServerConfig::MISC_SOCK_PATH);
-    if (bind(misc_socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-      close(misc_socket_fd);
-      misc_socket_fd = -1;
-    }
-  }
+  // Event sockets: misc and IR changes from the fw libs, OTA progress from
+  // ota_service, finished SET_ASYNC jobs from the api libs
 
-  ir_socket_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
-  if (ir_socket_fd >= 0) {
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, ServerConfig::IR_SOCK_PATH,
-            sizeof(addr.sun_path) - 1);
-    unlink(ServerConfig::IR_SOCK_PATH);
-    if (bind(ir_socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-      close(ir_socket_fd);
-      ir_socket_fd = -1;
-    }
-  }
+  misc_socket_fd = bind_event_socket(ServerConfig::MISC_SOCK_PATH);
+  ir_socket_fd = bind_event_socket(ServerConfig::IR_SOCK_PATH);
+  ota_socket_fd = bind_event_socket(ServerConfig::OTA_PROGRESS_SOCK_PATH);
+  job_socket_fd = bind_event_socket(ServerConfig::JOB_EVENT_SOCK_PATH);
 
   stop_broadcast = false;
   broadcast_thread = std::thread(&WebServer::broadcast_loop, this);
@@ -379,6 +487,16 @@ void WebServer::shutdown() {
     ir_socket_fd = -1;
     unlink(ServerConfig::IR_SOCK_PATH);
   }
+  if (ota_socket_fd >= 0) {
+    close(ota_socket_fd);
+    ota_socket_fd = -1;
+    unlink(ServerConfig::OTA_PROGRESS_SOCK_PATH);
+  }
+  if (job_socket_fd >= 0) {
+    close(job_socket_fd);
+    job_socket_fd = -1;
+    unlink(ServerConfig::JOB_EVENT_SOCK_PATH);
+  }
 
   mg_exit_library();
 }
@@ -31,6 +31,8 @@ public:
 private:
   int misc_socket_fd{-1};
   int ir_socket_fd{-1};
+  int ota_socket_fd{-1};
+  int job_socket_fd{-1};
   bool stop_broadcast{false};
   std::string document_root{"dist"};
 
@@ -46,6 +48,8 @@ private:
 
   void handle_misc_event();
   void handle_ir_event();
+  void handle_ota_progress_event();
+  void handle_job_event();
   void broadcast_loop();
 
   // Static request handlers routed to instance
@@ -0,0 +1,129 @@
+/**
+ * @file ota_bench.c
+ * @brief Decompression benchmark for OTA firmware package formats.
+ *
+ * Compares package size and decompression throughput of fw_package.tar.gz
+ * against the seekable fw_package.tar.zst produced by ota_packager --zstd.
+ * Meant to be run on the camera, since target CPU throughput is what matters.
+ *
+ *   ./ota_bench fw_package.tar.gz fw_package.tar.zst [iterations]
+ *
+ * @author Rikin Shah
+ * @date 2026-10-19
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef OTA_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+// Inflates the whole file and returns the decompressed byte count
+static long long bench_gzip(const char *path) {
+    gzFile gz = gzopen(path, "rb");
+    if (!gz) return -1;
+    gzbuffer(gz, 64 * 1024);
+
+    static unsigned char buf[64 * 1024];
+    long long total = 0;
+    int n;
+    while ((n = gzread(gz, buf, sizeof(buf))) > 0)
+        total += n;
+    gzclose(gz);
+    return n < 0 ? -1 : total;
+}
+
+#ifdef OTA_HAVE_ZSTD
+// Streams every frame; the index and seek table frames are skippable and ignored
+static long long bench_zstd(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (!fp || !dctx) {
+        if (fp) fclose(fp);
+        ZSTD_freeDCtx(dctx);
+        return -1;
+    }
+
+    size_t in_cap = ZSTD_DStreamInSize(), out_cap = ZSTD_DStreamOutSize();
+    unsigned char *in_buf = malloc(in_cap), *out_buf = malloc(out_cap);
+    long long total = 0;
+    size_t n;
+    while (in_buf && out_buf && (n = fread(in_buf, 1, in_cap, fp)) > 0) {
+        ZSTD_inBuffer in = { in_buf, n, 0 };
+        while (in.pos < in.size) {
+            ZSTD_outBuffer out = { out_buf, out_cap, 0 };
+            size_t rc = ZSTD_decompressStream(dctx, &out, &in);
+            if (ZSTD_isError(rc)) {
+                total = -1;
+                goto done;
+            }
+            total += out.pos;
+        }
+    }
+
+done:
+    free(in_buf);
+    free(out_buf);
+    ZSTD_freeDCtx(dctx);
+    fclose(fp);
+    return total;
+}
+#endif
+
+static void report(const char *label, const char *path, long long (*fn)(const char *), int iterations) {
+    long size = file_size(path);
+    if (size < 0) {
+        printf("%-5s %s: not found\n", label, path);
+        return;
+    }
+
+    long long out = 0;
+    double best = 1e9;
+    for (int i = 0; i < iterations; i++) {
+        double t0 = now_sec();
+        out = fn(path);
+        double dt = now_sec() - t0;
+        if (out < 0) {
+            printf("%-5s %s: decompression failed\n", label, path);
+            return;
+        }
+        if (dt < best) best = dt;
+    }
+
+    printf("%-5s size %9ld B  ratio %5.3f  best %8.2f ms  %8.2f MB/s\n",
+           label, size, out ? (double)size / out : 0.0, best * 1e3,
+           best > 0 ? out / best / 1e6 : 0.0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s fw_package.tar.gz fw_package.tar.zst [iterations]\n", argv[0]);
+        return 1;
+    }
+    int iterations = argc > 3 ? atoi(argv[3]) : 5;
+    if (iterations < 1) iterations = 1;
+
+    report("gzip", argv[1], bench_gzip, iterations);
+#ifdef OTA_HAVE_ZSTD
+    report("zstd", argv[2], bench_zstd, iterations);
+#else
+    printf("zstd  built without zstd support (make ZSTD=1)\n");
+#endif
+    return 0;
+}
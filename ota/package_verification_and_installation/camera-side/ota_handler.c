@@ -9,6 +9,12 @@
  */
 
 #include "ota_handler.h"
+#include <dirent.h>
+#include <signal.h>
+#include <zlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
 
 #define CMD_SIZE            e_SIZE_256
 #define VALUE_SIZE          e_SIZE_128
@@ -29,9 +35,36 @@ void log_msg(const char *msg) {
     printf("[%s] %s\n", buf, msg);
 }
 
+// Reads the "compression" field of the manifest; gzip when absent
+int ota_package_is_zstd() {
+    static int cached = -1;
+    if (cached >= 0)
+        return cached;
+
+    cached = 0;
+    FILE *fp = fopen(OTA_MANIFEST, "r");
+    if (!fp)
+        return cached;
+
+    char line[e_SIZE_512];
+    while (fgets(line, sizeof(line), fp)) {
+        const char *key = strstr(line, "\"compression\"");
+        if (key) {
+            cached = strstr(key, "\"zstd\"") != NULL;
+            break;
+        }
+    }
+    fclose(fp);
+    return cached;
+}
+
+const char* ota_package_path() {
+    return ota_package_is_zstd() ? OTA_TAR_ZST : OTA_TAR;
+}
+
 int reject_large_update() {
     struct stat st;
-    if (stat(OTA_TAR, &st) != e_OTA_SUCCESS) {
+    if (stat(ota_package_path(), &st) != e_OTA_SUCCESS) {
         perror("stat OTA_TAR");
         return e_OTA_ERR_MANIFEST_OPEN;
     }
@@ -73,10 +106,470 @@ int verify_package() {
     return run_command("Verifying OTA package...", cmd);
 }
 
+// Inflates the gzip package in-process and pipes the tar stream into cmd.
+// When verify_ota left a chunk list, every chunk is checked against the
+// signed Merkle tree before it is inflated, so corruption stops the stream
+// at the bad chunk and is reported as e_OTA_ERR_VERIFY_FAILED. install = 1
+// also throttles and reports progress.
+static int stream_gzip_package(const char *cmd, int install) {
+    int ret = e_OTA_ERR_EXTRACTION_FAILED;
+    ota_chunks_t chunks;
+    int fd = open(OTA_TAR, O_RDONLY | O_CLOEXEC);
+    int have_chunks = fd >= 0 ? ota_chunks_load(&chunks, OTA_CHUNK_HASHES) : -1;
+    struct stat st;
+    if (fd < 0 || have_chunks < 0 || fstat(fd, &st) != 0 ||
+        (have_chunks == 0 && ota_chunks_bind(&chunks, fd) != 0)) {
+        log_msg("OTA package is missing or does not match its chunk list.");
+        if (fd >= 0 && have_chunks == 0) ret = e_OTA_ERR_VERIFY_FAILED;
+        if (fd >= 0) close(fd);
+        if (have_chunks == 0) ota_chunks_free(&chunks);
+        return ret;
+    }
+
+    size_t in_cap = have_chunks == 0 ? chunks.chunk_size : 65536;
+    unsigned char *in_buf = malloc(in_cap);
+    unsigned char out_buf[16384];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (!in_buf || inflateInit2(&zs, 15 + 16) != Z_OK) {
+        free(in_buf);
+        close(fd);
+        if (have_chunks == 0) ota_chunks_free(&chunks);
+        return ret;
+    }
+
+    log_msg(cmd);
+    // An early tar exit must surface as a failed write, not kill the service
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+    FILE *out = popen(cmd, "w");
+    if (!out) perror("popen (tar)");
+
+    uint64_t off = 0;
+    uint32_t index = 0;
+    int zrc = Z_OK, failed = !out, tar_gone = 0;
+    while (!failed && !tar_gone && off < (uint64_t)st.st_size) {
+        size_t want = (uint64_t)st.st_size - off < in_cap ? (size_t)(st.st_size - off) : in_cap;
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = read(fd, in_buf + got, want - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
+        }
+        if (got != want) {
+            failed = 1;
+            break;
+        }
+        if (have_chunks == 0 && ota_chunk_check(&chunks, index, in_buf, got) != 0) {
+            char msg[e_SIZE_128];
+            snprintf(msg, sizeof(msg), "Package chunk %u does not match the signed Merkle tree. Aborting.", index);
+            log_msg(msg);
+            ret = e_OTA_ERR_VERIFY_FAILED;
+            failed = 1;
+            break;
+        }
+        index++;
+        off += got;
+
+        zs.next_in = in_buf;
+        zs.avail_in = (uInt)got;
+        while (zs.avail_in > 0 && !failed && !tar_gone) {
+            if (zrc == Z_STREAM_END) {
+                inflateReset(&zs);  // concatenated gzip members
+                zrc = Z_OK;
+            }
+            zs.next_out = out_buf;
+            zs.avail_out = sizeof(out_buf);
+            zrc = inflate(&zs, Z_NO_FLUSH);
+            if (zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR) {
+                log_msg("OTA package is corrupt.");
+                failed = 1;
+                break;
+            }
+            size_t produced = sizeof(out_buf) - zs.avail_out;
+            if (produced > 0 && fwrite(out_buf, 1, produced, out) != produced) {
+                // tar stops reading after the end-of-archive blocks; its exit status decides
+                tar_gone = 1;
+                break;
+            }
+            if (install) ota_throttle_account(produced);
+        }
+        if (install) ota_progress_update(off, 0);
+    }
+    if (!failed && !tar_gone && zrc != Z_STREAM_END) {
+        log_msg("OTA package is truncated.");
+        failed = 1;
+    }
+
+    inflateEnd(&zs);
+    free(in_buf);
+    close(fd);
+    if (have_chunks == 0) ota_chunks_free(&chunks);
+
+    int status = out ? pclose(out) : -1;
+    signal(SIGPIPE, old_sigpipe);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        char err[e_SIZE_128];
+        snprintf(err, sizeof(err), "Command failed with exit code %d",
+                 status == -1 ? -1 : WEXITSTATUS(status));
+        log_msg(err);
+        failed = 1;
+    }
+    return failed ? ret : e_OTA_SUCCESS;
+}
+
 int extract_file_list_from_tar() {
+    if (ota_package_is_zstd()) {
+        log_msg("Reading file list from zstd package index...");
+        return zst_list_files(OTA_TAR_ZST, TMP_FILE_LIST);
+    }
+
     char cmd[e_SIZE_512];
-    snprintf(cmd, sizeof(cmd), "gzip -dc %s | tar -tf - | grep -v '/$' > %s", OTA_TAR, TMP_FILE_LIST);
-    return run_command("Extracting file list from OTA package...", cmd);
+    snprintf(cmd, sizeof(cmd), "tar -tf - | grep -v '/$' > %s", TMP_FILE_LIST);
+    log_msg("Extracting file list from OTA package...");
+    return stream_gzip_package(cmd, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Per-file hash comparison
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char *path;
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    char sha256[65];
+} ota_hash_entry_t;
+
+typedef struct {
+    ota_hash_entry_t *items;
+    size_t count;
+    size_t sorted;   // items[0..sorted) are ordered by path for bsearch
+    size_t cap;
+} ota_hash_table_t;
+
+static int hash_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const ota_hash_entry_t *)a)->path, ((const ota_hash_entry_t *)b)->path);
+}
+
+static void hash_table_free(ota_hash_table_t *t) {
+    for (size_t i = 0; i < t->count; i++)
+        free(t->items[i].path);
+    free(t->items);
+    memset(t, 0, sizeof(*t));
+}
+
+static ota_hash_entry_t *hash_table_add(ota_hash_table_t *t, const char *path) {
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        ota_hash_entry_t *items = realloc(t->items, cap * sizeof(*items));
+        if (!items) return NULL;
+        t->items = items;
+        t->cap = cap;
+    }
+    ota_hash_entry_t *e = &t->items[t->count];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    if (!e->path) return NULL;
+    t->count++;
+    return e;
+}
+
+static ota_hash_entry_t *hash_table_find(ota_hash_table_t *t, const char *path) {
+    ota_hash_entry_t key = { .path = (char *)path };
+    ota_hash_entry_t *e = t->sorted ? bsearch(&key, t->items, t->sorted, sizeof(key), hash_entry_cmp) : NULL;
+    if (e) return e;
+    for (size_t i = t->sorted; i < t->count; i++) {
+        if (strcmp(t->items[i].path, path) == 0) return &t->items[i];
+    }
+    return NULL;
+}
+
+// Loads either the manifest list (with_mtime = 0) or the installed-file index
+static int hash_table_load(ota_hash_table_t *t, const char *file, int with_mtime) {
+    FILE *fp = fopen(file, "r");
+    if (!fp) return -1;
+
+    char line[e_SIZE_1024];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = 0;
+        char sha[65];
+        long long size, mtime_sec = 0;
+        long mtime_nsec = 0;
+        int off = 0;
+        int ok = with_mtime
+            ? sscanf(line, "%64s %lld %lld %ld %n", sha, &size, &mtime_sec, &mtime_nsec, &off) == 4
+            : sscanf(line, "%64s %lld %n", sha, &size, &off) == 2;
+        if (!ok || off == 0 || line[off] == '\0') continue;
+
+        ota_hash_entry_t *e = hash_table_add(t, line + off);
+        if (!e) break;
+        memcpy(e->sha256, sha, sizeof(e->sha256));
+        e->size = size;
+        e->mtime_sec = mtime_sec;
+        e->mtime_nsec = mtime_nsec;
+    }
+    fclose(fp);
+
+    qsort(t->items, t->count, sizeof(*t->items), hash_entry_cmp);
+    t->sorted = t->count;
+    return 0;
+}
+
+static int hash_table_save_index(const ota_hash_table_t *t) {
+    char tmp[e_SIZE_256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", HASH_INDEX_FILE);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        perror("fopen (HASH_INDEX_FILE)");
+        return e_OTA_ERR_INTERNAL;
+    }
+    for (size_t i = 0; i < t->count; i++) {
+        const ota_hash_entry_t *e = &t->items[i];
+        fprintf(fp, "%s %lld %lld %ld %s\n", e->sha256, e->size, e->mtime_sec, e->mtime_nsec, e->path);
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        remove(tmp);
+        return e_OTA_ERR_INTERNAL;
+    }
+    fclose(fp);
+    if (rename(tmp, HASH_INDEX_FILE) != 0) {
+        perror("rename (HASH_INDEX_FILE)");
+        remove(tmp);
+        return e_OTA_ERR_INTERNAL;
+    }
+    return e_OTA_SUCCESS;
+}
+
+static void digest_to_hex(const unsigned char *md, unsigned int md_len, char *out_hex) {
+    for (unsigned int i = 0; i < md_len; i++)
+        sprintf(out_hex + i * 2, "%02x", md[i]);
+}
+
+// Hashes a file through a read-only mapping; no copy through stdio buffers
+static int sha256_file_hex(const char *path, char out_hex[65]) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    int ok = EVP_Digest(map ? map : "", st.st_size, md, &md_len, EVP_sha256(), NULL);
+    if (map) munmap(map, st.st_size);
+    if (ok != 1 || md_len != 32) return -1;
+
+    digest_to_hex(md, md_len, out_hex);
+    return 0;
+}
+
+static void index_record(ota_hash_table_t *index, const char *path, const struct stat *st, const char *sha) {
+    ota_hash_entry_t *e = hash_table_find(index, path);
+    if (!e) e = hash_table_add(index, path);
+    if (!e) return;
+    memcpy(e->sha256, sha, sizeof(e->sha256));
+    e->size = st->st_size;
+    e->mtime_sec = st->st_mtim.tv_sec;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+int skip_unchanged_files() {
+    ota_hash_table_t manifest = {0};
+    ota_hash_table_t index = {0};
+
+    if (hash_table_load(&manifest, OTA_FILE_HASHES, 0) != 0) {
+        log_msg("No per-file hashes in package; installing all files.");
+        return e_OTA_SUCCESS;
+    }
+    hash_table_load(&index, HASH_INDEX_FILE, 1);  // optional cache
+    ota_progress_set_total(0, (uint32_t)manifest.count);
+
+    char tmp_list[e_SIZE_256];
+    snprintf(tmp_list, sizeof(tmp_list), "%s.tmp", TMP_FILE_LIST);
+    FILE *in = fopen(TMP_FILE_LIST, "r");
+    FILE *out = in ? fopen(tmp_list, "w") : NULL;
+    if (!in || !out) {
+        perror("fopen (TMP_FILE_LIST)");
+        if (in) fclose(in);
+        hash_table_free(&manifest);
+        hash_table_free(&index);
+        return e_OTA_ERR_FILELIST_FAILED;
+    }
+
+    char path[e_SIZE_512];
+    int skipped = 0, changed = 0, rehashed = 0;
+    while (fgets(path, sizeof(path), in)) {
+        path[strcspn(path, "\n")] = 0;
+        if (strlen(path) == 0) continue;
+        ota_progress_update(0, skipped + changed);
+
+        ota_hash_entry_t *m = hash_table_find(&manifest, path);
+        if (m) {
+            char installed[e_SIZE_1024];
+            struct stat st;
+            snprintf(installed, sizeof(installed), "%s/%s", VIENNA_DIR, path);
+            if (lstat(installed, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == m->size) {
+                const char *sha = NULL;
+                char computed[65];
+                ota_hash_entry_t *c = hash_table_find(&index, path);
+                if (c && c->size == st.st_size && c->mtime_sec == (long long)st.st_mtim.tv_sec &&
+                    c->mtime_nsec == st.st_mtim.tv_nsec) {
+                    sha = c->sha256;
+                } else if (sha256_file_hex(installed, computed) == 0) {
+                    index_record(&index, path, &st, computed);
+                    sha = computed;
+                    rehashed++;
+                }
+                if (sha && strcmp(sha, m->sha256) == 0) {
+                    skipped++;
+                    continue;
+                }
+            }
+        }
+        fprintf(out, "%s\n", path);
+        changed++;
+    }
+    fclose(in);
+
+    if (fclose(out) != 0 || rename(tmp_list, TMP_FILE_LIST) != 0) {
+        perror("rename (TMP_FILE_LIST)");
+        remove(tmp_list);
+        hash_table_free(&manifest);
+        hash_table_free(&index);
+        return e_OTA_ERR_FILELIST_FAILED;
+    }
+
+    if (rehashed > 0)
+        hash_table_save_index(&index);
+
+    char msg[e_SIZE_128];
+    snprintf(msg, sizeof(msg), "%d files unchanged and skipped, %d to install (%d rehashed).",
+             skipped, changed, rehashed);
+    log_msg(msg);
+
+    hash_table_free(&manifest);
+    hash_table_free(&index);
+    return e_OTA_SUCCESS;
+}
+
+int update_hash_index() {
+    ota_hash_table_t manifest = {0};
+    ota_hash_table_t index = {0};
+
+    if (hash_table_load(&manifest, OTA_FILE_HASHES, 0) != 0)
+        return e_OTA_SUCCESS;
+    hash_table_load(&index, HASH_INDEX_FILE, 1);
+
+    // Every listed file is now either freshly extracted from the verified
+    // package or was found identical to it, so the manifest hash applies.
+    for (size_t i = 0; i < manifest.count; i++) {
+        char installed[e_SIZE_1024];
+        struct stat st;
+        snprintf(installed, sizeof(installed), "%s/%s", VIENNA_DIR, manifest.items[i].path);
+        if (lstat(installed, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == manifest.items[i].size)
+            index_record(&index, manifest.items[i].path, &st, manifest.items[i].sha256);
+    }
+
+    int ret = hash_table_save_index(&index);
+    hash_table_free(&manifest);
+    hash_table_free(&index);
+    return ret;
+}
+
+// Number of entries in TMP_FILE_LIST and, when the package carries per-file
+// hashes, their total unpacked size (0 otherwise)
+static uint32_t file_list_totals(uint64_t *bytes_total) {
+    ota_hash_table_t manifest = {0};
+    int have_sizes = hash_table_load(&manifest, OTA_FILE_HASHES, 0) == 0;
+    *bytes_total = 0;
+
+    uint32_t files = 0;
+    FILE *fp = fopen(TMP_FILE_LIST, "r");
+    char path[e_SIZE_512];
+    while (fp && fgets(path, sizeof(path), fp)) {
+        path[strcspn(path, "\n")] = 0;
+        if (path[0] == '\0') continue;
+        files++;
+        ota_hash_entry_t *m = have_sizes ? hash_table_find(&manifest, path) : NULL;
+        if (m)
+            *bytes_total += m->size;
+        else
+            have_sizes = 0;  // a partial sum would make the ETA lie
+    }
+    if (fp) fclose(fp);
+    if (!have_sizes) *bytes_total = 0;
+
+    hash_table_free(&manifest);
+    return files;
+}
+
+// In-process `cp -a` for the backup and rollback copies, so their writes go
+// through the install throttle. Returns 1 when src does not exist.
+static int copy_preserving(const char *src, const char *dst) {
+    struct stat st;
+    if (lstat(src, &st) != 0)
+        return errno == ENOENT ? 1 : -1;
+
+    if (S_ISLNK(st.st_mode)) {
+        char target[e_SIZE_1024];
+        ssize_t n = readlink(src, target, sizeof(target) - 1);
+        if (n < 0) return -1;
+        target[n] = '\0';
+        unlink(dst);
+        return symlink(target, dst);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        char cp_cmd[e_SIZE_1024 * 2 + 32];
+        snprintf(cp_cmd, sizeof(cp_cmd), "cp -a \"%s\" \"%s\" 2>/dev/null", src, dst);
+        return run_command("Copying special file...", cp_cmd) == 0 ? 0 : -1;
+    }
+
+    char tmp[e_SIZE_1024];
+    snprintf(tmp, sizeof(tmp), "%s.ota_tmp", dst);
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    int out = in >= 0 ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    if (out < 0) {
+        if (in >= 0) close(in);
+        return -1;
+    }
+
+    unsigned char buf[16384];
+    ssize_t n;
+    int ret = 0;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            ret = -1;
+            break;
+        }
+        ota_throttle_account(n);
+    }
+    if (n < 0) ret = -1;
+    close(in);
+
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if (fchown(out, st.st_uid, st.st_gid) != 0) { /* best effort, as cp -a */ }
+    if (ret == 0 && (fchmod(out, st.st_mode & 07777) != 0 || futimens(out, times) != 0)) ret = -1;
+    if (close(out) != 0) ret = -1;
+    if (ret == 0 && rename(tmp, dst) != 0) ret = -1;
+    if (ret != 0) unlink(tmp);
+    return ret;
 }
 
 int backup_files_from_list() {
@@ -86,6 +579,10 @@ int backup_files_from_list() {
         return e_OTA_ERR_BACKUP_FAILED;
     }
 
+    uint64_t bytes_total;
+    uint32_t files_total = file_list_totals(&bytes_total), done = 0;
+    ota_progress_set_total(0, files_total);
+
     char path[e_SIZE_512];
     size_t len = 0;
     while (fgets(path, sizeof(path), fp)) {
@@ -106,19 +603,51 @@ int backup_files_from_list() {
         snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p \"%s\"", dirname(dst_dir));
         run_command("Creating backup directory...", mkdir_cmd);
 
-        char cp_cmd[e_SIZE_1024];
-        snprintf(cp_cmd, sizeof(cp_cmd), "cp -a \"%s\" \"%s\" 2>/dev/null", src, dst);
-        run_command("Backing up file...", cp_cmd);
+        // A file new in this OTA has nothing to back up
+        if (copy_preserving(src, dst) < 0) {
+            char msg[e_SIZE_1024];
+            snprintf(msg, sizeof(msg), "Warning: failed to back up %s", src);
+            log_msg(msg);
+        }
+        ota_progress_update(0, ++done);
     }
 
     fclose(fp);
+    ota_throttle_flush();
     return e_OTA_SUCCESS;
 }
 
 int extract_tar_package() {
+    struct stat st;
+    if (stat(TMP_FILE_LIST, &st) == 0 && st.st_size == 0) {
+        log_msg("All files already up to date; nothing to extract.");
+        return e_OTA_SUCCESS;
+    }
+
+    uint64_t bytes_total;
+    uint32_t files_total = file_list_totals(&bytes_total);
+
+    // Only the files left in the list after skip_unchanged_files() are written
+    if (ota_package_is_zstd()) {
+        log_msg("Extracting OTA package contents (zstd)...");
+        ota_progress_set_total(bytes_total, files_total);
+        int ret = zst_extract_files(OTA_TAR_ZST, VIENNA_DIR, TMP_FILE_LIST);
+        ota_throttle_flush();
+        return ret;
+    }
+
+    struct stat pkg;
+    uint64_t pkg_size = stat(OTA_TAR, &pkg) == 0 ? (uint64_t)pkg.st_size : 0;
+    ota_progress_set_total(pkg_size, files_total);
+
     char cmd[e_SIZE_512];
-    snprintf(cmd, sizeof(cmd), "gzip -dc %s | tar -xf - -C %s", OTA_TAR, VIENNA_DIR);
-    return run_command("Extracting OTA package contents...", cmd);
+    snprintf(cmd, sizeof(cmd), "tar -xf - -C %s -T %s", VIENNA_DIR, TMP_FILE_LIST);
+    log_msg("Extracting OTA package contents...");
+    int ret = stream_gzip_package(cmd, 1);
+    if (ret == e_OTA_SUCCESS)
+        ota_progress_update(pkg_size, files_total);
+    ota_throttle_flush();
+    return ret;
 }
 
 int run_updated_component() {
@@ -139,6 +668,10 @@ int rollback_partial() {
         return e_OTA_ERR_ROLLBACK_FAILED;
     }
 
+    uint64_t bytes_total;
+    uint32_t done = 0;
+    ota_progress_set_total(0, file_list_totals(&bytes_total));
+
     char path[e_SIZE_512];
     size_t len = 0;
     while (fgets(path, sizeof(path), fp)) {
@@ -149,44 +682,92 @@ int rollback_partial() {
 
         char src[e_SIZE_512];
         char dst[e_SIZE_512];
-        snprintf(src, sizeof(src), "%s/%s", BACKUP_DIR, path);
-        snprintf(dst, sizeof(dst), "%s/%s", VIENNA_DIR, path);
-
-        char cp_cmd[e_SIZE_1024];
-        snprintf(cp_cmd, sizeof(cp_cmd), "cp -a \"%s\" \"%s\" 2>/dev/null", src, dst);
-        run_command("Restoring backup file...", cp_cmd);
+        if (snprintf(src, sizeof(src), "%s/%s", BACKUP_DIR, path) >= (int)sizeof(src) ||
+            snprintf(dst, sizeof(dst), "%s/%s", VIENNA_DIR, path) >= (int)sizeof(dst) ||
+            copy_preserving(src, dst) < 0) {
+            char msg[e_SIZE_1024];
+            snprintf(msg, sizeof(msg), "Warning: failed to restore %s/%s", VIENNA_DIR, path);
+            log_msg(msg);
+        }
+        ota_progress_update(0, ++done);
     }
 
     fclose(fp);
+    ota_throttle_flush();
     return e_OTA_SUCCESS;
 }
 
 int clean_ota_temp_files() {
-    char cmd[e_SIZE_256];
-    snprintf(cmd, sizeof(cmd), "rm -f %s/fw_package.tar.gz %s/manifest.json %s", OTA_DIR, OTA_DIR, TMP_FILE_LIST);
+    char cmd[e_SIZE_512];
+    snprintf(cmd, sizeof(cmd), "rm -f %s %s %s/manifest.json %s %s %s", OTA_TAR, OTA_TAR_ZST, OTA_DIR, TMP_FILE_LIST,
+             OTA_FILE_HASHES, OTA_CHUNK_HASHES);
     return run_command("Cleaning up OTA temporary files...", cmd);
 }
 
 int is_ota_in_progress() {
-    FILE *fp = popen("ps | grep ota_service | grep -v grep", "r");
-    if (!fp) {
-        perror("popen");
+    // The lock is held for the lifetime of this process and released by the
+    // kernel on exit, so a crashed service never leaves a stale lock behind.
+    static int lock_fd = -1;
+    if (lock_fd >= 0)
+        return 0;
+
+    int fd = open(OTA_LOCK_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open (OTA_LOCK_FILE)");
         return 0;
     }
 
-    char line[e_SIZE_256];
-    int count = 0;
-    pid_t self_pid = getpid();
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        int busy = (errno == EWOULDBLOCK);
+        if (!busy)
+            perror("flock (OTA_LOCK_FILE)");
+        close(fd);
+        return busy;
+    }
 
-    while (fgets(line, sizeof(line), fp)) {
-        int pid;
-        if ((sscanf(line, "%d", &pid) == 1) && (pid != self_pid)) {
-            count++;
+    lock_fd = fd;
+    return 0;
+}
+
+static int remove_tree_at(int parent_fd, const char *name) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        // Not a directory (or a symlink to one): unlink the entry itself
+        if (errno == ENOTDIR || errno == ELOOP)
+            return unlinkat(parent_fd, name, 0);
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        if (ent->d_type == DT_DIR || ent->d_type == DT_UNKNOWN) {
+            if (remove_tree_at(dirfd(dir), ent->d_name) != 0) ret = -1;
+        } else if (unlinkat(dirfd(dir), ent->d_name, 0) != 0 && errno != ENOENT) {
+            ret = -1;
         }
     }
+    closedir(dir);
 
-    pclose(fp);
-    return count > 0;
+    if (unlinkat(parent_fd, name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+        ret = -1;
+    return ret;
+}
+
+int remove_tree(const char *path) {
+    if (remove_tree_at(AT_FDCWD, path) != 0) {
+        perror("remove_tree");
+        return e_OTA_ERR_INTERNAL;
+    }
+    return e_OTA_SUCCESS;
 }
 
 int set_config_file_var(const char *var, const char *val) {
@@ -275,28 +856,40 @@ int set_ota_status_env_from_result(e_OTA_RESULT result) {
     return set_config_file_var(OTA_STATUS_ENV_VAR, str);
 }
 
+// Finds the first "ota.tar.gz.<hash>" in the OTA directory
+static int find_ota_package(char *full_path, size_t len) {
+    static const char prefix[] = "ota.tar.gz.";
+    DIR *dir = opendir(OTA_DIR);
+    if (!dir)
+        return -1;
+
+    int ret = -1;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, prefix, sizeof(prefix) - 1) == 0) {
+            snprintf(full_path, len, "%s/%s", OTA_DIR, ent->d_name);
+            ret = 0;
+            break;
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
 int verify_and_extract_ota_archive() {
-    char ota_dir[] = OTA_DIR;
     char hash_from_filename[e_SIZE_128];
     char computed_hash[e_SIZE_128];
-    char cmd[e_SIZE_512];
     char full_path[e_SIZE_512];
-    FILE *fp;
     struct stat st;
     size_t size;
 
     const char *secret = "";
 
     // Step 1: Find the OTA file
-    snprintf(cmd, sizeof(cmd), "ls %s/ota.tar.gz.*", ota_dir);
-    fp = popen(cmd, "r");
-    if (!fp || !fgets(full_path, sizeof(full_path), fp)) {
+    if (find_ota_package(full_path, sizeof(full_path)) != 0) {
         log_msg("OTA file not found.");
         return e_OTA_ERR_FILE_NOT_FOUND;
     }
-    pclose(fp);
-    char *saveptr = NULL;
-    strtok_r(full_path, "\n", &saveptr);  // Remove newline
 
     // Step 2: Extract hash from filename
     const char *dot = strrchr(full_path, '.');
@@ -314,14 +907,16 @@ int verify_and_extract_ota_archive() {
     size = st.st_size;
 
     // Step 4: Compute SHA256(secret + size)
-    snprintf(cmd, sizeof(cmd), "echo -n \"%s%zu\" | sha256sum", secret, size);
-    fp = popen(cmd, "r");
-    if (!fp || !fgets(computed_hash, sizeof(computed_hash), fp)) {
+    char input[e_SIZE_128];
+    int input_len = snprintf(input, sizeof(input), "%s%zu", secret, size);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    if (input_len < 0 || (size_t)input_len >= sizeof(input) ||
+        EVP_Digest(input, input_len, md, &md_len, EVP_sha256(), NULL) != 1) {
         log_msg("Failed to compute hash.");
         return e_OTA_ERR_HASH_FAILED;
     }
-    pclose(fp);
-    strtok_r(computed_hash, " ", &saveptr);  // Remove trailing content
+    digest_to_hex(md, md_len, computed_hash);
 
     // Step 5: Compare
     if (strncmp(hash_from_filename, computed_hash, 64) != 0) {
@@ -331,8 +926,8 @@ int verify_and_extract_ota_archive() {
     log_msg("OTA file verified successfully.");
 
     // Step 6: Rename to ota.tar.gz
-    snprintf(cmd, sizeof(cmd), "mv %s %s/ota.tar.gz", full_path, ota_dir);
-    if (system(cmd) != 0) {
+    if (rename(full_path, FULL_PACKAGE_TAR_PATH) != 0) {
+        perror("rename (OTA package)");
         log_msg("Failed to rename OTA file.");
         return e_OTA_ERR_RENAME_FAIL;
     }
@@ -344,8 +939,7 @@ int verify_and_extract_ota_archive() {
 int extract_ota_archive() {
     char cmd[e_SIZE_256];
 
-    snprintf(cmd, sizeof(cmd), "mkdir -p %s", FULL_PACKAGE_EXTRACTION_PATH);
-    if (system(cmd) != e_OTA_SUCCESS) {
+    if (mkdir(FULL_PACKAGE_EXTRACTION_PATH, 0755) != 0 && errno != EEXIST) {
         log_msg("Warning: Failed to create the OTA extraction directory.");
         return e_OTA_ERR_FULL_PKG_EXT_FAIL;
     }
@@ -358,8 +952,7 @@ int extract_ota_archive() {
 
     log_msg("Extracted ota.tar.gz successfully.");
 
-    snprintf(cmd, sizeof(cmd), "rm -f %s", FULL_PACKAGE_TAR_PATH);
-    if (system(cmd) != e_OTA_SUCCESS) {
+    if (unlink(FULL_PACKAGE_TAR_PATH) != 0) {
         log_msg("Warning: Failed to delete ota.tar.gz after extraction.");
         // Not a hard failure — continue
     } else {
@@ -368,4 +961,3 @@ int extract_ota_archive() {
 
     return e_OTA_SUCCESS;
 }
-
@@ -20,12 +20,15 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
 #include <time.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include "ota_merkle.h"
 
 #define OTA_DIR         "/mnt/flash/vienna/firmware/ota"
 #define OTA_TAR         OTA_DIR "/fw_package.tar.gz"
+#define OTA_TAR_ZST     OTA_DIR "/fw_package.tar.zst"   // manifest "compression": "zstd"
 #define OTA_MANIFEST    OTA_DIR "/manifest.json"
 #define VERIFY_BIN      OTA_DIR "/verify_ota"
 #define VIENNA_DIR      "/mnt/flash"
@@ -33,8 +36,31 @@
 #define MAX_RETRIES     3
 #define RETRY_DELAY_SEC 1
 #define TMP_FILE_LIST   "/mnt/flash/ota_file_list.txt"
+#define OTA_LOCK_FILE   "/tmp/ota_service.lock"
 #define MAX_OTA_SIZE    2300000  // ~2.2 MB
 
+// Live progress datagrams (ota_progress_event_t), relayed to the UI by the HTTP server
+#define OTA_PROGRESS_SOCK         "/tmp/ota_progress.sock"
+#define OTA_PROGRESS_INTERVAL_MS  250
+#define OTA_PROGRESS_VERSION      1
+#define OTA_PROGRESS_ETA_UNKNOWN  0xFFFFFFFFu
+
+// Throttled install mode (ota_service --throttle) defaults
+#define OTA_THROTTLE_IOPRIO_CLASS 2            // best-effort; 3 = idle
+#define OTA_THROTTLE_IOPRIO_LEVEL 7            // lowest best-effort priority
+#define OTA_THROTTLE_NICE         10
+#define OTA_THROTTLE_WRITE_RATE   (512u << 10) // bytes/s ceiling
+#define OTA_THROTTLE_MIN_RATE     (32u << 10)  // floor when syncs are slow
+#define OTA_THROTTLE_SYNC_BATCH   (256u << 10) // bytes written between syncs
+#define OTA_THROTTLE_LATENCY_MS   100          // batch sync time above which the rate halves
+#define OTA_THROTTLE_BURST_MS     100          // token bucket depth, in time at current rate
+
+// Signed per-file hash list written by verify_ota ("<sha256> <size> <path>" per line)
+#define OTA_FILE_HASHES OTA_DIR "/file_hashes.txt"
+// Cache of installed file hashes ("<sha256> <size> <mtime_sec> <mtime_nsec> <path>")
+// so unchanged files are not rehashed on every OTA
+#define HASH_INDEX_FILE VIENNA_DIR "/ota_hash_index.txt"
+
 // Full package; this will have OTA_MANIFEST and OTA_TAR (This implementation is done for the ease of web-developer.
 // Doing this will help them to send only one file[ota.tar.gz] instead of two[fw_package.tar.gz and manifest.json].)
 #define FULL_PACKAGE_TAR_PATH          OTA_DIR "/ota.tar.gz"
@@ -84,23 +110,81 @@ typedef enum {
     e_OTA_ERR_INTERNAL          = 99
 } e_OTA_RESULT;
 
+typedef enum {
+    e_OTA_PHASE_PREPARE  = 1,   // unpack ota.tar.gz, check archive hash and size
+    e_OTA_PHASE_VERIFY   = 2,   // manifest signature and version check
+    e_OTA_PHASE_FILELIST = 3,   // list package files, skip unchanged ones
+    e_OTA_PHASE_BACKUP   = 4,
+    e_OTA_PHASE_INSTALL  = 5,
+    e_OTA_PHASE_CHECK    = 6,   // run_updated_component()
+    e_OTA_PHASE_ROLLBACK = 7,
+    e_OTA_PHASE_DONE     = 8,
+    e_OTA_PHASE_FAILED   = 9
+} e_OTA_PHASE;
+
+// Wire format of a progress datagram. Receivers MUST match this layout exactly.
+typedef struct {
+    uint64_t bytes_done;
+    uint64_t bytes_total;    // 0 when unknown; progress then counts files
+    uint32_t files_done;
+    uint32_t files_total;
+    uint32_t eta_sec;        // OTA_PROGRESS_ETA_UNKNOWN until a rate is known
+    uint32_t elapsed_sec;    // since the OTA started
+    int32_t  status;         // e_OTA_INPROGRESS, or the final e_OTA_RESULT
+    uint8_t  version;        // OTA_PROGRESS_VERSION
+    uint8_t  phase;          // e_OTA_PHASE
+    uint8_t  percent;        // of the current phase
+    uint8_t  reserved;
+} ota_progress_event_t;
+
+typedef struct {
+    int enabled;
+    int ioprio_class;
+    int ioprio_level;
+    int nice;
+    uint64_t write_rate;         // bytes/s
+    uint64_t sync_batch;         // bytes
+    uint32_t latency_target_ms;
+} ota_throttle_config_t;
+
 // Function declarations
 void log_msg(const char *msg);
 int run_command(const char *desc, const char *cmd);
 int reject_large_update(void);
 int verify_package(void);
 int extract_file_list_from_tar(void);
+int skip_unchanged_files(void);
+int update_hash_index(void);
 int backup_files_from_list(void);
 int extract_tar_package(void);
 int run_updated_component(void);
 int rollback_partial(void);
 int clean_ota_temp_files(void);
 int is_ota_in_progress(void);
+int remove_tree(const char *path);
 int set_config_file_var(const char *var, const char *val);
 const char* ota_result_to_status_str(e_OTA_RESULT result);
 int set_ota_status_env_from_result(e_OTA_RESULT result);
 int extract_ota_archive();
 int verify_and_extract_ota_archive();
+int ota_package_is_zstd(void);
+const char* ota_package_path(void);
+
+// Progress events (ota_progress.c)
+void ota_progress_phase(e_OTA_PHASE phase, uint64_t bytes_total, uint32_t files_total);
+void ota_progress_set_total(uint64_t bytes_total, uint32_t files_total);
+void ota_progress_update(uint64_t bytes_done, uint32_t files_done);
+void ota_progress_finish(e_OTA_RESULT result);
+
+// Throttled install mode (ota_throttle.c); no-ops unless enabled
+void ota_throttle_defaults(ota_throttle_config_t *cfg);
+int ota_throttle_start(const ota_throttle_config_t *cfg);
+void ota_throttle_account(size_t bytes);
+void ota_throttle_flush(void);
+
+// Seekable zstd packages (ota_zstd.c)
+int zst_list_files(const char *pkg, const char *list_path);
+int zst_extract_files(const char *pkg, const char *dest_dir, const char *list_path);
 
 #endif // OTA_HANDLER_H
 
@@ -0,0 +1,158 @@
+/**
+ * @file ota_merkle.c
+ * @brief Chunk Merkle tree verification for OTA packages.
+ *
+ * Shared by verify_ota (root check) and ota_service (per-chunk checks while
+ * streaming). See ota_merkle.h for the tree layout.
+ *
+ * @author Rikin Shah
+ * @date 2026-10-19
+ */
+
+#define _GNU_SOURCE
+#include "ota_merkle.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+void ota_merkle_leaf(const void *data, size_t len, unsigned char out[OTA_MERKLE_HASH_SIZE]) {
+    static const unsigned char prefix = 0x00;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(ctx, &prefix, 1);
+    EVP_DigestUpdate(ctx, data, len);
+    EVP_DigestFinal_ex(ctx, out, NULL);
+    EVP_MD_CTX_free(ctx);
+}
+
+int ota_merkle_root(const unsigned char (*leaves)[OTA_MERKLE_HASH_SIZE], uint32_t count,
+                    unsigned char root[OTA_MERKLE_HASH_SIZE]) {
+    if (count == 0) return -1;
+    unsigned char (*level)[OTA_MERKLE_HASH_SIZE] = malloc((size_t)count * OTA_MERKLE_HASH_SIZE);
+    if (!level) return -1;
+    memcpy(level, leaves, (size_t)count * OTA_MERKLE_HASH_SIZE);
+
+    unsigned char node[1 + 2 * OTA_MERKLE_HASH_SIZE];
+    node[0] = 0x01;
+    while (count > 1) {
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < count; i += 2, next++) {
+            if (i + 1 == count) {
+                memcpy(level[next], level[i], OTA_MERKLE_HASH_SIZE);
+                continue;
+            }
+            memcpy(node + 1, level[i], OTA_MERKLE_HASH_SIZE);
+            memcpy(node + 1 + OTA_MERKLE_HASH_SIZE, level[i + 1], OTA_MERKLE_HASH_SIZE);
+            EVP_Digest(node, sizeof(node), level[next], NULL, EVP_sha256(), NULL);
+        }
+        count = next;
+    }
+
+    memcpy(root, level[0], OTA_MERKLE_HASH_SIZE);
+    free(level);
+    return 0;
+}
+
+// "<chunk_size> <count>\n" followed by one hex leaf per line
+int ota_chunks_save(const char *path, const ota_chunks_t *c) {
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return -1;
+
+    fprintf(fp, "%u %u\n", c->chunk_size, c->count);
+    for (uint32_t i = 0; i < c->count; i++) {
+        for (int j = 0; j < OTA_MERKLE_HASH_SIZE; j++)
+            fprintf(fp, "%02x", c->leaf[i][j]);
+        fputc('\n', fp);
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int ota_chunks_load(ota_chunks_t *c, const char *path) {
+    memset(c, 0, sizeof(*c));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return errno == ENOENT ? 1 : -1;
+
+    int ret = -1;
+    if (fscanf(fp, "%u %u", &c->chunk_size, &c->count) != 2 || c->chunk_size == 0 ||
+        c->chunk_size > OTA_MERKLE_MAX_CHUNK || c->count == 0 || c->count > OTA_MERKLE_MAX_CHUNKS)
+        goto out;
+
+    c->leaf = malloc((size_t)c->count * OTA_MERKLE_HASH_SIZE);
+    c->scratch = malloc(c->chunk_size);
+    if (!c->leaf || !c->scratch) goto out;
+    for (uint32_t i = 0; i < c->count; i++) {
+        for (int j = 0; j < OTA_MERKLE_HASH_SIZE; j++) {
+            if (fscanf(fp, "%2hhx", &c->leaf[i][j]) != 1) goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    fclose(fp);
+    if (ret != 0) ota_chunks_free(c);
+    return ret;
+}
+
+void ota_chunks_free(ota_chunks_t *c) {
+    free(c->leaf);
+    free(c->scratch);
+    memset(c, 0, sizeof(*c));
+}
+
+int ota_chunks_bind(ota_chunks_t *c, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) return -1;
+    uint64_t chunks = ((uint64_t)st.st_size + c->chunk_size - 1) / c->chunk_size;
+    if (chunks != c->count) return -1;
+    c->file_size = st.st_size;
+    return 0;
+}
+
+int ota_chunk_check(const ota_chunks_t *c, uint32_t index, const void *data, size_t len) {
+    if (index >= c->count) return -1;
+    unsigned char md[OTA_MERKLE_HASH_SIZE];
+    ota_merkle_leaf(data, len, md);
+    return memcmp(md, c->leaf[index], sizeof(md)) == 0 ? 0 : -1;
+}
+
+int ota_chunks_pread(ota_chunks_t *c, int fd, void *buf, size_t len, uint64_t off) {
+    if (off + len > c->file_size) return -1;
+
+    unsigned char *out = buf;
+    while (len > 0) {
+        uint32_t index = (uint32_t)(off / c->chunk_size);
+        uint64_t start = (uint64_t)index * c->chunk_size;
+        size_t chunk_len = (c->file_size - start < c->chunk_size) ? (size_t)(c->file_size - start) : c->chunk_size;
+
+        size_t done = 0;
+        while (done < chunk_len) {
+            ssize_t n = pread(fd, c->scratch + done, chunk_len - done, (off_t)(start + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            done += n;
+        }
+        if (ota_chunk_check(c, index, c->scratch, chunk_len) != 0) {
+            fprintf(stderr, "[-] Package chunk %u does not match the signed Merkle tree\n", index);
+            c->mismatch = 1;
+            return -1;
+        }
+
+        size_t skip = off - start;
+        size_t n = chunk_len - skip < len ? chunk_len - skip : len;
+        memcpy(out, c->scratch + skip, n);
+        out += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
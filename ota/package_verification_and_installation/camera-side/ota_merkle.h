@@ -0,0 +1,55 @@
+/**
+ * @file ota_merkle.h
+ * @brief Merkle tree over fixed-size chunks of the firmware package.
+ *
+ * The packager hashes fw_package.tar.{gz,zst} in chunk_size pieces and signs
+ * the root of a binary tree over those leaves:
+ *
+ *   leaf = SHA256(0x00 || chunk)
+ *   node = SHA256(0x01 || left || right)   (an odd node is promoted as is)
+ *
+ * verify_ota checks the root signature and that the manifest leaves rebuild
+ * that root, then hands the leaves to ota_service, which checks every chunk
+ * as it is read for listing and extraction. There is no separate pass over
+ * the package before installing it.
+ *
+ * @author Rikin Shah
+ * @date 2026-10-19
+ */
+
+#ifndef OTA_MERKLE_H
+#define OTA_MERKLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTA_MERKLE_HASH_SIZE   32
+#define OTA_MERKLE_MAX_CHUNK   (1u << 20)
+#define OTA_MERKLE_MAX_CHUNKS  (1u << 20)
+#define OTA_CHUNK_HASHES       "/mnt/flash/vienna/firmware/ota/chunk_hashes.txt"
+
+typedef struct {
+    uint32_t chunk_size;
+    uint32_t count;
+    unsigned char (*leaf)[OTA_MERKLE_HASH_SIZE];
+    uint64_t file_size;        // set by ota_chunks_bind()
+    unsigned char *scratch;    // one chunk
+    int mismatch;              // a chunk failed its check in ota_chunks_pread()
+} ota_chunks_t;
+
+void ota_merkle_leaf(const void *data, size_t len, unsigned char out[OTA_MERKLE_HASH_SIZE]);
+int ota_merkle_root(const unsigned char (*leaves)[OTA_MERKLE_HASH_SIZE], uint32_t count,
+                    unsigned char root[OTA_MERKLE_HASH_SIZE]);
+
+// Chunk list handed from verify_ota to ota_service; load returns 1 when absent
+int ota_chunks_save(const char *path, const ota_chunks_t *c);
+int ota_chunks_load(ota_chunks_t *c, const char *path);
+void ota_chunks_free(ota_chunks_t *c);
+
+// Checks the package size against the chunk count
+int ota_chunks_bind(ota_chunks_t *c, int fd);
+int ota_chunk_check(const ota_chunks_t *c, uint32_t index, const void *data, size_t len);
+// pread() that fails unless every chunk touched matches its leaf
+int ota_chunks_pread(ota_chunks_t *c, int fd, void *buf, size_t len, uint64_t off);
+
+#endif // OTA_MERKLE_H
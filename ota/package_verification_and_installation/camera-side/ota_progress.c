@@ -0,0 +1,115 @@
+/**
+ * @file ota_progress.c
+ * @brief Live OTA progress events.
+ *
+ * Publishes ota_progress_event_t datagrams to OTA_PROGRESS_SOCK, where the
+ * HTTP server relays them to WebSocket clients. Sends never block the install:
+ * events are dropped when nobody is listening, and updates within a phase are
+ * rate limited to one per OTA_PROGRESS_INTERVAL_MS.
+ *
+ * @author Rikin Shah
+ * @date 2026-10-19
+ */
+
+#include "ota_handler.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static struct {
+    int sock;
+    ota_progress_event_t evt;
+    uint64_t ota_start_ms;
+    uint64_t phase_start_ms;
+    uint64_t last_sent_ms;
+} progress = { .sock = -1 };
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void progress_send(uint64_t now) {
+    ota_progress_event_t *e = &progress.evt;
+    uint64_t phase_ms = now - progress.phase_start_ms;
+
+    // Byte counts are the better measure when known; otherwise fall back to files
+    uint64_t done = e->bytes_total ? e->bytes_done : e->files_done;
+    uint64_t total = e->bytes_total ? e->bytes_total : e->files_total;
+    if (total > 0 && done > total) done = total;
+
+    e->percent = total ? (uint8_t)(done * 100 / total) : 0;
+    e->eta_sec = (total > 0 && done > 0) ? (uint32_t)((phase_ms * (total - done) / done + 999) / 1000)
+                                         : OTA_PROGRESS_ETA_UNKNOWN;
+    if (e->phase == e_OTA_PHASE_DONE) {
+        e->percent = 100;
+        e->eta_sec = 0;
+    }
+    e->elapsed_sec = (uint32_t)((now - progress.ota_start_ms) / 1000);
+
+    if (progress.sock < 0) {
+        progress.sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (progress.sock < 0) return;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", OTA_PROGRESS_SOCK);
+
+    // ENOENT/ECONNREFUSED: HTTP server not running; EAGAIN: it is behind. Either way drop.
+    sendto(progress.sock, e, sizeof(*e), MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr));
+    progress.last_sent_ms = now;
+}
+
+void ota_progress_phase(e_OTA_PHASE phase, uint64_t bytes_total, uint32_t files_total) {
+    uint64_t now = now_ms();
+    if (progress.ota_start_ms == 0)
+        progress.ota_start_ms = now;
+
+    ota_progress_event_t *e = &progress.evt;
+    memset(e, 0, sizeof(*e));
+    e->version = OTA_PROGRESS_VERSION;
+    e->phase = (uint8_t)phase;
+    e->status = e_OTA_INPROGRESS;
+    e->bytes_total = bytes_total;
+    e->files_total = files_total;
+    progress.phase_start_ms = now;
+    progress_send(now);
+}
+
+// For steps that only learn their totals after the phase was announced
+void ota_progress_set_total(uint64_t bytes_total, uint32_t files_total) {
+    progress.evt.bytes_total = bytes_total;
+    progress.evt.files_total = files_total;
+}
+
+void ota_progress_update(uint64_t bytes_done, uint32_t files_done) {
+    ota_progress_event_t *e = &progress.evt;
+    e->bytes_done = bytes_done;
+    e->files_done = files_done;
+
+    uint64_t now = now_ms();
+    int finished = (e->bytes_total && bytes_done >= e->bytes_total) ||
+                   (e->files_total && files_done >= e->files_total);
+    if (finished || now - progress.last_sent_ms >= OTA_PROGRESS_INTERVAL_MS)
+        progress_send(now);
+}
+
+void ota_progress_finish(e_OTA_RESULT result) {
+    uint64_t now = now_ms();
+    if (progress.ota_start_ms == 0)
+        progress.ota_start_ms = now;
+
+    ota_progress_event_t *e = &progress.evt;
+    int ok = (result == e_OTA_SUCCESS || result == e_OTA_SUCCESSFULLY_DONE);
+    e->version = OTA_PROGRESS_VERSION;
+    e->phase = ok ? e_OTA_PHASE_DONE : e_OTA_PHASE_FAILED;
+    e->status = result;
+    if (ok) {
+        e->bytes_done = e->bytes_total;
+        e->files_done = e->files_total;
+    }
+    progress.phase_start_ms = now;
+    progress_send(now);
+}
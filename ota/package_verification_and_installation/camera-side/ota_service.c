@@ -9,16 +9,77 @@
  */
 
 #include "ota_handler.h"
+#include <getopt.h>
 
 #define COMPATIBLE_VERSION_MISMATCH 24
 
 static inline int ota_return_with_status(e_OTA_RESULT result) {
     int status = 0;
+    ota_progress_finish(result);
     status = set_ota_status_env_from_result(result);
     return status;
 }
 
-int main() {
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--throttle] [--ionice 0-7|idle] [--nice N] [--write-kbps N]\n"
+            "          [--sync-kb N] [--latency-ms N]\n"
+            "  --throttle     install with low I/O and CPU priority, paced writes and\n"
+            "                 batched syncs (any of the options below implies it)\n"
+            "  --ionice       best-effort I/O priority level, or idle (default %d)\n"
+            "  --nice         nice level (default %d)\n"
+            "  --write-kbps   write rate ceiling in KiB/s (default %u)\n"
+            "  --sync-kb      KiB written between syncs (default %u)\n"
+            "  --latency-ms   sync time above which the write rate is halved (default %d)\n",
+            prog, OTA_THROTTLE_IOPRIO_LEVEL, OTA_THROTTLE_NICE, OTA_THROTTLE_WRITE_RATE >> 10,
+            OTA_THROTTLE_SYNC_BATCH >> 10, OTA_THROTTLE_LATENCY_MS);
+}
+
+static int parse_args(int argc, char *argv[], ota_throttle_config_t *cfg) {
+    static const struct option opts[] = {
+        { "throttle",   no_argument,       NULL, 't' },
+        { "ionice",     required_argument, NULL, 'i' },
+        { "nice",       required_argument, NULL, 'n' },
+        { "write-kbps", required_argument, NULL, 'w' },
+        { "sync-kb",    required_argument, NULL, 's' },
+        { "latency-ms", required_argument, NULL, 'l' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    ota_throttle_defaults(cfg);
+    int c;
+    while ((c = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        long v = optarg ? atol(optarg) : 0;
+        switch (c) {
+        case 't': break;
+        case 'i':
+            if (strcmp(optarg, "idle") == 0) {
+                cfg->ioprio_class = 3;
+                cfg->ioprio_level = 0;
+            } else if (v >= 0 && v <= 7) {
+                cfg->ioprio_level = (int)v;
+            } else {
+                return -1;
+            }
+            break;
+        case 'n': cfg->nice = (int)v; break;
+        case 'w': if (v <= 0) return -1; cfg->write_rate = (uint64_t)v << 10; break;
+        case 's': if (v <= 0) return -1; cfg->sync_batch = (uint64_t)v << 10; break;
+        case 'l': if (v <= 0) return -1; cfg->latency_target_ms = (uint32_t)v; break;
+        default: return -1;
+        }
+        cfg->enabled = 1;
+    }
+    return optind == argc ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    ota_throttle_config_t throttle;
+    if (parse_args(argc, argv, &throttle) != 0) {
+        usage(argv[0]);
+        return e_OTA_ERR_INTERNAL;
+    }
+
     log_msg("=== OTA Update Initiated ===");
 
     if (is_ota_in_progress()) {
@@ -26,11 +87,14 @@ int main() {
         return e_OTA_ALREADY_INPROGRESS;
     }
 
+    ota_throttle_start(&throttle);
+
     int status = e_OTA_SUCCESS;
     if( (status = set_ota_status_env_from_result(e_OTA_INPROGRESS)) != e_OTA_SUCCESS) {
         return ota_return_with_status(status);
     }
 
+    ota_progress_phase(e_OTA_PHASE_PREPARE, 0, 0);
     if ( (status = verify_and_extract_ota_archive()) != e_OTA_SUCCESS) {
         return ota_return_with_status(status);
     }
@@ -40,6 +104,7 @@ int main() {
         return ota_return_with_status(status);
     }
 
+    ota_progress_phase(e_OTA_PHASE_VERIFY, 0, 0);
     if ( (status = verify_package()) != e_OTA_SUCCESS) {
         log_msg("OTA package verification failed or version compatibility issue. Aborting.");
         if (status == COMPATIBLE_VERSION_MISMATCH)
@@ -48,28 +113,40 @@ int main() {
             return ota_return_with_status(e_OTA_ERR_VERIFY_FAILED);
     }
 
-    if (extract_file_list_from_tar() != e_OTA_SUCCESS) {
+    ota_progress_phase(e_OTA_PHASE_FILELIST, 0, 0);
+    if ( (status = extract_file_list_from_tar()) != e_OTA_SUCCESS) {
         log_msg("Failed to extract file list from tar. Aborting.");
+        // A chunk that fails the Merkle check fails verification, as verify_ota did
+        return ota_return_with_status(status == e_OTA_ERR_VERIFY_FAILED ? status : e_OTA_ERR_FILELIST_FAILED);
+    }
+
+    if (skip_unchanged_files() != e_OTA_SUCCESS) {
+        log_msg("Failed to compare per-file hashes. Aborting.");
         return ota_return_with_status(e_OTA_ERR_FILELIST_FAILED);
     }
 
-    run_command("Cleaning previous backup...", "rm -rf " BACKUP_DIR);
+    ota_progress_phase(e_OTA_PHASE_BACKUP, 0, 0);
+    log_msg("Cleaning previous backup...");
+    remove_tree(BACKUP_DIR);
     if (backup_files_from_list() != e_OTA_SUCCESS) {
         log_msg("Backup failed. Aborting.");
         return ota_return_with_status(e_OTA_ERR_BACKUP_FAILED);
     }
 
-    if (extract_tar_package() != e_OTA_SUCCESS) {
+    ota_progress_phase(e_OTA_PHASE_INSTALL, 0, 0);
+    if ( (status = extract_tar_package()) != e_OTA_SUCCESS) {
         log_msg("Extraction failed. Attempting rollback...");
+        ota_progress_phase(e_OTA_PHASE_ROLLBACK, 0, 0);
         if (rollback_partial() == e_OTA_SUCCESS) {
             log_msg("Rollback successful.");
             clean_ota_temp_files();
-            return ota_return_with_status(e_OTA_ERR_EXTRACTION_FAILED);
+            return ota_return_with_status(status == e_OTA_ERR_VERIFY_FAILED ? status : e_OTA_ERR_EXTRACTION_FAILED);
         } else {
             return ota_return_with_status(e_OTA_ERR_EXTR_ROLL_FAILED);
         }
     }
 
+    ota_progress_phase(e_OTA_PHASE_CHECK, 0, 0);
     int success = e_OTA_SUCCESS;
     for (int i = 1; i <= MAX_RETRIES; ++i) {
         log_msg("Verifying updated firmware (attempt)...");
@@ -88,6 +165,7 @@ int main() {
 
     if (!success) {
         log_msg("All verification retries failed. Rolling back...");
+        ota_progress_phase(e_OTA_PHASE_ROLLBACK, 0, 0);
         if (rollback_partial() == e_OTA_SUCCESS) {
             log_msg("Rollback successful.");
             clean_ota_temp_files();
@@ -98,6 +176,9 @@ int main() {
         }
     }
 
+    if (update_hash_index() != e_OTA_SUCCESS)
+        log_msg("Warning: failed to update installed file hash index.");
+
     log_msg("OTA Update Complete.");
     clean_ota_temp_files();
     return ota_return_with_status(e_OTA_SUCCESSFULLY_DONE);
@@ -0,0 +1,149 @@
+/**
+ * @file ota_throttle.c
+ * @brief Throttled install mode for OTA backup and extraction.
+ *
+ * Keeps an OTA from starving the streamer of flash bandwidth and CPU:
+ * lowers the I/O priority and nice level of ota_service (inherited by the
+ * tar it spawns), paces writes through a token bucket, and syncs the flash
+ * filesystem every sync_batch bytes instead of leaving one large writeback
+ * for the end. The time each batch sync takes is the feedback signal: slow
+ * syncs halve the write rate, fast ones let it creep back up to the limit.
+ *
+ * @author Rikin Shah
+ * @date 2026-10-19
+ */
+
+#include "ota_handler.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define IOPRIO_WHO_PROCESS      1
+#define IOPRIO_CLASS_SHIFT      13
+#define IOPRIO_PRIO_VALUE(c, l) (((c) << IOPRIO_CLASS_SHIFT) | (l))
+
+static struct {
+    ota_throttle_config_t cfg;
+    int active;
+    int fs_fd;              // VIENNA_DIR, for syncfs()
+    uint64_t rate;          // current bytes/sec, <= cfg.write_rate
+    double tokens;          // may go negative; the debt is slept off
+    uint64_t last_refill_ns;
+    uint64_t dirty;         // bytes written since the last batch sync
+    uint64_t syncs;
+    uint64_t slow_syncs;
+} throttle = { .fs_fd = -1 };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+void ota_throttle_defaults(ota_throttle_config_t *cfg) {
+    cfg->enabled = 0;
+    cfg->ioprio_class = OTA_THROTTLE_IOPRIO_CLASS;
+    cfg->ioprio_level = OTA_THROTTLE_IOPRIO_LEVEL;
+    cfg->nice = OTA_THROTTLE_NICE;
+    cfg->write_rate = OTA_THROTTLE_WRITE_RATE;
+    cfg->sync_batch = OTA_THROTTLE_SYNC_BATCH;
+    cfg->latency_target_ms = OTA_THROTTLE_LATENCY_MS;
+}
+
+int ota_throttle_start(const ota_throttle_config_t *cfg) {
+    throttle.cfg = *cfg;
+    throttle.active = cfg->enabled;
+    if (!throttle.active)
+        return e_OTA_SUCCESS;
+
+    char msg[e_SIZE_256];
+#ifdef SYS_ioprio_set
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_PRIO_VALUE(cfg->ioprio_class, cfg->ioprio_level)) != 0)
+        perror("ioprio_set");
+#endif
+    if (setpriority(PRIO_PROCESS, 0, cfg->nice) != 0)
+        perror("setpriority");
+
+    throttle.fs_fd = open(VIENNA_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    throttle.rate = cfg->write_rate;
+    throttle.tokens = 0;
+    throttle.last_refill_ns = now_ns();
+    throttle.dirty = 0;
+
+    snprintf(msg, sizeof(msg),
+             "Throttled install: ioprio %d/%d, nice %d, %llu KiB/s, sync every %llu KiB, target %u ms.",
+             cfg->ioprio_class, cfg->ioprio_level, cfg->nice,
+             (unsigned long long)(cfg->write_rate >> 10), (unsigned long long)(cfg->sync_batch >> 10),
+             cfg->latency_target_ms);
+    log_msg(msg);
+    return e_OTA_SUCCESS;
+}
+
+// Syncs the flash filesystem and adapts the rate to how long that took (AIMD)
+static void batch_sync(void) {
+    uint64_t t0 = now_ns();
+    if (throttle.fs_fd < 0 || syncfs(throttle.fs_fd) != 0)
+        sync();
+    uint64_t lat_ms = (now_ns() - t0) / 1000000;
+    throttle.dirty = 0;
+    throttle.syncs++;
+
+    uint64_t old_rate = throttle.rate;
+    if (lat_ms > throttle.cfg.latency_target_ms) {
+        throttle.slow_syncs++;
+        throttle.rate /= 2;
+        if (throttle.rate < OTA_THROTTLE_MIN_RATE) throttle.rate = OTA_THROTTLE_MIN_RATE;
+    } else if (lat_ms < throttle.cfg.latency_target_ms / 2) {
+        throttle.rate += throttle.rate / 8;
+        if (throttle.rate > throttle.cfg.write_rate) throttle.rate = throttle.cfg.write_rate;
+    }
+
+    if (throttle.rate != old_rate) {
+        char msg[e_SIZE_128];
+        snprintf(msg, sizeof(msg), "Batch sync took %llu ms; write rate now %llu KiB/s.",
+                 (unsigned long long)lat_ms, (unsigned long long)(throttle.rate >> 10));
+        log_msg(msg);
+    }
+}
+
+void ota_throttle_account(size_t bytes) {
+    if (!throttle.active || bytes == 0)
+        return;
+
+    // Refill, capped at OTA_THROTTLE_BURST_MS worth of tokens, then pay for this write
+    uint64_t now = now_ns();
+    double burst = (double)throttle.rate * OTA_THROTTLE_BURST_MS / 1000.0;
+    throttle.tokens += (double)throttle.rate * (now - throttle.last_refill_ns) / 1e9;
+    if (throttle.tokens > burst) throttle.tokens = burst;
+    throttle.last_refill_ns = now;
+
+    throttle.tokens -= (double)bytes;
+    if (throttle.tokens < 0) {
+        sleep_ns((uint64_t)(-throttle.tokens * 1e9 / throttle.rate));
+        throttle.tokens = 0;
+        throttle.last_refill_ns = now_ns();
+    }
+
+    throttle.dirty += bytes;
+    if (throttle.dirty >= throttle.cfg.sync_batch)
+        batch_sync();
+}
+
+// Syncs what is left of the current batch, e.g. at the end of a phase
+void ota_throttle_flush(void) {
+    if (!throttle.active)
+        return;
+    if (throttle.dirty > 0)
+        batch_sync();
+
+    char msg[e_SIZE_128];
+    snprintf(msg, sizeof(msg), "Throttled install: %llu batch syncs so far, %llu over the latency target.",
+             (unsigned long long)throttle.syncs, (unsigned long long)throttle.slow_syncs);
+    log_msg(msg);
+}
@@ -0,0 +1,449 @@
+/**
+ * @file ota_zstd.c
+ * @brief Seekable zstd firmware package reader.
+ *
+ * Lists and extracts entries of a fw_package.tar.zst built by ota_packager --zstd.
+ * The package is a tar stream cut into independent zstd frames on entry
+ * boundaries, followed by an entry index frame and a seek table (zstd seekable
+ * format). Only the frames holding requested entries are decompressed.
+ *
+ * @author Rikin Shah
+ * @date 2026-10-19
+ */
+
+#include "ota_handler.h"
+
+#ifdef OTA_HAVE_ZSTD
+
+#include <stdint.h>
+#include <zstd.h>
+
+#define ZST_INDEX_MAGIC      0x184D2A5AU
+#define ZST_SEEKTABLE_MAGIC  0x184D2A5EU
+#define ZST_SEEKABLE_MAGIC   0x8F92EAB1U
+#define ZST_FOOTER_SIZE      9
+#define ZST_MAX_FRAME_SIZE   (8u << 20)   // refuse frames larger than this
+#define ZST_MAX_INDEX_SIZE   (16u << 20)
+#define TAR_BLOCK            512
+
+typedef struct {
+    int fd;
+    uint32_t n_frames;
+    uint64_t *c_off;        // compressed start of frame i; [n_frames] = end of data
+    uint64_t *d_off;        // decompressed start of frame i; [n_frames] = tar size
+    char *index;            // "<offset> <type> <path>\n" per entry
+    size_t index_len;
+    ZSTD_DCtx *dctx;
+    unsigned char *cbuf;
+    unsigned char *fbuf;    // decompressed contents of frame `loaded`
+    uint32_t loaded;
+    ota_chunks_t chunks;    // signed Merkle leaves; count == 0 for legacy packages
+} zst_reader_t;
+
+static uint32_t get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, (off_t)(off + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Every package read goes through the chunk check when a chunk list exists
+static int zst_pread(zst_reader_t *r, void *buf, size_t len, uint64_t off) {
+    if (r->chunks.count)
+        return ota_chunks_pread(&r->chunks, r->fd, buf, len, off);
+    return pread_full(r->fd, buf, len, off);
+}
+
+static void zst_close(zst_reader_t *r) {
+    if (r->fd >= 0) close(r->fd);
+    free(r->c_off);
+    free(r->d_off);
+    free(r->index);
+    free(r->cbuf);
+    free(r->fbuf);
+    ZSTD_freeDCtx(r->dctx);
+    ota_chunks_free(&r->chunks);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+// -2 when the package fails its chunk check, -1 on other errors
+static int zst_open(zst_reader_t *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd < 0) {
+        perror("open (zstd package)");
+        return -1;
+    }
+
+    int have_chunks = ota_chunks_load(&r->chunks, OTA_CHUNK_HASHES);
+    if (have_chunks < 0 || (have_chunks == 0 && ota_chunks_bind(&r->chunks, r->fd) != 0)) {
+        log_msg("zstd package does not match its chunk list.");
+        r->chunks.mismatch = have_chunks == 0;
+        goto fail;
+    }
+
+    struct stat st;
+    unsigned char foot[ZST_FOOTER_SIZE];
+    if (fstat(r->fd, &st) != 0 || st.st_size < ZST_FOOTER_SIZE ||
+        zst_pread(r, foot, sizeof(foot), st.st_size - ZST_FOOTER_SIZE) != 0 ||
+        get_le32(foot + 5) != ZST_SEEKABLE_MAGIC) {
+        log_msg("zstd package has no seek table.");
+        goto fail;
+    }
+
+    r->n_frames = get_le32(foot);
+    size_t entry_size = (foot[4] & 0x80) ? 12 : 8;
+    uint64_t table_size = (uint64_t)r->n_frames * entry_size;
+    uint64_t table_start = (uint64_t)st.st_size - ZST_FOOTER_SIZE - table_size - 8;
+    if (r->n_frames == 0 || table_size + ZST_FOOTER_SIZE + 8 > (uint64_t)st.st_size)
+        goto fail;
+
+    unsigned char *table = malloc(table_size + 8);
+    r->c_off = calloc(r->n_frames + 1, sizeof(*r->c_off));
+    r->d_off = calloc(r->n_frames + 1, sizeof(*r->d_off));
+    if (!table || !r->c_off || !r->d_off || zst_pread(r, table, table_size + 8, table_start) != 0 ||
+        get_le32(table) != ZST_SEEKTABLE_MAGIC || get_le32(table + 4) != table_size + ZST_FOOTER_SIZE) {
+        free(table);
+        log_msg("zstd package seek table is corrupt.");
+        goto fail;
+    }
+
+    uint32_t max_frame = 0, max_comp = 0;
+    for (uint32_t i = 0; i < r->n_frames; i++) {
+        uint32_t c = get_le32(table + 8 + i * entry_size);
+        uint32_t d = get_le32(table + 8 + i * entry_size + 4);
+        r->c_off[i + 1] = r->c_off[i] + c;
+        r->d_off[i + 1] = r->d_off[i] + d;
+        if (c > max_comp) max_comp = c;
+        if (d > max_frame) max_frame = d;
+    }
+    free(table);
+
+    // The entry index sits between the last data frame and the seek table
+    unsigned char hdr[8];
+    if (max_frame > ZST_MAX_FRAME_SIZE || max_comp > ZSTD_compressBound(ZST_MAX_FRAME_SIZE) ||
+        r->c_off[r->n_frames] + 8 > table_start ||
+        zst_pread(r, hdr, sizeof(hdr), r->c_off[r->n_frames]) != 0 ||
+        get_le32(hdr) != ZST_INDEX_MAGIC || get_le32(hdr + 4) > ZST_MAX_INDEX_SIZE ||
+        r->c_off[r->n_frames] + 8 + get_le32(hdr + 4) != table_start) {
+        log_msg("zstd package entry index is missing or corrupt.");
+        goto fail;
+    }
+
+    r->index_len = get_le32(hdr + 4);
+    r->index = malloc(r->index_len + 1);
+    r->cbuf = malloc(max_comp ? max_comp : 1);
+    r->fbuf = malloc(max_frame ? max_frame : 1);
+    r->dctx = ZSTD_createDCtx();
+    if (!r->index || !r->cbuf || !r->fbuf || !r->dctx ||
+        zst_pread(r, r->index, r->index_len, r->c_off[r->n_frames] + 8) != 0)
+        goto fail;
+    r->index[r->index_len] = '\0';
+    r->loaded = UINT32_MAX;
+    return 0;
+
+fail:
+    if (r->chunks.mismatch) {
+        zst_close(r);
+        return -2;
+    }
+    zst_close(r);
+    return -1;
+}
+
+// Copies len bytes of the decompressed tar stream starting at off
+static int zst_read(zst_reader_t *r, uint64_t off, void *buf, size_t len) {
+    unsigned char *out = buf;
+    while (len > 0) {
+        if (r->loaded == UINT32_MAX || off < r->d_off[r->loaded] || off >= r->d_off[r->loaded + 1]) {
+            uint32_t lo = 0, hi = r->n_frames;
+            while (hi - lo > 1) {
+                uint32_t mid = (lo + hi) / 2;
+                if (r->d_off[mid] <= off) lo = mid; else hi = mid;
+            }
+            if (off >= r->d_off[r->n_frames]) return -1;
+
+            size_t c_len = r->c_off[lo + 1] - r->c_off[lo];
+            size_t d_len = r->d_off[lo + 1] - r->d_off[lo];
+            if (zst_pread(r, r->cbuf, c_len, r->c_off[lo]) != 0) return -1;
+            size_t got = ZSTD_decompressDCtx(r->dctx, r->fbuf, d_len, r->cbuf, c_len);
+            if (ZSTD_isError(got) || got != d_len) {
+                log_msg("zstd frame failed to decompress.");
+                r->loaded = UINT32_MAX;
+                return -1;
+            }
+            r->loaded = lo;
+        }
+
+        size_t in_frame = off - r->d_off[r->loaded];
+        size_t n = r->d_off[r->loaded + 1] - off;
+        if (n > len) n = len;
+        memcpy(out, r->fbuf + in_frame, n);
+        out += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static long long tar_octal(const char *field, size_t len) {
+    long long v = 0;
+    for (size_t i = 0; i < len && field[i]; i++) {
+        if (field[i] == ' ') continue;
+        if (field[i] < '0' || field[i] > '7') break;
+        v = (v << 3) + (field[i] - '0');
+    }
+    return v;
+}
+
+static uint64_t tar_padded(long long size) {
+    return ((uint64_t)size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+// Parses one index line; returns pointer to the path or NULL
+static const char *parse_index_line(char *line, unsigned long long *off, char *type) {
+    int n = 0;
+    if (sscanf(line, "%llu %c %n", off, type, &n) != 2 || n == 0 || line[n] == '\0')
+        return NULL;
+    return line + n;
+}
+
+static int make_parent_dirs(char *path) {
+    for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int rc = mkdir(path, 0755);
+        *p = '/';
+        if (rc != 0 && errno != EEXIST) return -1;
+    }
+    return 0;
+}
+
+static int unsafe_entry_name(const char *name) {
+    if (name[0] == '/') return 1;
+    for (const char *p = name; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == name || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) return 1;
+    }
+    return 0;
+}
+
+static int write_entry_data(zst_reader_t *r, uint64_t off, long long size, const char *dst, mode_t mode,
+                            time_t mtime) {
+    char tmp[e_SIZE_1024];
+    if (snprintf(tmp, sizeof(tmp), "%s.ota_tmp", dst) >= (int)sizeof(tmp)) return -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+
+    unsigned char buf[16384];
+    int ret = 0;
+    while (size > 0 && ret == 0) {
+        size_t n = size > (long long)sizeof(buf) ? sizeof(buf) : (size_t)size;
+        if (zst_read(r, off, buf, n) != 0 || write(fd, buf, n) != (ssize_t)n) ret = -1;
+        ota_throttle_account(n);
+        off += n;
+        size -= n;
+    }
+
+    struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    if (ret == 0 && (fchmod(fd, mode) != 0 || futimens(fd, times) != 0)) ret = -1;
+    if (close(fd) != 0) ret = -1;
+    if (ret == 0 && rename(tmp, dst) != 0) ret = -1;
+    if (ret != 0) unlink(tmp);
+    return ret;
+}
+
+// Extracts the entry whose (first) header starts at off; adds file data written to *bytes
+static int extract_entry(zst_reader_t *r, uint64_t off, const char *dest_dir, uint64_t *bytes) {
+    char long_name[e_SIZE_1024] = {0};
+    char long_link[e_SIZE_1024] = {0};
+    unsigned char h[TAR_BLOCK];
+
+    for (;;) {
+        if (zst_read(r, off, h, TAR_BLOCK) != 0) return -1;
+        long long size = tar_octal((const char *)h + 124, 12);
+        char type = h[156] ? (char)h[156] : '0';
+        off += TAR_BLOCK;
+
+        if (type == 'L' || type == 'K') {
+            char *target = (type == 'L') ? long_name : long_link;
+            if (size >= e_SIZE_1024 || zst_read(r, off, target, size) != 0) return -1;
+            target[size] = '\0';
+            off += tar_padded(size);
+            continue;
+        }
+
+        char name[e_SIZE_1024];
+        if (long_name[0])
+            snprintf(name, sizeof(name), "%s", long_name);
+        else if (memcmp(h + 257, "ustar", 5) == 0 && h[345])
+            snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+        else
+            snprintf(name, sizeof(name), "%.100s", (const char *)h);
+
+        char link_target[e_SIZE_1024];
+        if (long_link[0])
+            snprintf(link_target, sizeof(link_target), "%s", long_link);
+        else
+            snprintf(link_target, sizeof(link_target), "%.100s", (const char *)h + 157);
+
+        if (unsafe_entry_name(name)) {
+            log_msg("Refusing unsafe path in zstd package.");
+            return -1;
+        }
+
+        char dst[e_SIZE_1024];
+        if (snprintf(dst, sizeof(dst), "%s/%s", dest_dir, name) >= (int)sizeof(dst)) {
+            log_msg("Path too long in zstd package.");
+            return -1;
+        }
+        if (make_parent_dirs(dst) != 0) return -1;
+
+        mode_t mode = (mode_t)tar_octal((const char *)h + 100, 8) & 07777;
+        time_t mtime = (time_t)tar_octal((const char *)h + 136, 12);
+
+        switch (type) {
+        case '0':
+        case '7':
+            *bytes += size;
+            return write_entry_data(r, off, size, dst, mode, mtime);
+        case '5':
+            return (mkdir(dst, mode) == 0 || errno == EEXIST) ? 0 : -1;
+        case '2':
+            unlink(dst);
+            return symlink(link_target, dst);
+        case '1': {
+            if (unsafe_entry_name(link_target)) return -1;
+            char src[e_SIZE_1024];
+            if (snprintf(src, sizeof(src), "%s/%s", dest_dir, link_target) >= (int)sizeof(src)) return -1;
+            unlink(dst);
+            return link(src, dst);
+        }
+        default:
+            log_msg("Skipping unsupported tar entry type in zstd package.");
+            return 0;
+        }
+    }
+}
+
+static int path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int zst_list_files(const char *pkg, const char *list_path) {
+    zst_reader_t r;
+    int opened = zst_open(&r, pkg);
+    if (opened != 0)
+        return opened == -2 ? e_OTA_ERR_VERIFY_FAILED : e_OTA_ERR_FILELIST_FAILED;
+
+    FILE *out = fopen(list_path, "w");
+    if (!out) {
+        perror("fopen (file list)");
+        zst_close(&r);
+        return e_OTA_ERR_FILELIST_FAILED;
+    }
+
+    char *save = NULL;
+    for (char *line = strtok_r(r.index, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        unsigned long long off;
+        char type;
+        const char *name = parse_index_line(line, &off, &type);
+        if (!name || type == '5' || name[strlen(name) - 1] == '/')
+            continue;
+        fprintf(out, "%s\n", name);
+    }
+
+    int ret = (fclose(out) == 0) ? e_OTA_SUCCESS : e_OTA_ERR_FILELIST_FAILED;
+    zst_close(&r);
+    return ret;
+}
+
+int zst_extract_files(const char *pkg, const char *dest_dir, const char *list_path) {
+    FILE *lf = fopen(list_path, "r");
+    if (!lf) {
+        perror("fopen (file list)");
+        return e_OTA_ERR_EXTRACTION_FAILED;
+    }
+
+    size_t n = 0, cap = 64;
+    char **wanted = malloc(cap * sizeof(*wanted));
+    char line[e_SIZE_1024];
+    while (wanted && fgets(line, sizeof(line), lf)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (!line[0]) continue;
+        if (n == cap) {
+            char **grown = realloc(wanted, (cap *= 2) * sizeof(*wanted));
+            if (!grown) break;
+            wanted = grown;
+        }
+        if ((wanted[n] = strdup(line)) != NULL) n++;
+    }
+    fclose(lf);
+    if (!wanted)
+        return e_OTA_ERR_EXTRACTION_FAILED;
+    qsort(wanted, n, sizeof(*wanted), path_cmp);
+
+    int ret = e_OTA_ERR_EXTRACTION_FAILED;
+    zst_reader_t r;
+    int opened = zst_open(&r, pkg);
+    if (opened == -2)
+        ret = e_OTA_ERR_VERIFY_FAILED;
+    if (opened == 0) {
+        int written = 0;
+        uint64_t bytes = 0;
+        ret = e_OTA_SUCCESS;
+
+        // Index order is archive order, so each frame is decompressed at most once
+        char *save = NULL;
+        for (char *l = strtok_r(r.index, "\n", &save); l && ret == e_OTA_SUCCESS; l = strtok_r(NULL, "\n", &save)) {
+            unsigned long long off;
+            char type;
+            const char *name = parse_index_line(l, &off, &type);
+            if (!name || !bsearch(&name, wanted, n, sizeof(*wanted), path_cmp))
+                continue;
+            if (extract_entry(&r, off, dest_dir, &bytes) != 0) {
+                char msg[e_SIZE_1024];
+                snprintf(msg, sizeof(msg), "Failed to extract %s from zstd package.", name);
+                log_msg(msg);
+                ret = e_OTA_ERR_EXTRACTION_FAILED;
+            }
+            written++;
+            ota_progress_update(bytes, written);
+        }
+        if (r.chunks.mismatch)
+            ret = e_OTA_ERR_VERIFY_FAILED;
+        zst_close(&r);
+
+        char msg[e_SIZE_128];
+        snprintf(msg, sizeof(msg), "Extracted %d entries from zstd package.", written);
+        log_msg(msg);
+    }
+
+    for (size_t i = 0; i < n; i++)
+        free(wanted[i]);
+    free(wanted);
+    return ret;
+}
+
+#else /* !OTA_HAVE_ZSTD */
+
+int zst_list_files(const char *pkg, const char *list_path) {
+    (void)pkg; (void)list_path;
+    log_msg("zstd package received but ota_service was built without zstd support.");
+    return e_OTA_ERR_FILELIST_FAILED;
+}
+
+int zst_extract_files(const char *pkg, const char *dest_dir, const char *list_path) {
+    (void)pkg; (void)dest_dir; (void)list_path;
+    log_msg("zstd package received but ota_service was built without zstd support.");
+    return e_OTA_ERR_EXTRACTION_FAILED;
+}
+
+#endif /* OTA_HAVE_ZSTD */
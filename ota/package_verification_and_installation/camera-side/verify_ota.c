@@ -19,6 +19,9 @@
 #include <openssl/buffer.h>
 
 #include <ctype.h>  /* required for isdigit */
+#include <fcntl.h>
+#include <unistd.h>
+#include "ota_merkle.h"
 
 #define DEBUG 0
 #define LOG(fmt, ...) do { if (DEBUG) fprintf(stderr, "[DEBUG] " fmt "\n", ##__VA_ARGS__); } while (0)
@@ -31,9 +34,11 @@
 } while (0)
 
 #define OTA_FILE "/mnt/flash/vienna/firmware/ota/fw_package.tar.gz"
+#define OTA_FILE_ZST "/mnt/flash/vienna/firmware/ota/fw_package.tar.zst"
 #define MANIFEST_FILE "/mnt/flash/vienna/firmware/ota/manifest.json"
 #define PUBLIC_KEY_FILE "/mnt/flash/vienna/firmware/ota/public.pem"
 #define JFFS2_VERSION_FILE "/mnt/flash/jffs2_version"
+#define FILE_HASHES_FILE "/mnt/flash/vienna/firmware/ota/file_hashes.txt"
 
 typedef struct {
     int major;
@@ -239,6 +244,243 @@ int version_check(const char *json) {
     return 0;
 }
 
+// Verifies an RSA/SHA-256 signature (base64) over an already computed digest
+static int verify_digest_signature(const unsigned char *digest, const char *sig_b64) {
+    size_t sig_len;
+    unsigned char *sig = base64_decode(sig_b64, &sig_len);
+    HEXDUMP("Decoded signature", sig, sig_len);
+
+    LOG("Loading public key from %s", PUBLIC_KEY_FILE);
+    FILE *fp = fopen(PUBLIC_KEY_FILE, "r");
+    if (!fp) { perror("pubkey"); free(sig); return 0; }
+    EVP_PKEY *pubkey = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+    fclose(fp);
+
+    if (!pubkey) {
+        fprintf(stderr, "[-] Error reading public key\n");
+        free(sig);
+        return 0;
+    }
+
+    RSA *rsa = EVP_PKEY_get1_RSA(pubkey);
+    if (!rsa) {
+        fprintf(stderr, "[-] Could not get RSA from public key\n");
+        EVP_PKEY_free(pubkey);
+        free(sig);
+        return 0;
+    }
+
+    LOG("Verifying signature using RSA_verify...");
+    int ret = RSA_verify(NID_sha256, digest, SHA256_DIGEST_LENGTH, sig, sig_len, rsa);
+    RSA_free(rsa);
+    EVP_PKEY_free(pubkey);
+    free(sig);
+    LOG("RSA_verify returned %d", ret);
+    return ret == 1;
+}
+
+// Reads one "key": value pair of a flat JSON object. Strings carry no escapes
+// (the packager drops such paths), so the value ends at the next quote or
+// delimiter. Returns the position after the value, or NULL on malformed input.
+static const char *next_json_pair(const char *p, char *key, size_t key_max,
+                                  char *val, size_t val_max) {
+    while (*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t') p++;
+    if (*p != '\"') return NULL;
+    const char *end = strchr(++p, '\"');
+    if (!end || (size_t)(end - p) >= key_max) return NULL;
+    memcpy(key, p, end - p);
+    key[end - p] = '\0';
+
+    p = end + 1;
+    while (*p == ' ' || *p == ':') p++;
+    if (*p == '\"') {
+        end = strchr(++p, '\"');
+        if (!end) return NULL;
+    } else {
+        end = p + strcspn(p, ",} \n");
+    }
+    if ((size_t)(end - p) >= val_max) return NULL;
+    memcpy(val, p, end - p);
+    val[end - p] = '\0';
+    return (*end == '\"') ? end + 1 : end;
+}
+
+// Rebuilds the canonical "<sha256> <size> <path>" list that the packager
+// signed from the manifest "files" array. Returns NULL if the array is absent.
+static char *build_file_list(const char *json, size_t *out_len, int *malformed) {
+    *malformed = 0;
+    *out_len = 0;
+    const char *p = strstr(json, "\"files\"");
+    if (!p) return NULL;
+    p = strchr(p, '[');
+    if (!p) { *malformed = 1; return NULL; }
+    p++;
+
+    size_t cap = 4096;
+    char *list = malloc(cap);
+    if (!list) { *malformed = 1; return NULL; }
+
+    for (;;) {
+        while (*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t') p++;
+        if (*p == ']') break;
+        if (*p != '{') { *malformed = 1; break; }
+        p++;
+
+        char key[32], val[1024];
+        char path[1024] = {0}, sha[65] = {0};
+        long long size = -1;
+        while ((p = next_json_pair(p, key, sizeof(key), val, sizeof(val))) != NULL) {
+            if (strcmp(key, "path") == 0) snprintf(path, sizeof(path), "%s", val);
+            else if (strcmp(key, "size") == 0) size = atoll(val);
+            else if (strcmp(key, "sha256") == 0 && strlen(val) == 64) memcpy(sha, val, sizeof(sha));
+            while (*p == ' ' || *p == '\n') p++;
+            if (*p == '}') break;
+        }
+        if (!p || !path[0] || size < 0 || strlen(sha) != 64) { *malformed = 1; break; }
+        p++;
+
+        size_t need = *out_len + strlen(path) + 100;
+        if (need > cap) {
+            while (need > cap) cap *= 2;
+            char *grown = realloc(list, cap);
+            if (!grown) { *malformed = 1; break; }
+            list = grown;
+        }
+        *out_len += sprintf(list + *out_len, "%s %lld %s\n", sha, size, path);
+    }
+
+    if (*malformed) {
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Checks the signed per-file hash list and hands it to ota_service, which
+// uses it to skip files that are already installed. Packages built before
+// per-file hashes existed simply install everything.
+static int verify_file_hashes(const char *json) {
+    size_t list_len;
+    int malformed;
+    char *list = build_file_list(json, &list_len, &malformed);
+    remove(FILE_HASHES_FILE);
+
+    if (!list) {
+        if (malformed) {
+            fprintf(stderr, "[-] Malformed files array in manifest\n");
+            return 1;
+        }
+        printf("[*] Manifest has no per-file hashes; full install.\n");
+        return 0;
+    }
+
+    char sig_b64[4096];
+    if (extract_json_field(json, "files_signature", sig_b64, sizeof(sig_b64))) {
+        fprintf(stderr, "[-] Manifest files array is not signed\n");
+        free(list);
+        return 1;
+    }
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)list, list_len, digest);
+    if (!verify_digest_signature(digest, sig_b64)) {
+        fprintf(stderr, "[-] File list signature invalid!\n");
+        free(list);
+        return 1;
+    }
+
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", FILE_HASHES_FILE);
+    FILE *out = fopen(tmp_path, "w");
+    if (!out || fwrite(list, 1, list_len, out) != list_len || fclose(out) != 0 ||
+        rename(tmp_path, FILE_HASHES_FILE) != 0) {
+        perror("file_hashes");
+        if (out) remove(tmp_path);
+        free(list);
+        return 1;
+    }
+
+    free(list);
+    printf("[+] File list signature verified.\n");
+    return 0;
+}
+
+// Checks the signed Merkle root over the package chunks and hands the leaves
+// to ota_service, which verifies each chunk as it streams through extraction.
+// Returns 1 when the manifest has no chunk tree (full-file hash instead).
+static int verify_chunk_tree(const char *json, const char *ota_file) {
+    remove(OTA_CHUNK_HASHES);
+    const char *p = strstr(json, "\"chunk_hashes\"");
+    if (!p) return 1;
+
+    char chunk_size[32], root_hex[80], sig_b64[4096];
+    if (extract_json_field(json, "chunk_size", chunk_size, sizeof(chunk_size)) ||
+        extract_json_field(json, "merkle_root", root_hex, sizeof(root_hex)) ||
+        extract_json_field(json, "merkle_signature", sig_b64, sizeof(sig_b64)) ||
+        strlen(root_hex) != 2 * SHA256_DIGEST_LENGTH) {
+        fprintf(stderr, "[-] Incomplete chunk tree in manifest\n");
+        return -1;
+    }
+
+    ota_chunks_t c = { .chunk_size = (uint32_t)atol(chunk_size) };
+    size_t cap = 0;
+    int ret = -1;
+    p = strchr(p, '[');
+    if (!p || c.chunk_size == 0 || c.chunk_size > OTA_MERKLE_MAX_CHUNK) goto malformed;
+    for (p++;;) {
+        while (*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t') p++;
+        if (*p == ']') break;
+        if (*p != '\"' || strspn(p + 1, "0123456789abcdef") != 2 * OTA_MERKLE_HASH_SIZE ||
+            p[1 + 2 * OTA_MERKLE_HASH_SIZE] != '\"' || c.count == OTA_MERKLE_MAX_CHUNKS)
+            goto malformed;
+        if (c.count == cap) {
+            cap = cap ? cap * 2 : 256;
+            void *grown = realloc(c.leaf, cap * OTA_MERKLE_HASH_SIZE);
+            if (!grown) goto out;
+            c.leaf = grown;
+        }
+        for (int j = 0; j < OTA_MERKLE_HASH_SIZE; j++)
+            sscanf(p + 1 + 2 * j, "%2hhx", &c.leaf[c.count][j]);
+        c.count++;
+        p += 2 + 2 * OTA_MERKLE_HASH_SIZE;
+    }
+
+    unsigned char root[OTA_MERKLE_HASH_SIZE], signed_root[OTA_MERKLE_HASH_SIZE];
+    for (int i = 0; i < OTA_MERKLE_HASH_SIZE; i++)
+        sscanf(&root_hex[i * 2], "%2hhx", &signed_root[i]);
+    if (ota_merkle_root((const unsigned char (*)[OTA_MERKLE_HASH_SIZE])c.leaf, c.count, root) != 0 ||
+        memcmp(root, signed_root, sizeof(root)) != 0) {
+        fprintf(stderr, "[-] Chunk hashes do not match the Merkle root!\n");
+        goto out;
+    }
+    if (!verify_digest_signature(root, sig_b64)) {
+        fprintf(stderr, "[-] Merkle root signature invalid!\n");
+        goto out;
+    }
+
+    int fd = open(ota_file, O_RDONLY);
+    int size_ok = fd >= 0 && ota_chunks_bind(&c, fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!size_ok) {
+        fprintf(stderr, "[-] Package size does not match the chunk tree\n");
+        goto out;
+    }
+
+    if (ota_chunks_save(OTA_CHUNK_HASHES, &c) != 0) {
+        perror("chunk_hashes");
+        goto out;
+    }
+    printf("[+] Merkle root signature verified; %u chunks are checked during extraction.\n", c.count);
+    ret = 0;
+    goto out;
+
+malformed:
+    fprintf(stderr, "[-] Malformed chunk_hashes array in manifest\n");
+out:
+    free(c.leaf);
+    return ret;
+}
+
 int main() {
     FILE *fp = fopen(MANIFEST_FILE, "r");
     if (!fp) { perror("manifest"); return 1; }
@@ -276,69 +518,65 @@ int main() {
         return 1;
     }
 
-    LOG("Computing SHA-256 hash of %s", OTA_FILE);
-    fp = fopen(OTA_FILE, "rb");
-    if (!fp) { perror("zip"); return 1; }
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    unsigned char buf[4096];
-    int n;
-    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
-        SHA256_Update(&ctx, buf, n);
-    fclose(fp);
-
-    unsigned char zip_hash[SHA256_DIGEST_LENGTH];
-    SHA256_Final(zip_hash, &ctx);
-    LOG("SHA-256 hash calculated from ZIP");
-    HEXDUMP("ZIP SHA-256", zip_hash, SHA256_DIGEST_LENGTH);
-
-    unsigned char manifest_hash[SHA256_DIGEST_LENGTH];
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
-        sscanf(&hash_hex[i * 2], "%2hhx", &manifest_hash[i]);
-    HEXDUMP("Manifest hash", manifest_hash, SHA256_DIGEST_LENGTH);
-
-    if (memcmp(zip_hash, manifest_hash, SHA256_DIGEST_LENGTH) != 0) {
-        fprintf(stderr, "[-] Hash mismatch!\n");
+    // ota_service picks the package from "compression" as well, so the
+    // signed file must be the one it is going to install.
+    char compression[16] = "gzip";
+    char filename[128] = {0};
+    extract_json_field(json, "compression", compression, sizeof(compression));
+    int is_zstd = strcmp(compression, "zstd") == 0;
+    const char *ota_file = is_zstd ? OTA_FILE_ZST : OTA_FILE;
+    if ((!is_zstd && strcmp(compression, "gzip") != 0) ||
+        (extract_json_field(json, "filename", filename, sizeof(filename)) == 0 &&
+         strcmp(filename, strrchr(ota_file, '/') + 1) != 0)) {
+        fprintf(stderr, "[-] Unsupported package %s (compression %s)\n", filename, compression);
         return 1;
     }
-    printf("[+] Hash verified.\n");
 
-    size_t sig_len;
-    unsigned char *sig = base64_decode(sig_b64, &sig_len);
-    HEXDUMP("Decoded signature", sig, sig_len);
-
-    LOG("Loading public key from %s", PUBLIC_KEY_FILE);
-    fp = fopen(PUBLIC_KEY_FILE, "r");
-    if (!fp) { perror("pubkey"); return 1; }
-    EVP_PKEY *pubkey = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
-    fclose(fp);
-
-    if (!pubkey) {
-        fprintf(stderr, "[-] Error reading public key\n");
+    int tree = verify_chunk_tree(json, ota_file);
+    if (tree < 0) {
+        free(json);
         return 1;
     }
 
-    RSA *rsa = EVP_PKEY_get1_RSA(pubkey);
-    if (!rsa) {
-        fprintf(stderr, "[-] Could not get RSA from public key\n");
-        EVP_PKEY_free(pubkey);
-        return 1;
-    }
+    // Without a chunk tree the whole package is hashed up front
+    if (tree > 0) {
+        LOG("Computing SHA-256 hash of %s", ota_file);
+        fp = fopen(ota_file, "rb");
+        if (!fp) { perror("zip"); return 1; }
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        unsigned char buf[4096];
+        int n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+            SHA256_Update(&ctx, buf, n);
+        fclose(fp);
 
-    LOG("Verifying signature using RSA_verify...");
-    int ret = RSA_verify(NID_sha256, zip_hash, SHA256_DIGEST_LENGTH, sig, sig_len, rsa);
-    RSA_free(rsa);
-    EVP_PKEY_free(pubkey);
-    free(sig);
-    free(json);
+        unsigned char zip_hash[SHA256_DIGEST_LENGTH];
+        SHA256_Final(zip_hash, &ctx);
+        LOG("SHA-256 hash calculated from ZIP");
+        HEXDUMP("ZIP SHA-256", zip_hash, SHA256_DIGEST_LENGTH);
+
+        unsigned char manifest_hash[SHA256_DIGEST_LENGTH];
+        for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+            sscanf(&hash_hex[i * 2], "%2hhx", &manifest_hash[i]);
+        HEXDUMP("Manifest hash", manifest_hash, SHA256_DIGEST_LENGTH);
+
+        if (memcmp(zip_hash, manifest_hash, SHA256_DIGEST_LENGTH) != 0) {
+            fprintf(stderr, "[-] Hash mismatch!\n");
+            return 1;
+        }
+        printf("[+] Hash verified.\n");
 
-    if (ret == 1) {
+        if (!verify_digest_signature(zip_hash, sig_b64)) {
+            fprintf(stderr, "[-] Signature invalid!\n");
+            free(json);
+            return 1;
+        }
         printf("[+] Signature verified. Firmware is authentic.\n");
-        return 0;
-    } else {
-        fprintf(stderr, "[-] Signature invalid!\n");
-        LOG("Signature verification failed: ret = %d", ret);
-        return 1;
     }
+
+    int ret = verify_file_hashes(json);
+    free(json);
+    return ret;
 }
 
@@ -3,13 +3,21 @@
 #include <string.h>
 #include <stdint.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <openssl/sha.h>
 #include <errno.h>
 #include <openssl/pem.h>
 #include <openssl/evp.h>
+#include <openssl/rsa.h>
 #include <openssl/bio.h>
 #include <openssl/buffer.h>
+#include <zlib.h>
+#ifdef OTA_HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define SECRET_STRING ""
 #define INPUT_FILE "ota.tar.gz"
@@ -20,77 +28,607 @@
 #define PRIVATE_KEY_PATH "../certs/private.pem"
 #define SIGNATURE_BIN "signature.bin"
 #define MANIFEST_PATH "manifest.json"
+#define FILES_SIGNATURE_BIN "files_signature.bin"
+#define MERKLE_SIGNATURE_BIN "merkle_signature.bin"
+#define CHUNK_SIZE_DEFAULT (64 * 1024)   // Merkle leaf size; the camera verifies per chunk
+#define CHUNK_SIZE_MAX (1024 * 1024)     // camera-side OTA_MERKLE_MAX_CHUNK
+#define TAR_BLOCK 512
+
+// Block-parallel gzip (pigz style): every block is deflated on its own with
+// the previous 32 KiB as preset dictionary and ends on a byte boundary, so
+// the concatenation is a single standard deflate stream.
+#define GZ_BLOCK (128 * 1024)
+#define GZ_DICT (32 * 1024)
+#define GZ_LEVEL Z_DEFAULT_COMPRESSION
+
+// zstd package: tar split into independent frames plus a seek table, so the
+// camera can list and extract entries without decompressing the whole file.
+#define FW_PACKAGE_ZST "fw_package.tar.zst"
+#define ZST_LEVEL 19
+#define ZST_FRAME_TARGET (128 * 1024)       // frames start at entry boundaries past this size
+#define ZST_FRAME_MAX (4 * ZST_FRAME_TARGET) // large entries are split at this size
+#define ZST_INDEX_MAGIC 0x184D2A5AU         // skippable frame: "<offset> <type> <path>" per entry
+#define ZST_SEEKTABLE_MAGIC 0x184D2A5EU     // skippable frame: zstd seekable format seek table
+#define ZST_SEEKABLE_MAGIC 0x8F92EAB1U
+
+static int use_zstd = 0;
+static int n_threads = 1;   // -j N; defaults to the number of online CPUs
+static size_t chunk_size = CHUNK_SIZE_DEFAULT;
+
+// ---------------------------------------------------------------------------
+// Thread pool
+// ---------------------------------------------------------------------------
+
+typedef void (*job_fn)(void *ctx, size_t index);
+
+typedef struct {
+    job_fn fn;
+    void *ctx;
+    size_t count;
+    size_t next;
+    pthread_mutex_t mutex;
+} job_queue_t;
+
+static void *job_worker(void *arg) {
+    job_queue_t *q = arg;
+    for (;;) {
+        pthread_mutex_lock(&q->mutex);
+        size_t i = q->next++;
+        pthread_mutex_unlock(&q->mutex);
+        if (i >= q->count) break;
+        q->fn(q->ctx, i);
+    }
+    return NULL;
+}
+
+// Runs fn(ctx, 0..count-1) on up to n_threads threads (the caller included)
+static void parallel_for(size_t count, job_fn fn, void *ctx) {
+    job_queue_t q = { fn, ctx, count, 0, PTHREAD_MUTEX_INITIALIZER };
+    int extra = n_threads - 1;
+    if ((size_t)extra > count) extra = count ? (int)count - 1 : 0;
+
+    pthread_t *tids = extra > 0 ? calloc(extra, sizeof(*tids)) : NULL;
+    int started = 0;
+    for (int i = 0; tids && i < extra; i++) {
+        if (pthread_create(&tids[i], NULL, job_worker, &q) != 0) break;
+        started++;
+    }
+    job_worker(&q);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+// ---------------------------------------------------------------------------
+// Hashing
+// ---------------------------------------------------------------------------
+
+static void to_hex(const unsigned char *hash, char *out_hex) {
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
+        sprintf(out_hex + i * 2, "%02x", hash[i]);
+}
+
+// SHA-256 of a file through a read-only mapping
+static int sha256_file(const char *filename, unsigned char *hash) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *map = NULL;
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    int ok = EVP_Digest(map ? map : "", st.st_size, hash, NULL, EVP_sha256(), NULL);
+    if (map) munmap(map, st.st_size);
+    return ok == 1 ? 0 : -1;
+}
 
 // Helper to compute SHA256 hash as hex string
 int sha256sum(const char *filename, char *out_hex) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) return -1;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    if (sha256_file(filename, hash) != 0) return -1;
+    to_hex(hash, out_hex);
+    return 0;
+}
+
+typedef struct {
+    const char *path;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    int ret;
+} file_hash_job_t;
 
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
+static void *file_hash_thread(void *arg) {
+    file_hash_job_t *job = arg;
+    job->ret = sha256_file(job->path, job->hash);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Chunk Merkle tree
+// ---------------------------------------------------------------------------
+// leaf = SHA256(0x00 || chunk), node = SHA256(0x01 || left || right), and an
+// odd node is promoted unchanged. Must match camera-side/ota_merkle.c.
 
-    unsigned char buffer[8192];
-    size_t read_len;
-    while ((read_len = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        SHA256_Update(&ctx, buffer, read_len);
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    unsigned char (*leaf)[SHA256_DIGEST_LENGTH];
+} chunk_hash_ctx_t;
+
+static void chunk_hash_job(void *arg, size_t i) {
+    chunk_hash_ctx_t *ctx = arg;
+    static const unsigned char prefix = 0x00;
+    size_t off = i * chunk_size;
+    size_t len = ctx->len - off < chunk_size ? ctx->len - off : chunk_size;
+
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+    EVP_DigestUpdate(md, &prefix, 1);
+    EVP_DigestUpdate(md, ctx->data + off, len);
+    EVP_DigestFinal_ex(md, ctx->leaf[i], NULL);
+    EVP_MD_CTX_free(md);
+}
+
+// Hashes every chunk of a file in parallel; the caller frees *leaves
+static int hash_chunks(const char *path, unsigned char (**leaves)[SHA256_DIGEST_LENGTH], size_t *count) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    *count = (st.st_size + chunk_size - 1) / chunk_size;
+    *leaves = malloc(*count * SHA256_DIGEST_LENGTH);
+    if (*leaves) {
+        chunk_hash_ctx_t ctx = { map, st.st_size, *leaves };
+        parallel_for(*count, chunk_hash_job, &ctx);
     }
-    fclose(file);
+    munmap(map, st.st_size);
+    return *leaves ? 0 : -1;
+}
+
+static int merkle_root(unsigned char (*leaves)[SHA256_DIGEST_LENGTH], size_t count, unsigned char *root) {
+    unsigned char (*level)[SHA256_DIGEST_LENGTH] = malloc(count * SHA256_DIGEST_LENGTH);
+    if (!level) return -1;
+    memcpy(level, leaves, count * SHA256_DIGEST_LENGTH);
+
+    unsigned char node[1 + 2 * SHA256_DIGEST_LENGTH];
+    node[0] = 0x01;
+    while (count > 1) {
+        size_t next = 0;
+        for (size_t i = 0; i < count; i += 2, next++) {
+            if (i + 1 == count) {
+                memcpy(level[next], level[i], SHA256_DIGEST_LENGTH);
+                continue;
+            }
+            memcpy(node + 1, level[i], SHA256_DIGEST_LENGTH);
+            memcpy(node + 1 + SHA256_DIGEST_LENGTH, level[i + 1], SHA256_DIGEST_LENGTH);
+            EVP_Digest(node, sizeof(node), level[next], NULL, EVP_sha256(), NULL);
+        }
+        count = next;
+    }
+    memcpy(root, level[0], SHA256_DIGEST_LENGTH);
+    free(level);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Firmware tarball
+// ---------------------------------------------------------------------------
 
+typedef struct {
+    size_t start;       // first header of the entry (GNU long-name headers included)
+    size_t data;        // first data byte
+    long long size;
+    char type;
+    char name[1024];
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_Final(hash, &ctx);
+} tar_entry_t;
+
+// Parses the octal size field of a tar header
+static long long tar_octal(const char *field, size_t len) {
+    long long v = 0;
+    for (size_t i = 0; i < len && field[i]; i++) {
+        if (field[i] == ' ') continue;
+        if (field[i] < '0' || field[i] > '7') break;
+        v = (v << 3) + (field[i] - '0');
+    }
+    return v;
+}
 
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
-        sprintf(out_hex + i * 2, "%02x", hash[i]);
+// Inflates the whole firmware tarball into memory
+static unsigned char *gunzip_file(const char *path, size_t *out_len) {
+    gzFile gz = gzopen(path, "rb");
+    if (!gz) return NULL;
+    gzbuffer(gz, 256 * 1024);
+
+    size_t cap = 1 << 20, len = 0;
+    unsigned char *buf = malloc(cap);
+    int got;
+    while (buf && (got = gzread(gz, buf + len, (unsigned)(cap - len))) > 0) {
+        len += got;
+        if (len == cap) {
+            unsigned char *grown = realloc(buf, cap * 2);
+            if (!grown) { free(buf); buf = NULL; break; }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    int err = 0;
+    gzerror(gz, &err);
+    gzclose(gz);
+    if (buf && err != Z_OK && err != Z_STREAM_END) {
+        free(buf);
+        return NULL;
+    }
+    *out_len = len;
+    return buf;
+}
 
+// Lists the entries of an in-memory tar (GNU and ustar headers)
+static int tar_scan(const unsigned char *tar, size_t tar_len, tar_entry_t **out, size_t *count) {
+    size_t n = 0, cap = 64;
+    tar_entry_t *entries = malloc(cap * sizeof(*entries));
+    if (!entries) return -1;
+
+    size_t pos = 0;
+    long long entry_start = -1;
+    char long_name[1024] = {0};
+    while (pos + TAR_BLOCK <= tar_len) {
+        const char *h = (const char *)tar + pos;
+        int empty = 1;
+        for (int i = 0; i < TAR_BLOCK; i++) {
+            if (h[i]) { empty = 0; break; }
+        }
+        if (empty) break;
+
+        long long size = tar_octal(h + 124, 12);
+        size_t next = pos + TAR_BLOCK + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        char type = h[156] ? h[156] : '0';
+        if (next > tar_len) goto fail;
+
+        if (type == 'x' || type == 'g') {
+            // Entries are addressed by header offset in the zstd index, so
+            // pax records would be lost there; gzip packages just skip them.
+            if (use_zstd) {
+                fprintf(stderr, "pax headers are not supported; create the firmware tar with --format=gnu\n");
+                goto fail;
+            }
+            pos = next;
+            continue;
+        }
+        if (entry_start < 0)
+            entry_start = pos;
+
+        if (type == 'L' || type == 'K') {
+            if (type == 'L') {
+                if (size >= (long long)sizeof(long_name)) goto fail;
+                memcpy(long_name, h + TAR_BLOCK, size);
+                long_name[size] = '\0';
+            }
+            pos = next;
+            continue;
+        }
+
+        if (n == cap) {
+            tar_entry_t *grown = realloc(entries, (cap *= 2) * sizeof(*entries));
+            if (!grown) goto fail;
+            entries = grown;
+        }
+        tar_entry_t *e = &entries[n++];
+        memset(e, 0, sizeof(*e));
+        e->start = entry_start;
+        e->data = pos + TAR_BLOCK;
+        e->size = size;
+        e->type = type;
+        if (long_name[0]) {
+            snprintf(e->name, sizeof(e->name), "%s", long_name);
+            long_name[0] = '\0';
+        } else if (memcmp(h + 257, "ustar", 5) == 0 && h[345]) {
+            snprintf(e->name, sizeof(e->name), "%.155s/%.100s", h + 345, h);
+        } else {
+            snprintf(e->name, sizeof(e->name), "%.100s", h);
+        }
+
+        entry_start = -1;
+        pos = next;
+    }
+
+    *out = entries;
+    *count = n;
     return 0;
+
+fail:
+    free(entries);
+    return -1;
 }
 
-// Signs a file using RSA and writes binary signature
-int sign_with_private_key(const char *data_path, const char *key_path, const char *sig_path) {
+typedef struct {
+    const unsigned char *tar;
+    tar_entry_t *entries;
+} entry_hash_ctx_t;
 
-    FILE *key_file = NULL;
+static void hash_entry_job(void *arg, size_t i) {
+    entry_hash_ctx_t *ctx = arg;
+    tar_entry_t *e = &ctx->entries[i];
+    if (e->type == '0' || e->type == '7')
+        EVP_Digest(ctx->tar + e->data, e->size, e->hash, NULL, EVP_sha256(), NULL);
+}
+
+// Regular files whose path can be carried verbatim in JSON get a per-file
+// hash; anything else is installed unconditionally by the camera.
+static int entry_has_hash(const tar_entry_t *e) {
+    return (e->type == '0' || e->type == '7') && !strpbrk(e->name, "\"\\\n");
+}
+
+#ifdef OTA_HAVE_ZSTD
+static void put_le32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
 
-    FILE *data_file = NULL;
+typedef struct {
+    const unsigned char *tar;
+    size_t tar_len;
+    const size_t *cuts;
+    size_t n_cuts;
+    unsigned char **frames;
+    size_t *frame_len;
+} zst_frame_ctx_t;
+
+static void compress_frame_job(void *arg, size_t i) {
+    zst_frame_ctx_t *ctx = arg;
+    size_t start = ctx->cuts[i];
+    size_t end = (i + 1 < ctx->n_cuts) ? ctx->cuts[i + 1] : ctx->tar_len;
+    size_t bound = ZSTD_compressBound(end - start);
+
+    ctx->frames[i] = malloc(bound);
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    if (ctx->frames[i] && cctx) {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZST_LEVEL);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+        size_t c = ZSTD_compress2(cctx, ctx->frames[i], bound, ctx->tar + start, end - start);
+        if (!ZSTD_isError(c)) ctx->frame_len[i] = c;
+    }
+    ZSTD_freeCCtx(cctx);
+}
+
+// Re-encodes the firmware tar as a seekable zstd archive. Frame cuts are
+// placed on tar entry boundaries, and an entry index frame records where
+// each entry's header starts in the decompressed stream. Frames are
+// independent, so they are compressed in parallel.
+int write_seekable_zstd(const unsigned char *tar, size_t tar_len, const tar_entry_t *entries,
+                        size_t n_entries, const char *out_path) {
+    size_t n_cuts = 0;
+    size_t *cuts = malloc((tar_len / ZST_FRAME_TARGET + n_entries + 2) * sizeof(*cuts));
+    size_t idx_len = 0, idx_cap = 64;
+    for (size_t i = 0; i < n_entries; i++)
+        idx_cap += strlen(entries[i].name) + 32;
+    char *idx = malloc(idx_cap);
+    int ret = -1;
+    if (!cuts || !idx) goto out;
+    cuts[n_cuts++] = 0;
+
+    for (size_t i = 0; i < n_entries; i++) {
+        const tar_entry_t *e = &entries[i];
+        if (e->start - cuts[n_cuts - 1] >= ZST_FRAME_TARGET)
+            cuts[n_cuts++] = e->start;
+        if (!strchr(e->name, '\n'))
+            idx_len += sprintf(idx + idx_len, "%zu %c %s\n", e->start, e->type, e->name);
+
+        // Split large entries so one big file never forces a huge frame
+        size_t next = e->data + (e->size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        while (next - cuts[n_cuts - 1] > ZST_FRAME_MAX) {
+            cuts[n_cuts] = cuts[n_cuts - 1] + ZST_FRAME_MAX;
+            n_cuts++;
+        }
+    }
+
+    unsigned char **frames = calloc(n_cuts, sizeof(*frames));
+    size_t *frame_len = calloc(n_cuts, sizeof(*frame_len));
+    FILE *out = fopen(out_path, "wb");
+    if (!frames || !frame_len || !out) goto zout;
+
+    zst_frame_ctx_t ctx = { tar, tar_len, cuts, n_cuts, frames, frame_len };
+    parallel_for(n_cuts, compress_frame_job, &ctx);
+
+    unsigned char le[9];
+    for (size_t i = 0; i < n_cuts; i++) {
+        if (!frame_len[i] || fwrite(frames[i], 1, frame_len[i], out) != frame_len[i]) {
+            fprintf(stderr, "zstd frame %zu failed\n", i);
+            goto zout;
+        }
+    }
+
+    put_le32(le, ZST_INDEX_MAGIC);
+    put_le32(le + 4, (uint32_t)idx_len);
+    fwrite(le, 1, 8, out);
+    fwrite(idx, 1, idx_len, out);
+
+    put_le32(le, ZST_SEEKTABLE_MAGIC);
+    put_le32(le + 4, (uint32_t)(n_cuts * 8 + 9));
+    fwrite(le, 1, 8, out);
+    for (size_t i = 0; i < n_cuts; i++) {
+        size_t end = (i + 1 < n_cuts) ? cuts[i + 1] : tar_len;
+        put_le32(le, (uint32_t)frame_len[i]);
+        put_le32(le + 4, (uint32_t)(end - cuts[i]));
+        fwrite(le, 1, 8, out);
+    }
+    put_le32(le, (uint32_t)n_cuts);
+    le[4] = 0;  // descriptor: no per-frame checksums (frames carry their own)
+    put_le32(le + 5, ZST_SEEKABLE_MAGIC);
+    fwrite(le, 1, 9, out);
+
+    if (!ferror(out)) {
+        ret = 0;
+        printf("[+] %s: %zu frames, %zu bytes uncompressed\n", out_path, n_cuts, tar_len);
+    }
+
+zout:
+    if (out && fclose(out) != 0) ret = -1;
+    for (size_t i = 0; frames && i < n_cuts; i++)
+        free(frames[i]);
+    free(frames);
+    free(frame_len);
+out:
+    free(cuts);
+    free(idx);
+    return ret;
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// Block-parallel gzip
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const unsigned char *in;
+    size_t len;
+    size_t n_blocks;
+    unsigned char **out;
+    size_t *out_len;
+    uLong *crc;
+} gz_block_ctx_t;
+
+static void deflate_block_job(void *arg, size_t i) {
+    gz_block_ctx_t *ctx = arg;
+    size_t start = i * GZ_BLOCK;
+    size_t len = (start + GZ_BLOCK <= ctx->len) ? GZ_BLOCK : ctx->len - start;
+    int last = (i + 1 == ctx->n_blocks);
+
+    ctx->crc[i] = crc32(crc32(0L, Z_NULL, 0), ctx->in + start, (uInt)len);
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, GZ_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return;
+
+    if (start > 0) {
+        size_t dict = start < GZ_DICT ? start : GZ_DICT;
+        deflateSetDictionary(&strm, ctx->in + start - dict, (uInt)dict);
+    }
+
+    // Sync flush leaves a byte-aligned, non-final block that the next one can follow
+    size_t cap = deflateBound(&strm, len) + 16;
+    ctx->out[i] = malloc(cap);
+    if (ctx->out[i]) {
+        strm.next_in = (Bytef *)(ctx->in + start);
+        strm.avail_in = (uInt)len;
+        strm.next_out = ctx->out[i];
+        strm.avail_out = (uInt)cap;
+        int rc = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if ((last && rc == Z_STREAM_END) || (!last && rc == Z_OK && strm.avail_in == 0))
+            ctx->out_len[i] = cap - strm.avail_out;
+    }
+    deflateEnd(&strm);
+}
+
+// Writes buf as a single-member gzip file, compressing blocks in parallel
+int gzip_parallel(const unsigned char *buf, size_t len, const char *out_path) {
+    size_t n_blocks = len ? (len + GZ_BLOCK - 1) / GZ_BLOCK : 1;
+    gz_block_ctx_t ctx = { buf, len, n_blocks,
+                           calloc(n_blocks, sizeof(unsigned char *)),
+                           calloc(n_blocks, sizeof(size_t)),
+                           calloc(n_blocks, sizeof(uLong)) };
+    int ret = -1;
+    FILE *out = NULL;
+    if (!ctx.out || !ctx.out_len || !ctx.crc) goto done;
+
+    parallel_for(n_blocks, deflate_block_job, &ctx);
+
+    out = fopen(out_path, "wb");
+    if (!out) goto done;
+
+    // gzip header: deflate, no name, mtime 0, unix
+    static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    fwrite(header, 1, sizeof(header), out);
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (size_t i = 0; i < n_blocks; i++) {
+        if (!ctx.out_len[i] || fwrite(ctx.out[i], 1, ctx.out_len[i], out) != ctx.out_len[i]) goto done;
+        size_t block_len = (i + 1 < n_blocks) ? GZ_BLOCK : len - i * GZ_BLOCK;
+        crc = crc32_combine(crc, ctx.crc[i], (z_off_t)block_len);
+    }
+
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (crc >> (8 * i)) & 0xff;
+        trailer[4 + i] = ((uint32_t)len >> (8 * i)) & 0xff;
+    }
+    fwrite(trailer, 1, sizeof(trailer), out);
+    ret = ferror(out) ? -1 : 0;
+
+done:
+    if (out && fclose(out) != 0) ret = -1;
+    for (size_t i = 0; ctx.out && i < n_blocks; i++)
+        free(ctx.out[i]);
+    free(ctx.out);
+    free(ctx.out_len);
+    free(ctx.crc);
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Signing
+// ---------------------------------------------------------------------------
+
+// Signs a SHA-256 digest with RSA (PKCS#1 v1.5) and writes the binary
+// signature. Identical to EVP_DigestSign over the data, without a second
+// pass over the file.
+int sign_with_private_key(const unsigned char *digest, const char *key_path, const char *sig_path) {
+
+    FILE *key_file = NULL;
 
     FILE *sig_file = NULL;
 
     EVP_PKEY *pkey = NULL;
 
-    EVP_MD_CTX *md_ctx = NULL;
+    EVP_PKEY_CTX *pkey_ctx = NULL;
 
     unsigned char *sig = NULL;
 
     int ret = -1;
-    
+
     key_file = fopen(key_path, "r");
     if (!key_file) goto cleanup;
 
     pkey = PEM_read_PrivateKey(key_file, NULL, NULL, NULL);
     if (!pkey) goto cleanup;
 
-    data_file = fopen(data_path, "rb");
-    if (!data_file) goto cleanup;
-
-    md_ctx = EVP_MD_CTX_new();
-    if (!md_ctx) {
+    pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
+    if (!pkey_ctx) {
         goto cleanup;
     }
 
-    if (EVP_DigestSignInit(md_ctx, NULL, EVP_sha256(), NULL, pkey) != 1) {
+    if (EVP_PKEY_sign_init(pkey_ctx) != 1 ||
+        EVP_PKEY_CTX_set_rsa_padding(pkey_ctx, RSA_PKCS1_PADDING) != 1 ||
+        EVP_PKEY_CTX_set_signature_md(pkey_ctx, EVP_sha256()) != 1) {
         goto cleanup;
     }
 
-    unsigned char buffer[8192];
-    size_t len;
-    while ((len = fread(buffer, 1, sizeof(buffer), data_file)) > 0) {
-        if (EVP_DigestSignUpdate(md_ctx, buffer, len) != 1) goto cleanup;
-    }
-
     size_t sig_len;
-    EVP_DigestSignFinal(md_ctx, NULL, &sig_len);
+    if (EVP_PKEY_sign(pkey_ctx, NULL, &sig_len, digest, SHA256_DIGEST_LENGTH) != 1) goto cleanup;
     sig = malloc(sig_len);
+    if (!sig) goto cleanup;
 
-    if (EVP_DigestSignFinal(md_ctx, sig, &sig_len) != 1) {
+    if (EVP_PKEY_sign(pkey_ctx, sig, &sig_len, digest, SHA256_DIGEST_LENGTH) != 1) {
         goto cleanup;
     }
 
@@ -103,11 +641,9 @@ cleanup:
 
     if (sig_file) fclose(sig_file);
 
-    if (data_file) fclose(data_file);
-
     if (key_file) fclose(key_file);
 
-    if (md_ctx) EVP_MD_CTX_free(md_ctx);
+    if (pkey_ctx) EVP_PKEY_CTX_free(pkey_ctx);
 
     if (pkey) EVP_PKEY_free(pkey);
 
@@ -155,46 +691,107 @@ char *base64_encode_file(const char *file_path) {
     return encoded;
 }
 
+// ---------------------------------------------------------------------------
+// Manifest
+// ---------------------------------------------------------------------------
+
 int generate_manifest() {
+    const char *package = use_zstd ? FW_PACKAGE_ZST : FW_PACKAGE;
+    int ret = -1;
+    char *sig_b64 = NULL;
+    char *files_sig_b64 = NULL;
+    char *merkle_sig_b64 = NULL;
+    unsigned char (*leaves)[SHA256_DIGEST_LENGTH] = NULL;
+    size_t n_chunks = 0;
+    char *list = NULL;
+    tar_entry_t *entries = NULL;
+    size_t n_entries = 0;
+
+    size_t tar_len = 0;
+    unsigned char *tar = gunzip_file(FW_PACKAGE, &tar_len);
+    if (!tar) {
+        perror("Error: firmware package not found or corrupt");
+        return -1;
+    }
+    if (tar_scan(tar, tar_len, &entries, &n_entries) != 0) {
+        fprintf(stderr, "Failed to parse %s\n", FW_PACKAGE);
+        goto out;
+    }
+
+#ifdef OTA_HAVE_ZSTD
+    if (use_zstd && write_seekable_zstd(tar, tar_len, entries, n_entries, FW_PACKAGE_ZST) != 0) {
+        fprintf(stderr, "Failed to create %s\n", FW_PACKAGE_ZST);
+        goto out;
+    }
+#endif
+
     struct stat st;
-    if (stat(FW_PACKAGE, &st) != 0) {
+    if (stat(package, &st) != 0) {
         perror("Error: firmware package not found");
-        return -1;
+        goto out;
     }
     long size = st.st_size;
 
-    char hash_hex[65] = {0};
-    if (sha256sum(FW_PACKAGE, hash_hex) != 0) {
+    // The package digest is one serial stream; run it alongside the per-file hashes
+    file_hash_job_t pkg_job = { package, {0}, -1 };
+    pthread_t pkg_thread;
+    int pkg_threaded = pthread_create(&pkg_thread, NULL, file_hash_thread, &pkg_job) == 0;
+    if (!pkg_threaded)
+        file_hash_thread(&pkg_job);
+
+    entry_hash_ctx_t hash_ctx = { tar, entries };
+    parallel_for(n_entries, hash_entry_job, &hash_ctx);
+
+    if (pkg_threaded)
+        pthread_join(pkg_thread, NULL);
+    if (pkg_job.ret != 0) {
         fprintf(stderr, "Failed to hash firmware\n");
-        return -1;
+        goto out;
     }
 
-    if (sign_with_private_key(FW_PACKAGE, PRIVATE_KEY_PATH, SIGNATURE_BIN) != 0) {
+    char hash_hex[65] = {0};
+    to_hex(pkg_job.hash, hash_hex);
+
+    if (sign_with_private_key(pkg_job.hash, PRIVATE_KEY_PATH, SIGNATURE_BIN) != 0) {
         fprintf(stderr, "Signature generation failed\n");
-        return -1;
+        goto out;
     }
 
-    char *sig_b64 = base64_encode_file(SIGNATURE_BIN);
+    sig_b64 = base64_encode_file(SIGNATURE_BIN);
     if (!sig_b64) {
         fprintf(stderr, "Failed to base64 encode signature\n");
-        return -1;
+        goto out;
+    }
+
+    // --- Chunk Merkle tree (lets the camera verify while it extracts) ---
+    unsigned char root[SHA256_DIGEST_LENGTH];
+    char root_hex[65] = {0};
+    if (hash_chunks(package, &leaves, &n_chunks) != 0 || merkle_root(leaves, n_chunks, root) != 0 ||
+        sign_with_private_key(root, PRIVATE_KEY_PATH, MERKLE_SIGNATURE_BIN) != 0) {
+        fprintf(stderr, "Merkle tree generation failed\n");
+        goto out;
+    }
+    to_hex(root, root_hex);
+    merkle_sig_b64 = base64_encode_file(MERKLE_SIGNATURE_BIN);
+    remove(MERKLE_SIGNATURE_BIN);
+    if (!merkle_sig_b64) {
+        fprintf(stderr, "Failed to base64 encode Merkle root signature\n");
+        goto out;
     }
 
     // --- Get version from fw_package.tar.gz ---
     char version[128] = {0};
-    FILE *fp = popen("tar -xOzf fw_package.tar.gz jffs2_version", "r");
-    if (!fp) {
-        perror("Error reading version from package");
-        free(sig_b64);
-        return -1;
+    for (size_t i = 0; i < n_entries; i++) {
+        if (strcmp(entries[i].name, "jffs2_version") == 0 || strcmp(entries[i].name, "./jffs2_version") == 0) {
+            size_t n = entries[i].size < (long long)sizeof(version) - 1 ? (size_t)entries[i].size : sizeof(version) - 1;
+            memcpy(version, tar + entries[i].data, n);
+            break;
+        }
     }
-    if (!fgets(version, sizeof(version), fp)) {
+    if (!version[0]) {
         fprintf(stderr, "Failed to read version from tar\n");
-        pclose(fp);
-        free(sig_b64);
-        return -1;
+        goto out;
     }
-    pclose(fp);
     version[strcspn(version, "\r\n")] = 0;  // Remove trailing newline
 
     // --- Get compatible version ---
@@ -209,46 +806,180 @@ int generate_manifest() {
         fprintf(stderr, "Warning: compatible_on file not found, leaving empty\n");
     }
 
+    // --- Per-file hashes (signed separately from the package) ---
+    // Canonical form: "<sha256> <size> <path>\n" per file, in archive order.
+    // This list is signed and shipped inside the manifest so the camera can
+    // skip files that are already installed byte-for-byte.
+    size_t list_cap = 1, list_len = 0;
+    int file_count = 0;
+    for (size_t i = 0; i < n_entries; i++)
+        list_cap += strlen(entries[i].name) + 96;
+    list = malloc(list_cap);
+    if (!list) goto out;
+    list[0] = '\0';
+    for (size_t i = 0; i < n_entries; i++) {
+        if (!entry_has_hash(&entries[i])) continue;
+        char file_hex[65];
+        to_hex(entries[i].hash, file_hex);
+        list_len += sprintf(list + list_len, "%s %lld %s\n", file_hex, entries[i].size, entries[i].name);
+        file_count++;
+    }
+
+    unsigned char list_digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)list, list_len, list_digest);
+    if (sign_with_private_key(list_digest, PRIVATE_KEY_PATH, FILES_SIGNATURE_BIN) != 0) {
+        fprintf(stderr, "File list signature generation failed\n");
+        goto out;
+    }
+
+    files_sig_b64 = base64_encode_file(FILES_SIGNATURE_BIN);
+    remove(FILES_SIGNATURE_BIN);
+    if (!files_sig_b64) {
+        fprintf(stderr, "Failed to base64 encode file list signature\n");
+        goto out;
+    }
+
     // --- Write manifest.json ---
     FILE *mf = fopen(MANIFEST_PATH, "w");
     if (!mf) {
         perror("Error creating manifest.json");
-        free(sig_b64);
-        return -1;
+        goto out;
     }
 
+    // "files" must stay after the top-level keys: the camera-side parser
+    // picks the first occurrence of each key, so "size", "hash" and
+    // "signature" must also precede "chunk_size", "chunk_hashes" and
+    // "merkle_signature".
     fprintf(mf,
         "{\n"
         "  \"version\": \"%s\",\n"
         "  \"compatible\": \"%s\",\n"
         "  \"filename\": \"%s\",\n"
+        "  \"compression\": \"%s\",\n"
         "  \"size\": %ld,\n"
         "  \"hash\": \"%s\",\n"
-        "  \"signature\": \"%s\"\n"
+        "  \"signature\": \"%s\",\n"
+        "  \"chunk_size\": %zu,\n"
+        "  \"merkle_root\": \"%s\",\n"
+        "  \"merkle_signature\": \"%s\",\n"
+        "  \"chunk_hashes\": [",
+        version, compatible, package, use_zstd ? "zstd" : "gzip", size, hash_hex, sig_b64,
+        chunk_size, root_hex, merkle_sig_b64
+    );
+
+    for (size_t i = 0; i < n_chunks; i++) {
+        char leaf_hex[65];
+        to_hex(leaves[i], leaf_hex);
+        fprintf(mf, "%s\n    \"%s\"", i ? "," : "", leaf_hex);
+    }
+    fprintf(mf, "\n  ],\n  \"files\": [");
+
+    int first = 1;
+    for (size_t i = 0; i < n_entries; i++) {
+        if (!entry_has_hash(&entries[i])) continue;
+        char file_hex[65];
+        to_hex(entries[i].hash, file_hex);
+        fprintf(mf, "%s\n    {\"path\": \"%s\", \"size\": %lld, \"sha256\": \"%s\"}",
+                first ? "" : ",", entries[i].name, entries[i].size, file_hex);
+        first = 0;
+    }
+
+    fprintf(mf,
+        "\n  ],\n"
+        "  \"files_signature\": \"%s\"\n"
         "}\n",
-        version, compatible, FW_PACKAGE, size, hash_hex, sig_b64
+        files_sig_b64
     );
 
-    fclose(mf);
-    free(sig_b64);
+    if (fclose(mf) != 0) {
+        perror("Error writing manifest.json");
+        goto out;
+    }
+    printf("[+] %d file hashes and %zu chunk hashes added to manifest (%d threads)\n", file_count, n_chunks,
+           n_threads);
     printf("[+] Manifest written to %s\n", MANIFEST_PATH);
-    return 0;
+    ret = 0;
+
+out:
+    free(sig_b64);
+    free(files_sig_b64);
+    free(merkle_sig_b64);
+    free(leaves);
+    free(list);
+    free(entries);
+    free(tar);
+    return ret;
 }
 
 int file_exists(const char *filename) {
     return access(filename, F_OK) == 0;
 }
 
+// Appends one regular file as a ustar entry
+static int tar_append_file(unsigned char **buf, size_t *len, size_t *cap, const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || strlen(path) >= 100) return -1;
+
+    size_t padded = (st.st_size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    size_t need = *len + TAR_BLOCK + padded + 2 * TAR_BLOCK;
+    if (need > *cap) {
+        unsigned char *grown = realloc(*buf, need * 2);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = need * 2;
+    }
+
+    unsigned char *h = *buf + *len;
+    memset(h, 0, TAR_BLOCK + padded);
+    snprintf((char *)h, 100, "%s", path);
+    snprintf((char *)h + 100, 8, "%07o", (unsigned)(st.st_mode & 07777));
+    snprintf((char *)h + 108, 8, "%07o", 0);
+    snprintf((char *)h + 116, 8, "%07o", 0);
+    snprintf((char *)h + 124, 12, "%011llo", (unsigned long long)st.st_size);
+    snprintf((char *)h + 136, 12, "%011llo", (unsigned long long)st.st_mtime);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    snprintf((char *)h + 265, 32, "root");
+    snprintf((char *)h + 297, 32, "root");
+
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    size_t got = fread(h + TAR_BLOCK, 1, st.st_size, f);
+    fclose(f);
+    if (got != (size_t)st.st_size) return -1;
+
+    *len += TAR_BLOCK + padded;
+    return 0;
+}
+
 int create_ota_tar() {
-    if (!file_exists(FIRMWARE_FILE)) {
-        fprintf(stderr, "Error: %s not found!\n", FIRMWARE_FILE);
+    const char *package = use_zstd ? FW_PACKAGE_ZST : FIRMWARE_FILE;
+    if (!file_exists(package)) {
+        fprintf(stderr, "Error: %s not found!\n", package);
         return -1;
     }
 
     printf("Creating OTA package...\n");
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "tar -czf %s %s %s", INPUT_FILE, FIRMWARE_FILE, MANIFEST_FILE);
-    if (system(cmd) != 0) {
+    size_t len = 0, cap = 0;
+    unsigned char *tar = NULL;
+    if (tar_append_file(&tar, &len, &cap, package) != 0 ||
+        tar_append_file(&tar, &len, &cap, MANIFEST_FILE) != 0) {
+        fprintf(stderr, "Error: Failed to create ota.tar.gz!\n");
+        free(tar);
+        return -1;
+    }
+    memset(tar + len, 0, 2 * TAR_BLOCK);  // end-of-archive marker
+    len += 2 * TAR_BLOCK;
+
+    int ret = gzip_parallel(tar, len, INPUT_FILE);
+    free(tar);
+    if (ret != 0) {
         fprintf(stderr, "Error: Failed to create ota.tar.gz!\n");
         return -1;
     }
@@ -289,7 +1020,34 @@ int rename_ota_with_sha() {
     return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = cpus > 0 ? (int)cpus : 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--zstd") == 0) {
+#ifdef OTA_HAVE_ZSTD
+            use_zstd = 1;
+#else
+            fprintf(stderr, "Error: built without zstd support (make ZSTD=1)\n");
+            return 1;
+#endif
+        } else if (strcmp(argv[i], "--chunk-kb") == 0 && i + 1 < argc) {
+            long kb = atol(argv[++i]);
+            if (kb < 1 || kb * 1024 > CHUNK_SIZE_MAX) {
+                fprintf(stderr, "Error: --chunk-kb must be 1..%d\n", CHUNK_SIZE_MAX / 1024);
+                return 1;
+            }
+            chunk_size = (size_t)kb * 1024;
+        } else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc) {
+            n_threads = atoi(argv[++i]);
+            if (n_threads < 1) n_threads = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--zstd] [-j threads] [--chunk-kb N]\n", argv[0]);
+            return 1;
+        }
+    }
+
     if (generate_manifest() != 0) {
         fprintf(stderr, "Error generating manifest\n");
         return 1;
@@ -305,4 +1063,3 @@ int main() {
 
     return 0;
 }
-
@@ -0,0 +1,98 @@
+#ifndef FAKE_DAEMON_H
+#define FAKE_DAEMON_H
+
+#include <mutex>
+#include <poll.h>
+#include <stdio.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Stand-in for a control daemon's message interface (fw/fw_msg.h): answers
+// every request with `reply` (never, if it is NULL) and records it
+class FakeDaemon {
+public:
+    FakeDaemon(const char *path, const char *reply)
+        : path_(path), reply_(reply ? reply : ""), silent_(!reply) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+        unlink(path);
+        lfd_ = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (bind(lfd_, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd_, 4) != 0 ||
+            pipe(stop_) != 0)
+            perror("fake daemon");
+        thread_ = std::thread([this] { serve(); });
+    }
+
+    ~FakeDaemon() {
+        if (write(stop_[1], "x", 1) != 1)
+            perror("fake daemon stop");
+        thread_.join();
+        close(lfd_);
+        close(stop_[0]);
+        close(stop_[1]);
+        unlink(path_.c_str());
+    }
+
+    std::vector<std::string> requests() {
+        std::lock_guard<std::mutex> g(mu_);
+        return requests_;
+    }
+
+    int accepts() {
+        std::lock_guard<std::mutex> g(mu_);
+        return accepts_;
+    }
+
+private:
+    void serve() {
+        int cfd = -1;
+        for (;;) {
+            struct pollfd p[3] = {{stop_[0], POLLIN, 0}, {lfd_, POLLIN, 0}, {cfd, POLLIN, 0}};
+            if (poll(p, 3, -1) < 0)
+                continue;
+            if (p[0].revents)
+                break;
+            if (p[1].revents & POLLIN) {
+                if (cfd >= 0)
+                    close(cfd);
+                cfd = accept(lfd_, NULL, NULL);
+                std::lock_guard<std::mutex> g(mu_);
+                accepts_++;
+                continue;
+            }
+            if (cfd >= 0 && p[2].revents) {
+                char buf[256];
+                ssize_t n = recv(cfd, buf, sizeof(buf), 0);
+                if (n <= 0) {
+                    close(cfd);
+                    cfd = -1;
+                    continue;
+                }
+                {
+                    std::lock_guard<std::mutex> g(mu_);
+                    requests_.emplace_back(buf, (size_t)n);
+                }
+                if (!silent_)
+                    send(cfd, reply_.data(), reply_.size(), MSG_NOSIGNAL);
+            }
+        }
+        if (cfd >= 0)
+            close(cfd);
+    }
+
+    std::string path_, reply_;
+    bool silent_;
+    int lfd_ = -1;
+    int stop_[2] = {-1, -1};
+    std::thread thread_;
+    std::mutex mu_;
+    std::vector<std::string> requests_;
+    int accepts_ = 0;
+};
+
+#endif // FAKE_DAEMON_H
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include "mock_fw_control.h"
 #include "mock_fw_extra.h"
@@ -15,6 +16,9 @@ static uint8_t mock_day_mode = 1;
 static uint8_t mock_image_misc = 1;
 static int8_t mock_stream_state = 1;
 static int mock_set_image_zoom_fail = 0;
+static int mock_set_image_zoom_delay_ms = 0;
+static int mock_set_image_zoom_calls = 0;
+static uint8_t mock_set_image_zoom_last = 0;
 static int mock_set_image_misc_fail = 0;
 static int mock_get_webrtc_fail = 0;
 static int mock_get_ir_cutfilter_fail = 0;
@@ -42,6 +46,9 @@ void set_mock_get_day_mode_fail(int fail) { mock_get_day_mode_fail = fail; }
 void set_mock_image_misc(uint8_t value) { mock_image_misc = value; }
 void set_mock_stream_state(int8_t value) { mock_stream_state = value; }
 void set_mock_set_image_zoom_fail(int fail) { mock_set_image_zoom_fail = fail; }
+void set_mock_set_image_zoom_delay_ms(int ms) { mock_set_image_zoom_delay_ms = ms; }
+int get_mock_set_image_zoom_calls(void) { return __atomic_load_n(&mock_set_image_zoom_calls, __ATOMIC_SEQ_CST); }
+uint8_t get_mock_set_image_zoom_last(void) { return mock_set_image_zoom_last; }
 void set_mock_set_image_misc_fail(int fail) { mock_set_image_misc_fail = fail; }
 void set_mock_get_webrtc_fail(int fail) { mock_get_webrtc_fail = fail; }
 void set_mock_get_ir_cutfilter_fail(int fail) { mock_get_ir_cutfilter_fail = fail; }
@@ -67,6 +74,9 @@ void reset_mock_fw_control(void) {
   mock_image_misc = 1;
   mock_stream_state = 1;
   mock_set_image_zoom_fail = 0;
+  mock_set_image_zoom_delay_ms = 0;
+  mock_set_image_zoom_calls = 0;
+  mock_set_image_zoom_last = 0;
   mock_set_image_misc_fail = 0;
   mock_get_webrtc_fail = 0;
   mock_get_ir_cutfilter_fail = 0;
@@ -110,7 +120,10 @@ void reset_mock_fw_control(void) {
 #include "fw/fw_audio.h"
 #include "log.h"
 
-pthread_mutex_t lock;
+pthread_rwlock_t system_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t network_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t image_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t streaming_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 /* ---- mock_fw_extra ---- */
 int8_t apply_video_frequency_change(VideoFrequency *freq) {
@@ -173,7 +186,10 @@ void stream_server_config_2k_on(void) {}
 
 /* ---- fw_image.h ---- */
 int8_t set_image_zoom(uint8_t image_zoom) {
-  (void)image_zoom;
+  __atomic_add_fetch(&mock_set_image_zoom_calls, 1, __ATOMIC_SEQ_CST);
+  if (mock_set_image_zoom_delay_ms)
+    usleep(mock_set_image_zoom_delay_ms * 1000);
+  mock_set_image_zoom_last = image_zoom;
   return mock_set_image_zoom_fail ? -1 : 0;
 }
 int8_t set_image_rotation(uint8_t image_rotation) {
@@ -21,6 +21,12 @@ void set_mock_stream_state(int8_t value);
 /** If non-zero, set_image_zoom returns -1 to trigger L1 error path. */
 void set_mock_set_image_zoom_fail(int fail);
 
+/** set_image_zoom sleeps this long (ms) before returning, default 0. */
+void set_mock_set_image_zoom_delay_ms(int ms);
+/** Number of set_image_zoom calls and the last value since the reset. */
+int get_mock_set_image_zoom_calls(void);
+uint8_t get_mock_set_image_zoom_last(void);
+
 /** If non-zero, set_image_misc returns -1 (set_image_misc_l2 returns -2). */
 void set_mock_set_image_misc_fail(int fail);
 
@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <utime.h>
 
 #include "mock_hw.h"
 
@@ -235,6 +239,115 @@ TEST_F(BoardSetupTest, CaptureFactoryBackup_Fail) {
     set_mock_system_return(0);
 }
 
+// ---------------------------------------------------------
+// In-process factory backup capture
+// ---------------------------------------------------------
+#define FLASH "/tmp/test_board/flash"
+#define BACKUP FLASH "/vienna/factory_backup"
+
+class FactoryBackupTest : public BoardSetupTest {
+protected:
+    void SetUp() override {
+        BoardSetupTest::SetUp();
+        system("mkdir -p " FLASH "/vienna/m5s_config " FLASH "/vienna/lib " FLASH "/etc/init.d");
+        put(FLASH "/vienna/m5s_config/hotspot_ssid", "Camera\n");
+        put(FLASH "/vienna/lib/libbig.so", "not archived\n");
+        put(FLASH "/etc/init.d/S99camera", "#!/bin/sh\n");
+        symlink("m5s_config/hotspot_ssid", FLASH "/vienna/ssid_link");
+        // Anything still going through tar would fail
+        set_mock_system_return(1);
+    }
+
+    void TearDown() override {
+        system("rm -rf /tmp/test_board/flash /tmp/test_board/out");
+    }
+
+    static void put(const char *path, const char *content) {
+        FILE *f = fopen(path, "w");
+        ASSERT_NE(f, nullptr) << path;
+        fputs(content, f);
+        fclose(f);
+        struct utimbuf t = { 1000000, 1000000 };
+        utime(path, &t);
+    }
+
+    static std::string slurp(const char *path) {
+        FILE *f = fopen(path, "r");
+        if (!f) return "<missing>";
+        char buf[4096] = {0};
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        return std::string(buf, n);
+    }
+
+    // system() is mocked, so the archives are checked by exec'ing tar
+    static int untar(const char *archive) {
+        system("mkdir -p /tmp/test_board/out");
+        pid_t pid = fork();
+        if (pid == 0) {
+            execlp("tar", "tar", "-xzf", archive, "-C", "/tmp/test_board/out", (char *)NULL);
+            _exit(127);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+};
+
+TEST_F(FactoryBackupTest, WritesCompressedArchivesAndManifest) {
+    capture_factory_backup();
+
+    ASSERT_EQ(untar(BACKUP "/vienna.tar.gz"), 0);
+    ASSERT_EQ(untar(BACKUP "/etc.tar.gz"), 0);
+    EXPECT_EQ(slurp("/tmp/test_board/out/vienna/m5s_config/hotspot_ssid"), "Camera\n");
+    EXPECT_EQ(slurp("/tmp/test_board/out/etc/init.d/S99camera"), "#!/bin/sh\n");
+    EXPECT_EQ(slurp("/tmp/test_board/out/vienna/lib/libbig.so"), "<missing>");
+    char target[64] = {0};
+    readlink("/tmp/test_board/out/vienna/ssid_link", target, sizeof(target) - 1);
+    EXPECT_STREQ(target, "m5s_config/hotspot_ssid");
+
+    std::string manifest = slurp(BACKUP "/manifest.txt");
+    // 8835b489a286f62c is the FNV-1a 64 of "Camera\n"
+    EXPECT_NE(manifest.find("f 7 1000000 8835b489a286f62c vienna/m5s_config/hotspot_ssid\n"),
+              std::string::npos);
+    EXPECT_NE(manifest.find("d 0 0 - vienna/m5s_config\n"), std::string::npos);
+    EXPECT_NE(manifest.find("x 0 0 - vienna/lib\n"), std::string::npos);
+    EXPECT_NE(manifest.find("x 0 0 - vienna/factory_backup\n"), std::string::npos);
+    EXPECT_NE(manifest.find("d 0 0 - etc/init.d\n"), std::string::npos);
+    EXPECT_EQ(manifest.find("libbig.so"), std::string::npos);
+}
+
+TEST_F(FactoryBackupTest, SkipsRecaptureWhenManifestMatches) {
+    capture_factory_backup();
+    struct stat first, second, third;
+    ASSERT_EQ(stat(BACKUP "/vienna.tar.gz", &first), 0);
+
+    capture_factory_backup();
+    ASSERT_EQ(stat(BACKUP "/vienna.tar.gz", &second), 0);
+    EXPECT_EQ(second.st_ino, first.st_ino);
+    EXPECT_EQ(second.st_mtim.tv_nsec, first.st_mtim.tv_nsec);
+
+    put(FLASH "/vienna/m5s_config/hotspot_ssid", "Renamed\n");
+    capture_factory_backup();
+    ASSERT_EQ(stat(BACKUP "/vienna.tar.gz", &third), 0);
+    EXPECT_NE(third.st_ino, first.st_ino);
+    ASSERT_EQ(untar(BACKUP "/vienna.tar.gz"), 0);
+    EXPECT_EQ(slurp("/tmp/test_board/out/vienna/m5s_config/hotspot_ssid"), "Renamed\n");
+}
+
+TEST_F(FactoryBackupTest, LongPathsSurviveTheArchive) {
+    std::string dir = FLASH "/vienna/" + std::string(90, 'd');
+    std::string file = dir + "/" + std::string(60, 'f');
+    mkdir(dir.c_str(), 0755);
+    put(file.c_str(), "deep\n");
+
+    capture_factory_backup();
+
+    ASSERT_EQ(untar(BACKUP "/vienna.tar.gz"), 0);
+    std::string out = "/tmp/test_board/out/vienna/" + std::string(90, 'd') + "/" + std::string(60, 'f');
+    EXPECT_EQ(slurp(out.c_str()), "deep\n");
+}
+
 TEST_F(BoardSetupTest, Main_WriteMacFail) {
     char arg0[] = "device_setup";
     char arg1[] = "02:1A:2B:3C:4D:5E"; char arg2[] = "SN1"; char arg3[] = "2023-10-10"; char arg4[] = "100";
@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <utime.h>
 
 #include "mock_hw.h"
 
@@ -13,10 +17,11 @@ extern "C" {
     void load_snapshot();
     void camera_configuration_reset();
     void camera_factory_reset();
+    const char *snapshot_lookup(const char *key);
     extern struct kv {
-        char key[128];
-        char value[512];
-    } entries[256];
+        char *key;
+        char *value;
+    } *entries;
     extern int entry_count;
 
 #ifndef SNAPSHOT_FILE
@@ -31,6 +36,12 @@ extern "C" {
 #ifndef FACTORY_RESET_STATUS_FILE
 #define FACTORY_RESET_STATUS_FILE "/tmp/test_factory/m5s_config/factory_reset_status"
 #endif
+#ifndef FACTORY_RESTORE_ROOT
+#define FACTORY_RESTORE_ROOT "/tmp/test_factory/root"
+#endif
+#ifndef CONFIG_VOLATILE_DIR
+#define CONFIG_VOLATILE_DIR "/tmp/test_factory/volatile"
+#endif
 }
 
 // NOTE: Since the production source hardcodes absolute paths, 
@@ -124,7 +135,11 @@ TEST_F(FactoryResetTest, CameraFactoryResetTest_Success) {
     // Assumes /mnt/flash/vienna/factory_backup exists (set up in SetUp)
     set_mock_system_return(0); // Make run_cmd succeed
     
+    system("mkdir -p " CONFIG_VOLATILE_DIR);
+    write_value(CONFIG_VOLATILE_DIR "/ir_led_brightness", "40");
+
     camera_factory_reset();
+    EXPECT_NE(access(CONFIG_VOLATILE_DIR "/ir_led_brightness", F_OK), 0);
     
     // Final status should be idle
     FILE* f = fopen(FACTORY_RESET_STATUS_FILE, "r");
@@ -159,6 +174,89 @@ TEST_F(FactoryResetTest, CameraConfigurationResetTest) {
     EXPECT_STREQ(buf, "val2\n");
 }
 
+TEST_F(FactoryResetTest, CameraConfigurationReset_DropsLazyCopies) {
+    FILE* f = fopen(SNAPSHOT_FILE, "w");
+    ASSERT_NE(f, nullptr);
+    fprintf(f, "ir_led_brightness=100\nwdr=0\n");
+    fclose(f);
+
+    // The flash file already holds the default; a lazy set left a newer
+    // value in tmpfs that has not been flushed yet
+    system("mkdir -p " CONFIG_VOLATILE_DIR);
+    write_value(CONFIG_DIR "/ir_led_brightness", "100");
+    write_value(CONFIG_VOLATILE_DIR "/ir_led_brightness", "40");
+    write_value(CONFIG_VOLATILE_DIR "/isp_temp_state", "1");
+
+    camera_configuration_reset();
+
+    EXPECT_NE(access(CONFIG_VOLATILE_DIR "/ir_led_brightness", F_OK), 0);
+    EXPECT_EQ(access(CONFIG_VOLATILE_DIR "/isp_temp_state", F_OK), 0); // not in the snapshot
+    f = fopen(CONFIG_DIR "/ir_led_brightness", "r");
+    ASSERT_NE(f, nullptr);
+    char buf[64] = {0};
+    fgets(buf, sizeof(buf), f);
+    fclose(f);
+    EXPECT_STREQ(buf, "100\n");
+}
+
+TEST_F(FactoryResetTest, LoadSnapshot_BeyondOldCap) {
+    FILE* f = fopen(SNAPSHOT_FILE, "w");
+    ASSERT_NE(f, nullptr);
+    for (int i = 0; i < 1000; i++)
+        fprintf(f, "key%d=value%d\n", i, i);
+    fprintf(f, "key7=override\n");
+    fclose(f);
+
+    load_snapshot();
+
+    EXPECT_EQ(entry_count, 1000);
+    EXPECT_STREQ(entries[999].key, "key999");
+    EXPECT_STREQ(snapshot_lookup("key999"), "value999");
+    EXPECT_STREQ(snapshot_lookup("key7"), "override");
+    EXPECT_EQ(snapshot_lookup("missing"), nullptr);
+}
+
+TEST_F(FactoryResetTest, CameraConfigurationReset_RewritesOnlyChangedKeys) {
+    const int n = 600;
+    FILE* f = fopen(SNAPSHOT_FILE, "w");
+    ASSERT_NE(f, nullptr);
+    for (int i = 0; i < n; i++)
+        fprintf(f, "cfg%d=val%d\n", i, i);
+    fclose(f);
+
+    char path[128], val[32];
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), CONFIG_DIR "/cfg%d", i);
+        snprintf(val, sizeof(val), (i % 100 == 0) ? "changed%d" : "val%d", i);
+        write_value(path, val);
+    }
+    unlink(CONFIG_DIR "/cfg599");
+
+    struct stat before_same, before_changed;
+    ASSERT_EQ(stat(CONFIG_DIR "/cfg1", &before_same), 0);
+    ASSERT_EQ(stat(CONFIG_DIR "/cfg300", &before_changed), 0);
+
+    camera_configuration_reset();
+
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), CONFIG_DIR "/cfg%d", i);
+        f = fopen(path, "r");
+        ASSERT_NE(f, nullptr) << path;
+        char buf[64] = {0};
+        fgets(buf, sizeof(buf), f);
+        fclose(f);
+        snprintf(val, sizeof(val), "val%d\n", i);
+        EXPECT_STREQ(buf, val);
+    }
+
+    struct stat after_same, after_changed;
+    ASSERT_EQ(stat(CONFIG_DIR "/cfg1", &after_same), 0);
+    ASSERT_EQ(stat(CONFIG_DIR "/cfg300", &after_changed), 0);
+    EXPECT_EQ(after_same.st_ino, before_same.st_ino);
+    EXPECT_EQ(after_same.st_mtim.tv_nsec, before_same.st_mtim.tv_nsec);
+    EXPECT_NE(after_changed.st_ino, before_changed.st_ino);
+}
+
 TEST_F(FactoryResetTest, CameraFactoryResetTest_TarFailure) {
     set_mock_system_return(1); // Make run_cmd (tar) fail
     camera_factory_reset();
@@ -207,3 +305,169 @@ TEST_F(FactoryResetTest, CameraFactoryReset_TarFail2) {
     // I would need a smart mock in mock_hw.c to do "succeed once, fail next".
     // For now, TarFailure already covers the fail branch because it returns early.
 }
+
+// ---------------------------------------------------------
+// In-process restore
+// ---------------------------------------------------------
+#define ROOT FACTORY_RESTORE_ROOT
+
+// system() is mocked, so the factory archives are built by exec'ing tar
+static int real_tar(const char *archive, const char *dir, const char *flags = "-cpf") {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execlp("tar", "tar", flags, archive, "-C", ROOT, dir, (char *)NULL);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void put_file(const char *path, const char *content, time_t mtime) {
+    FILE *f = fopen(path, "w");
+    ASSERT_NE(f, nullptr) << path;
+    fputs(content, f);
+    fclose(f);
+    struct utimbuf t = { mtime, mtime };
+    utime(path, &t);
+}
+
+static std::string slurp(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return "<missing>";
+    char buf[256] = {0};
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    return std::string(buf, n);
+}
+
+static struct stat stat_of(const char *path) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    lstat(path, &st);
+    return st;
+}
+
+static std::string read_status() {
+    return slurp(FACTORY_RESET_STATUS_FILE);
+}
+
+class FactoryRestoreTest : public FactoryResetTest {
+protected:
+    void SetUp() override {
+        FactoryResetTest::SetUp();
+        system("mkdir -p " ROOT "/vienna/m5s_config " ROOT "/vienna/lib " ROOT "/etc");
+        put_file(ROOT "/vienna/m5s_config/same", "factory-same\n", 1000000);
+        put_file(ROOT "/vienna/m5s_config/drift", "AAAA\n", 1000000);
+        put_file(ROOT "/vienna/m5s_config/gone", "gone\n", 1000000);
+        put_file(ROOT "/etc/hosts", "127.0.0.1 localhost\n", 1000000);
+        symlink("same", ROOT "/vienna/m5s_config/link");
+        ASSERT_EQ(real_tar(FACTORY_BACKUP_DIR "/vienna.tar", "vienna"), 0);
+        ASSERT_EQ(real_tar(FACTORY_BACKUP_DIR "/etc.tar", "etc"), 0);
+        // Any fallback to the tar command fails, so a pass means in-process
+        set_mock_system_return(1);
+    }
+};
+
+TEST_F(FactoryRestoreTest, RewritesOnlyDriftedFiles) {
+    struct stat same_before = stat_of(ROOT "/vienna/m5s_config/same");
+    struct stat hosts_before = stat_of(ROOT "/etc/hosts");
+    put_file(ROOT "/vienna/m5s_config/drift", "BBBB\n", 2000000);
+    unlink(ROOT "/vienna/m5s_config/gone");
+    unlink(ROOT "/vienna/m5s_config/link");
+    symlink("drift", ROOT "/vienna/m5s_config/link");
+
+    camera_factory_reset();
+
+    EXPECT_EQ(read_status(), "idle\n");
+    EXPECT_EQ(slurp(ROOT "/vienna/m5s_config/drift"), "AAAA\n");
+    EXPECT_EQ(stat_of(ROOT "/vienna/m5s_config/drift").st_mtime, 1000000);
+    EXPECT_EQ(slurp(ROOT "/vienna/m5s_config/gone"), "gone\n");
+    char target[64] = {0};
+    readlink(ROOT "/vienna/m5s_config/link", target, sizeof(target) - 1);
+    EXPECT_STREQ(target, "same");
+    // Untouched files keep their inode: they were not rewritten
+    EXPECT_EQ(stat_of(ROOT "/vienna/m5s_config/same").st_ino, same_before.st_ino);
+    EXPECT_EQ(stat_of(ROOT "/etc/hosts").st_ino, hosts_before.st_ino);
+}
+
+TEST_F(FactoryRestoreTest, SameContentOnlyRestoresMetadata) {
+    mode_t factory_mode = stat_of(ROOT "/vienna/m5s_config/same").st_mode;
+    put_file(ROOT "/vienna/m5s_config/same", "factory-same\n", 3000000);
+    chmod(ROOT "/vienna/m5s_config/same", 0600);
+    struct stat before = stat_of(ROOT "/vienna/m5s_config/same");
+
+    camera_factory_reset();
+
+    struct stat after = stat_of(ROOT "/vienna/m5s_config/same");
+    EXPECT_EQ(read_status(), "idle\n");
+    EXPECT_EQ(after.st_ino, before.st_ino);
+    EXPECT_EQ(after.st_mtime, 1000000);
+    EXPECT_EQ(after.st_mode, factory_mode);
+}
+
+TEST_F(FactoryRestoreTest, ManifestRemovesExtraFiles) {
+    FILE *m = fopen(FACTORY_BACKUP_DIR "/manifest.txt", "w");
+    ASSERT_NE(m, nullptr);
+    fprintf(m, "# factory manifest\n"
+               "d 0 0 - vienna\n"
+               "d 0 0 - vienna/m5s_config\n"
+               "f 13 1000000 - vienna/m5s_config/same\n"
+               "f 5 1000000 - vienna/m5s_config/drift\n"
+               "f 5 1000000 - vienna/m5s_config/gone\n"
+               "l 0 0 - vienna/m5s_config/link\n"
+               "x 0 0 - vienna/lib\n"
+               "d 0 0 - etc\n"
+               "f 20 1000000 - etc/hosts\n");
+    fclose(m);
+    put_file(ROOT "/vienna/m5s_config/user_added", "x\n", 1000000);
+    put_file(ROOT "/vienna/lib/libkeep.so", "keep\n", 1000000);
+    system("mkdir -p " ROOT "/vienna/stray/sub");
+    put_file(ROOT "/vienna/stray/sub/file", "x\n", 1000000);
+
+    camera_factory_reset();
+
+    EXPECT_EQ(read_status(), "idle\n");
+    EXPECT_EQ(slurp(ROOT "/vienna/m5s_config/user_added"), "<missing>");
+    EXPECT_NE(access(ROOT "/vienna/stray", F_OK), 0);
+    EXPECT_EQ(slurp(ROOT "/vienna/lib/libkeep.so"), "keep\n");
+    EXPECT_EQ(slurp(ROOT "/vienna/m5s_config/same"), "factory-same\n");
+    EXPECT_EQ(slurp(ROOT "/etc/hosts"), "127.0.0.1 localhost\n");
+}
+
+TEST_F(FactoryRestoreTest, UnreadableArchiveFallsBackToTar) {
+    put_file(FACTORY_BACKUP_DIR "/etc.tar", "not a tar archive", 1000000);
+    camera_factory_reset();
+    EXPECT_EQ(read_status(), "fail\n");
+
+    set_mock_system_return(0);
+    camera_factory_reset();
+    EXPECT_EQ(read_status(), "idle\n");
+}
+
+TEST_F(FactoryRestoreTest, CompressedArchiveUsesManifestHashes) {
+    // device_setup's layout: .tar.gz plus a manifest with content hashes
+    ASSERT_EQ(real_tar(FACTORY_BACKUP_DIR "/vienna.tar.gz", "vienna", "-czpf"), 0);
+    unlink(FACTORY_BACKUP_DIR "/vienna.tar");
+    FILE *m = fopen(FACTORY_BACKUP_DIR "/manifest.txt", "w");
+    ASSERT_NE(m, nullptr);
+    // FNV-1a 64 of "factory-same\n" and "AAAA\n"
+    fprintf(m, "f 13 1000000 %016llx vienna/m5s_config/same\n"
+               "f 5 1000000 %016llx vienna/m5s_config/drift\n",
+            0xf8d0c47ae8c9047cULL, 0x7137863f84e01549ULL);
+    fclose(m);
+
+    put_file(ROOT "/vienna/m5s_config/same", "factory-same\n", 4000000);
+    put_file(ROOT "/vienna/m5s_config/drift", "BBBB\n", 4000000);
+    struct stat same_before = stat_of(ROOT "/vienna/m5s_config/same");
+    struct stat drift_before = stat_of(ROOT "/vienna/m5s_config/drift");
+
+    camera_factory_reset();
+
+    EXPECT_EQ(read_status(), "idle\n");
+    struct stat same_after = stat_of(ROOT "/vienna/m5s_config/same");
+    EXPECT_EQ(same_after.st_ino, same_before.st_ino);
+    EXPECT_EQ(same_after.st_mtime, 1000000);
+    EXPECT_NE(stat_of(ROOT "/vienna/m5s_config/drift").st_ino, drift_before.st_ino);
+    EXPECT_EQ(slurp(ROOT "/vienna/m5s_config/drift"), "AAAA\n");
+}
@@ -0,0 +1,495 @@
+/**
+ * Tests for the fw subsystem entry points (fw_image.c, fw_network.c, ...)
+ * built together, unlike test_motocam_fw_libs which stubs them out.
+ */
+#include <gtest/gtest.h>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_daemon.h"
+#include "mock_hw.h"
+
+extern "C" {
+#include "fw.h"
+#include "fw/fw_clock.h"
+#include "fw/fw_config.h"
+#include "fw/fw_image.h"
+#include "fw/fw_msg.h"
+#include "fw/fw_network.h"
+#include "fw/fw_proc.h"
+#include "fw/fw_reactor.h"
+#include "fw/fw_state_machine.h"
+#include "fw/fw_streaming.h"
+}
+
+using Clock = std::chrono::steady_clock;
+
+static long elapsed_ms(Clock::time_point since) {
+    return (long)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - since).count();
+}
+
+class FwSubsystemsTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        system("mkdir -p /tmp/test_fws/config");
+        set_mock_system_return(0);
+        set_mock_popen_return(0);
+        set_mock_popen_output("3");
+        set_mock_pthread_allow(0);
+    }
+
+    void TearDown() override {
+        fw_msg_close(&fw_msg_streamer);
+        fw_clock_set(NULL, NULL);
+        system("rm -rf /tmp/test_fws");
+    }
+
+    static void write_file(const char *path, const char *text) {
+        FILE *f = fopen(path, "w");
+        ASSERT_NE(f, nullptr);
+        fputs(text, f);
+        fclose(f);
+    }
+};
+
+TEST_F(FwSubsystemsTest, GettersShareTheSubsystemLock) {
+    // Another reader holds image_lock; a getter still goes through
+    ASSERT_EQ(pthread_rwlock_rdlock(&image_lock), 0);
+
+    uint8_t zoom = 0;
+    auto start = Clock::now();
+    std::thread reader([&] { get_image_zoom(&zoom); });
+    reader.join();
+    EXPECT_LT(elapsed_ms(start), 100);
+    EXPECT_EQ(zoom, 3);
+
+    pthread_rwlock_unlock(&image_lock);
+}
+
+// A virtual clock whose sleepers are held until the test opens the gate
+static uint64_t gated_now;
+static int gate_open;
+static int gate_entered; // a sleeper reached the gate
+static uint64_t gated_clock(void) { return __atomic_load_n(&gated_now, __ATOMIC_SEQ_CST); }
+static void gated_sleep(uint32_t ms) {
+    __atomic_store_n(&gate_entered, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&gate_open, __ATOMIC_SEQ_CST))
+        usleep(1000);
+    __atomic_add_fetch(&gated_now, ms, __ATOMIC_SEQ_CST);
+}
+
+TEST_F(FwSubsystemsTest, ImageReadsStayFastDuringWifiSwitch) {
+    // The switch polls wifi_runtime_result once a second until it reads 0;
+    // the gate keeps it at its first wait
+    gated_now = 1000;
+    gate_open = 0;
+    gate_entered = 0;
+    fw_clock_set(gated_clock, gated_sleep);
+
+    int8_t switch_ret = 1;
+    std::thread wifi([&] {
+        switch_ret = set_wifi_dhcp_client_config("cam-ap", 2, "secret");
+    });
+    // Once it waits, the switch has marked wifi_runtime_result in progress
+    // and the 0 written below is not overwritten
+    for (int i = 0; i < 2000 && !__atomic_load_n(&gate_entered, __ATOMIC_SEQ_CST); i++)
+        usleep(1000);
+    EXPECT_EQ(__atomic_load_n(&gate_entered, __ATOMIC_SEQ_CST), 1);
+
+    // network_lock is held exclusively for the whole switch...
+    EXPECT_EQ(pthread_rwlock_tryrdlock(&network_lock), EBUSY);
+
+    // ...while image getters are not held up by it
+    for (int i = 0; i < 5; i++) {
+        uint8_t zoom = 0, wdr = 0;
+        auto start = Clock::now();
+        EXPECT_EQ(get_image_zoom(&zoom), 0);
+        EXPECT_EQ(get_wdr(&wdr), 0);
+        EXPECT_LT(elapsed_ms(start), 100);
+    }
+
+    write_file("/tmp/test_fws/wifi_runtime_result", "0\n");
+    __atomic_store_n(&gate_open, 1, __ATOMIC_SEQ_CST);
+    wifi.join();
+    EXPECT_EQ(switch_ret, 0);
+
+    ASSERT_EQ(pthread_rwlock_tryrdlock(&network_lock), 0);
+    pthread_rwlock_unlock(&network_lock);
+}
+
+TEST_F(FwSubsystemsTest, SetterExcludesGettersOfItsSubsystem) {
+    ASSERT_EQ(pthread_rwlock_wrlock(&image_lock), 0);
+
+    uint8_t zoom = 0;
+    int done = 0;
+    std::thread reader([&] {
+        get_image_zoom(&zoom);
+        __atomic_store_n(&done, 1, __ATOMIC_SEQ_CST);
+    });
+    usleep(100 * 1000);
+    EXPECT_EQ(__atomic_load_n(&done, __ATOMIC_SEQ_CST), 0);
+
+    pthread_rwlock_unlock(&image_lock);
+    reader.join();
+    EXPECT_EQ(done, 1);
+}
+
+// signalserver and portablertc are scripts on PATH; misc and
+// webrtc_enabled live in the config image, so reads see real values
+class WebrtcMiscTest : public FwSubsystemsTest {
+protected:
+    std::string old_path;
+
+    void SetUp() override {
+        FwSubsystemsTest::SetUp();
+        system("mkdir -p /tmp/test_fws/bin");
+        add_daemon(SIGNALING_SERVER_PROCESS_NAME);
+        add_daemon(PORTABLE_RTC_PROCESS_NAME);
+        old_path = getenv("PATH");
+        setenv("PATH", ("/tmp/test_fws/bin:" + old_path).c_str(), 1);
+        ASSERT_EQ(config_store_open("/tmp/test_fws/config/m5s_config.img", "/tmp/test_fws"), 0);
+    }
+
+    void TearDown() override {
+        const char *webrtc[] = {SIGNALING_SERVER_PROCESS_NAME, PORTABLE_RTC_PROCESS_NAME};
+        fw_proc_stop_all(webrtc, 2, 100);
+        config_store_close();
+        setenv("PATH", old_path.c_str(), 1);
+        FwSubsystemsTest::TearDown();
+    }
+
+    static void add_daemon(const char *name) {
+        std::string path = std::string("/tmp/test_fws/bin/") + name;
+        write_file(path.c_str(), "#!/bin/sh\nexec sleep 30\n");
+        chmod(path.c_str(), 0755);
+    }
+
+    static int config_int(const char *key) {
+        char value[CONFIG_VALUE_MAX];
+        return config_store_get(key, value, sizeof(value)) == 0 ? atoi(value) : -1;
+    }
+};
+
+TEST_F(WebrtcMiscTest, FourKMiscAndWebrtcStartDoNotInterleave) {
+    for (int round = 0; round < 5; round++) {
+        ASSERT_EQ(set_image_misc(3), 0);
+        ASSERT_EQ(stop_webrtc_stream(), 0);
+
+        // Both calls queue up behind a holder of streaming_lock
+        ASSERT_EQ(pthread_rwlock_wrlock(&streaming_lock), 0);
+        int misc_done = 0;
+        std::thread webrtc([] { start_webrtc_stream(); });
+        std::thread misc([&misc_done] {
+            set_image_misc(4);
+            __atomic_store_n(&misc_done, 1, __ATOMIC_SEQ_CST);
+        });
+        usleep(100 * 1000);
+
+        // The misc change must not touch the streamer while it is held
+        EXPECT_EQ(__atomic_load_n(&misc_done, __ATOMIC_SEQ_CST), 0) << "round " << round;
+        EXPECT_EQ(config_int("misc"), 3) << "round " << round;
+
+        pthread_rwlock_unlock(&streaming_lock);
+        misc.join();
+        webrtc.join();
+
+        // Either one wins, but 4K never runs next to WebRTC
+        if (config_int("misc") == 4) {
+            EXPECT_NE(config_int("webrtc_enabled"), 1) << "round " << round;
+            EXPECT_EQ(is_running(SIGNALING_SERVER_PROCESS_NAME), 0) << "round " << round;
+        } else {
+            EXPECT_EQ(config_int("webrtc_enabled"), 1) << "round " << round;
+        }
+    }
+}
+
+class ReactorTest : public FwSubsystemsTest {
+protected:
+    void SetUp() override {
+        FwSubsystemsTest::SetUp();
+        fw_clock_use_virtual(1000);
+    }
+
+    struct Delay {
+        delay_sm_ctx_t sm;
+        int steps;
+        fw_sm_instance_t m;
+        uint64_t done_at;
+    };
+
+    static void add_delay(Delay *d, uint32_t ms) {
+        delay_sm_init(&d->sm, ms);
+        d->steps = 0;
+        d->done_at = 0;
+        fw_sm_instance_init(&d->m, [](void *ctx) {
+            Delay *self = static_cast<Delay *>(ctx);
+            self->steps++;
+            return delay_sm_step(&self->sm);
+        }, d, &d->sm.timer, -1);
+        ASSERT_EQ(fw_reactor_add(&d->m), 0);
+    }
+
+    // Advance virtual time to t and run whatever became due
+    static void run_at(uint64_t t) {
+        fw_clock_advance_ms((uint32_t)(t - fw_clock_now_ms()));
+        fw_reactor_run_once(0);
+    }
+};
+
+TEST_F(ReactorTest, MachinesRunConcurrentlyUnderVirtualClock) {
+    Delay d[3];
+    const uint32_t delays[3] = {300, 100, 200};
+    for (int i = 0; i < 3; i++)
+        add_delay(&d[i], delays[i]);
+
+    // A machine that waits for a pipe instead of a deadline
+    struct Reader { int fd; int steps; } reader = {-1, 0};
+    int pipefd[2];
+    ASSERT_EQ(pipe2(pipefd, O_NONBLOCK), 0);
+    reader.fd = pipefd[0];
+    fw_sm_instance_t rm;
+    fw_sm_instance_init(&rm, [](void *ctx) {
+        Reader *self = static_cast<Reader *>(ctx);
+        char c;
+        self->steps++;
+        return read(self->fd, &c, 1) == 1 ? FW_SM_DONE_OK : FW_SM_RUNNING;
+    }, &reader, NULL, pipefd[0]);
+    ASSERT_EQ(fw_reactor_add(&rm), 0);
+
+    auto start = Clock::now();
+    run_at(1000); // first step of each: timers start, the reader finds nothing
+    EXPECT_EQ(fw_reactor_next_due(), 1100u);
+
+    auto record = [&] {
+        for (auto &x : d)
+            if (x.m.status == FW_SM_DONE_OK && !x.done_at)
+                x.done_at = fw_clock_now_ms();
+    };
+    run_at(1100);
+    record();
+    ASSERT_EQ(write(pipefd[1], "x", 1), 1);
+    run_at(1150);
+    EXPECT_EQ(rm.status, FW_SM_DONE_OK);
+    EXPECT_EQ(fw_reactor_next_due(), 1200u);
+    run_at(1200);
+    record();
+    run_at(1300);
+    record();
+
+    EXPECT_EQ(d[0].done_at, 1300u);
+    EXPECT_EQ(d[1].done_at, 1100u);
+    EXPECT_EQ(d[2].done_at, 1200u);
+    for (auto &x : d)
+        EXPECT_EQ(x.steps, 2) << "stepped only at its deadline";
+    EXPECT_EQ(reader.steps, 2);
+    EXPECT_EQ(fw_reactor_next_due(), UINT64_MAX);
+    EXPECT_LT(elapsed_ms(start), 100);
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+TEST_F(ReactorTest, CancelledMachineIsNotStepped) {
+    Delay d;
+    add_delay(&d, 500);
+    run_at(1000);
+    EXPECT_EQ(d.steps, 1);
+
+    fw_reactor_cancel(&d.m);
+    EXPECT_EQ(d.m.status, FW_SM_IDLE);
+    EXPECT_EQ(fw_reactor_next_due(), UINT64_MAX);
+    run_at(2000);
+    EXPECT_EQ(d.steps, 1);
+}
+
+TEST_F(ReactorTest, BlockingAdapterSleepsOnVirtualClock) {
+    auto start = Clock::now();
+    delay_sm_ctx_t sm;
+    delay_sm_init(&sm, 5000);
+    EXPECT_EQ(delay_sm_run(&sm), FW_SM_DONE_OK);
+    EXPECT_GE(fw_clock_now_ms(), 6000u);
+    EXPECT_LT(elapsed_ms(start), 100);
+}
+
+TEST_F(ReactorTest, BlockingAdaptersDoNotSerialise) {
+    fw_clock_set(NULL, NULL);
+
+    auto start = Clock::now();
+    std::thread a([] {
+        delay_sm_ctx_t sm;
+        delay_sm_init(&sm, 200);
+        EXPECT_EQ(delay_sm_run(&sm), FW_SM_DONE_OK);
+    });
+    std::thread b([] {
+        delay_sm_ctx_t sm;
+        delay_sm_init(&sm, 200);
+        EXPECT_EQ(delay_sm_run(&sm), FW_SM_DONE_OK);
+    });
+    a.join();
+    b.join();
+
+    long ms = elapsed_ms(start);
+    EXPECT_GE(ms, 200);
+    EXPECT_LT(ms, 350); // one after the other would take 400
+}
+
+// The fake streamer is a thread that comes up after start_ms and then
+// announces itself the way the real one does
+class StreamerRestartTest : public FwSubsystemsTest {
+protected:
+    static void notify_ready_after(int start_ms) {
+        usleep(start_ms * 1000);
+        int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", STREAMER_NOTIFY_SOCK);
+        for (int i = 0; i < 100; i++) {
+            if (sendto(fd, "READY=1", 7, 0, (struct sockaddr *)&addr, sizeof(addr)) == 7)
+                break;
+            usleep(10 * 1000);
+        }
+        close(fd);
+    }
+
+    static long thread_cpu_ms() {
+        struct timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+};
+
+TEST_F(StreamerRestartTest, StopStreamWaitsForReadyNotification) {
+    std::thread streamer(notify_ready_after, 200);
+
+    auto start = Clock::now();
+    long cpu = thread_cpu_ms();
+    EXPECT_EQ(stop_stream(), 0);
+    long ms = elapsed_ms(start);
+    streamer.join();
+
+    EXPECT_GE(ms, 200);
+    EXPECT_LT(ms, 1000);
+    EXPECT_LT(thread_cpu_ms() - cpu, 100) << "waited without spinning";
+}
+
+TEST_F(StreamerRestartTest, OpenPortMeansReady) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(getsockname(lfd, (struct sockaddr *)&addr, &len), 0);
+
+    misc_sm_ctx_t sm;
+    misc_sm_init(&sm);
+    sm.ready_port = ntohs(addr.sin_port);
+    std::thread streamer([lfd] {
+        usleep(250 * 1000);
+        listen(lfd, 1);
+    });
+    EXPECT_EQ(misc_sm_run(&sm), FW_SM_DONE_OK);
+    streamer.join();
+    close(lfd);
+
+    EXPECT_EQ(sm.ready_by, MISC_READY_PORT);
+    EXPECT_GE(sm.elapsed_ms, 250u);
+    EXPECT_LT(sm.elapsed_ms, 1000u);
+}
+
+TEST_F(StreamerRestartTest, TimeoutFallsBackToProcess) {
+    misc_sm_ctx_t sm;
+    misc_sm_init(&sm);
+    sm.timeout_ms = 300;
+    EXPECT_EQ(misc_sm_run(&sm), FW_SM_DONE_FAIL);
+    EXPECT_EQ(sm.ready_by, MISC_READY_NONE);
+    EXPECT_GE(sm.elapsed_ms, 300u);
+    EXPECT_LT(sm.elapsed_ms, 1000u);
+
+    // A streamer that never says it is ready still counts once it runs
+    system("mkdir -p /tmp/test_fws/proc/77");
+    write_file("/tmp/test_fws/proc/77/cmdline", "streamer");
+    misc_sm_init(&sm);
+    sm.timeout_ms = 300;
+    EXPECT_EQ(misc_sm_run(&sm), FW_SM_DONE_OK);
+    EXPECT_EQ(sm.ready_by, MISC_READY_PROCESS);
+}
+
+TEST_F(StreamerRestartTest, RunningStreamerIsReadyAfterGrace) {
+    // Nothing sends READY=1; the full timeout is not waited out
+    system("mkdir -p /tmp/test_fws/proc/77");
+    write_file("/tmp/test_fws/proc/77/cmdline", "streamer");
+    misc_sm_ctx_t sm;
+    misc_sm_init(&sm);
+    ASSERT_GE(sm.notify_fd, 0);
+    sm.grace_ms = 200;
+
+    EXPECT_EQ(misc_sm_run(&sm), FW_SM_DONE_OK);
+    EXPECT_EQ(sm.ready_by, MISC_READY_PROCESS);
+    EXPECT_GE(sm.elapsed_ms, 200u);
+    EXPECT_LT(sm.elapsed_ms, 1000u);
+}
+
+TEST_F(FwSubsystemsTest, StreamerControlKeepsOneConnection) {
+    FakeDaemon streamer(STREAMER_MSG_SOCK, "0");
+    uint32_t sent = fw_msg_streamer.sent, via_cli = fw_msg_streamer.via_cli;
+
+    EXPECT_EQ(set_image_mirror(1), 0);
+    EXPECT_EQ(set_image_flip(1), 0);
+    EXPECT_EQ(set_image_mirror(0), 0);
+
+    std::vector<std::string> want = {"-C 2 --mirror 1", "-C 2 --flip 1", "-C 2 --mirror 0"};
+    EXPECT_EQ(streamer.requests(), want);
+    EXPECT_EQ(streamer.accepts(), 1);
+    EXPECT_EQ(fw_msg_streamer.sent - sent, 3u);
+    EXPECT_EQ(fw_msg_streamer.via_cli, via_cli);
+}
+
+TEST_F(FwSubsystemsTest, StreamerControlReconnectsAfterRestart) {
+    uint32_t via_cli = fw_msg_streamer.via_cli;
+    {
+        FakeDaemon streamer(STREAMER_MSG_SOCK, "0");
+        EXPECT_EQ(set_image_flip(1), 0);
+        EXPECT_EQ(streamer.requests().size(), 1u);
+    }
+    FakeDaemon restarted(STREAMER_MSG_SOCK, "0");
+    EXPECT_EQ(set_image_flip(0), 0);
+    EXPECT_EQ(restarted.requests().size(), 1u);
+    EXPECT_EQ(fw_msg_streamer.via_cli, via_cli);
+}
+
+TEST_F(FwSubsystemsTest, StreamerControlDoesNotResendUnansweredRequest) {
+    FakeDaemon streamer(STREAMER_MSG_SOCK, NULL);
+    uint32_t via_cli = fw_msg_streamer.via_cli;
+
+    auto start = Clock::now();
+    EXPECT_EQ(fw_msg_request(&fw_msg_streamer, "-C 2 --flip 1", NULL, 0), -1);
+    EXPECT_LT(elapsed_ms(start), FW_MSG_TIMEOUT_MS + 300);
+
+    std::vector<std::string> want = {"-C 2 --flip 1"};
+    EXPECT_EQ(streamer.requests(), want);
+    EXPECT_EQ(fw_msg_streamer.via_cli, via_cli);
+}
+
+TEST_F(FwSubsystemsTest, StreamerControlFallsBackToCli) {
+    uint32_t via_cli = fw_msg_streamer.via_cli;
+    EXPECT_EQ(fw_msg_request(&fw_msg_streamer, "-C 2 --flip 1", NULL, 0), 0);
+    EXPECT_EQ(fw_msg_streamer.via_cli - via_cli, 1u);
+
+    set_mock_system_return(1 << 8);
+    EXPECT_NE(fw_msg_request(&fw_msg_streamer, "-C 2 --flip 1", NULL, 0), 0);
+
+    FakeDaemon streamer(STREAMER_MSG_SOCK, "3");
+    EXPECT_EQ(fw_msg_request(&fw_msg_streamer, "-C 2 --flip 1", NULL, 0), 3);
+    EXPECT_EQ(fw_msg_streamer.via_cli - via_cli, 2u);
+}
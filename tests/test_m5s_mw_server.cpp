@@ -1,4 +1,5 @@
 #include <gtest/gtest.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,12 +7,16 @@
 #include <signal.h>
 #include <fstream>
 
+#include "fake_daemon.h"
 #include "mock_hw.h"
+#include "fw/fw_clock.h"
+#include "fw/fw_msg.h"
 
 extern "C" {
     // Declarations from motocam_api_server.c and timer.c
     int update_calibration_value();
     void timer_init();
+    void timer_deinit();
     void control_ir();
     void get_gain(float *gain_value);
     void process_auto_day_night();
@@ -45,6 +50,10 @@ extern "C" {
     int8_t get_mode() { return g_day_mode; }
     void get_image_misc(uint8_t* val) { *val = g_image_misc; }
     void set_image_misc(uint8_t val) { g_image_misc = val; }
+
+    // fw_config.c
+    int config_flush_lazy(void) { return 0; }
+    void config_flush_due(void) {}
 }
 
 class MwServerTest : public ::testing::Test {
@@ -68,6 +77,9 @@ protected:
     }
     
     void TearDown() override {
+        timer_deinit();
+        fw_msg_close(&fw_msg_asc);
+        fw_clock_set(NULL, NULL);
         system("rm -rf /tmp/test_m5s/*");
     }
 };
@@ -172,6 +184,22 @@ TEST_F(MwServerTest, GetGain_MissingFile) {
     EXPECT_FLOAT_EQ(gain, -1.0f);
 }
 
+TEST_F(MwServerTest, GetGain_FromAscDaemon) {
+    FakeDaemon asc(ASC_MSG_SOCK, "0 3.25");
+    uint32_t via_cli = fw_msg_asc.via_cli;
+
+    // No GAIN_FILE: the value comes with the reply
+    float gain = 0;
+    get_gain(&gain);
+    EXPECT_FLOAT_EQ(gain, 3.25f);
+    get_gain(&gain);
+
+    std::vector<std::string> want = {"-e 12 -g", "-e 12 -g"};
+    EXPECT_EQ(asc.requests(), want);
+    EXPECT_EQ(asc.accepts(), 1);
+    EXPECT_EQ(fw_msg_asc.via_cli, via_cli);
+}
+
 extern "C" int m5s_mw_server_main();
 TEST_F(MwServerTest, MainLoopTest) {
     pthread_t thread;
@@ -185,9 +213,21 @@ TEST_F(MwServerTest, MainLoopTest) {
     }, NULL);
     
     ASSERT_EQ(ret, 0);
-    sleep(1); 
-    pthread_cancel(thread);
-    pthread_join(thread, NULL);
+
+    // main() returns on SIGTERM once its handler is in place
+    struct sigaction sa;
+    for (int i = 0; i < 2000; i++) {
+        sigaction(SIGTERM, NULL, &sa);
+        if (sa.sa_handler != SIG_DFL)
+            break;
+        usleep(1000);
+    }
+    ASSERT_NE(sa.sa_handler, SIG_DFL);
+    // Again if one lands between the stop check and pause()
+    while (pthread_tryjoin_np(thread, NULL) == EBUSY) {
+        pthread_kill(thread, SIGTERM);
+        usleep(1000);
+    }
     SUCCEED();
 }
 
@@ -404,3 +444,21 @@ TEST_F(MwServerTest, UpdateCalibration_ReadFail) {
 TEST_F(MwServerTest, UpdateCalibration_FopenWriteFail) {
     // Already did this with directory case in UpdateCalibration_OutputOpenFailure
 }
+
+TEST_F(MwServerTest, TimerTicksOnFwClock) {
+    fw_clock_use_virtual(0);
+    g_isp_temp = 85; // > ISP_HIGH_TEMP_THRESHOLD
+    g_ir_led_brightness = 10;
+    timer_init();
+
+    // control_ir() runs every sixth 10 s tick; the worker's sleeps advance
+    // the virtual clock, so no real time passes. Last, as the ticks leave
+    // process_auto_day_night() mid-count
+    for (int i = 0; i < 10000 && !__atomic_load_n(&g_isp_temp_state, __ATOMIC_SEQ_CST); i++)
+        usleep(100);
+    timer_deinit();
+
+    EXPECT_EQ(g_isp_temp_state, 1);
+    EXPECT_EQ(g_ir_led_brightness, 6); // HIGH
+    EXPECT_GE(fw_clock_now_ms(), 10000u);
+}
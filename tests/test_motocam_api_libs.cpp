@@ -3,15 +3,23 @@
  */
 #include <gtest/gtest.h>
 #include <cstdlib>
+#include <chrono>
 #include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 extern "C" {
 #include "motocam_api_l1.h"
 #include "motocam_api_l2.h"
 #include "motocam_command_enums.h"
 #include "l1/motocam_audio_api_l1.h"
+#include "l1/motocam_coalesce_api_l1.h"
 #include "l1/motocam_config_api_l1.h"
 #include "l1/motocam_image_api_l1.h"
+#include "l1/motocam_job_api_l1.h"
 #include "l1/motocam_network_api_l1.h"
 #include "l1/motocam_streaming_api_l1.h"
 #include "l1/motocam_system_api_l1.h"
@@ -1704,3 +1712,260 @@ TEST_F(MotocamApiLibsTest, DirectL2_Network_And_System_FwFailureBranches) {
   out = nullptr;
   set_mock_login_pin_mode(0);
 }
+
+/* SET coalescing: a slow set_image_zoom while a burst of zoom SETs arrives */
+class CoalesceTest : public MotocamApiLibsTest {
+ protected:
+  /* Sends SET IMAGE ZOOM through do_processing; returns the ACK result byte */
+  static int8_t send_zoom(uint8_t zoom, uint8_t *failed) {
+    uint8_t req[8];
+    size_t len = 0;
+    build_valid_crc_packet(req, sizeof(req), SET, IMAGE, ZOOM, 1, &zoom, &len);
+    uint8_t *res = nullptr;
+    uint8_t res_size = 0;
+    do_processing(req, (uint8_t)len, &res, &res_size);
+    int8_t ret = (int8_t)res[5];
+    *failed = res[4];
+    free(res);
+    return ret;
+  }
+
+  static void wait_for_zoom_calls(int calls) {
+    for (int i = 0; i < 1000 && get_mock_set_image_zoom_calls() < calls; i++)
+      usleep(1000);
+  }
+};
+
+TEST_F(CoalesceTest, BurstCollapsesToLatestValue) {
+  unsigned long executed0, replaced0, executed1, replaced1;
+  get_coalesce_stats(&executed0, &replaced0);
+  set_mock_set_image_zoom_delay_ms(100);
+
+  uint8_t failed[5] = {9, 9, 9, 9, 9};
+  int8_t ret[5];
+  std::vector<std::thread> callers;
+  callers.emplace_back([&] { ret[0] = send_zoom(1, &failed[0]); });
+  wait_for_zoom_calls(1);
+  for (int i = 1; i < 5; i++) {
+    callers.emplace_back([&, i] { ret[i] = send_zoom((uint8_t)(i + 1), &failed[i]); });
+    usleep(5000); /* keep the arrival order */
+  }
+  for (auto &t : callers)
+    t.join();
+
+  /* 1 ran at once, 2..4 were replaced, 5 ran after 1 */
+  EXPECT_EQ(get_mock_set_image_zoom_calls(), 2);
+  EXPECT_EQ(get_mock_set_image_zoom_last(), 5);
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(failed[i], 0u) << "caller " << i;
+    EXPECT_EQ(ret[i], 0) << "caller " << i;
+  }
+  get_coalesce_stats(&executed1, &replaced1);
+  EXPECT_EQ(executed1 - executed0, 2u);
+  EXPECT_EQ(replaced1 - replaced0, 3u);
+}
+
+TEST_F(CoalesceTest, ReplacedCallersGetFinalResult) {
+  set_mock_set_image_zoom_delay_ms(100);
+
+  uint8_t failed[3];
+  int8_t ret[3];
+  std::thread first([&] { ret[0] = send_zoom(1, &failed[0]); });
+  wait_for_zoom_calls(1);
+  set_mock_set_image_zoom_fail(1); /* the coalesced execution fails */
+  std::thread second([&] { ret[1] = send_zoom(2, &failed[1]); });
+  usleep(5000);
+  std::thread third([&] { ret[2] = send_zoom(3, &failed[2]); });
+  first.join();
+  second.join();
+  third.join();
+
+  EXPECT_EQ(get_mock_set_image_zoom_calls(), 2);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(failed[i], 1u) << "caller " << i;
+    EXPECT_EQ(ret[i], -1) << "caller " << i;
+  }
+}
+
+TEST_F(CoalesceTest, OnlyStateSettingCommandsCoalesce) {
+  EXPECT_EQ(is_state_setting_command(IMAGE, ZOOM), 1);
+  EXPECT_EQ(is_state_setting_command(IMAGE, IRBRIGHTNESS), 1);
+  EXPECT_EQ(is_state_setting_command(SYSTEM, SHUTDOWN), 0);
+  EXPECT_EQ(is_state_setting_command(NETWORK, WifiClient), 0);
+
+  /* Sequential requests each execute */
+  uint8_t failed;
+  EXPECT_EQ(send_zoom(1, &failed), 0);
+  EXPECT_EQ(send_zoom(1, &failed), 0);
+  EXPECT_EQ(get_mock_set_image_zoom_calls(), 2);
+}
+
+/* Built with JOB_WORKERS=1 and JOB_QUEUE_MAX=2 so the queue fills quickly */
+class JobTest : public MotocamApiLibsTest {
+ protected:
+  void TearDown() override {
+    /* Jobs outlive the test; let them finish before the mocks are reset */
+    for (uint16_t id : submitted)
+      wait_for_job(id);
+  }
+
+  /* Sends SET_ASYNC IMAGE ZOOM; returns the job id, or -(error) */
+  int send_zoom_async(uint8_t zoom) {
+    uint8_t req[8];
+    size_t len = 0;
+    build_valid_crc_packet(req, sizeof(req), SET_ASYNC, IMAGE, ZOOM, 1, &zoom, &len);
+    uint8_t *res = nullptr;
+    uint8_t res_size = 0;
+    do_processing(req, (uint8_t)len, &res, &res_size);
+    EXPECT_EQ(res[0], (uint8_t)ACK);
+    unsigned sum = 0;
+    for (int i = 0; i < res_size; i++)
+      sum += res[i];
+    EXPECT_EQ(sum % 256, 0u); /* CRC */
+    int ret;
+    if (res[4] == 0) {
+      EXPECT_EQ(res[3], 4u);
+      ret = res[6] << 8 | res[7];
+      submitted.push_back((uint16_t)ret);
+    } else {
+      ret = (int8_t)res[5];
+    }
+    free(res);
+    return ret;
+  }
+
+  /* GET SYSTEM JOB_STATUS; returns the state and fills in the result */
+  static uint8_t query_job(uint16_t id, int8_t *result) {
+    uint8_t data[2] = {(uint8_t)(id >> 8), (uint8_t)id};
+    uint8_t req[8];
+    size_t len = 0;
+    build_valid_crc_packet(req, sizeof(req), GET, SYSTEM, JOB_STATUS, 2, data, &len);
+    uint8_t *res = nullptr;
+    uint8_t res_size = 0;
+    do_processing(req, (uint8_t)len, &res, &res_size);
+    EXPECT_EQ(res[0], (uint8_t)RESPONSE);
+    EXPECT_EQ(res[4], 0u);
+    uint8_t state = res[5];
+    *result = (int8_t)res[6];
+    free(res);
+    return state;
+  }
+
+  static uint8_t wait_for_job(uint16_t id) {
+    int8_t result;
+    uint8_t state = JOB_UNKNOWN;
+    for (int i = 0; i < 2000; i++) {
+      state = get_job_state(id, &result);
+      if (state != JOB_QUEUED && state != JOB_RUNNING)
+        break;
+      usleep(1000);
+    }
+    return state;
+  }
+
+  std::vector<uint16_t> submitted;
+};
+
+TEST_F(JobTest, SetAsyncAcksBeforeTheCommandRuns) {
+  set_mock_set_image_zoom_delay_ms(200);
+
+  auto start = std::chrono::steady_clock::now();
+  int id = send_zoom_async(4);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_GT(id, 0);
+  EXPECT_LT(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), 100);
+
+  int8_t result = 99;
+  uint8_t state = query_job((uint16_t)id, &result);
+  EXPECT_TRUE(state == JOB_QUEUED || state == JOB_RUNNING) << (int)state;
+
+  EXPECT_EQ(wait_for_job((uint16_t)id), JOB_DONE);
+  EXPECT_EQ(query_job((uint16_t)id, &result), JOB_DONE);
+  EXPECT_EQ(result, 0);
+  EXPECT_EQ(get_mock_set_image_zoom_last(), 4);
+}
+
+TEST_F(JobTest, DuplicateSubmissionJoinsThePendingJob) {
+  set_mock_set_image_zoom_delay_ms(100);
+
+  int first = send_zoom_async(2);
+  int again = send_zoom_async(2);
+  int other = send_zoom_async(3);
+  ASSERT_GT(first, 0);
+  EXPECT_EQ(again, first);
+  EXPECT_GT(other, 0);
+  EXPECT_NE(other, first);
+
+  EXPECT_EQ(wait_for_job((uint16_t)first), JOB_DONE);
+  EXPECT_EQ(wait_for_job((uint16_t)other), JOB_DONE);
+  EXPECT_EQ(get_mock_set_image_zoom_calls(), 2);
+
+  /* Once finished, the same request is a new job */
+  int later = send_zoom_async(2);
+  EXPECT_GT(later, 0);
+  EXPECT_NE(later, first);
+}
+
+TEST_F(JobTest, FullQueueIsRejected) {
+  set_mock_set_image_zoom_delay_ms(100);
+
+  ASSERT_GT(send_zoom_async(1), 0);
+  for (int i = 0; i < 1000 && get_mock_set_image_zoom_calls() < 1; i++)
+    usleep(1000);
+  /* One job running, JOB_QUEUE_MAX waiting */
+  ASSERT_GT(send_zoom_async(2), 0);
+  ASSERT_GT(send_zoom_async(3), 0);
+  EXPECT_EQ(send_zoom_async(4), JOB_ERR_BUSY);
+
+  for (uint16_t id : submitted)
+    EXPECT_EQ(wait_for_job(id), JOB_DONE);
+  EXPECT_EQ(get_mock_set_image_zoom_last(), 3);
+}
+
+TEST_F(JobTest, CompletionIsSentAsAnEvent) {
+  int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  ASSERT_GE(fd, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, JOB_EVENT_SOCK_PATH, sizeof(addr.sun_path) - 1);
+  unlink(JOB_EVENT_SOCK_PATH);
+  ASSERT_EQ(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+  struct timeval tv = {2, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  set_mock_set_image_zoom_fail(1);
+  int id = send_zoom_async(5);
+  ASSERT_GT(id, 0);
+
+  job_event_t evt;
+  ASSERT_EQ(recv(fd, &evt, sizeof(evt), 0), (ssize_t)sizeof(evt));
+  EXPECT_EQ(evt.job_id, id);
+  EXPECT_EQ(evt.command, IMAGE);
+  EXPECT_EQ(evt.sub_command, ZOOM);
+  EXPECT_EQ(evt.result, -1);
+
+  int8_t result = 0;
+  EXPECT_EQ(query_job((uint16_t)id, &result), JOB_DONE);
+  EXPECT_EQ(result, -1);
+
+  close(fd);
+  unlink(JOB_EVENT_SOCK_PATH);
+}
+
+TEST_F(JobTest, StatusOfUnknownJobAndBadRequest) {
+  int8_t result;
+  EXPECT_EQ(query_job(0, &result), JOB_UNKNOWN);
+  EXPECT_EQ(query_job(0xFFFF, &result), JOB_UNKNOWN);
+
+  uint8_t data = 1;
+  uint8_t req[8];
+  size_t len = 0;
+  build_valid_crc_packet(req, sizeof(req), GET, SYSTEM, JOB_STATUS, 1, &data, &len);
+  uint8_t *res = nullptr;
+  uint8_t res_size = 0;
+  do_processing(req, (uint8_t)len, &res, &res_size);
+  EXPECT_EQ(res[4], 1u);
+  EXPECT_EQ((int8_t)res[5], -5);
+  free(res);
+}
@@ -3,8 +3,18 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <string>
+#include <chrono>
+#include <sys/stat.h>
 
 #include "mock_hw.h"
+#include "fw/fw_clock.h"
+#include "fw/fw_config.h"
+#include "fw/fw_proc.h"
+#include "hw_handle.h"
+#include "ir_cut.h"
+#include "ir_led.h"
 
 extern "C" {
     // Declarations from fw.c
@@ -44,6 +54,7 @@ extern "C" {
     void update_ir_cut_filter_off();
     uint8_t get_ir_cut_filter();
     int start_led_watcher();
+    void stop_led_watcher();
     uint8_t get_gpio_value(int gpio_pin);
     int read_wifi_state(void);
 
@@ -80,9 +91,6 @@ extern "C" {
     // Stubs for functions called by fw.c and gpio.c
     void* msgbroker_get_instance(int id) { return nullptr; }
     int msgbroker_publish(void* b, const char* topic, const char* src, const char* key, const char* val) { return 0; }
-    void fw_sm_timer_start(void* t, int ms) {}
-    void fw_sm_yield() {}
-    int fw_sm_timer_expired(void* t) { usleep(10000); return 1; }
 }
 
 class MotocamFwLibsTest : public ::testing::Test {
@@ -96,6 +104,7 @@ protected:
         set_mock_popen_return(0);
         set_mock_popen_output("");
         set_mock_pthread_allow(0); 
+        hw_close_all(); // the simulated sysfs below is recreated per test
 
         // Ensure directories exist for GPIO mock
         system("mkdir -p /tmp/test_fw/gpio/gpio59");
@@ -128,12 +137,21 @@ protected:
     }
 
     virtual void TearDown() {
+        fw_clock_set(NULL, NULL);
         set_mock_pthread_allow(0);
         set_mock_system_return(0);
         set_mock_popen_return(0);
         set_mock_popen_output("");
         system("rm -rf /tmp/test_fw/*");
     }
+
+    // Let the LED watcher run for ms on the virtual clock, which its
+    // sleeps advance; gives up after a second if no watcher is running
+    static void run_watcher_ms(uint64_t ms) {
+        uint64_t until = fw_clock_now_ms() + ms;
+        for (int i = 0; i < 10000 && fw_clock_now_ms() < until; i++)
+            usleep(100);
+    }
 };
 
 TEST_F(MotocamFwLibsTest, ExecCmd_ValidCommand) {
@@ -240,6 +258,7 @@ TEST_F(MotocamFwLibsTest, GpioInitTest) {
 }
 
 TEST_F(MotocamFwLibsTest, IrCutFilterTest) {
+    fw_clock_use_virtual(0);
     update_ir_cut_filter_on();
     EXPECT_EQ(get_ir_cut_filter(), 0);
     update_ir_cut_filter_off();
@@ -324,6 +343,7 @@ TEST_F(MotocamFwLibsTest, KillAllProcessesTest) {
 }
 
 TEST_F(MotocamFwLibsTest, LedWatcherLogicTest) {
+    fw_clock_use_virtual(0);
     set_mock_pthread_allow(1);
     auto set_wifi_up = [](bool up) {
         FILE* f = fopen("/tmp/test_fw/wifi_operstate", "w");
@@ -340,32 +360,32 @@ TEST_F(MotocamFwLibsTest, LedWatcherLogicTest) {
     set_mock_system_return(0);
     
     gpio_init(); 
-    sleep(1);
+    run_watcher_ms(1000);
 
     set_ota("in-progress");
-    sleep(1);
+    run_watcher_ms(1000);
 
     set_ota("fail");
     set_wifi_up(false);
-    sleep(1);
+    run_watcher_ms(1000);
 
     set_ota("ota-successful-90");
     set_wifi_up(true);
     set_mock_popen_output("inet addr:1.1.1.1");
-    sleep(1);
+    run_watcher_ms(1000);
 
     set_mock_system_return(1); // ONVIF Fail
-    sleep(1);
+    run_watcher_ms(1000);
 
     FILE* f_ws = fopen("/tmp/test_fw/wifi_state", "w"); 
     if(f_ws) { fprintf(f_ws, "1"); fclose(f_ws); }
     set_mock_popen_output(""); // No client
-    sleep(1);
+    run_watcher_ms(1000);
 
     // WiFi Fail AND OTA Fail (hits PATTERN_WIFI_OTA_FAIL)
     set_wifi_up(false);
     set_ota("fail");
-    sleep(1);
+    run_watcher_ms(1000);
 
     // WiFi OK, but no client on AP (hits PATTERN_WIFI_AP_NO_CLIENT)
     set_wifi_up(true);
@@ -375,17 +395,18 @@ TEST_F(MotocamFwLibsTest, LedWatcherLogicTest) {
     FILE* f_ws2 = fopen("/tmp/test_fw/wifi_state", "w");
     if(f_ws2) { fprintf(f_ws2, "1"); fclose(f_ws2); }
     // ap_has_connected_sta=0
-    sleep(1);
+    run_watcher_ms(1000);
 
     // WiFi OK, client connected (hits normal green LED / IR magenta)
     set_mock_popen_output("AA:BB:CC:DD:EE:FF"); // has ':' so connected
-    sleep(1);
+    run_watcher_ms(1000);
 
     // IR Cut filter state 1
     FILE* f_ir = fopen("/tmp/test_fw/ircut_filter", "w");
     if(f_ir) { fprintf(f_ir, "1\n"); fclose(f_ir); }
-    sleep(1);
+    run_watcher_ms(1000);
 
+    stop_led_watcher();
     SUCCEED();
 }
 
@@ -474,6 +495,7 @@ TEST_F(MotocamFwLibsTest, GpioValue_FgetsNull) {
 }
 
 TEST_F(MotocamFwLibsTest, MoreOtaFailures) {
+    fw_clock_use_virtual(0);
     set_mock_pthread_allow(1);
     auto set_ota = [](const char* status) {
         FILE* f = fopen("/tmp/test_fw/ota_status", "w");
@@ -482,11 +504,12 @@ TEST_F(MotocamFwLibsTest, MoreOtaFailures) {
     
     gpio_init();
     set_ota("compatible-mismatch-24");
-    sleep(1);
+    run_watcher_ms(1000);
     set_ota("generic_fail");
-    sleep(1);
+    run_watcher_ms(1000);
     set_ota("error_encountered");
-    sleep(1);
+    run_watcher_ms(1000);
+    stop_led_watcher();
     SUCCEED();
 }
 
@@ -621,5 +644,797 @@ TEST_F(MotocamFwLibsTest, WifiNoIp) {
     set_wifi_up(true);
     set_mock_popen_output("no ip string\n");
     // led watcher picks this up, makes check_wifi fail early
-    sleep(1);
+    fw_clock_use_virtual(0);
+    set_mock_pthread_allow(1);
+    ASSERT_EQ(start_led_watcher(), 0);
+    run_watcher_ms(1000);
+    stop_led_watcher();
+}
+
+// --- Binary config image (fw_config.c) ---
+
+#define TEST_CONFIG_IMAGE "/tmp/test_fw/config/m5s_config.img"
+
+class ConfigStoreTest : public MotocamFwLibsTest {
+protected:
+    void TearDown() override {
+        config_store_close();
+        MotocamFwLibsTest::TearDown();
+    }
+
+    static void write_text(const char *path, const char *text) {
+        FILE *f = fopen(path, "w");
+        ASSERT_NE(f, nullptr);
+        fputs(text, f);
+        fclose(f);
+    }
+
+    static std::string read_text(const char *path) {
+        char buf[256] = {0};
+        FILE *f = fopen(path, "r");
+        if (!f) return "<missing>";
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        return std::string(buf, n);
+    }
+
+    static uint32_t region_generation(int region) {
+        config_image_t hdr;
+        FILE *f = fopen(TEST_CONFIG_IMAGE, "rb");
+        if (!f) return 0;
+        fseek(f, (long)region * CONFIG_REGION_SIZE, SEEK_SET);
+        size_t n = fread(&hdr, offsetof(config_image_t, slot), 1, f);
+        fclose(f);
+        return (n == 1 && hdr.magic == CONFIG_IMAGE_MAGIC) ? hdr.generation : 0;
+    }
+};
+
+TEST_F(ConfigStoreTest, ImportsKeyDirectoryOnFirstOpen) {
+    write_text("/tmp/test_fw/day_mode", "1\n");
+    write_text("/tmp/test_fw/ir_tmp_ctl", "3\n");
+    write_text("/tmp/test_fw/multi_line", "a\nb\n");
+
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    EXPECT_EQ(config_store_generation(), 1u);
+
+    char value[CONFIG_VALUE_MAX];
+    ASSERT_EQ(config_store_get("day_mode", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "1");
+    // Not a one-line value: stays file-only
+    EXPECT_EQ(config_store_get("multi_line", value, sizeof(value)), -1);
+
+    // Served from the image, not through popen (which returns "" here)
+    char out[64];
+    EXPECT_EQ(exec_cmd("cat /tmp/test_fw/day_mode", out, sizeof(out)), 0);
+    EXPECT_STREQ(out, "1\n");
+    EXPECT_EQ(get_mode(), 1);
+    EXPECT_EQ(get_ir_tmp_ctl(), 3);
+}
+
+TEST_F(ConfigStoreTest, SetsAlternateRegionsAndMirrorKeyFiles) {
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    EXPECT_EQ(region_generation(0), 1u);
+
+    EXPECT_EQ(set_uboot_env("wdr", 1), 0);
+    EXPECT_EQ(config_store_generation(), 2u);
+    EXPECT_EQ(region_generation(0), 1u);
+    EXPECT_EQ(region_generation(1), 2u);
+
+    EXPECT_EQ(set_uboot_env_chars("hotspot_ssid", "cam-01"), 0);
+    EXPECT_EQ(config_store_generation(), 3u);
+    EXPECT_EQ(region_generation(0), 3u);
+    EXPECT_EQ(region_generation(1), 2u);
+
+    // The key files follow when another process may read them
+    EXPECT_EQ(read_text("/tmp/test_fw/wdr"), "<missing>");
+    ASSERT_EQ(config_store_mirror(), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/wdr"), "1\n");
+    EXPECT_EQ(read_text("/tmp/test_fw/hotspot_ssid"), "cam-01\n");
+    EXPECT_NE(access("/tmp/test_fw/wdr.tmp", F_OK), 0);
+    EXPECT_EQ(config_store_generation(), 3u);
+
+    char value[CONFIG_VALUE_MAX];
+    ASSERT_EQ(config_store_get("hotspot_ssid", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "cam-01");
+}
+
+TEST_F(ConfigStoreTest, MirrorFilesAreBatchedUntilFlush) {
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    for (int v = 1; v <= 3; v++)
+        ASSERT_EQ(set_uboot_env("zoom", v), 0);
+    ASSERT_EQ(set_uboot_env("eis", 1), 0);
+    EXPECT_EQ(config_store_generation(), 5u);
+    EXPECT_EQ(read_text("/tmp/test_fw/zoom"), "<missing>");
+
+    char value[CONFIG_VALUE_MAX];
+    ASSERT_EQ(config_store_get("zoom", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "3");
+
+    // One file per key for the four sets, then one commit for their stamps
+    ASSERT_EQ(config_store_flush(), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/zoom"), "3\n");
+    EXPECT_EQ(read_text("/tmp/test_fw/eis"), "1\n");
+    EXPECT_EQ(config_store_generation(), 6u);
+    EXPECT_EQ(config_store_flush(), 0);
+    EXPECT_EQ(config_store_generation(), 6u);
+
+    // A set after the file was written but before its stamp
+    ASSERT_EQ(set_uboot_env("eis", 2), 0);
+    ASSERT_EQ(config_store_mirror(), 0);
+    ASSERT_EQ(set_uboot_env("eis", 3), 0);
+    ASSERT_EQ(config_store_get("eis", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "3");
+    ASSERT_EQ(config_store_flush(), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/eis"), "3\n");
+
+    // Pending files are written from the image when the store is reopened
+    ASSERT_EQ(set_uboot_env("zoom", 4), 0);
+    config_store_close();
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/zoom"), "4\n");
+    ASSERT_EQ(config_store_get("zoom", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "4");
+}
+
+TEST_F(ConfigStoreTest, TornRegionFallsBackToPreviousCommit) {
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    ASSERT_EQ(set_uboot_env("eis", 1), 0); // generation 2, region B
+    ASSERT_EQ(set_uboot_env("eis", 2), 0); // generation 3, region A
+    config_store_close();
+
+    // Damage region A's slots and lose the mirror file, as after a crash
+    FILE *f = fopen(TEST_CONFIG_IMAGE, "r+b");
+    ASSERT_NE(f, nullptr);
+    fseek(f, offsetof(config_image_t, slot) + 40, SEEK_SET);
+    fputs("garbage", f);
+    fclose(f);
+    unlink("/tmp/test_fw/eis");
+
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    char value[CONFIG_VALUE_MAX];
+    ASSERT_EQ(config_store_get("eis", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "1");
+    EXPECT_EQ(read_text("/tmp/test_fw/eis"), "1\n");
+    // The rewritten mirror is committed over the damaged region
+    EXPECT_EQ(config_store_generation(), 3u);
+}
+
+TEST_F(ConfigStoreTest, ExternalWriteFallsBackToFileAndIsImported) {
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    ASSERT_EQ(set_uboot_env_chars("ota_status", "0"), 0);
+
+    write_text("/tmp/test_fw/ota_status", "12\n");
+    char value[CONFIG_VALUE_MAX];
+    EXPECT_EQ(config_store_get("ota_status", value, sizeof(value)), -1);
+
+    config_store_close();
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    ASSERT_EQ(config_store_get("ota_status", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "12");
+}
+
+TEST_F(ConfigStoreTest, OversizedValueStaysFileOnly) {
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    std::string big(CONFIG_VALUE_MAX + 10, 'x');
+    EXPECT_EQ(set_uboot_env_chars("big_key", big.c_str()), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/big_key"), big + "\n");
+
+    char value[CONFIG_VALUE_MAX];
+    EXPECT_EQ(config_store_get("big_key", value, sizeof(value)), -1);
+    EXPECT_EQ(config_store_generation(), 1u);
+}
+
+TEST_F(ConfigStoreTest, ExportsAndImportsKeyDirectory) {
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    ASSERT_EQ(set_uboot_env("zoom", 2), 0);
+    ASSERT_EQ(set_uboot_env_chars("stream_state", "1"), 0);
+
+    mkdir("/tmp/test_fw/export", 0755);
+    ASSERT_EQ(config_store_export_dir("/tmp/test_fw/export"), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/export/zoom"), "2\n");
+    EXPECT_EQ(read_text("/tmp/test_fw/export/stream_state"), "1\n");
+
+    // Import replaces the image contents with the directory
+    write_text("/tmp/test_fw/export/zoom", "4\n");
+    unlink("/tmp/test_fw/export/stream_state");
+    ASSERT_EQ(config_store_import_dir("/tmp/test_fw/export"), 0);
+    char value[CONFIG_VALUE_MAX];
+    ASSERT_EQ(config_store_get("zoom", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "4");
+    EXPECT_EQ(read_text("/tmp/test_fw/zoom"), "4\n");
+    EXPECT_EQ(config_store_get("stream_state", value, sizeof(value)), -1);
+}
+
+// --- Config transactions (fw_config.c) ---
+
+class ConfigTxnTest : public ConfigStoreTest {
+protected:
+    void TearDown() override {
+        unlink("/tmp/test_fw/" CONFIG_TXN_JOURNAL);
+        ConfigStoreTest::TearDown();
+    }
+};
+
+TEST_F(ConfigTxnTest, CommitsAllKeysAndRetiresJournal) {
+    config_txn_t txn;
+    config_txn_begin(&txn);
+    EXPECT_EQ(config_txn_set_int(&txn, "eis", 1), 0);
+    EXPECT_EQ(config_txn_set_int(&txn, "wdr", 0), 0);
+    EXPECT_EQ(config_txn_set(&txn, "client_ssid", "my net"), 0);
+    EXPECT_EQ(config_txn_set_int(&txn, "eis", 0), 0); // last value wins
+    EXPECT_EQ(txn.count, 3);
+    ASSERT_EQ(config_txn_commit(&txn), 0);
+
+    EXPECT_EQ(read_text("/tmp/test_fw/eis"), "0\n");
+    EXPECT_EQ(read_text("/tmp/test_fw/wdr"), "0\n");
+    EXPECT_EQ(read_text("/tmp/test_fw/client_ssid"), "my net\n");
+    EXPECT_NE(access("/tmp/test_fw/" CONFIG_TXN_JOURNAL, F_OK), 0);
+}
+
+TEST_F(ConfigTxnTest, RejectedKeyCommitsNothing) {
+    config_txn_t txn;
+    config_txn_begin(&txn);
+    config_txn_set_int(&txn, "eis", 1);
+    EXPECT_EQ(config_txn_set(&txn, "bad/key", "1"), -1);
+    EXPECT_EQ(config_txn_commit(&txn), -1);
+    EXPECT_EQ(read_text("/tmp/test_fw/eis"), "<missing>");
+}
+
+TEST_F(ConfigTxnTest, InterruptedApplyIsReplayed) {
+    write_text("/tmp/test_fw/wdr", "1\n");
+    // The second key cannot be written, so the commit stops after the journal
+    mkdir("/tmp/test_fw/wdr.tmp", 0755);
+
+    config_txn_t txn;
+    config_txn_begin(&txn);
+    config_txn_set_int(&txn, "eis", 1);
+    config_txn_set_int(&txn, "wdr", 0);
+    config_txn_set_int(&txn, "stream1_resolution", 3);
+    EXPECT_EQ(config_txn_commit(&txn), -1);
+    EXPECT_EQ(access("/tmp/test_fw/" CONFIG_TXN_JOURNAL, F_OK), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/wdr"), "1\n");
+
+    rmdir("/tmp/test_fw/wdr.tmp");
+    ASSERT_EQ(config_txn_recover("/tmp/test_fw"), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/eis"), "1\n");
+    EXPECT_EQ(read_text("/tmp/test_fw/wdr"), "0\n");
+    EXPECT_EQ(read_text("/tmp/test_fw/stream1_resolution"), "3\n");
+    EXPECT_NE(access("/tmp/test_fw/" CONFIG_TXN_JOURNAL, F_OK), 0);
+}
+
+TEST_F(ConfigTxnTest, TornJournalIsDiscarded) {
+    write_text("/tmp/test_fw/eis", "0\n");
+    write_text("/tmp/test_fw/" CONFIG_TXN_JOURNAL, "eis 1\nwdr 1\nend 2 0000");
+
+    ASSERT_EQ(config_txn_recover("/tmp/test_fw"), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/eis"), "0\n");
+    EXPECT_EQ(read_text("/tmp/test_fw/wdr"), "<missing>");
+    EXPECT_NE(access("/tmp/test_fw/" CONFIG_TXN_JOURNAL, F_OK), 0);
+}
+
+TEST_F(ConfigTxnTest, ImageBackendCommitsOneGeneration) {
+    ASSERT_EQ(config_store_open(TEST_CONFIG_IMAGE, "/tmp/test_fw"), 0);
+    uint32_t gen = config_store_generation();
+
+    config_txn_t txn;
+    config_txn_begin(&txn);
+    config_txn_set_int(&txn, "misc", 10);
+    config_txn_set_int(&txn, "eis", 1);
+    config_txn_set_int(&txn, "wdr", 0);
+    config_txn_set_int(&txn, "ircut_filter", 1);
+    ASSERT_EQ(config_txn_commit(&txn), 0);
+    EXPECT_EQ(config_store_generation(), gen + 1);
+
+    char value[CONFIG_VALUE_MAX];
+    ASSERT_EQ(config_store_get("misc", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "10");
+    ASSERT_EQ(config_store_get("ircut_filter", value, sizeof(value)), 0);
+    EXPECT_STREQ(value, "1");
+    ASSERT_EQ(config_store_mirror(), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/eis"), "1\n");
+}
+
+TEST_F(ConfigTxnTest, ReadLockOnlyForConfigReads) {
+    int fd = config_read_lock("cat /tmp/test_fw/eis");
+    EXPECT_GE(fd, 0);
+    config_read_unlock(fd);
+    EXPECT_EQ(config_read_lock("cat /proc/uptime"), -1);
+    EXPECT_EQ(config_read_lock("ls /tmp/test_fw"), -1);
+}
+
+// --- Durability classes (fw_config.c) ---
+
+class ConfigClassTest : public ConfigTxnTest {
+protected:
+    void SetUp() override {
+        ConfigTxnTest::SetUp();
+        config_flush_lazy(); // nothing left over from earlier tests
+    }
+
+    static config_class_stats_t stats(config_class_t cls) {
+        config_class_stats_t s;
+        config_class_stats(cls, &s);
+        return s;
+    }
+};
+
+TEST_F(ConfigClassTest, KeyTableAssignsClasses) {
+    EXPECT_EQ(config_key_class("isp_temp_state"), CONFIG_CLASS_VOLATILE);
+    EXPECT_EQ(config_key_class("ir_temp_state"), CONFIG_CLASS_VOLATILE);
+    EXPECT_EQ(config_key_class("ir_led_brightness"), CONFIG_CLASS_LAZY);
+    EXPECT_EQ(config_key_class("login_pin"), CONFIG_CLASS_SYNC);
+    EXPECT_EQ(config_key_class("unknown_key"), CONFIG_CLASS_SYNC);
+}
+
+TEST_F(ConfigClassTest, VolatileKeyStaysOffFlash) {
+    config_class_stats_t before = stats(CONFIG_CLASS_VOLATILE);
+    EXPECT_EQ(set_uboot_env("isp_temp_state", 1), 0);
+    EXPECT_EQ(set_uboot_env("isp_temp_state", 0), 0);
+
+    EXPECT_EQ(read_text("/tmp/test_fw/isp_temp_state"), "<missing>");
+    EXPECT_EQ(read_text("/tmp/test_fw/volatile/isp_temp_state"), "0\n");
+    char out[16];
+    EXPECT_EQ(exec_cmd("cat /tmp/test_fw/isp_temp_state", out, sizeof(out)), 0);
+    EXPECT_STREQ(out, "0\n");
+
+    config_class_stats_t after = stats(CONFIG_CLASS_VOLATILE);
+    EXPECT_EQ(after.sets - before.sets, 2u);
+    EXPECT_EQ(after.flash_syncs, before.flash_syncs);
+}
+
+TEST_F(ConfigClassTest, LazyKeyIsPersistedOnFlush) {
+    config_class_stats_t before = stats(CONFIG_CLASS_LAZY);
+    for (int v = 1; v <= 5; v++)
+        EXPECT_EQ(set_uboot_env("ir_led_brightness", v), 0);
+
+    EXPECT_EQ(read_text("/tmp/test_fw/ir_led_brightness"), "<missing>");
+    char out[16];
+    EXPECT_EQ(exec_cmd("cat /tmp/test_fw/ir_led_brightness", out, sizeof(out)), 0);
+    EXPECT_STREQ(out, "5\n");
+
+    // Another process wrote a newer value to the shared tmpfs copy
+    write_text("/tmp/test_fw/volatile/ir_led_brightness", "6\n");
+    ASSERT_EQ(config_flush_lazy(), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/ir_led_brightness"), "6\n");
+
+    config_class_stats_t after = stats(CONFIG_CLASS_LAZY);
+    EXPECT_EQ(after.sets - before.sets, 6u); // 5 sets + 1 flushed key
+    EXPECT_EQ(after.flash_syncs - before.flash_syncs, 3u); // one journal commit
+    EXPECT_EQ(config_flush_lazy(), 0);
+    EXPECT_EQ(stats(CONFIG_CLASS_LAZY).flash_syncs, after.flash_syncs);
+}
+
+TEST_F(ConfigClassTest, FailedLazyFlushIsRetried) {
+    EXPECT_EQ(set_uboot_env("ir_led_brightness", 7), 0);
+
+    // The key file cannot be replaced, so the commit fails
+    mkdir("/tmp/test_fw/ir_led_brightness.tmp", 0755);
+    EXPECT_EQ(config_flush_lazy(), -1);
+    rmdir("/tmp/test_fw/ir_led_brightness.tmp");
+    unlink("/tmp/test_fw/" CONFIG_TXN_JOURNAL);
+    EXPECT_EQ(read_text("/tmp/test_fw/ir_led_brightness"), "<missing>");
+
+    ASSERT_EQ(config_flush_lazy(), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/ir_led_brightness"), "7\n");
+}
+
+TEST_F(ConfigClassTest, ResetAfterLazySetKeepsTheDefault) {
+    write_text("/tmp/test_fw/ir_led_brightness", "100\n");
+    EXPECT_EQ(set_uboot_env("ir_led_brightness", 40), 0);
+    EXPECT_TRUE(config_value_equals_int("ir_led_brightness", 40));
+
+    // camera_configuration_reset (factory_reset.c) rewrites the key file
+    // and drops the unflushed tmpfs copy
+    write_text("/tmp/test_fw/ir_led_brightness", "100\n");
+    unlink("/tmp/test_fw/volatile/ir_led_brightness");
+
+    EXPECT_TRUE(config_value_equals_int("ir_led_brightness", 100));
+    ASSERT_EQ(config_flush_lazy(), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/ir_led_brightness"), "100\n");
+}
+
+TEST_F(ConfigClassTest, SyncKeyCountsEveryWrite) {
+    config_class_stats_t before = stats(CONFIG_CLASS_SYNC);
+    EXPECT_EQ(set_uboot_env_chars("login_pin", "1234"), 0);
+    EXPECT_EQ(set_uboot_env("wdr", 1), 0);
+    EXPECT_EQ(read_text("/tmp/test_fw/login_pin"), "1234\n");
+
+    config_class_stats_t after = stats(CONFIG_CLASS_SYNC);
+    EXPECT_EQ(after.sets - before.sets, 2u);
+    EXPECT_EQ(after.flash_syncs - before.flash_syncs, 2u);
+}
+
+class ConfigNoopTest : public ConfigClassTest {};
+
+TEST_F(ConfigNoopTest, UnchangedValueIsSkippedAndCounted) {
+    ASSERT_EQ(set_uboot_env_chars("camera_name", "cam-1"), 0);
+    unsigned long total = config_skipped(NULL);
+    unsigned long named = config_skipped("camera_name");
+
+    EXPECT_EQ(config_unchanged("camera_name", "cam-1"), 1);
+    EXPECT_EQ(config_unchanged("camera_name", "cam-2"), 0);
+    EXPECT_EQ(config_unchanged("missing_key", "1"), 0);
+    EXPECT_EQ(config_value_equals("camera_name", "cam-1"), 1); // not counted
+
+    EXPECT_EQ(config_skipped("camera_name"), named + 1);
+    EXPECT_EQ(config_skipped(NULL), total + 1);
+    EXPECT_EQ(config_skipped("missing_key"), 0u);
+}
+
+TEST_F(ConfigNoopTest, RewriteByAnotherProcessIsNoticed) {
+    // Old enough to be served from the cache from now on
+    write_text("/tmp/test_fw/wdr", "1\n");
+    struct timespec old[2] = {{time(NULL) - 10, 0}, {time(NULL) - 10, 0}};
+    ASSERT_EQ(utimensat(AT_FDCWD, "/tmp/test_fw/wdr", old, 0), 0);
+    EXPECT_EQ(config_value_equals_int("wdr", 1), 1);
+    EXPECT_EQ(config_value_equals_int("wdr", 1), 1);
+
+    write_text("/tmp/test_fw/wdr", "0\n");
+    EXPECT_EQ(config_value_equals_int("wdr", 1), 0);
+    EXPECT_EQ(config_value_equals_int("wdr", 0), 1);
+
+    // Same size, rewritten in place within the mtime granularity
+    FILE *f = fopen("/tmp/test_fw/wdr", "r+");
+    ASSERT_NE(f, nullptr);
+    fputs("1\n", f);
+    fclose(f);
+    EXPECT_EQ(config_value_equals_int("wdr", 1), 1);
+}
+
+TEST_F(ConfigNoopTest, DeferredKeyIsComparedWithTmpfsCopy) {
+    write_text("/tmp/test_fw/ir_led_brightness", "3\n");
+    EXPECT_EQ(config_value_equals_int("ir_led_brightness", 3), 1);
+
+    ASSERT_EQ(set_uboot_env("ir_led_brightness", 4), 0);
+    EXPECT_EQ(config_unchanged_int("ir_led_brightness", 3), 0);
+    EXPECT_EQ(config_unchanged_int("ir_led_brightness", 4), 1);
+}
+
+TEST_F(ConfigNoopTest, FileOutsideKeyStore) {
+    write_text("/tmp/test_fw/user_dob", "01-02-2000");
+    EXPECT_EQ(config_file_equals("/tmp/test_fw/user_dob", "01-02-2000"), 1);
+    EXPECT_EQ(config_file_equals("/tmp/test_fw/user_dob", "01-02-2001"), 0);
+    EXPECT_EQ(config_file_equals("/tmp/test_fw/no_such_file", ""), 0);
+}
+
+// Simulated sysfs: the files from MotocamFwLibsTest::SetUp stand in for
+// the GPIO attributes and PWM devices; hw_stats() counts the syscalls.
+class HwHandleTest : public MotocamFwLibsTest {
+protected:
+    static hw_stats_t stats() {
+        hw_stats_t s;
+        hw_stats(&s);
+        return s;
+    }
+
+    static std::string read_file(const char *path) {
+        char buf[64] = {0};
+        FILE *f = fopen(path, "r");
+        if (!f) return "<missing>";
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        return std::string(buf, n);
+    }
+};
+
+TEST_F(HwHandleTest, SysfsWithoutChardev) {
+    EXPECT_EQ(hw_gpio_chardev(), 0);
+}
+
+TEST_F(HwHandleTest, ClaimExportsOutputs) {
+    system("rm -rf /tmp/test_fw/gpio/export");
+    fclose(fopen("/tmp/test_fw/gpio/export", "w"));
+    const int pins[] = {1, 2, 3};
+    const int values[] = {0, 1, 0};
+    ASSERT_EQ(hw_gpio_claim(pins, values, 3), 0);
+
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/export"), "3");
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio1/direction"), "out");
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio2/value"), "1");
+    EXPECT_EQ(hw_gpio_get(1), 0);
+    EXPECT_EQ(hw_gpio_get(2), 1);
+    EXPECT_EQ(hw_gpio_get(100), -1);
+}
+
+TEST_F(HwHandleTest, GpioLineIsOpenedOnce) {
+    const int pins[] = {3, 2, 1};
+    const int values[] = {1, 0, 1};
+    ASSERT_EQ(hw_gpio_claim(pins, values, 3), 0);
+
+    const int rounds = 100;
+    hw_stats_t before = stats();
+    for (int i = 0; i < rounds; i++) {
+        const int step[] = {i & 1, !(i & 1), 1};
+        ASSERT_EQ(hw_gpio_set(pins, step, 3), 0);
+        ASSERT_EQ(hw_gpio_get(3), i & 1);
+    }
+    hw_stats_t after = stats();
+
+    EXPECT_EQ(after.opens - before.opens, 0u);
+    EXPECT_EQ(after.writes - before.writes, 3u * rounds);
+    EXPECT_EQ(after.reads - before.reads, 1u * rounds);
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio2/value"), "0");
+
+    // fopen/fprintf/fclose per value was open + write + close each time
+    unsigned long now = (after.opens - before.opens) + (after.writes - before.writes) +
+                        (after.reads - before.reads);
+    unsigned long legacy = 3ul * (4ul * rounds);
+    RecordProperty("syscalls", (int)now);
+    RecordProperty("syscalls_reopening", (int)legacy);
+    EXPECT_LE(now * 3, legacy);
+}
+
+TEST_F(HwHandleTest, PwmDeviceAndLockStayOpen) {
+    ASSERT_EQ(debug_pwm4_set(10), 0);
+
+    hw_stats_t before = stats();
+    for (int i = 0; i < 50; i++)
+        ASSERT_EQ(debug_pwm4_set(10), 0);
+    hw_stats_t after = stats();
+
+    EXPECT_EQ(after.opens - before.opens, 0u);
+    EXPECT_EQ(after.writes - before.writes, 50u);
+    EXPECT_EQ(after.locks - before.locks, 100u); // lock + unlock per write
+    EXPECT_EQ(read_file("/tmp/test_fw/pwmdev-4"), "1000000,900000\n");
+}
+
+TEST_F(HwHandleTest, CloseAllReopensReplacedFiles) {
+    const int pin = 59;
+    const int one = 1;
+    ASSERT_EQ(hw_gpio_claim(&pin, &one, 1), 0);
+    EXPECT_EQ(hw_gpio_get(pin), 1);
+
+    // A new inode at the same path is only seen after the handles are closed
+    unlink("/tmp/test_fw/gpio/gpio59/value");
+    FILE *f = fopen("/tmp/test_fw/gpio/gpio59/value", "w");
+    ASSERT_NE(f, nullptr);
+    fputs("0\n", f);
+    fclose(f);
+    EXPECT_EQ(hw_gpio_get(pin), 1);
+    hw_close_all();
+    EXPECT_EQ(hw_gpio_get(pin), 0);
+}
+
+// Pulses are timed on the virtual clock: waiting advances it instantly
+class IrCutTest : public HwHandleTest {
+protected:
+    void SetUp() override {
+        HwHandleTest::SetUp();
+        fw_clock_use_virtual(1000);
+        ASSERT_EQ(ir_cut_wait(-1), 0); // nothing left moving from earlier tests
+    }
+
+    static long elapsed_ms(uint64_t since) {
+        return (long)(fw_clock_now_ms() - since);
+    }
+};
+
+TEST_F(IrCutTest, RequestReturnsBeforePulseEnds) {
+    uint64_t start = fw_clock_now_ms();
+    EXPECT_EQ(ir_cut_request(1), IR_CUT_STARTED);
+    EXPECT_LT(elapsed_ms(start), IR_CUT_PULSE_MS / 2);
+
+    EXPECT_EQ(ir_cut_state(), IR_CUT_MOVING);
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio59/value"), "1");
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio60/value"), "0");
+
+    EXPECT_EQ(ir_cut_wait(-1), 0);
+    EXPECT_GE(elapsed_ms(start), IR_CUT_PULSE_MS);
+    EXPECT_EQ(ir_cut_state(), IR_CUT_NIGHT);
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio59/value"), "0");
+}
+
+TEST_F(IrCutTest, PulseEndsWhenStateIsPolled) {
+    ASSERT_EQ(ir_cut_request(0), IR_CUT_STARTED);
+    fw_clock_advance_ms(IR_CUT_PULSE_MS - 1);
+    EXPECT_EQ(ir_cut_state(), IR_CUT_MOVING);
+    fw_clock_advance_ms(1);
+    EXPECT_EQ(ir_cut_state(), IR_CUT_DAY);
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio59/value"), "0");
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio60/value"), "1");
+}
+
+TEST_F(IrCutTest, OppositeRequestIsQueued) {
+    ASSERT_EQ(ir_cut_request(1), IR_CUT_STARTED);
+    EXPECT_EQ(ir_cut_request(0), IR_CUT_QUEUED);
+    // The coil is not reversed mid-pulse
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio60/value"), "0");
+
+    EXPECT_EQ(ir_cut_wait(-1), 0);
+    EXPECT_EQ(ir_cut_state(), IR_CUT_DAY);
+    EXPECT_EQ(read_file("/tmp/test_fw/gpio/gpio60/value"), "1");
+}
+
+TEST_F(IrCutTest, SameRequestIsMergedAndWinsOverQueue) {
+    uint64_t start = fw_clock_now_ms();
+    ASSERT_EQ(ir_cut_request(1), IR_CUT_STARTED);
+    EXPECT_EQ(ir_cut_request(0), IR_CUT_QUEUED);
+    EXPECT_EQ(ir_cut_request(1), IR_CUT_MERGED);
+
+    EXPECT_EQ(ir_cut_wait(-1), 0);
+    EXPECT_EQ(ir_cut_state(), IR_CUT_NIGHT);
+    EXPECT_LT(elapsed_ms(start), 2 * IR_CUT_PULSE_MS); // one pulse only
+}
+
+TEST_F(IrCutTest, WaitTimesOut) {
+    uint64_t start = fw_clock_now_ms();
+    ASSERT_EQ(ir_cut_request(1), IR_CUT_STARTED);
+    EXPECT_EQ(ir_cut_wait(10), -1);
+    EXPECT_EQ(elapsed_ms(start), 10);
+    EXPECT_EQ(ir_cut_state(), IR_CUT_MOVING);
+    EXPECT_EQ(ir_cut_wait(-1), 0);
+}
+
+class IrLedTest : public HwHandleTest {
+protected:
+    void SetUp() override {
+        HwHandleTest::SetUp();
+        fw_clock_use_virtual(1000);
+        ASSERT_GE(ir_led_wait(-1), 0); // nothing left ramping from earlier tests
+        ir_led_flush();
+    }
+
+    // Off-time of a PWM; the test files are not truncated by pwrite()
+    static long pwm_off(const char *path) {
+        unsigned int period, off;
+        FILE *f = fopen(path, "r");
+        if (!f) return -1;
+        int n = fscanf(f, "%u,%u", &period, &off);
+        fclose(f);
+        return n == 2 ? (long)off : -1;
+    }
+};
+
+TEST_F(IrLedTest, RequestReturnsBeforePwm4IsWritten) {
+    EXPECT_EQ(ir_led_request(8, 0), 0);
+    // pwm5 leads, pwm4 follows IR_LED_STAGGER_MS later
+    EXPECT_EQ(pwm_off("/tmp/test_fw/pwmdev-5"), 200000);
+    EXPECT_EQ(pwm_off("/tmp/test_fw/pwmdev-4"), -1);
+    EXPECT_EQ(ir_led_target(), 8);
+
+    EXPECT_EQ(ir_led_wait(-1), 0);
+    EXPECT_EQ(pwm_off("/tmp/test_fw/pwmdev-4"), 400000);
+}
+
+TEST_F(IrLedTest, RampMovesBothPwmsPerStep) {
+    ASSERT_EQ(ir_led_request(0, 0), 0);
+    ASSERT_EQ(ir_led_wait(-1), 0);
+
+    hw_stats_t before = stats();
+    EXPECT_EQ(ir_led_request(10, 10 * IR_LED_STEP_MS), 0);
+    long first = pwm_off("/tmp/test_fw/pwmdev-5");
+    EXPECT_LT(first, 1000000);
+    EXPECT_GT(first, 100000);
+
+    EXPECT_EQ(ir_led_wait(-1), 0);
+    hw_stats_t after = stats();
+    // Each step takes the PWM lock once for both channels. .writes is
+    // process-wide and also counts GPIO writes from threads earlier tests
+    // leave running, so it is only stable when this test runs alone
+    EXPECT_EQ(after.locks - before.locks, 20u);
+    EXPECT_EQ(pwm_off("/tmp/test_fw/pwmdev-5"), 100000);
+    EXPECT_EQ(pwm_off("/tmp/test_fw/pwmdev-4"), 200000);
+}
+
+TEST_F(IrLedTest, LatestRequestWinsMidRamp) {
+    ASSERT_EQ(ir_led_request(0, 0), 0);
+    ASSERT_EQ(ir_led_wait(-1), 0);
+
+    ASSERT_EQ(ir_led_request(10, 50 * IR_LED_STEP_MS), 0);
+    EXPECT_EQ(ir_led_wait(5 * IR_LED_STEP_MS), -1);
+    EXPECT_EQ(ir_led_request(2, 5 * IR_LED_STEP_MS), 0);
+    EXPECT_EQ(ir_led_target(), 2);
+
+    EXPECT_EQ(ir_led_wait(-1), 0);
+    EXPECT_EQ(pwm_off("/tmp/test_fw/pwmdev-5"), 900000);
+    EXPECT_EQ(pwm_off("/tmp/test_fw/pwmdev-4"), 900000);
+}
+
+TEST_F(IrLedTest, PersistIsDebounced) {
+    config_class_stats_t before, mid, after;
+    config_class_stats(CONFIG_CLASS_LAZY, &before);
+
+    const uint8_t drag[] = {2, 4, 6, 8}; // 2 .. 8
+    for (uint8_t level : drag) {
+        ASSERT_EQ(ir_led_request(level, 0), 0);
+        ASSERT_EQ(ir_led_wait(-1), 0);
+    }
+    config_class_stats(CONFIG_CLASS_LAZY, &mid);
+    EXPECT_EQ(mid.sets - before.sets, 0u);
+
+    fw_clock_advance_ms(IR_LED_PERSIST_MS);
+    EXPECT_EQ(ir_led_target(), 8);
+    config_class_stats(CONFIG_CLASS_LAZY, &after);
+    EXPECT_EQ(after.sets - before.sets, 1u);
+    EXPECT_EQ(config_value_equals_int("ir_led_brightness", 8), 1);
+}
+
+TEST_F(IrLedTest, FailedWriteDropsTarget) {
+    set_mock_fcntl_fail(1);
+    EXPECT_EQ(ir_led_request(6, 0), 0);
+    EXPECT_EQ(ir_led_wait(-1), 1);
+    EXPECT_EQ(ir_led_target(), -1);
+    set_mock_fcntl_fail(0);
+
+    EXPECT_EQ(ir_led_request(99, 0), -1);
+}
+
+// Stand-in daemons are scripts on PATH; /proc is the fake tree, so only
+// daemons spawned by the supervisor are visible to it
+class ProcSupervisorTest : public MotocamFwLibsTest {
+protected:
+    std::string old_path;
+
+    void SetUp() override {
+        MotocamFwLibsTest::SetUp();
+        mkdir("/tmp/test_fw/bin", 0755);
+        add_daemon("fake_daemon", "exec sleep 30");
+        add_daemon("fake_oneshot", "sleep 0.1");
+        add_daemon("fake_stubborn", "trap '' TERM\nwhile :; do sleep 0.05; done");
+        old_path = getenv("PATH");
+        setenv("PATH", ("/tmp/test_fw/bin:" + old_path).c_str(), 1);
+    }
+
+    void TearDown() override {
+        const char *all[] = {"fake_daemon", "fake_oneshot", "fake_stubborn"};
+        fw_proc_stop_all(all, 3, 100);
+        setenv("PATH", old_path.c_str(), 1);
+        MotocamFwLibsTest::TearDown();
+    }
+
+    static void add_daemon(const char *name, const char *body) {
+        std::string path = std::string("/tmp/test_fw/bin/") + name;
+        FILE *f = fopen(path.c_str(), "w");
+        ASSERT_NE(f, nullptr);
+        fprintf(f, "#!/bin/sh\n%s\n", body);
+        fclose(f);
+        chmod(path.c_str(), 0755);
+    }
+
+    static long ms_since(std::chrono::steady_clock::time_point since) {
+        return (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - since).count();
+    }
+};
+
+TEST_F(ProcSupervisorTest, SpawnedDaemonIsTrackedAndStopped) {
+    EXPECT_EQ(is_running("fake_daemon"), 0);
+    ASSERT_EQ(fw_proc_start("fake_daemon"), 0);
+    EXPECT_EQ(is_running("fake_daemon"), 1);
+    EXPECT_EQ(fw_proc_start("fake_daemon"), 1);
+
+    auto start = std::chrono::steady_clock::now();
+    stop_process("fake_daemon");
+    EXPECT_LT(ms_since(start), 1000) << "stopped on its exit, not a fixed wait";
+    EXPECT_EQ(is_running("fake_daemon"), 0);
+}
+
+TEST_F(ProcSupervisorTest, ExitIsSeenWithoutScanning) {
+    ASSERT_EQ(fw_proc_start("fake_oneshot"), 0);
+    set_mock_opendir_fail(1); // a /proc scan would find nothing either way
+    EXPECT_EQ(is_running("fake_oneshot"), 1);
+    int i = 0;
+    while (i++ < 200 && is_running("fake_oneshot"))
+        usleep(10 * 1000);
+    set_mock_opendir_fail(0);
+    EXPECT_EQ(is_running("fake_oneshot"), 0);
+    EXPECT_EQ(fw_proc_start("fake_oneshot"), 0) << "the slot was reaped";
+}
+
+TEST_F(ProcSupervisorTest, StubbornDaemonIsKilledAfterTimeout) {
+    ASSERT_EQ(fw_proc_start("fake_stubborn"), 0);
+    usleep(50 * 1000); // let it install its trap
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(fw_proc_stop("fake_stubborn", 200), 0);
+    long ms = ms_since(start);
+    EXPECT_GE(ms, 200);
+    EXPECT_LT(ms, 1500);
+    EXPECT_EQ(is_running("fake_stubborn"), 0);
+}
+
+TEST_F(ProcSupervisorTest, MissingBinaryFailsToStart) {
+    EXPECT_EQ(fw_proc_start("no_such_daemon"), -1);
+    EXPECT_EQ(fw_proc_start(""), -1);
+    EXPECT_EQ(fw_proc_stop("no_such_daemon", 100), 0);
 }